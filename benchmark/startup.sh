@@ -0,0 +1,41 @@
+#!/bin/bash
+
+# time process startup, handy for checking lazy class registration
+#
+# run as:
+#
+#   ./startup.sh [runs]
+#
+# set VIPS to pick the vips binary to test, eg. to compare two builds
+
+vips=${VIPS:-vips}
+runs=${1:-200}
+
+$vips --version
+echo "runs=$runs"
+
+# time $runs runs of a command, print milliseconds per run
+time_runs() {
+  start=$(date +%s%N)
+  for i in $(seq $runs); do
+    "$@" > /dev/null
+  done
+  end=$(date +%s%N)
+  echo "scale=3; ($end - $start) / ($runs * 1000000)" | bc
+}
+
+$vips black startup-temp.v 1 1
+
+# just vips_init(), --vips-version exits during option parsing
+echo "vips_init(): $(time_runs $vips --vips-version) ms"
+
+# a single, simple operation: this looks up one class
+echo "one operation: $(time_runs $vips avg startup-temp.v) ms"
+
+# a load and save through VipsForeign: this has to look at all the loaders
+echo "load and save: $(time_runs $vips copy startup-temp.v startup-temp2.v) ms"
+
+# list all classes: this registers and initialises everything
+echo "all classes: $(time_runs $vips -l) ms"
+
+rm -f startup-temp.v startup-temp2.v
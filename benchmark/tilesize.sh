@@ -0,0 +1,67 @@
+#!/bin/bash
+
+# compare fixed and adaptive tile sizes, see vips_tile_size_set_adaptive()
+
+uname -a
+vips --version
+
+# sample2.v is 290x442 pixels ... replicate this many times horizontally and 
+# vertically to get a highres image for the benchmark
+tile=13
+
+echo building test image ...
+echo "tile=$tile"
+vips replicate sample2.v temp.v $tile $tile
+if [ $? != 0 ]; then
+  echo "build of test image failed -- out of disc space?"
+  exit 1
+fi
+echo -n "test image is" `vipsheader -f width temp.v` 
+echo " by" `vipsheader -f height temp.v` "pixels"
+
+echo "building test mask ..."
+cat > temp_mask.con <<EOM
+3 3 9 0
+1 1 1
+1 1 1
+1 1 1
+EOM
+
+# best of three runs of a command
+best() {
+  best_time=
+  for i in 1 2 3; do
+    if ! /usr/bin/time -f %e -o temp_time "$@" >/dev/null 2>&1; then
+      echo "benchmark failed -- install problem?"
+      exit 1
+    fi
+    t=`tail -1 temp_time`
+    if [ -z "$best_time" ] || 
+      awk -v t=$t -v b=$best_time 'BEGIN { exit !(t < b) }'; then
+      best_time=$t
+    fi
+  done
+  echo $best_time
+}
+
+# a short uchar pipeline and a long float pipeline
+bench() {
+  echo -n "conv, uchar: "
+  best vips conv temp.v temp2.v temp_mask.con --precision integer
+  echo -n "Lab, float: "
+  best vips colourspace temp.v temp2.v lab 
+  echo -n "Lab, float, sharpen: "
+  best vips sharpen temp.v temp2.v
+}
+
+echo reported real-time is best of three runs
+
+echo "fixed tiles:"
+unset VIPS_ADAPTIVE_TILES
+bench
+
+echo "adaptive tiles:"
+export VIPS_ADAPTIVE_TILES=1
+bench
+
+rm -f temp.v temp2.v temp_mask.con temp_time
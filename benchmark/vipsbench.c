@@ -0,0 +1,612 @@
+/* Time a set of operations over synthetic images.
+ *
+ * 16/10/17
+ * 	- first version
+ */
+
+/*
+
+    This file is part of VIPS.
+
+    VIPS is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301  USA
+
+ */
+
+/*
+
+    These files are distributed with VIPS - http://www.vips.ecs.soton.ac.uk
+
+ */
+
+/*
+#define DEBUG
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /*HAVE_CONFIG_H*/
+#include <vips/intl.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <locale.h>
+
+#include <vips/vips.h>
+
+static char *bench_sizes = "1000,4000";
+static char *bench_formats = "uchar,ushort,float";
+static char *bench_concurrency = NULL;
+static char *bench_ops = NULL;
+static int bench_iterations = 3;
+static char *bench_output = NULL;
+static char *bench_baseline = NULL;
+static double bench_tolerance = 10.0;
+
+static GOptionEntry bench_options[] = {
+	{ "sizes", 's', 0,
+		G_OPTION_ARG_STRING, &bench_sizes,
+		N_( "test images are square, with sides from SIZES" ),
+		"SIZES" },
+	{ "formats", 'f', 0,
+		G_OPTION_ARG_STRING, &bench_formats,
+		N_( "test images have band formats from FORMATS" ),
+		"FORMATS" },
+	{ "concurrency", 'c', 0,
+		G_OPTION_ARG_STRING, &bench_concurrency,
+		N_( "run with each number of threads in THREADS" ),
+		"THREADS" },
+	{ "ops", 0, 0,
+		G_OPTION_ARG_STRING, &bench_ops,
+		N_( "only run the benchmarks named in OPS" ),
+		"OPS" },
+	{ "iterations", 'i', 0,
+		G_OPTION_ARG_INT, &bench_iterations,
+		N_( "take the best of N runs" ),
+		"N" },
+	{ "output", 'o', 0,
+		G_OPTION_ARG_FILENAME, &bench_output,
+		N_( "write JSON results to FILE" ),
+		"FILE" },
+	{ "baseline", 'b', 0,
+		G_OPTION_ARG_FILENAME, &bench_baseline,
+		N_( "compare to results in FILE" ),
+		"FILE" },
+	{ "tolerance", 't', 0,
+		G_OPTION_ARG_DOUBLE, &bench_tolerance,
+		N_( "flag a regression if more than PERCENT slower" ),
+		"PERCENT" },
+	{ NULL }
+};
+
+/* Run a benchmark on an image. This must include a sink.
+ */
+typedef int (*BenchFn)( VipsImage *in, const char *suffix );
+
+typedef struct _BenchCase {
+	const char *name;
+	BenchFn fn;
+
+	/* For savers and loaders.
+	 */
+	const char *suffix;
+} BenchCase;
+
+typedef struct _BenchResult {
+	char *name;
+	int size;
+	const char *format;
+	int concurrency;
+	double time;
+	size_t peak_mem;
+} BenchResult;
+
+static int
+bench_sink( VipsImage *image )
+{
+	double avg;
+
+	return( vips_avg( image, &avg, NULL ) );
+}
+
+/* Most benchmarks make an image, then sink it.
+ */
+#define BENCH_SINK( CALL ) { \
+	VipsImage *t; \
+	int result; \
+	\
+	if( CALL ) \
+		return( -1 ); \
+	result = bench_sink( t ); \
+	g_object_unref( t ); \
+	\
+	return( result ); \
+}
+
+static int
+bench_resize( VipsImage *in, const char *suffix )
+	BENCH_SINK( vips_resize( in, &t, 0.5, NULL ) )
+
+static int
+bench_shrink( VipsImage *in, const char *suffix )
+	BENCH_SINK( vips_resize( in, &t, 0.1, NULL ) )
+
+static int
+bench_conv( VipsImage *in, const char *suffix )
+	BENCH_SINK( vips_gaussblur( in, &t, 2.0, NULL ) )
+
+static int
+bench_sharpen( VipsImage *in, const char *suffix )
+	BENCH_SINK( vips_sharpen( in, &t, NULL ) )
+
+static int
+bench_colour( VipsImage *in, const char *suffix )
+	BENCH_SINK( vips_colourspace( in, &t,
+		VIPS_INTERPRETATION_LAB, NULL ) )
+
+static int
+bench_linear( VipsImage *in, const char *suffix )
+	BENCH_SINK( vips_linear1( in, &t, 1.1, 10.0, NULL ) )
+
+static int
+bench_composite( VipsImage *in, const char *suffix )
+{
+	VipsImage *context = vips_image_new();
+	VipsImage **t = (VipsImage **)
+		vips_object_local_array( VIPS_OBJECT( context ), 3 );
+
+	int result;
+
+	/* A flipped copy of the image with a constant alpha over the
+	 * original.
+	 */
+	result = -1;
+	if( !vips_flip( in, &t[0], VIPS_DIRECTION_HORIZONTAL, NULL ) &&
+		!vips_bandjoin_const1( t[0], &t[1], 128.0, NULL ) &&
+		!vips_composite2( in, t[1], &t[2],
+			VIPS_BLEND_MODE_OVER, NULL ) )
+		result = bench_sink( t[2] );
+
+	g_object_unref( context );
+
+	return( result );
+}
+
+static int
+bench_stats( VipsImage *in, const char *suffix )
+{
+	VipsImage *t;
+
+	if( vips_stats( in, &t, NULL ) )
+		return( -1 );
+	g_object_unref( t );
+
+	return( 0 );
+}
+
+static int
+bench_save( VipsImage *in, const char *suffix )
+{
+	void *buf;
+	size_t len;
+
+	if( vips_image_write_to_buffer( in, suffix, &buf, &len, NULL ) )
+		return( -1 );
+	g_free( buf );
+
+	return( 0 );
+}
+
+/* Loaders get the image saved in @suffix format, see bench_run().
+ */
+static int
+bench_load( VipsImage *in, const char *suffix )
+{
+	return( bench_sink( in ) );
+}
+
+static BenchCase bench_cases[] = {
+	{ "resize", bench_resize, NULL },
+	{ "shrink", bench_shrink, NULL },
+	{ "conv", bench_conv, NULL },
+	{ "sharpen", bench_sharpen, NULL },
+	{ "colour", bench_colour, NULL },
+	{ "linear", bench_linear, NULL },
+	{ "composite", bench_composite, NULL },
+	{ "stats", bench_stats, NULL },
+	{ "save-jpeg", bench_save, ".jpg" },
+	{ "load-jpeg", bench_load, ".jpg" },
+	{ "save-png", bench_save, ".png" },
+	{ "load-png", bench_load, ".png" },
+	{ "save-tiff", bench_save, ".tif" },
+	{ "load-tiff", bench_load, ".tif" },
+	{ "save-webp", bench_save, ".webp" },
+	{ "load-webp", bench_load, ".webp" },
+};
+
+/* A noisy RGB image in memory, so the time to make it is not part of the
+ * benchmark.
+ */
+static VipsImage *
+bench_image_new( int size, VipsBandFormat format )
+{
+	static double a[] = { 1.0, 0.8, 0.6 };
+	static double b[] = { 0.0, 20.0, 40.0 };
+
+	VipsImage *context = vips_image_new();
+	VipsImage **t = (VipsImage **)
+		vips_object_local_array( VIPS_OBJECT( context ), 4 );
+
+	VipsInterpretation interpretation;
+	VipsImage *out;
+
+	interpretation = format == VIPS_FORMAT_USHORT ?
+		VIPS_INTERPRETATION_RGB16 : VIPS_INTERPRETATION_sRGB;
+
+	out = NULL;
+	if( !vips_gaussnoise( &t[0], size, size,
+			"mean", 128.0, "sigma", 40.0, NULL ) &&
+		!vips_linear( t[0], &t[1], a, b, 3, NULL ) &&
+		!vips_cast( t[1], &t[2], format, NULL ) &&
+		!vips_copy( t[2], &t[3],
+			"interpretation", interpretation, NULL ) )
+		out = vips_image_copy_memory( t[3] );
+
+	g_object_unref( context );
+
+	return( out );
+}
+
+static gboolean
+bench_selected( const char *name )
+{
+	char **ops;
+	gboolean selected;
+	int i;
+
+	if( !bench_ops )
+		return( TRUE );
+
+	ops = g_strsplit( bench_ops, ",", -1 );
+	selected = FALSE;
+	for( i = 0; ops[i]; i++ )
+		if( strcmp( ops[i], name ) == 0 )
+			selected = TRUE;
+	g_strfreev( ops );
+
+	return( selected );
+}
+
+/* Run a case on an image, best of bench_iterations.
+ */
+static int
+bench_run( BenchCase *bench, VipsImage *in,
+	int size, VipsBandFormat format, int concurrency, GArray *results )
+{
+	void *buf;
+	size_t len;
+	GTimer *timer;
+	BenchResult result;
+	size_t start_mem;
+	int i;
+
+	/* Loaders need the image saved to a buffer first.
+	 */
+	buf = NULL;
+	len = 0;
+	if( bench->fn == bench_load &&
+		vips_image_write_to_buffer( in, bench->suffix,
+			&buf, &len, NULL ) )
+		return( -1 );
+
+	result.name = g_strdup( bench->name );
+	result.size = size;
+	result.format = vips_enum_nick( VIPS_TYPE_BAND_FORMAT, format );
+	result.concurrency = concurrency;
+	result.time = -1;
+
+	vips_concurrency_set( concurrency );
+	start_mem = vips_tracked_get_mem();
+	vips_tracked_reset_mem_highwater();
+	timer = g_timer_new();
+
+	for( i = 0; i < VIPS_MAX( 1, bench_iterations ); i++ ) {
+		VipsImage *image;
+		int status;
+		double elapsed;
+
+		g_timer_start( timer );
+
+		if( buf ) {
+			if( !(image = vips_image_new_from_buffer( buf, len,
+				"", NULL )) )
+				status = -1;
+			else {
+				status = bench->fn( image, bench->suffix );
+				g_object_unref( image );
+			}
+		}
+		else
+			status = bench->fn( in, bench->suffix );
+
+		elapsed = g_timer_elapsed( timer, NULL );
+
+		if( status ) {
+			g_timer_destroy( timer );
+			g_free( buf );
+			g_free( result.name );
+			return( -1 );
+		}
+
+		if( result.time < 0 ||
+			elapsed < result.time )
+			result.time = elapsed;
+	}
+
+	result.peak_mem = vips_tracked_get_mem_highwater() - start_mem;
+
+	g_timer_destroy( timer );
+	g_free( buf );
+
+	g_array_append_val( results, result );
+
+	fprintf( stderr, "%s, %dx%d %s, %d threads: %.4fs\n",
+		result.name, size, size, result.format, concurrency,
+		result.time );
+
+	return( 0 );
+}
+
+static int *
+bench_parse_ints( const char *str, int *n )
+{
+	char **items;
+	int *ints;
+	int i;
+
+	items = g_strsplit( str, ",", -1 );
+	*n = g_strv_length( items );
+	ints = g_new( int, *n );
+	for( i = 0; i < *n; i++ )
+		ints[i] = atoi( items[i] );
+	g_strfreev( items );
+
+	return( ints );
+}
+
+static void
+bench_write( FILE *fp, GArray *results )
+{
+	guint i;
+
+	fprintf( fp, "{\n" );
+	fprintf( fp, "  \"version\": \"%s\",\n", vips_version_string() );
+	fprintf( fp, "  \"iterations\": %d,\n", bench_iterations );
+	fprintf( fp, "  \"results\": [\n" );
+
+	for( i = 0; i < results->len; i++ ) {
+		BenchResult *result = &g_array_index( results, BenchResult, i );
+		double mpix = (double) result->size * result->size /
+			(1000000.0 * result->time);
+
+		fprintf( fp, "    {\"name\":\"%s\",\"size\":%d,"
+			"\"format\":\"%s\",\"concurrency\":%d,"
+			"\"time\":%g,\"mpix_per_sec\":%g,"
+			"\"peak_mem\":%" G_GUINT64_FORMAT "}%s\n",
+			result->name, result->size,
+			result->format, result->concurrency,
+			result->time, mpix,
+			(guint64) result->peak_mem,
+			i < results->len - 1 ? "," : "" );
+	}
+
+	fprintf( fp, "  ]\n" );
+	fprintf( fp, "}\n" );
+}
+
+/* Compare to a file written by bench_write(). We write one result per line,
+ * so we can parse it with sscanf() and don't need a JSON library.
+ *
+ * Return the number of regressions, or -1 on error.
+ */
+static int
+bench_compare( const char *filename, GArray *results )
+{
+	char *contents;
+	char **lines;
+	int n_regressions;
+	int i;
+	guint j;
+
+	if( !g_file_get_contents( filename, &contents, NULL, NULL ) ) {
+		vips_error( "vipsbench",
+			_( "unable to read baseline \"%s\"" ), filename );
+		return( -1 );
+	}
+	lines = g_strsplit( contents, "\n", -1 );
+	g_free( contents );
+
+	n_regressions = 0;
+	for( i = 0; lines[i]; i++ ) {
+		char name[256];
+		char format[256];
+		int size;
+		int concurrency;
+		double time;
+
+		if( sscanf( lines[i], " {\"name\":\"%255[^\"]\",\"size\":%d,"
+			"\"format\":\"%255[^\"]\",\"concurrency\":%d,"
+			"\"time\":%lg",
+			name, &size, format, &concurrency, &time ) != 5 )
+			continue;
+
+		for( j = 0; j < results->len; j++ ) {
+			BenchResult *result =
+				&g_array_index( results, BenchResult, j );
+			double change =
+				100.0 * (result->time - time) / time;
+
+			if( strcmp( result->name, name ) != 0 ||
+				result->size != size ||
+				strcmp( result->format, format ) != 0 ||
+				result->concurrency != concurrency ||
+				time <= 0 )
+				continue;
+
+			fprintf( stderr, "%s, %dx%d %s, %d threads: "
+				"%.4fs, baseline %.4fs, %+.1f%%%s\n",
+				name, size, size, format, concurrency,
+				result->time, time, change,
+				change > bench_tolerance ?
+					" ** REGRESSION **" : "" );
+
+			if( change > bench_tolerance )
+				n_regressions += 1;
+		}
+	}
+
+	g_strfreev( lines );
+
+	return( n_regressions );
+}
+
+int
+main( int argc, char **argv )
+{
+	GOptionContext *context;
+	GOptionGroup *main_group;
+	GError *error = NULL;
+	char *default_concurrency;
+	int *sizes;
+	int n_sizes;
+	int *concurrency;
+	int n_concurrency;
+	char **formats;
+	GArray *results;
+	int i, j, k;
+	guint l;
+	int n_regressions;
+
+	if( VIPS_INIT( argv[0] ) )
+	        vips_error_exit( "unable to start VIPS" );
+	textdomain( GETTEXT_PACKAGE );
+	setlocale( LC_ALL, "" );
+
+	/* We want to time the operations, not the cache.
+	 */
+	vips_cache_set_max( 0 );
+
+        context = g_option_context_new( _( "- benchmark libvips" ) );
+
+	main_group = g_option_group_new( NULL, NULL, NULL, NULL, NULL );
+	g_option_group_add_entries( main_group, bench_options );
+	vips_add_option_entries( main_group );
+	g_option_group_set_translation_domain( main_group, GETTEXT_PACKAGE );
+	g_option_context_set_main_group( context, main_group );
+
+	if( !g_option_context_parse( context, &argc, &argv, &error ) ) {
+		if( error ) {
+			fprintf( stderr, "%s\n", error->message );
+			g_error_free( error );
+		}
+
+		vips_error_exit( "try \"%s --help\"", g_get_prgname() );
+	}
+
+	g_option_context_free( context );
+
+	/* By default, run with one thread and with all of them.
+	 */
+	default_concurrency = vips_concurrency_get() > 1 ?
+		g_strdup_printf( "1,%d", vips_concurrency_get() ) :
+		g_strdup( "1" );
+	if( !bench_concurrency )
+		bench_concurrency = default_concurrency;
+
+	sizes = bench_parse_ints( bench_sizes, &n_sizes );
+	concurrency = bench_parse_ints( bench_concurrency, &n_concurrency );
+	formats = g_strsplit( bench_formats, ",", -1 );
+	results = g_array_new( FALSE, FALSE, sizeof( BenchResult ) );
+
+	for( i = 0; i < n_sizes; i++ )
+		for( j = 0; formats[j]; j++ ) {
+			VipsBandFormat format;
+			VipsImage *in;
+
+			if( (format = vips_enum_from_nick( "vipsbench",
+				VIPS_TYPE_BAND_FORMAT, formats[j] )) < 0 ||
+				!(in = bench_image_new( sizes[i], format )) )
+				vips_error_exit( NULL );
+
+			for( k = 0; k < VIPS_NUMBER( bench_cases ); k++ ) {
+				BenchCase *bench = &bench_cases[k];
+				int c;
+
+				if( !bench_selected( bench->name ) )
+					continue;
+
+				/* Skip formats this libvips can't save.
+				 */
+				if( bench->suffix &&
+					!vips_foreign_find_save_buffer(
+						bench->suffix ) ) {
+					vips_error_clear();
+					continue;
+				}
+
+				for( c = 0; c < n_concurrency; c++ )
+					if( bench_run( bench, in,
+						sizes[i], format,
+						concurrency[c], results ) )
+						vips_error_exit( NULL );
+			}
+
+			g_object_unref( in );
+		}
+
+	if( bench_output ) {
+		FILE *fp;
+
+		if( !(fp = fopen( bench_output, "w" )) )
+			vips_error_exit( "unable to write \"%s\"", bench_output );
+		bench_write( fp, results );
+		fclose( fp );
+	}
+	else
+		bench_write( stdout, results );
+
+	n_regressions = 0;
+	if( bench_baseline &&
+		(n_regressions = bench_compare( bench_baseline, results )) < 0 )
+		vips_error_exit( NULL );
+
+	for( l = 0; l < results->len; l++ )
+		g_free( g_array_index( results, BenchResult, l ).name );
+	g_array_free( results, TRUE );
+	g_strfreev( formats );
+	g_free( concurrency );
+	g_free( sizes );
+	g_free( default_concurrency );
+
+	vips_shutdown();
+
+	if( n_regressions > 0 ) {
+		fprintf( stderr, "%d regressions\n", n_regressions );
+		return( 1 );
+	}
+
+	return( 0 );
+}
@@ -8,6 +8,9 @@
  * 	  corresponding pixel in the input)
  * 	- LUT-able: ie. arithmetic (image) can be exactly replaced by
  * 	  maplut (image, arithmetic (lut)) for 8/16 bit int images
+ *
+ * 16/10/17
+ * 	- fuse chains of arithmetic operations and run them a line at a time
  */
 
 /*
@@ -502,6 +505,60 @@ vips__bandalike( const char *domain,
  */
 #define MAX_INPUT_IMAGES (64)
 
+/* Maximum number of operations we fuse together.
+ */
+#define MAX_FUSED_STEPS (16)
+
+/* Cleared by --vips-nofuse and VIPS_NOFUSE.
+ */
+gboolean vips__fuse_enabled = TRUE;
+
+/* One operation in a fused chain. 
+ */
+typedef struct _VipsArithmeticStep {
+	VipsArithmetic *arithmetic;
+
+	/* For each input, >= 0 means a line of leaf image n, < 0 means the 
+	 * line made by step -(n + 1).
+	 */
+	int n;
+	int src[MAX_INPUT_IMAGES];
+} VipsArithmeticStep;
+
+/* A set of fused operations. The steps are in the order we run them, so
+ * the final step is the operation which owns this plan.
+ */
+typedef struct _VipsArithmeticFuse {
+	/* The images we actually read pixels from, NULL-terminated.
+	 */
+	VipsImage *leaves[MAX_INPUT_IMAGES + 1];
+	int n_leaves;
+
+	/* Our output's reorder record covers the images we would have read
+	 * without fusion, not the leaves. We make a record for the leaves 
+	 * on this image, so we can prepare them with 
+	 * vips_reorder_prepare_many().
+	 */
+	VipsImage *order;
+
+	VipsArithmeticStep steps[MAX_FUSED_STEPS];
+	int n_steps;
+} VipsArithmeticFuse;
+
+/* Per-thread state for a fused chain.
+ */
+typedef struct _VipsArithmeticSeq {
+	/* Regions on the leaf images.
+	 */
+	VipsRegion **ir;
+
+	/* A line buffer for each step except the last, which writes straight
+	 * to the output, and the width in pixels they can hold.
+	 */
+	VipsPel *line[MAX_FUSED_STEPS];
+	int width;
+} VipsArithmeticSeq;
+
 static int
 vips_arithmetic_gen( VipsRegion *or, 
 	void *seq, void *a, void *b, gboolean *stop )
@@ -540,6 +597,218 @@ vips_arithmetic_gen( VipsRegion *or,
 	return( 0 );
 }
 
+static int
+vips_arithmetic_fuse_stop( void *vseq, void *a, void *b )
+{
+	VipsArithmeticSeq *seq = (VipsArithmeticSeq *) vseq;
+
+	int i;
+
+	if( seq->ir ) 
+		vips_stop_many( seq->ir, NULL, NULL );
+	for( i = 0; i < MAX_FUSED_STEPS; i++ )
+		VIPS_FREE( seq->line[i] );
+	VIPS_FREE( seq );
+
+	return( 0 );
+}
+
+static void *
+vips_arithmetic_fuse_start( VipsImage *out, void *a, void *b )
+{
+	VipsArithmeticFuse *fuse = (VipsArithmeticFuse *) a;
+
+	VipsArithmeticSeq *seq;
+	int i;
+
+	if( !(seq = VIPS_NEW( NULL, VipsArithmeticSeq )) )
+		return( NULL );
+	for( i = 0; i < MAX_FUSED_STEPS; i++ )
+		seq->line[i] = NULL;
+	seq->width = 0;
+
+	if( !(seq->ir = vips_start_many( out, fuse->leaves, NULL )) ) {
+		vips_arithmetic_fuse_stop( seq, NULL, NULL );
+		return( NULL );
+	}
+
+	return( seq );
+}
+
+/* Run a fused chain of operations. We prepare the leaf images, then run 
+ * every step for each scanline, passing lines between steps in small 
+ * buffers which stay in cache.
+ */
+static int
+vips_arithmetic_fuse_gen( VipsRegion *or, 
+	void *vseq, void *a, void *b, gboolean *stop )
+{
+	VipsArithmeticSeq *seq = (VipsArithmeticSeq *) vseq;
+	VipsArithmeticFuse *fuse = (VipsArithmeticFuse *) a;
+	VipsArithmetic *arithmetic = VIPS_ARITHMETIC( b ); 
+	VipsObjectClass *class = VIPS_OBJECT_GET_CLASS( arithmetic ); 
+	VipsRect *r = &or->valid;
+
+	VipsPel *leaf[MAX_INPUT_IMAGES];
+	VipsPel *p[MAX_INPUT_IMAGES + 1], *q;
+	int i, s, y;
+
+	if( r->width > seq->width ) {
+		for( s = 0; s < fuse->n_steps - 1; s++ ) {
+			VipsImage *im = fuse->steps[s].arithmetic->out;
+
+			VIPS_FREE( seq->line[s] );
+			if( !(seq->line[s] = VIPS_ARRAY( NULL, 
+				r->width * VIPS_IMAGE_SIZEOF_PEL( im ), 
+				VipsPel )) )
+				return( -1 );
+		}
+		seq->width = r->width;
+	}
+
+	/* All the leaves are the size of our output, so we can prepare the 
+	 * same area on each.
+	 */
+	if( vips_reorder_prepare_many( fuse->order, seq->ir, r ) )
+		return( -1 );
+	for( i = 0; seq->ir[i]; i++ ) 
+		leaf[i] = VIPS_REGION_ADDR( seq->ir[i], r->left, r->top );
+	q = VIPS_REGION_ADDR( or, r->left, r->top );
+
+	VIPS_GATE_START( "vips_arithmetic_fuse_gen: work" );
+
+	for( y = 0; y < r->height; y++ ) {
+		for( s = 0; s < fuse->n_steps; s++ ) {
+			VipsArithmeticStep *step = &fuse->steps[s];
+			VipsArithmeticClass *aclass = 
+				VIPS_ARITHMETIC_GET_CLASS( step->arithmetic ); 
+
+			for( i = 0; i < step->n; i++ )
+				p[i] = step->src[i] >= 0 ?
+					leaf[step->src[i]] : 
+					seq->line[-step->src[i] - 1];
+			p[i] = NULL;
+
+			aclass->process_line( step->arithmetic, 
+				s == fuse->n_steps - 1 ? q : seq->line[s], 
+				p, r->width );
+		}
+
+		for( i = 0; seq->ir[i]; i++ )
+			leaf[i] += VIPS_REGION_LSKIP( seq->ir[i] );
+		q += VIPS_REGION_LSKIP( or );
+	}
+
+	VIPS_GATE_STOP( "vips_arithmetic_fuse_gen: work" );
+
+	VIPS_COUNT_PIXELS( or, class->nickname ); 
+
+	return( 0 );
+}
+
+/* If @image is made by an arithmetic operation and nothing else needs its
+ * pixels, return the operation. We see through the copies that
+ * vips_image_decode() and friends make.
+ */
+static VipsArithmetic *
+vips_arithmetic_fusable( VipsImage *image )
+{
+	for(;;) {
+		/* If anything else uses these pixels, we'd compute them
+		 * twice.
+		 */
+		if( g_slist_length( image->downstream ) != 1 )
+			return( NULL );
+
+		if( image->generate_fn == vips_arithmetic_gen ||
+			image->generate_fn == vips_arithmetic_fuse_gen )
+			return( VIPS_ARITHMETIC( image->client2 ) );
+
+		if( !(image = vips__copy_source( image )) )
+			return( NULL );
+	}
+}
+
+/* Add @arithmetic, and any fusable operations upstream of it, to @fuse.
+ * Return the step number, or -1 if the plan is full.
+ */
+static int
+vips_arithmetic_fuse_add( VipsArithmeticFuse *fuse, 
+	VipsArithmetic *arithmetic )
+{
+	VipsArithmeticStep step;
+	int i;
+
+	step.arithmetic = arithmetic;
+	step.n = arithmetic->n;
+	for( i = 0; i < arithmetic->n; i++ ) {
+		VipsImage *in = arithmetic->ready[i];
+
+		VipsArithmetic *upstream;
+		int s;
+
+		if( (upstream = vips_arithmetic_fusable( in )) ) {
+			if( (s = vips_arithmetic_fuse_add( fuse, 
+				upstream )) < 0 )
+				return( -1 );
+			step.src[i] = -(s + 1);
+		}
+		else {
+			if( fuse->n_leaves >= MAX_INPUT_IMAGES )
+				return( -1 );
+			step.src[i] = fuse->n_leaves;
+			fuse->leaves[fuse->n_leaves++] = in;
+		}
+	}
+
+	if( fuse->n_steps >= MAX_FUSED_STEPS )
+		return( -1 );
+	fuse->steps[fuse->n_steps] = step;
+
+	return( fuse->n_steps++ );
+}
+
+/* Look for arithmetic operations upstream of us whose output only we use.
+ * We can run them ourselves a line at a time, rather than have each one 
+ * compute and store a whole region.
+ *
+ * Operations stay alive while their output does, and we hold a ref to our 
+ * inputs, so the steps are safe to use for as long as we are.
+ */
+static int
+vips_arithmetic_fuse( VipsArithmetic *arithmetic )
+{
+	VipsArithmeticFuse *fuse;
+
+	if( !(fuse = VIPS_NEW( arithmetic, VipsArithmeticFuse )) )
+		return( -1 );
+	fuse->n_leaves = 0;
+	fuse->order = NULL;
+	fuse->n_steps = 0;
+
+	/* If the plan fills, or there's nothing upstream we can fuse, just
+	 * run normally.
+	 */
+	if( vips_arithmetic_fuse_add( fuse, arithmetic ) < 0 ||
+		fuse->n_steps < 2 )
+		return( 0 );
+	fuse->leaves[fuse->n_leaves] = NULL;
+
+	fuse->order = vips_image_new();
+	vips_object_local( arithmetic, fuse->order );
+	if( vips__reorder_set_input( fuse->order, fuse->leaves ) )
+		return( -1 );
+
+#ifdef DEBUG
+	printf( "vips_arithmetic_fuse: %d steps, %d leaves\n", 
+		fuse->n_steps, fuse->n_leaves );
+#endif /*DEBUG*/
+
+	arithmetic->fuse = fuse;
+
+	return( 0 );
+}
+
 static int
 vips_arithmetic_build( VipsObject *object )
 {
@@ -611,11 +880,25 @@ vips_arithmetic_build( VipsObject *object )
 		arithmetic->out->BandFmt = 
 			aclass->format_table[arithmetic->ready[0]->BandFmt];
 
-	if( vips_image_generate( arithmetic->out,
-		vips_start_many, vips_arithmetic_gen, vips_stop_many, 
-		arithmetic->ready, arithmetic ) ) 
+	if( vips__fuse_enabled &&
+		vips_arithmetic_fuse( arithmetic ) )
 		return( -1 );
 
+	if( arithmetic->fuse ) {
+		if( vips_image_generate( arithmetic->out,
+			vips_arithmetic_fuse_start, 
+			vips_arithmetic_fuse_gen, 
+			vips_arithmetic_fuse_stop, 
+			arithmetic->fuse, arithmetic ) ) 
+			return( -1 );
+	}
+	else {
+		if( vips_image_generate( arithmetic->out,
+			vips_start_many, vips_arithmetic_gen, vips_stop_many, 
+			arithmetic->ready, arithmetic ) ) 
+			return( -1 );
+	}
+
 	return( 0 );
 }
 
@@ -647,6 +930,7 @@ vips_arithmetic_init( VipsArithmetic *arithmetic )
 {
 	arithmetic->base_bands = 1;
 	arithmetic->format = VIPS_FORMAT_NOTSET;
+	arithmetic->fuse = NULL;
 }
 
 void 
@@ -743,6 +1027,7 @@ vips_arithmetic_operation_init( void )
 {
 	extern GType vips_add_get_type( void ); 
 	extern GType vips_sum_get_type( void ); 
+	extern GType vips_expr_get_type( void ); 
 	extern GType vips_subtract_get_type( void ); 
 	extern GType vips_multiply_get_type( void ); 
 	extern GType vips_divide_get_type( void ); 
@@ -782,6 +1067,7 @@ vips_arithmetic_operation_init( void )
 
 	vips_add_get_type();
 	vips_sum_get_type();
+	vips_expr_get_type();
 	vips_subtract_get_type();
 	vips_multiply_get_type();
 	vips_divide_get_type();
@@ -0,0 +1,950 @@
+/* evaluate an arithmetic expression over a set of images
+ *
+ * 16/10/17
+ * 	- from sum.c
+ * 	- limit parser recursion
+ */
+
+/*
+
+    Copyright (C) 1991-2005 The National Gallery
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301  USA
+
+ */
+
+/*
+
+    These files are distributed with VIPS - http://www.vips.ecs.soton.ac.uk
+
+ */
+
+/*
+#define DEBUG
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /*HAVE_CONFIG_H*/
+#include <vips/intl.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+
+#include <vips/vips.h>
+#include <vips/vector.h>
+
+#include "parithmetic.h"
+
+/* Limits on expression complexity.
+ */
+#define MAX_NODES (256)
+#define MAX_REFS (64)
+#define MAX_DEPTH (16)
+#define MAX_NESTING (256)
+
+/* The C path evaluates this many elements at a time.
+ */
+#define CHUNK (128)
+
+typedef enum {
+	EXPR_CONST,
+	EXPR_REF,
+	EXPR_NEG,
+	EXPR_ADD,
+	EXPR_SUB,
+	EXPR_MUL,
+	EXPR_DIV,
+	EXPR_LESS,
+	EXPR_MORE,
+	EXPR_LESSEQ,
+	EXPR_MOREEQ,
+	EXPR_EQUAL,
+	EXPR_NOTEQ
+} VipsExprOp;
+
+/* One step of the compiled expression. We run these as a stack machine.
+ */
+typedef struct _VipsExprStep {
+	VipsExprOp op;
+
+	/* EXPR_CONST pushes this.
+	 */
+	double value;
+
+	/* EXPR_REF pushes this input.
+	 */
+	int ref;
+} VipsExprStep;
+
+typedef struct _VipsExpr {
+	VipsArithmetic parent_instance;
+
+	VipsArrayImage *in;
+	char *expression;
+
+	/* The expression, in postfix order.
+	 */
+	VipsExprStep step[MAX_NODES];
+	int n_step;
+
+	/* Each distinct image and band the expression uses. band is -1 for
+	 * all bands.
+	 */
+	int ref_image[MAX_REFS];
+	int ref_band[MAX_REFS];
+	int n_ref;
+
+	/* The parser's position in expression, and how deeply we've 
+	 * recursed.
+	 */
+	const char *p;
+	int nesting;
+
+	/* The orc program, if we could make one, and the var for each ref.
+	 */
+	VipsVector *vector;
+	int var[MAX_REFS];
+} VipsExpr;
+
+typedef VipsArithmeticClass VipsExprClass;
+
+G_DEFINE_TYPE( VipsExpr, vips_expr, VIPS_TYPE_ARITHMETIC );
+
+static void
+vips_expr_dispose( GObject *gobject )
+{
+	VipsExpr *expr = (VipsExpr *) gobject;
+
+	VIPS_FREEF( vips_vector_free, expr->vector );
+
+	G_OBJECT_CLASS( vips_expr_parent_class )->dispose( gobject );
+}
+
+static int vips_expr_parse_rel( VipsExpr *expr );
+
+static void
+vips_expr_skip( VipsExpr *expr )
+{
+	while( isspace( (int) *expr->p ) )
+		expr->p += 1;
+}
+
+/* Does the input start with token? Skip it if it does.
+ */
+static gboolean
+vips_expr_match( VipsExpr *expr, const char *token )
+{
+	size_t len = strlen( token );
+
+	vips_expr_skip( expr );
+	if( strncmp( expr->p, token, len ) == 0 ) {
+		expr->p += len;
+		return( TRUE );
+	}
+
+	return( FALSE );
+}
+
+static int
+vips_expr_error( VipsExpr *expr, const char *message )
+{
+	VipsObjectClass *class = VIPS_OBJECT_GET_CLASS( expr );
+
+	vips_error( class->nickname, _( "%s at character %d of \"%s\"" ),
+		message, (int) (expr->p - expr->expression),
+		expr->expression );
+
+	return( -1 );
+}
+
+static int
+vips_expr_emit( VipsExpr *expr, VipsExprOp op, double value, int ref )
+{
+	if( expr->n_step >= MAX_NODES )
+		return( vips_expr_error( expr, _( "expression too long" ) ) );
+
+	expr->step[expr->n_step].op = op;
+	expr->step[expr->n_step].value = value;
+	expr->step[expr->n_step].ref = ref;
+	expr->n_step += 1;
+
+	return( 0 );
+}
+
+/* Find or add a reference to an image and band.
+ */
+static int
+vips_expr_ref( VipsExpr *expr, int image, int band )
+{
+	int i;
+
+	for( i = 0; i < expr->n_ref; i++ )
+		if( expr->ref_image[i] == image &&
+			expr->ref_band[i] == band )
+			return( i );
+
+	if( expr->n_ref >= MAX_REFS ) {
+		vips_expr_error( expr, _( "too many image references" ) );
+		return( -1 );
+	}
+
+	expr->ref_image[expr->n_ref] = image;
+	expr->ref_band[expr->n_ref] = band;
+
+	return( expr->n_ref++ );
+}
+
+/* primary: number | $n | $n[b] | ( rel )
+ */
+static int
+vips_expr_parse_primary( VipsExpr *expr )
+{
+	vips_expr_skip( expr );
+
+	if( vips_expr_match( expr, "(" ) ) {
+		if( vips_expr_parse_rel( expr ) )
+			return( -1 );
+		if( !vips_expr_match( expr, ")" ) )
+			return( vips_expr_error( expr, _( "expected \")\"" ) ) );
+	}
+	else if( vips_expr_match( expr, "$" ) ) {
+		int image;
+		int band;
+		int ref;
+
+		if( !isdigit( (int) *expr->p ) )
+			return( vips_expr_error( expr,
+				_( "expected image number" ) ) );
+		image = strtol( expr->p, (char **) &expr->p, 10 );
+		if( image >= expr->in->area.n )
+			return( vips_expr_error( expr,
+				_( "no such image" ) ) );
+
+		band = -1;
+		if( vips_expr_match( expr, "[" ) ) {
+			vips_expr_skip( expr );
+			if( !isdigit( (int) *expr->p ) )
+				return( vips_expr_error( expr,
+					_( "expected band number" ) ) );
+			band = strtol( expr->p, (char **) &expr->p, 10 );
+			if( !vips_expr_match( expr, "]" ) )
+				return( vips_expr_error( expr,
+					_( "expected \"]\"" ) ) );
+		}
+
+		if( (ref = vips_expr_ref( expr, image, band )) < 0 ||
+			vips_expr_emit( expr, EXPR_REF, 0.0, ref ) )
+			return( -1 );
+	}
+	else if( isdigit( (int) *expr->p ) || *expr->p == '.' ) {
+		double value;
+
+		value = g_ascii_strtod( expr->p, (char **) &expr->p );
+		if( vips_expr_emit( expr, EXPR_CONST, value, 0 ) )
+			return( -1 );
+	}
+	else
+		return( vips_expr_error( expr, _( "syntax error" ) ) );
+
+	return( 0 );
+}
+
+/* unary: - unary | + unary | primary
+ *
+ * Every unary operator and every bracket passes through here, so this is
+ * where we stop runaway recursion.
+ */
+static int
+vips_expr_parse_unary( VipsExpr *expr )
+{
+	int result;
+
+	if( expr->nesting >= MAX_NESTING )
+		return( vips_expr_error( expr, 
+			_( "expression nested too deeply" ) ) );
+	expr->nesting += 1;
+
+	result = 0;
+	if( vips_expr_match( expr, "-" ) ) {
+		if( vips_expr_parse_unary( expr ) ||
+			vips_expr_emit( expr, EXPR_NEG, 0.0, 0 ) )
+			result = -1;
+	}
+	else if( vips_expr_match( expr, "+" ) ) {
+		if( vips_expr_parse_unary( expr ) )
+			result = -1;
+	}
+	else if( vips_expr_parse_primary( expr ) )
+		result = -1;
+
+	expr->nesting -= 1;
+
+	return( result );
+}
+
+/* mul: unary { (* | /) unary }
+ */
+static int
+vips_expr_parse_mul( VipsExpr *expr )
+{
+	if( vips_expr_parse_unary( expr ) )
+		return( -1 );
+
+	for(;;) {
+		VipsExprOp op;
+
+		if( vips_expr_match( expr, "*" ) )
+			op = EXPR_MUL;
+		else if( vips_expr_match( expr, "/" ) )
+			op = EXPR_DIV;
+		else
+			break;
+
+		if( vips_expr_parse_unary( expr ) ||
+			vips_expr_emit( expr, op, 0.0, 0 ) )
+			return( -1 );
+	}
+
+	return( 0 );
+}
+
+/* add: mul { (+ | -) mul }
+ */
+static int
+vips_expr_parse_add( VipsExpr *expr )
+{
+	if( vips_expr_parse_mul( expr ) )
+		return( -1 );
+
+	for(;;) {
+		VipsExprOp op;
+
+		if( vips_expr_match( expr, "+" ) )
+			op = EXPR_ADD;
+		else if( vips_expr_match( expr, "-" ) )
+			op = EXPR_SUB;
+		else
+			break;
+
+		if( vips_expr_parse_mul( expr ) ||
+			vips_expr_emit( expr, op, 0.0, 0 ) )
+			return( -1 );
+	}
+
+	return( 0 );
+}
+
+/* rel: add { (< | > | <= | >= | == | !=) add }
+ *
+ * Test the two-character operators first.
+ */
+static int
+vips_expr_parse_rel( VipsExpr *expr )
+{
+	if( vips_expr_parse_add( expr ) )
+		return( -1 );
+
+	for(;;) {
+		VipsExprOp op;
+
+		if( vips_expr_match( expr, "<=" ) )
+			op = EXPR_LESSEQ;
+		else if( vips_expr_match( expr, ">=" ) )
+			op = EXPR_MOREEQ;
+		else if( vips_expr_match( expr, "==" ) )
+			op = EXPR_EQUAL;
+		else if( vips_expr_match( expr, "!=" ) )
+			op = EXPR_NOTEQ;
+		else if( vips_expr_match( expr, "<" ) )
+			op = EXPR_LESS;
+		else if( vips_expr_match( expr, ">" ) )
+			op = EXPR_MORE;
+		else
+			break;
+
+		if( vips_expr_parse_add( expr ) ||
+			vips_expr_emit( expr, op, 0.0, 0 ) )
+			return( -1 );
+	}
+
+	return( 0 );
+}
+
+/* Check the stack never gets too deep.
+ */
+static int
+vips_expr_depth( VipsExpr *expr )
+{
+	int sp;
+	int i;
+
+	sp = 0;
+	for( i = 0; i < expr->n_step; i++ ) {
+		switch( expr->step[i].op ) {
+		case EXPR_CONST:
+		case EXPR_REF:
+			sp += 1;
+			if( sp > MAX_DEPTH ) {
+				vips_expr_error( expr,
+					_( "expression too complex" ) );
+				return( -1 );
+			}
+			break;
+
+		case EXPR_NEG:
+			break;
+
+		default:
+			sp -= 1;
+			break;
+		}
+	}
+
+	g_assert( sp == 1 );
+
+	return( 0 );
+}
+
+/* Reinterpret a float as an int, for orc constants.
+ */
+static int
+vips_expr_float_bits( float value )
+{
+	union {
+		float f;
+		gint32 i;
+	} u;
+
+	u.f = value;
+
+	return( u.i );
+}
+
+/* Make a float constant and return its name.
+ */
+static void
+vips_expr_constant( VipsExpr *expr, char *name, float value )
+{
+	vips_vector_constant( expr->vector,
+		name, vips_expr_float_bits( value ), 4 );
+}
+
+/* Turn an orc cmp mask into 255.0 or 0.0, the usual vips relational values.
+ */
+static void
+vips_expr_mask( VipsExpr *expr, const char *dest )
+{
+	char c255[256];
+
+	vips_expr_constant( expr, c255, 255.0 );
+	vips_vector_asm3( expr->vector, "andl", dest, dest, c255 );
+}
+
+/* Try to compile the expression to an orc program. Images are all float
+ * and the same number of bands, so each op is a simple loop over a line.
+ */
+static void
+vips_expr_compile( VipsExpr *expr, VipsBandFormat format )
+{
+	/* Names of the things on the stack.
+	 */
+	char stack[MAX_DEPTH][256];
+	int n_temp;
+	int sp;
+	int i;
+
+	/* The orc limits from vips_vector_full().
+	 */
+	if( !vips_vector_isenabled() ||
+		format != VIPS_FORMAT_FLOAT ||
+		expr->n_ref > 6 ||
+		expr->n_step > 40 )
+		return;
+
+	expr->vector = vips_vector_new( "expr", 4 );
+
+	for( i = 0; i < expr->n_ref; i++ ) {
+		char name[256];
+
+		vips_snprintf( name, 256, "s%d", i + 1 );
+		expr->var[i] = vips_vector_source_name( expr->vector, name, 4 );
+	}
+
+	n_temp = 0;
+	sp = 0;
+	for( i = 0; i < expr->n_step; i++ ) {
+		VipsExprStep *step = &expr->step[i];
+
+		char *a;
+		char *b;
+		char dest[256];
+
+		/* Pop the args to ops, and make a temp for the result.
+		 */
+		a = NULL;
+		b = NULL;
+		if( step->op == EXPR_NEG ) {
+			sp -= 1;
+			a = stack[sp];
+		}
+		else if( step->op != EXPR_CONST &&
+			step->op != EXPR_REF ) {
+			sp -= 2;
+			a = stack[sp];
+			b = stack[sp + 1];
+		}
+		if( a ) {
+			for( ; n_temp <= sp; n_temp++ ) {
+				vips_snprintf( dest, 256, "t%d", n_temp );
+				vips_vector_temporary( expr->vector, dest, 4 );
+			}
+			vips_snprintf( dest, 256, "t%d", sp );
+		}
+
+		switch( step->op ) {
+		case EXPR_CONST:
+			vips_expr_constant( expr, dest, step->value );
+			break;
+
+		case EXPR_REF:
+			vips_snprintf( dest, 256, "s%d", step->ref + 1 );
+			break;
+
+		case EXPR_NEG:
+		{
+			char c0[256];
+
+			vips_expr_constant( expr, c0, 0.0 );
+			vips_vector_asm3( expr->vector, "subf", dest, c0, a );
+		}
+			break;
+
+		case EXPR_ADD:
+			vips_vector_asm3( expr->vector, "addf", dest, a, b );
+			break;
+
+		case EXPR_SUB:
+			vips_vector_asm3( expr->vector, "subf", dest, a, b );
+			break;
+
+		case EXPR_MUL:
+			vips_vector_asm3( expr->vector, "mulf", dest, a, b );
+			break;
+
+		case EXPR_DIV:
+			vips_vector_asm3( expr->vector, "divf", dest, a, b );
+			break;
+
+		case EXPR_LESS:
+			vips_vector_asm3( expr->vector, "cmpltf", dest, a, b );
+			vips_expr_mask( expr, dest );
+			break;
+
+		case EXPR_MORE:
+			vips_vector_asm3( expr->vector, "cmpltf", dest, b, a );
+			vips_expr_mask( expr, dest );
+			break;
+
+		case EXPR_LESSEQ:
+			vips_vector_asm3( expr->vector, "cmplef", dest, a, b );
+			vips_expr_mask( expr, dest );
+			break;
+
+		case EXPR_MOREEQ:
+			vips_vector_asm3( expr->vector, "cmplef", dest, b, a );
+			vips_expr_mask( expr, dest );
+			break;
+
+		case EXPR_EQUAL:
+			vips_vector_asm3( expr->vector, "cmpeqf", dest, a, b );
+			vips_expr_mask( expr, dest );
+			break;
+
+		case EXPR_NOTEQ:
+		{
+			char cm1[256];
+
+			vips_vector_constant( expr->vector, cm1, -1, 4 );
+			vips_vector_asm3( expr->vector, "cmpeqf", dest, a, b );
+			vips_vector_asm3( expr->vector, "xorl", dest, dest, cm1 );
+			vips_expr_mask( expr, dest );
+		}
+			break;
+
+		default:
+			g_assert_not_reached();
+		}
+
+		vips_strncpy( stack[sp], dest, 256 );
+		sp += 1;
+	}
+
+	vips_vector_asm2( expr->vector, "copyl", "d1", stack[0] );
+
+	if( vips_vector_full( expr->vector ) ||
+		!vips_vector_compile( expr->vector ) ||
+		!expr->vector->compiled ) {
+#ifdef DEBUG
+		printf( "vips_expr_compile: using C path\n" );
+#endif /*DEBUG*/
+
+		VIPS_FREEF( vips_vector_free, expr->vector );
+	}
+}
+
+/* Run the steps over the line in chunks, keeping the stack in double.
+ */
+#define EVAL( TYPE ) { \
+	TYPE ** restrict p = (TYPE **) in; \
+	TYPE * restrict q = (TYPE *) out; \
+	\
+	for( x = 0; x < sz; x += CHUNK ) { \
+		int n = VIPS_MIN( CHUNK, sz - x ); \
+		int sp; \
+		\
+		sp = 0; \
+		for( i = 0; i < expr->n_step; i++ ) { \
+			VipsExprStep *step = &expr->step[i]; \
+			double *a = stack[sp - 2]; \
+			double *b = stack[sp - 1]; \
+			\
+			switch( step->op ) { \
+			case EXPR_CONST: \
+				for( j = 0; j < n; j++ ) \
+					stack[sp][j] = step->value; \
+				sp += 1; \
+				break; \
+			\
+			case EXPR_REF: \
+				for( j = 0; j < n; j++ ) \
+					stack[sp][j] = p[step->ref][x + j]; \
+				sp += 1; \
+				break; \
+			\
+			case EXPR_NEG: \
+				for( j = 0; j < n; j++ ) \
+					b[j] = -b[j]; \
+				break; \
+			\
+			case EXPR_ADD: \
+				for( j = 0; j < n; j++ ) \
+					a[j] = a[j] + b[j]; \
+				sp -= 1; \
+				break; \
+			\
+			case EXPR_SUB: \
+				for( j = 0; j < n; j++ ) \
+					a[j] = a[j] - b[j]; \
+				sp -= 1; \
+				break; \
+			\
+			case EXPR_MUL: \
+				for( j = 0; j < n; j++ ) \
+					a[j] = a[j] * b[j]; \
+				sp -= 1; \
+				break; \
+			\
+			case EXPR_DIV: \
+				for( j = 0; j < n; j++ ) \
+					a[j] = a[j] / b[j]; \
+				sp -= 1; \
+				break; \
+			\
+			case EXPR_LESS: \
+				for( j = 0; j < n; j++ ) \
+					a[j] = a[j] < b[j] ? 255 : 0; \
+				sp -= 1; \
+				break; \
+			\
+			case EXPR_MORE: \
+				for( j = 0; j < n; j++ ) \
+					a[j] = a[j] > b[j] ? 255 : 0; \
+				sp -= 1; \
+				break; \
+			\
+			case EXPR_LESSEQ: \
+				for( j = 0; j < n; j++ ) \
+					a[j] = a[j] <= b[j] ? 255 : 0; \
+				sp -= 1; \
+				break; \
+			\
+			case EXPR_MOREEQ: \
+				for( j = 0; j < n; j++ ) \
+					a[j] = a[j] >= b[j] ? 255 : 0; \
+				sp -= 1; \
+				break; \
+			\
+			case EXPR_EQUAL: \
+				for( j = 0; j < n; j++ ) \
+					a[j] = a[j] == b[j] ? 255 : 0; \
+				sp -= 1; \
+				break; \
+			\
+			case EXPR_NOTEQ: \
+				for( j = 0; j < n; j++ ) \
+					a[j] = a[j] != b[j] ? 255 : 0; \
+				sp -= 1; \
+				break; \
+			\
+			default: \
+				g_assert_not_reached(); \
+			} \
+		} \
+		\
+		for( j = 0; j < n; j++ ) \
+			q[x + j] = stack[0][j]; \
+	} \
+}
+
+static void
+vips_expr_buffer( VipsArithmetic *arithmetic,
+	VipsPel *out, VipsPel **in, int width )
+{
+	VipsExpr *expr = (VipsExpr *) arithmetic;
+	VipsImage *im = arithmetic->ready[0];
+	const int sz = width * im->Bands;
+
+	if( expr->vector ) {
+		VipsExecutor executor;
+		int i;
+
+		vips_executor_set_program( &executor, expr->vector, sz );
+		for( i = 0; i < expr->n_ref; i++ )
+			vips_executor_set_array( &executor,
+				expr->var[i], in[i] );
+		vips_executor_set_destination( &executor, out );
+		vips_executor_run( &executor );
+	}
+	else {
+		/* The stack has one extra slot at the bottom so that a and
+		 * b above are always valid pointers.
+		 */
+		double stack_base[MAX_DEPTH + 2][CHUNK];
+		double (*stack)[CHUNK] = stack_base + 2;
+
+		int x, i, j;
+
+		if( im->BandFmt == VIPS_FORMAT_DOUBLE )
+			EVAL( double )
+		else
+			EVAL( float )
+	}
+}
+
+/* We compute in float, or double if any input is double.
+ */
+
+#define F VIPS_FORMAT_FLOAT
+#define D VIPS_FORMAT_DOUBLE
+
+static const VipsBandFormat vips_expr_format_table[10] = {
+/* UC  C   US  S   UI  I  F  X  D  DX */
+   F,  F,  F,  F,  F,  F, F, F, D, D
+};
+
+static int
+vips_expr_build( VipsObject *object )
+{
+	VipsObjectClass *class = VIPS_OBJECT_GET_CLASS( object );
+	VipsArithmetic *arithmetic = VIPS_ARITHMETIC( object );
+	VipsExpr *expr = (VipsExpr *) object;
+
+	VipsImage **in;
+	VipsImage **t;
+	VipsBandFormat format;
+	int i;
+
+	if( !expr->in ||
+		expr->in->area.n < 1 ) {
+		vips_error( class->nickname, "%s", _( "no input images" ) );
+		return( -1 );
+	}
+	in = (VipsImage **) expr->in->area.data;
+
+	format = VIPS_FORMAT_FLOAT;
+	for( i = 0; i < expr->in->area.n; i++ ) {
+		if( vips_check_noncomplex( class->nickname, in[i] ) )
+			return( -1 );
+		if( in[i]->BandFmt == VIPS_FORMAT_DOUBLE )
+			format = VIPS_FORMAT_DOUBLE;
+	}
+
+	expr->n_step = 0;
+	expr->n_ref = 0;
+	expr->p = expr->expression;
+	expr->nesting = 0;
+	if( vips_expr_parse_rel( expr ) )
+		return( -1 );
+	vips_expr_skip( expr );
+	if( *expr->p )
+		return( vips_expr_error( expr, _( "syntax error" ) ) );
+	if( vips_expr_depth( expr ) )
+		return( -1 );
+	if( expr->n_ref == 0 ) {
+		vips_error( class->nickname,
+			"%s", _( "expression uses no images" ) );
+		return( -1 );
+	}
+
+	/* Make an input for each image and band we use. Arithmetic will
+	 * bandalike these for us, so single bands are used with every band
+	 * of the other inputs.
+	 */
+	t = (VipsImage **) vips_object_local_array( object, 2 * expr->n_ref );
+	for( i = 0; i < expr->n_ref; i++ ) {
+		VipsImage *image = in[expr->ref_image[i]];
+
+		if( expr->ref_band[i] >= 0 ) {
+			if( vips_extract_band( image, &t[2 * i],
+				expr->ref_band[i], NULL ) )
+				return( -1 );
+			image = t[2 * i];
+		}
+
+		if( vips_cast( image, &t[2 * i + 1], format, NULL ) )
+			return( -1 );
+	}
+
+	/* The inputs are all cast to format, so we can make the program 
+	 * before arithmetic starts generating pixels.
+	 */
+	vips_expr_compile( expr, format );
+
+	/* Every other element of t.
+	 */
+	arithmetic->n = expr->n_ref;
+	arithmetic->in = (VipsImage **)
+		vips_object_local_array( object, expr->n_ref );
+	for( i = 0; i < expr->n_ref; i++ ) {
+		arithmetic->in[i] = t[2 * i + 1];
+		g_object_ref( arithmetic->in[i] );
+	}
+
+	if( VIPS_OBJECT_CLASS( vips_expr_parent_class )->build( object ) )
+		return( -1 );
+
+	return( 0 );
+}
+
+static void
+vips_expr_class_init( VipsExprClass *class )
+{
+	GObjectClass *gobject_class = G_OBJECT_CLASS( class );
+	VipsObjectClass *object_class = (VipsObjectClass *) class;
+	VipsArithmeticClass *aclass = VIPS_ARITHMETIC_CLASS( class );
+
+	gobject_class->dispose = vips_expr_dispose;
+	gobject_class->set_property = vips_object_set_property;
+	gobject_class->get_property = vips_object_get_property;
+
+	object_class->nickname = "expr";
+	object_class->description =
+		_( "evaluate an arithmetic expression over images" );
+	object_class->build = vips_expr_build;
+
+	aclass->process_line = vips_expr_buffer;
+
+	vips_arithmetic_set_format_table( aclass, vips_expr_format_table );
+
+	VIPS_ARG_BOXED( class, "in", 0,
+		_( "Input" ),
+		_( "Array of input images" ),
+		VIPS_ARGUMENT_REQUIRED_INPUT,
+		G_STRUCT_OFFSET( VipsExpr, in ),
+		VIPS_TYPE_ARRAY_IMAGE );
+
+	VIPS_ARG_STRING( class, "expression", 110,
+		_( "Expression" ),
+		_( "Expression to evaluate" ),
+		VIPS_ARGUMENT_REQUIRED_INPUT,
+		G_STRUCT_OFFSET( VipsExpr, expression ),
+		NULL );
+}
+
+static void
+vips_expr_init( VipsExpr *expr )
+{
+}
+
+static int
+vips_exprv( VipsImage **in, VipsImage **out, int n, 
+	const char *expression, va_list ap )
+{
+	VipsArrayImage *array; 
+	int result;
+
+	array = vips_array_image_new( in, n );
+	result = vips_call_split( "expr", ap, array, out, expression );
+	vips_area_unref( VIPS_AREA( array ) );
+
+	return( result );
+}
+
+/**
+ * vips_expr:
+ * @in: (array length=n): array of input images
+ * @out: (out): output image
+ * @n: number of input images
+ * @expression: expression to evaluate
+ * @...: %NULL-terminated list of optional named arguments
+ *
+ * This operation evaluates @expression for every pixel in @in and writes 
+ * the result to @out. For example:
+ *
+ * |[
+ * vips_expr( in, &out, 2, "($0 - $1) * ($0[1] > 128)", NULL )
+ * ]|
+ *
+ * `$n` is input image n, and `$n[b]` is band b of image n. Single bands are
+ * used with every band of the other images, in the same way as vips_add().
+ * You can use `+`, `-`, `*`, `/`, unary minus, brackets, numbers, and
+ * the relational operators `<`, `>`, `<=`, `>=`, `==` and `!=`, which give 
+ * 255 for true and 0 for false. Relational operators bind less tightly 
+ * than arithmetic.
+ *
+ * Images must not be complex. The output is double if any input is double,
+ * and float otherwise. Division follows IEEE rules, so dividing by zero 
+ * gives an infinity rather than zero.
+ *
+ * The whole expression is compiled to a single vector program, so complex 
+ * formulas run in one pass over the pixels. If the expression is too large
+ * for the vector system, or the images are double, a C path is used 
+ * instead.
+ *
+ * If the images differ in size, the smaller images are enlarged to match the
+ * largest by adding zero pixels along the bottom and right.
+ *
+ * See also: vips_add(), vips_relational(), vips_linear().
+ *
+ * Returns: 0 on success, -1 on error
+ */
+int
+vips_expr( VipsImage **in, VipsImage **out, int n, 
+	const char *expression, ... )
+{
+	va_list ap;
+	int result;
+
+	va_start( ap, expression );
+	result = vips_exprv( in, out, n, expression, ap );
+	va_end( ap );
+
+	return( result );
+}
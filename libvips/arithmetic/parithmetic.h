@@ -81,6 +81,11 @@ typedef struct _VipsArithmetic {
 	/* Set this to override class->format_table.
 	 */
 	VipsBandFormat format;
+
+	/* If we run some of the operations upstream of us as well, the plan
+	 * for doing that. See vips_arithmetic_fuse().
+	 */
+	struct _VipsArithmeticFuse *fuse;
 } VipsArithmetic;
 
 typedef struct _VipsArithmeticClass {
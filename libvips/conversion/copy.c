@@ -54,6 +54,8 @@
  * 5/6/15
  * 	- move byteswap out to vips_byteswap()
  * 	- move band folding out to vips_bandfold()/vips_unfold()
+ * 16/10/17
+ * 	- add vips__copy_source()
  */
 
 /*
@@ -143,6 +145,30 @@ vips_copy_gen( VipsRegion *or, void *seq, void *a, void *b, gboolean *stop )
 	return( 0 );
 }
 
+/* If @image is a vips_copy() which leaves pixels untouched, return the image
+ * it copies. Arithmetic uses this to see through the copies it makes of its 
+ * inputs when fusing operations, see vips_arithmetic_build().
+ */
+VipsImage *
+vips__copy_source( VipsImage *image )
+{
+	VipsCopy *copy;
+
+	if( image->generate_fn != vips_copy_gen )
+		return( NULL );
+
+	copy = (VipsCopy *) image->client2;
+	if( copy->swap ||
+		copy->in->Xsize != image->Xsize ||
+		copy->in->Ysize != image->Ysize ||
+		copy->in->Bands != image->Bands ||
+		copy->in->BandFmt != image->BandFmt ||
+		copy->in->Coding != image->Coding )
+		return( NULL );
+
+	return( copy->in );
+}
+
 /* The props we copy, if set, from the operation to the image.
  */
 static const char *vips_copy_names[] = {
@@ -23,6 +23,10 @@
  * 	- re-enable skipahead now we have the single-thread-first-tile idea
  * 6/3/17
  * 	- deprecate @trace, @access now seq is much simpler
+ * 16/10/17
+ * 	- serve lines we've already read from the linecache without taking
+ * 	  the lock, so many workers can read behind at once
+ * 	- the unlocked path only looks up lines in the cache, it never reads
  */
 
 /*
@@ -80,12 +84,13 @@ typedef struct _VipsSequential {
 	VipsAccess access;
 	gboolean trace;
 
-	/* Lock access to y_pos with this.
+	/* Lock reads from our source with this. 
 	 */
 	GMutex *lock;
 
 	/* The next read from our source will fetch this scanline, ie. it's 0
-	 * when we start.
+	 * when we start. Only set with the lock held, but read atomically
+	 * without it, see vips_sequential_generate().
 	 */
 	int y_pos;
 
@@ -122,6 +127,21 @@ vips_sequential_generate( VipsRegion *or,
 			"request for line %d, height %d\n", 
 			sequential, r->top, r->height );
 
+	/* Lines above y_pos have been read and are probably still in the 
+	 * linecache. We can copy these out without the lock, so workers 
+	 * which are behind don't queue up behind the one that's reading. 
+	 *
+	 * We must never make the linecache read from @in without the lock, 
+	 * so this is lookup only. If any line has gone, take the slow path.
+	 */
+	if( VIPS_RECT_BOTTOM( r ) <= g_atomic_int_get( &sequential->y_pos ) ) {
+		if( g_atomic_int_get( &sequential->error ) )
+			return( -1 );
+
+		if( vips__line_cache_lookup( ir->im, or ) )
+			return( 0 );
+	}
+
 	VIPS_GATE_START( "vips_sequential_generate: wait" );
 
 	g_mutex_lock( sequential->lock );
@@ -153,12 +173,13 @@ vips_sequential_generate( VipsRegion *or,
 		area.width = 1;
 		area.height = r->top - sequential->y_pos;
 		if( vips_region_prepare( ir, &area ) ) {
-			sequential->error = -1;
+			g_atomic_int_set( &sequential->error, -1 );
 			g_mutex_unlock( sequential->lock );
 			return( -1 );
 		}
 
-		sequential->y_pos = VIPS_RECT_BOTTOM( &area );
+		g_atomic_int_set( &sequential->y_pos, 
+			VIPS_RECT_BOTTOM( &area ) );
 	}
 
 	/* This is a request for old or present pixels -- serve from cache.
@@ -166,12 +187,13 @@ vips_sequential_generate( VipsRegion *or,
 	 */
 	if( vips_region_prepare( ir, r ) ||
 		vips_region_region( or, ir, r, r->left, r->top ) ) {
-		sequential->error = -1;
+		g_atomic_int_set( &sequential->error, -1 );
 		g_mutex_unlock( sequential->lock );
 		return( -1 );
 	}
 
-	sequential->y_pos = VIPS_MAX( sequential->y_pos, VIPS_RECT_BOTTOM( r ) );
+	g_atomic_int_set( &sequential->y_pos, 
+		VIPS_MAX( sequential->y_pos, VIPS_RECT_BOTTOM( r ) ) );
 
 	g_mutex_unlock( sequential->lock );
 
@@ -191,9 +213,14 @@ vips_sequential_build( VipsObject *object )
 	if( VIPS_OBJECT_CLASS( vips_sequential_parent_class )->build( object ) )
 		return( -1 );
 
+	/* Threaded, so workers reading behind can fetch lines while one
+	 * worker reads ahead. We hold our own lock while we read from @in,
+	 * so it still only sees one request at a time.
+	 */
 	if( vips_linecache( sequential->in, &t, 
 		"tile_height", sequential->tile_height,
 		"access", VIPS_ACCESS_SEQUENTIAL,
+		"threaded", TRUE,
 		NULL ) )
 		return( -1 );
 
@@ -282,6 +309,11 @@ vips_sequential_init( VipsSequential *sequential )
  * @strip_height can be used to set the size of the tiles that
  * vips_sequential() uses. The default value is 1.
  *
+ * Pixels are read from @in by one thread at a time, in order, into a 
+ * shared cache. The cache keeps enough of the lines above the read point for
+ * every worker, so workers asking for lines which have already been read 
+ * are served at once, in parallel, without reading them again. 
+ *
  * See also: vips_cache(), vips_linecache(), vips_tilecache().
  *
  * Returns: 0 on success, -1 on error.
@@ -35,6 +35,8 @@
  * 	- terminate on tile calc error
  * 7/3/17
  * 	- remove "access" on linecache, use the base class instead
+ * 16/10/17
+ * 	- threaded linecache keeps a request of look-behind for each worker
  */
 
 /*
@@ -889,18 +891,24 @@ vips_line_cache_gen( VipsRegion *or,
 {
 	VipsBlockCache *block_cache = (VipsBlockCache *) b;
 
+	int max_tiles;
+
 	VIPS_GATE_START( "vips_line_cache_gen: wait" );
 
 	g_mutex_lock( block_cache->lock );
 
 	VIPS_GATE_STOP( "vips_line_cache_gen: wait" );
 
-	/* We size up the cache to the largest request.
+	/* We size up the cache to the largest request. In threaded mode, 
+	 * all the workers can be reading at once and each can be up to a 
+	 * request behind the others, so keep a request for each, plus one 
+	 * being read.
 	 */
-	if( or->valid.height > 
-		block_cache->max_tiles * block_cache->tile_height ) {
-		block_cache->max_tiles = 
-			1 + (or->valid.height / block_cache->tile_height);
+	max_tiles = 1 + (or->valid.height / block_cache->tile_height);
+	if( block_cache->threaded )
+		max_tiles *= 1 + vips_concurrency_get();
+	if( max_tiles > block_cache->max_tiles ) {
+		block_cache->max_tiles = max_tiles;
 		VIPS_DEBUG_MSG( "vips_line_cache_gen: bumped max_tiles to %d\n",
 			block_cache->max_tiles ); 
 	}
@@ -910,6 +918,54 @@ vips_line_cache_gen( VipsRegion *or,
 	return( vips_tile_cache_gen( or, seq, a, b, stop ) ); 
 }
 
+/* If every line of @or is already in the linecache that made @image, paste
+ * them in and return TRUE. Otherwise return FALSE and leave @or alone. This
+ * never computes anything, so it's safe to call without any lock on the 
+ * cache's input.
+ */
+gboolean
+vips__line_cache_lookup( VipsImage *image, VipsRegion *or )
+{
+	VipsBlockCache *cache;
+	VipsRect *r = &or->valid;
+	int tw, th;
+	int xs, ys;
+	int x, y;
+	VipsTile *tile;
+
+	if( image->generate_fn != vips_line_cache_gen )
+		return( FALSE );
+	cache = (VipsBlockCache *) image->client2;
+	tw = cache->tile_width;
+	th = cache->tile_height;
+	xs = (r->left / tw) * tw;
+	ys = (r->top / th) * th;
+
+	g_mutex_lock( cache->lock );
+
+	for( y = ys; y < VIPS_RECT_BOTTOM( r ); y += th )
+		for( x = xs; x < VIPS_RECT_RIGHT( r ); x += tw ) 
+			if( !(tile = vips_tile_search( cache, x, y )) ||
+				tile->state != VIPS_TILE_STATE_DATA ) {
+				g_mutex_unlock( cache->lock );
+				return( FALSE );
+			}
+
+	/* Tiles can't be recycled while we hold the lock, so we can paste
+	 * without reffing them.
+	 */
+	for( y = ys; y < VIPS_RECT_BOTTOM( r ); y += th )
+		for( x = xs; x < VIPS_RECT_RIGHT( r ); x += tw ) {
+			tile = vips_tile_search( cache, x, y );
+			vips_tile_touch( tile );
+			vips_tile_paste( tile, or );
+		}
+
+	g_mutex_unlock( cache->lock );
+
+	return( TRUE );
+}
+
 static int
 vips_line_cache_build( VipsObject *object )
 {
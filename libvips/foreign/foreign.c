@@ -18,6 +18,9 @@
  * 	- transform cmyk->rgb if there's an embedded profile
  * 16/6/17
  * 	- add page_height
+ * 16/10/17
+ * 	- decompress to disc if memory would break the pipeline's budget
+ * 	- optionally decompress large images to compressed memory, not disc
  */
 
 /*
@@ -412,6 +415,11 @@ vips_foreign_map( const char *base, VipsSListMap2Fn fn, void *a, void *b )
 	GSList *files;
 	void *result;
 
+	/* We need the foreign classes to be registered before we can find
+	 * @base.
+	 */
+	vips__operations_init();
+
 	files = NULL;
 	(void) vips_class_map_all( g_type_from_name( base ), 
 		(VipsClassMapFn) file_add_class, (void *) &files );
@@ -746,13 +754,34 @@ vips_foreign_load_temp( VipsForeignLoad *load )
 	if( !load->disc )
 		load->memory = TRUE;
 
-	/* We open via disc if:
-	 * - 'memory' is off
-	 * - the uncompressed image will be larger than 
-	 *   vips_get_disc_threshold()
+	/* We open via disc if the uncompressed image would break the memory 
+	 * budget of the pipeline we are loading for, see 
+	 * vips_image_set_memory_budget(). We usually load on the main 
+	 * thread, so look at the pipeline @out feeds, not just the current
+	 * budget.
+	 */
+	if( vips__budget_would_exceed_image( load->out, image_size ) ) {
+#ifdef DEBUG
+		printf( "vips_foreign_load_temp: disc temp for budget\n" );
+#endif /*DEBUG*/
+
+		return( vips_image_new_temp_file( "%s.v" ) );
+	}
+
+	/* We open via disc, or via compressed memory if 
+	 * --vips-spill-memory is set, if 'memory' is off and the 
+	 * uncompressed image will be larger than vips_get_disc_threshold().
 	 */
 	if( !load->memory && 
 		image_size > disc_threshold ) {
+		if( vips__spill_memory ) {
+#ifdef DEBUG
+			printf( "vips_foreign_load_temp: spill temp\n" );
+#endif /*DEBUG*/
+
+			return( vips__spill_new() );
+		}
+
 #ifdef DEBUG
 		printf( "vips_foreign_load_temp: disc temp\n" );
 #endif /*DEBUG*/
@@ -819,8 +848,22 @@ vips_foreign_load_start( VipsImage *out, void *a, void *b )
 		g_object_set_qdata( G_OBJECT( load->real ), 
 			vips__foreign_load_operation, load ); 
 
-		if( class->load( load ) ||
-			vips_image_pio_input( load->real ) ) 
+		if( class->load( load ) )
+			return( NULL );
+
+		/* Spill images need to be run into their compressed store,
+		 * then swapped for an image that reads from it.
+		 */
+		if( vips__image_isspill( load->real ) ) {
+			VipsImage *t;
+
+			if( vips__spill_build( load->real, &t ) )
+				return( NULL );
+			VIPS_UNREF( load->real );
+			load->real = t;
+		}
+
+		if( vips_image_pio_input( load->real ) ) 
 			return( NULL );
 
 		/* ->header() read the header into @out, load has read the
@@ -94,6 +94,11 @@ vips_foreign_load_vips_header( VipsForeignLoad *load )
 	if( !(out2 = vips_image_new_mode( vips->filename, "r" )) )
 		return( -1 );
 
+	/* Windows on the file use this to hint the kernel.
+	 */
+	if( vips_object_argument_isset( VIPS_OBJECT( load ), "access" ) )
+		vips__image_set_access( out2, load->access );
+
 	/* Remove the @out that's there now. 
 	 */
 	g_object_get( load, "out", &out, NULL ); 
@@ -155,6 +160,9 @@ vips_foreign_load_vips_init( VipsForeignLoadVips *vips )
  *
  * Read in a vips image. 
  *
+ * Tiled images made by vips_vipssave() are decompressed a tile at a time,
+ * as pixels are needed.
+ *
  * See also: vips_vipssave().
  *
  * Returns: 0 on success, -1 on error.
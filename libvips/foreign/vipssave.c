@@ -1,6 +1,8 @@
 /* save to vips
  *
  * 24/11/11
+ * 16/10/17
+ * 	- add "tile" and "tile_size"
  */
 
 /*
@@ -53,6 +55,11 @@ typedef struct _VipsForeignSaveVips {
 
 	char *filename;
 
+	/* Write a tiled file, and the tile size.
+	 */
+	gboolean tile;
+	int tile_size;
+
 } VipsForeignSaveVips;
 
 typedef VipsForeignSaveClass VipsForeignSaveVipsClass;
@@ -72,6 +79,10 @@ vips_foreign_save_vips_build( VipsObject *object )
 		build( object ) )
 		return( -1 );
 
+	if( vips->tile )
+		return( vips__tiled_write( save->ready, 
+			vips->filename, vips->tile_size ) );
+
 	if( !(x = vips_image_new_mode( vips->filename, "w" )) )
 		return( -1 );
 	if( vips_image_write( save->ready, x ) ) {
@@ -116,11 +127,26 @@ vips_foreign_save_vips_class_init( VipsForeignSaveVipsClass *class )
 		VIPS_ARGUMENT_REQUIRED_INPUT, 
 		G_STRUCT_OFFSET( VipsForeignSaveVips, filename ),
 		NULL );
+
+	VIPS_ARG_BOOL( class, "tile", 2, 
+		_( "Tile" ), 
+		_( "Write a tiled image" ),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET( VipsForeignSaveVips, tile ),
+		FALSE );
+
+	VIPS_ARG_INT( class, "tile_size", 3, 
+		_( "Tile size" ), 
+		_( "Tile size in pixels" ),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET( VipsForeignSaveVips, tile_size ),
+		VIPS__TILED_MIN, VIPS__TILED_MAX, 256 );
 }
 
 static void
 vips_foreign_save_vips_init( VipsForeignSaveVips *vips )
 {
+	vips->tile_size = 256;
 }
 
 /**
@@ -129,8 +155,22 @@ vips_foreign_save_vips_init( VipsForeignSaveVips *vips )
  * @filename: file to write to 
  * @...: %NULL-terminated list of optional named arguments
  *
+ * Optional arguments:
+ *
+ * * @tile: %gboolean, write a tiled image
+ * * @tile_size: %gint, tile size in pixels, 16 to 8192
+ *
  * Write @in to @filename in VIPS format.
  *
+ * Normally the pixels are written as a single uncompressed raster. Set @tile
+ * to write the image as a set of @tile_size by @tile_size tiles instead. 
+ * Each tile is compressed with a simple difference predictor and run-length
+ * coding, so it's fast to read and write, and tiles are computed and 
+ * compressed in parallel. vips_vipsload() can read any part of a tiled file 
+ * without decompressing the rest. Tiled files can't be mapped 
+ * directly, so use them for storage rather than for intermediates. 
+ * Versions of libvips before 8.6 can't read tiled files.
+ *
  * See also: vips_vipsload().
  *
  * Returns: 0 on success, -1 on error.
@@ -178,6 +178,9 @@ int vips_add( VipsImage *left, VipsImage *right, VipsImage **out, ... )
 	__attribute__((sentinel));
 int vips_sum( VipsImage **in, VipsImage **out, int n, ... )
 	__attribute__((sentinel));
+int vips_expr( VipsImage **in, VipsImage **out, int n, 
+	const char *expression, ... )
+	__attribute__((sentinel));
 int vips_subtract( VipsImage *in1, VipsImage *in2, VipsImage **out, ... )
 	__attribute__((sentinel));
 int vips_multiply( VipsImage *left, VipsImage *right, VipsImage **out, ... )
@@ -89,6 +89,8 @@ GType vips_pcs_get_type (void) G_GNUC_CONST;
 /* enumerations from "../../../libvips/include/vips/operation.h" */
 GType vips_operation_flags_get_type (void) G_GNUC_CONST;
 #define VIPS_TYPE_OPERATION_FLAGS (vips_operation_flags_get_type())
+GType vips_cache_policy_get_type (void) G_GNUC_CONST;
+#define VIPS_TYPE_CACHE_POLICY (vips_cache_policy_get_type())
 /* enumerations from "../../../libvips/include/vips/convolution.h" */
 GType vips_combine_get_type (void) G_GNUC_CONST;
 #define VIPS_TYPE_COMBINE (vips_combine_get_type())
@@ -64,6 +64,11 @@ G_STMT_START { \
 extern gboolean vips__thread_profile;
 
 void vips_profile_set( gboolean profile );
+void vips_profile_set_ring( int n_events );
+void vips_profile_set_trace( const char *filename );
+char *vips_profile_get_trace( void );
+int vips_profile_save_trace( const char *filename );
+void vips_profile_get_wait( guint64 *n_wait, double *wait_time );
 
 void vips__thread_profile_attach( const char *thread_name );
 void vips__thread_profile_detach( void ); 
@@ -39,6 +39,9 @@ extern "C" {
 
 typedef int (*VipsRegionWrite)( VipsRegion *region, VipsRect *area, void *a );
 int vips_sink_disc( VipsImage *im, VipsRegionWrite write_fn, void *a );
+void vips_sink_disc_set_buffers( int n );
+void vips_sink_disc_stats( guint64 *n_wait, double *wait_time, 
+	guint64 *bytes_written );
 
 int vips_sink( VipsImage *im, 
 	VipsStartFn start_fn, VipsGenerateFn generate_fn, VipsStopFn stop_fn,
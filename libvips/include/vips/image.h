@@ -515,6 +515,16 @@ int vips_reorder_prepare_many( VipsImage *image,
 	struct _VipsRegion **regions, VipsRect *r );
 void vips_reorder_margin_hint( VipsImage *image, int margin );
 
+/* Defined in threadpool.c, but really a function on image.
+ */
+void vips_image_set_priority( VipsImage *image, int priority );
+int vips_image_get_priority( VipsImage *image );
+
+/* Defined in memory.c, but really a function on image.
+ */
+void vips_image_set_memory_budget( VipsImage *image, size_t budget );
+size_t vips_image_get_memory_budget( VipsImage *image );
+
 #ifdef __cplusplus
 }
 #endif /*__cplusplus*/
@@ -64,6 +64,8 @@ extern int vips__tile_width;
 extern int vips__tile_height;
 extern int vips__fatstrip_height;
 extern int vips__thinstrip_height;
+extern gboolean vips__tile_adaptive;
+extern size_t vips__l2_size;
 
 /* Default n threads.
  */
@@ -99,9 +101,48 @@ extern gboolean vips__cache_trace;
 
 extern int vips__n_active_threads;
 
+/* Worker pool limits.
+ */
+extern int vips__threadpool_max_idle;
+extern int vips__threadpool_idle_timeout;
+extern int vips__threadpool_max_active;
+
+/* Buffers vips_sink_disc() writes behind through.
+ */
+extern int vips__sink_disc_buffers;
+
 void vips__threadpool_init( void );
+void vips__threadpool_shutdown( void );
 
 void vips__cache_init( void );
+void vips__cache_shutdown( void );
+void vips__operations_init( void );
+void vips__cache_disc_init( void );
+gboolean vips__cache_disc_lookup( VipsOperation *operation, char **key );
+void vips__cache_disc_attach( VipsOperation *operation, char *key );
+void vips__cache_disc_written( VipsImage *image, VipsImage *out );
+int vips__object_set_built( VipsObject *object );
+
+/* Per-pipeline memory budgets.
+ */
+typedef struct _VipsBudget VipsBudget;
+typedef gboolean (*VipsBudgetDoneFn)( void *a );
+
+VipsBudget *vips__budget_new( size_t limit );
+VipsBudget *vips__budget_ref( VipsBudget *budget );
+void vips__budget_unref( VipsBudget *budget );
+void vips__budget_set_current( VipsBudget *budget );
+VipsBudget *vips__budget_get_current( void );
+VipsBudget *vips__budget_charge( size_t size );
+void vips__budget_uncharge( VipsBudget *budget, size_t size );
+gboolean vips__budget_over( VipsBudget *budget );
+gboolean vips__budget_would_exceed( size_t size );
+gboolean vips__budget_would_exceed_image( VipsImage *image, size_t size );
+void vips__budget_wait( VipsBudget *budget, VipsBudgetDoneFn done, void *a );
+void vips__budget_wake( VipsBudget *budget );
+void vips__tracked_park( void *s );
+void vips__tracked_unpark( void *s );
+size_t vips__image_get_pipeline_budget( VipsImage *image );
 
 void vips__print_renders( void );
 
@@ -118,6 +159,40 @@ int vips__open_image_write( const char *filename, gboolean temp );
 int vips_image_open_input( VipsImage *image );
 int vips_image_open_output( VipsImage *image );
 
+/* vips files with Compression set to this are tiled, with Level set to the 
+ * tile size.
+ */
+#define VIPS__COMPRESSION_TILED (1)
+#define VIPS__TILED_MIN (16)
+#define VIPS__TILED_MAX (8192)
+int vips__tiled_write( VipsImage *in, const char *filename, int tile_size );
+
+gboolean vips__line_cache_lookup( VipsImage *image, VipsRegion *or );
+
+/* The worst case size of N bytes after vips__rle_encode().
+ */
+#define VIPS__RLE_BOUND( N ) ((N) + (N) / 128 + 1)
+size_t vips__rle_encode( VipsPel *q, VipsPel *p, size_t lskip, 
+	int width, int height, size_t ps, VipsPel *line );
+int vips__rle_decode( VipsPel *q, int width, int height, size_t ps, 
+	VipsPel *p, size_t length );
+
+/* Spill big loads to compressed memory rather than disc.
+ */
+extern gboolean vips__spill_memory;
+VipsImage *vips__spill_new( void );
+gboolean vips__image_isspill( VipsImage *image );
+int vips__spill_write_line( VipsImage *image, int ypos, VipsPel *linebuffer );
+int vips__spill_build( VipsImage *image, VipsImage **out );
+
+VipsImage *vips__copy_source( VipsImage *image );
+
+/* Cleared by --vips-nofuse and VIPS_NOFUSE.
+ */
+extern gboolean vips__fuse_enabled;
+
+void vips__simd_init( void );
+
 void vips__link_break_all( VipsImage *im );
 void *vips__link_map( VipsImage *image, gboolean upstream, 
 	VipsSListMap2Fn fn, void *a, void *b );
@@ -127,11 +202,22 @@ unsigned char *vips__b64_decode( const char *buffer, size_t *data_length );
 
 void *vips__mmap( int fd, int writeable, size_t length, gint64 offset );
 int vips__munmap( const void *start, size_t length );
+extern gboolean vips__mmap_advise_enabled;
+extern size_t vips__window_cache_max;
+void vips__window_flush( VipsImage *im );
+void vips__mmap_advise( void *baseaddr, size_t length, VipsAccess access );
+void vips__mmap_release( int fd, void *baseaddr, size_t length, 
+	gint64 offset, VipsAccess access );
+void vips__file_prefetch( int fd, gint64 offset, gint64 length );
+void vips__memory_advise_hugepage( void *data, size_t length );
 int vips_mapfile( VipsImage * );
 int vips_mapfilerw( VipsImage * );
 int vips_remapfilerw( VipsImage * );
 
 void vips__buffer_init( void );
+void vips__buffer_flush( void );
+void vips__buffer_shutdown( void );
+void vips__buffer_arena_drain( void );
 
 void vips__copy_4byte( int swap, unsigned char *to, unsigned char *from );
 void vips__copy_2byte( gboolean swap, unsigned char *to, unsigned char *from );
@@ -231,19 +317,53 @@ char *vips__xml_properties( VipsImage *image );
 
 void vips__cairo2rgba( guint32 *buf, int n );
 
-#ifdef DEBUG_LEAK
 extern GQuark vips__image_pixels_quark;
-#endif /*DEBUG_LEAK*/
 
-/* With DEBUG_LEAK, hang one of these off each image and count pixels 
- * calculated.
+/* Counters for each class of operation. Output images point to one of 
+ * these, see vips_cache_operation_buildp(). n_tiles is 64 bits, so it has
+ * a lock.
+ */
+typedef struct _VipsClassStats {
+	const char *nickname;
+	GMutex *lock;
+	guint64 n_tiles;
+} VipsClassStats;
+
+extern GQuark vips__image_class_quark;
+
+/* How a file image will be read. Windows pass this on to the kernel.
+ */
+extern GQuark vips__image_access_quark;
+
+void vips__image_set_access( VipsImage *image, VipsAccess access );
+gboolean vips__image_get_access( VipsImage *image, VipsAccess *access );
+
+void vips__stats_init( void );
+VipsClassStats *vips__stats_class_get( const char *nickname );
+void vips__stats_class_tile( VipsClassStats *class_stats );
+
+void vips__window_stats( int *n_windows, size_t *bytes, 
+	guint64 *n_map, guint64 *n_unmap );
+void vips__threadpool_wait_stats( guint64 *n_wait, double *wait_time );
+gint64 vips__get_time( void );
+
+/* With DEBUG_LEAK, or with accounting on, hang one of these off each image 
+ * and count pixels calculated.
  */
 typedef struct _VipsImagePixels {
 	const char *nickname; 
 	gint64 tpels;		/* Number of pels we expect to calculate */
 	gint64 npels;		/* Number of pels calculated so far */
+	gint64 time;		/* usecs spent, not counting input images */
+	gint64 total_time;	/* As time, but never reset */
 } VipsImagePixels;
 
+extern gboolean vips__accounting;
+
+void vips__region_init( void );
+void vips__region_report( VipsImage *image );
+void vips__region_account_flush( void );
+
 int vips__foreign_convert_saveable( VipsImage *in, VipsImage **ready,
 	VipsSaveable saveable, VipsBandFormat *format, VipsCoding *coding,
 	VipsArrayDouble *background );
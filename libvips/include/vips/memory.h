@@ -72,6 +72,7 @@ void vips_tracked_free( void *s );
 void *vips_tracked_malloc( size_t size );
 size_t vips_tracked_get_mem( void );
 size_t vips_tracked_get_mem_highwater( void );
+void vips_tracked_reset_mem_highwater( void );
 int vips_tracked_get_allocs( void );
 
 int vips_tracked_open( const char *pathname, int flags, ... );
@@ -43,6 +43,12 @@ typedef enum /*< flags >*/ {
 	VIPS_OPERATION_DEPRECATED = 8
 } VipsOperationFlags;
 
+typedef enum {
+	VIPS_CACHE_POLICY_LRU,
+	VIPS_CACHE_POLICY_GDS,
+	VIPS_CACHE_POLICY_LAST
+} VipsCachePolicy;
+
 #define VIPS_TYPE_OPERATION (vips_operation_get_type())
 #define VIPS_OPERATION( obj ) \
 	(G_TYPE_CHECK_INSTANCE_CAST( (obj), \
@@ -128,6 +134,14 @@ int vips_cache_get_max_files( void );
 void vips_cache_set_max_files( int max_files );
 void vips_cache_set_dump( gboolean dump );
 void vips_cache_set_trace( gboolean trace );
+void vips_cache_set_policy( VipsCachePolicy policy );
+VipsCachePolicy vips_cache_get_policy( void );
+void vips_cache_get_stats( guint64 *n_hit, guint64 *n_miss, guint64 *n_evict );
+int vips_cache_set_disc( const char *dir );
+char *vips_cache_get_disc( void );
+void vips_cache_set_max_disc( size_t max_disc );
+size_t vips_cache_get_max_disc( void );
+int vips_cache_disc_save( VipsImage *image );
 
 /* Part of threadpool, really, but we want these in a header that gets scanned
  * for our typelib.
@@ -69,6 +69,7 @@ typedef struct {
 
 	void *baseaddr;		/* Base of window */
 	size_t length;		/* Size of window */
+	gint64 offset;		/* File offset of baseaddr */
 } VipsWindow;
 
 /* window manager.
@@ -77,11 +78,16 @@ VipsWindow *vips_window_ref( struct _VipsImage *im, int top, int height );
 int vips_window_unref( VipsWindow *window );
 void vips_window_print( VipsWindow *window );
 
+/* Per-thread free lists for pixel memory. Private to buffer.c.
+ */
+typedef struct _VipsBufferArena VipsBufferArena;
+
 /* Per-thread buffer state. Held in a GPrivate.
  */
 typedef struct {
 	GHashTable *hash;	/* VipsImage -> VipsBufferCache* */
 	GThread *thread;	/* Just for sanity checking */
+	VipsBufferArena *arena;	/* Free pixel memory */
 } VipsBufferThread;
 
 /* Per-image buffer cache. This keeps a list of "done" VipsBuffer that this
@@ -126,6 +132,7 @@ VipsBuffer *vips_buffer_ref( struct _VipsImage *im, VipsRect *area );
 VipsBuffer *vips_buffer_unref_ref( VipsBuffer *buffer, 
 	struct _VipsImage *im, VipsRect *area );
 void vips_buffer_print( VipsBuffer *buffer );
+void vips_buffer_arena_stats( guint64 *n_hit, guint64 *n_miss, size_t *size );
 
 void vips__render_shutdown( void );
 
@@ -153,6 +160,10 @@ typedef enum _RegionType {
 #define VIPS__THINSTRIP_HEIGHT (1)
 #define VIPS__FATSTRIP_HEIGHT (16)
 
+/* The L2 cache size we assume if we can't find the real one.
+ */
+#define VIPS__L2_SIZE (256 * 1024)
+
 /* Functions on regions.
  */
 struct _VipsRegion;
@@ -0,0 +1,101 @@
+/* A snapshot of the libvips counters.
+ */
+
+/*
+
+    This file is part of VIPS.
+
+    VIPS is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301  USA
+
+ */
+
+/*
+
+    These files are distributed with VIPS - http://www.vips.ecs.soton.ac.uk
+
+ */
+
+#ifndef VIPS_STATS_H
+#define VIPS_STATS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif /*__cplusplus*/
+
+typedef struct _VipsStatsOperation {
+	const char *nickname;
+	guint64 n_tiles;
+} VipsStatsOperation;
+
+typedef struct _VipsStats {
+	/* The operation cache.
+	 */
+	int cache_size;
+	guint64 cache_hit;
+	guint64 cache_miss;
+	guint64 cache_evict;
+
+	/* Tracked memory and files.
+	 */
+	size_t mem;
+	size_t mem_highwater;
+	int allocs;
+	int files;
+
+	/* Pixel buffer recycling.
+	 */
+	guint64 buffer_hit;
+	guint64 buffer_miss;
+	size_t buffer_cached;
+
+	/* mmap windows onto files.
+	 */
+	int windows;
+	size_t window_bytes;
+	guint64 window_maps;
+	guint64 window_unmaps;
+
+	/* Time workers have spent blocked.
+	 */
+	guint64 threadpool_n_wait;
+	double threadpool_wait_time;
+
+	/* vips_sink_disc() write-behind.
+	 */
+	guint64 sink_n_wait;
+	double sink_wait_time;
+	guint64 sink_bytes_written;
+
+	/* Compiled vector programs.
+	 */
+	int vector_programs;
+	guint64 vector_hit;
+	guint64 vector_miss;
+
+	/* Tiles computed by each operation class.
+	 */
+	int n_operations;
+	VipsStatsOperation *operations;
+} VipsStats;
+
+void vips_stats_snapshot( VipsStats *stats );
+void vips_stats_clear( VipsStats *stats );
+
+#ifdef __cplusplus
+}
+#endif /*__cplusplus*/
+
+#endif /*VIPS_STATS_H*/
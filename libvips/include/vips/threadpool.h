@@ -136,8 +136,19 @@ int vips_threadpool_run( VipsImage *im,
 	VipsThreadpoolWorkFn work,
 	VipsThreadpoolProgressFn progress,
 	void *a );
+int vips_threadpool_run_concurrent( VipsImage *im, 
+	VipsThreadStartFn start, 
+	VipsThreadpoolAllocateFn allocate, 
+	VipsThreadpoolWorkFn work,
+	VipsThreadpoolProgressFn progress,
+	void *a );
 void vips_get_tile_size( VipsImage *im, 
 	int *tile_width, int *tile_height, int *n_lines );
+void vips_tile_size_set_adaptive( gboolean adaptive );
+
+void vips_threadpool_set_max_idle( int max_idle );
+void vips_threadpool_set_idle_timeout( int timeout );
+void vips_threadpool_set_max_active( int max_active );
 
 #ifdef __cplusplus
 }
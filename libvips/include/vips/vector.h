@@ -85,6 +85,15 @@ typedef struct {
 	/* Compiled successfully.
 	 */
 	gboolean compiled;
+
+	/* Everything we've declared and every instruction, used to find 
+	 * an identical program which has been compiled already.
+	 */
+	GString *signature;
+
+	/* The cache entry we share the program with, if any.
+	 */
+	struct _VipsVectorCacheEntry *entry;
 } VipsVector;
 
 /* An executor.
@@ -126,6 +135,10 @@ gboolean vips_vector_compile( VipsVector *vector );
 
 void vips_vector_print( VipsVector *vector );
 
+void vips_vector_cache_set_max( int max );
+void vips_vector_cache_get_stats( guint64 *n_hit, guint64 *n_miss, 
+	int *n_program );
+
 void vips_executor_set_program( VipsExecutor *executor, 
 	VipsVector *vector, int n );
 void vips_executor_set_scanline( VipsExecutor *executor, 
@@ -138,6 +151,32 @@ void vips_executor_run( VipsExecutor *executor );
 
 void vips_vector_to_fixed_point( double *in, int *out, int n, int scale );
 
+/* Vector features for native kernels, best last.
+ */
+typedef enum {
+	VIPS_SIMD_SSE41 = 1,
+	VIPS_SIMD_NEON = 2,
+	VIPS_SIMD_AVX2 = 4,
+	VIPS_SIMD_AVX512 = 8
+} VipsSimdFeature;
+
+/* Set from the command-line.
+ */
+extern gboolean vips__simd_enabled;
+
+VipsSimdFeature vips_simd_get_features( void );
+void vips_simd_register( const char *name, 
+	VipsSimdFeature feature, void *fn );
+void *vips_simd_get( const char *name );
+
+/* The "convf_f32" kernel: a float convolution of n elements. in is the 
+ * top-left of the mask for out[0]. out[x] = 
+ * sum(coeff[i] * in[offsets[i] + x]) / scale + offset, computed in double.
+ */
+typedef void (*VipsSimdConvfFn)( float *out, const float *in, 
+	const int *offsets, const double *coeff, int nnz, int n, 
+	double scale, double offset );
+
 #ifdef __cplusplus
 }
 #endif /*__cplusplus*/
@@ -127,6 +127,7 @@ extern "C" {
 #include <vips/interpolate.h>
 #include <vips/semaphore.h>
 #include <vips/threadpool.h>
+#include <vips/stats.h>
 #include <vips/header.h>
 #include <vips/operation.h>
 #include <vips/foreign.h>
@@ -185,6 +186,7 @@ void vips_thread_shutdown( void );
 void vips_add_option_entries( GOptionGroup *option_group );
 
 extern void vips_leak_set( gboolean leak ); 
+void vips_accounting_set( gboolean accounting ); 
 
 const char *vips_version_string( void );
 int vips_version( int flag );
@@ -25,6 +25,10 @@
  * 	  buffers don't clog up the system
  * 13/10/16
  * 	- better solution: don't keep a buffercache for non-workers
+ * 16/10/17
+ * 	- add vips__buffer_shutdown(), workers are reused between pipelines
+ * 	- recycle pixel memory through a size-classed arena
+ * 	- blocks in the arena are not counted by vips_tracked_get_mem()
  */
 
 /*
@@ -91,6 +95,39 @@ static const int buffer_cache_max_reserve = 2;
  */
 static GPrivate *buffer_thread_key = NULL;
 
+/* Pixel memory is recycled through an arena. Blocks are rounded up to one of
+ * a set of size classes: 4kb, 6kb, 8kb, 12kb and so on up to 96mb. Each worker
+ * keeps a few free blocks in its VipsBufferArena, and spills to a 
+ * global list when it has too many, or when it exits. 
+ *
+ * The free lists are threaded through the blocks themselves.
+ */
+#define VIPS_BUFFER_ARENA_N_CLASSES (30)
+
+/* The max number of bytes we keep in free blocks per worker, and on the 
+ * global lists.
+ */
+static const size_t buffer_arena_thread_max = 4 * 1024 * 1024;
+static const size_t buffer_arena_global_max = 32 * 1024 * 1024;
+
+struct _VipsBufferArena {
+	VipsPel *free[VIPS_BUFFER_ARENA_N_CLASSES];
+	size_t size;		/* Bytes in free blocks */
+
+	/* Hits and misses we've not yet added to the global totals.
+	 */
+	guint64 n_hit;
+	guint64 n_miss;
+};
+
+/* The global free lists, plus totals for hits and misses. 
+ */
+static GMutex *buffer_arena_lock = NULL;
+static VipsPel *buffer_arena_free[VIPS_BUFFER_ARENA_N_CLASSES];
+static size_t buffer_arena_size = 0;
+static guint64 buffer_arena_n_hit = 0;
+static guint64 buffer_arena_n_miss = 0;
+
 void
 vips_buffer_print( VipsBuffer *buffer )
 {
@@ -196,10 +233,247 @@ vips_buffer_dump_all( void )
 #endif /*DEBUG*/
 }
 
+static size_t
+buffer_arena_class_size( int i )
+{
+	size_t base = (size_t) 1 << (12 + i / 2);
+
+	return( (i & 1) ? base + base / 2 : base );
+}
+
+/* The smallest class which can hold size bytes, or -1 if it's too large for 
+ * the arena.
+ */
+static int
+buffer_arena_class( size_t size )
+{
+	int i;
+
+	for( i = 0; i < VIPS_BUFFER_ARENA_N_CLASSES; i++ )
+		if( size <= buffer_arena_class_size( i ) )
+			return( i );
+
+	return( -1 );
+}
+
+/* Add a thread's counters to the totals. The arena lock must be held.
+ */
+static void
+buffer_arena_sync( VipsBufferArena *arena )
+{
+	buffer_arena_n_hit += arena->n_hit;
+	buffer_arena_n_miss += arena->n_miss;
+	arena->n_hit = 0;
+	arena->n_miss = 0;
+}
+
+/* Get the arena for this thread, if any. We must not make a new
+ * VipsBufferThread here, we can be called during thread exit.
+ */
+static VipsBufferArena *
+buffer_arena_get( void )
+{
+	VipsBufferThread *buffer_thread;
+
+	if( (buffer_thread = g_private_get( buffer_thread_key )) ) 
+		return( buffer_thread->arena );
+	else
+		return( NULL );
+}
+
+/* Get a block of at least *bsize bytes. *bsize is updated with the size of 
+ * the block we return.
+ */
+static VipsPel *
+buffer_arena_alloc( size_t *bsize )
+{
+	VipsBufferArena *arena = buffer_arena_get();
+
+	int i;
+	VipsPel *buf;
+
+	if( (i = buffer_arena_class( *bsize )) < 0 ) 
+		return( vips_tracked_malloc( *bsize ) );
+	*bsize = buffer_arena_class_size( i );
+
+	if( arena &&
+		(buf = arena->free[i]) ) {
+		arena->free[i] = *((VipsPel **) buf);
+		arena->size -= *bsize;
+		arena->n_hit += 1;
+		vips__tracked_unpark( buf );
+
+		return( buf );
+	}
+
+	g_mutex_lock( buffer_arena_lock );
+
+	if( (buf = buffer_arena_free[i]) ) {
+		buffer_arena_free[i] = *((VipsPel **) buf);
+		buffer_arena_size -= *bsize;
+		buffer_arena_n_hit += 1;
+	}
+	else 
+		buffer_arena_n_miss += 1;
+
+	if( arena )
+		buffer_arena_sync( arena );
+
+	g_mutex_unlock( buffer_arena_lock );
+
+	if( buf )
+		vips__tracked_unpark( buf );
+	else
+		buf = vips_tracked_malloc( *bsize );
+
+	return( buf );
+}
+
+/* Put a parked block on this thread's free list, or the global lists, or 
+ * return it to the OS.
+ */
+static void
+buffer_arena_push( VipsBufferArena *arena, VipsPel *buf, int i )
+{
+	size_t bsize = buffer_arena_class_size( i );
+
+	if( arena &&
+		arena->size + bsize <= buffer_arena_thread_max ) {
+		*((VipsPel **) buf) = arena->free[i];
+		arena->free[i] = buf;
+		arena->size += bsize;
+
+		return;
+	}
+
+	g_mutex_lock( buffer_arena_lock );
+
+	if( buffer_arena_size + bsize <= buffer_arena_global_max ) {
+		*((VipsPel **) buf) = buffer_arena_free[i];
+		buffer_arena_free[i] = buf;
+		buffer_arena_size += bsize;
+		buf = NULL;
+	}
+
+	g_mutex_unlock( buffer_arena_lock );
+
+	if( buf ) {
+		vips__tracked_unpark( buf );
+		vips_tracked_free( buf );
+	}
+}
+
+/* Return a block to the arena. 
+ */
+static void
+buffer_arena_release( VipsBufferArena *arena, VipsPel *buf, size_t bsize )
+{
+	int i;
+
+	i = buffer_arena_class( bsize );
+	if( i < 0 ||
+		buffer_arena_class_size( i ) != bsize ) {
+		vips_tracked_free( buf );
+		return;
+	}
+
+	/* Memory waiting for reuse is not charged to any pipeline, and is
+	 * not counted as live by vips_tracked_get_mem(). 
+	 */
+	vips__tracked_park( buf );
+
+	buffer_arena_push( arena, buf, i );
+}
+
+static VipsBufferArena *
+buffer_arena_new( void )
+{
+	return( g_new0( VipsBufferArena, 1 ) );
+}
+
+/* Move all of a thread's free blocks to the global lists. 
+ */
+static void
+buffer_arena_free( VipsBufferArena *arena )
+{
+	int i;
+
+	for( i = 0; i < VIPS_BUFFER_ARENA_N_CLASSES; i++ ) 
+		while( arena->free[i] ) {
+			VipsPel *buf = arena->free[i];
+
+			arena->free[i] = *((VipsPel **) buf);
+			buffer_arena_push( NULL, buf, i );
+		}
+
+	g_mutex_lock( buffer_arena_lock );
+	buffer_arena_sync( arena );
+	g_mutex_unlock( buffer_arena_lock );
+
+	g_free( arena );
+}
+
+/**
+ * vips_buffer_arena_stats:
+ * @n_hit: (out) (allow-none): return number of allocations served from the
+ * arena
+ * @n_miss: (out) (allow-none): return number of allocations which had to
+ * malloc
+ * @size: (out) (allow-none): return bytes held on the global free lists
+ *
+ * Get counters for the pixel buffer arena. Workers add their counts to the 
+ * totals when they touch the global lists, or finish a pipeline, so the
+ * numbers can lag a little. 
+ */
+void
+vips_buffer_arena_stats( guint64 *n_hit, guint64 *n_miss, size_t *size )
+{
+	g_mutex_lock( buffer_arena_lock );
+
+	if( n_hit )
+		*n_hit = buffer_arena_n_hit;
+	if( n_miss )
+		*n_miss = buffer_arena_n_miss;
+	if( size )
+		*size = buffer_arena_size;
+
+	g_mutex_unlock( buffer_arena_lock );
+}
+
+/* Free all blocks on the global lists. This is called during vips_shutdown,
+ * after all workers have exited.
+ */
+void
+vips__buffer_arena_drain( void )
+{
+	int i;
+
+	if( !buffer_arena_lock )
+		return;
+
+	g_mutex_lock( buffer_arena_lock );
+
+	for( i = 0; i < VIPS_BUFFER_ARENA_N_CLASSES; i++ ) 
+		while( buffer_arena_free[i] ) {
+			VipsPel *buf = buffer_arena_free[i];
+
+			buffer_arena_free[i] = *((VipsPel **) buf);
+			vips__tracked_unpark( buf );
+			vips_tracked_free( buf );
+		}
+	buffer_arena_size = 0;
+
+	g_mutex_unlock( buffer_arena_lock );
+}
+
 static void
 vips_buffer_free( VipsBuffer *buffer )
 {
-	VIPS_FREEF( vips_tracked_free, buffer->buf );
+	if( buffer->buf ) {
+		buffer_arena_release( buffer_arena_get(), 
+			buffer->buf, buffer->bsize );
+		buffer->buf = NULL;
+	}
 	buffer->bsize = 0;
 	g_free( buffer );
 
@@ -220,7 +494,11 @@ vips_buffer_free( VipsBuffer *buffer )
 static void
 buffer_thread_free( VipsBufferThread *buffer_thread )
 {
+	/* Destroying the hash will free buffers into the arena, so we must
+	 * do this first.
+	 */
 	VIPS_FREEF( g_hash_table_destroy, buffer_thread->hash );
+	VIPS_FREEF( buffer_arena_free, buffer_thread->arena );
 	VIPS_FREE( buffer_thread );
 }
 
@@ -305,6 +583,7 @@ buffer_thread_new( void )
 		g_direct_hash, g_direct_equal, 
 		NULL, (GDestroyNotify) buffer_cache_free );
 	buffer_thread->thread = g_thread_self();
+	buffer_thread->arena = buffer_arena_new();
 
 	return( buffer_thread );
 }
@@ -479,10 +758,19 @@ buffer_move( VipsBuffer *buffer, VipsRect *area )
 		area->width * area->height;
 	if( buffer->bsize < new_bsize ||
 		!buffer->buf ) {
+		if( buffer->buf ) {
+			buffer_arena_release( buffer_arena_get(), 
+				buffer->buf, buffer->bsize );
+			buffer->buf = NULL;
+		}
+
+		/* The arena may round the size up.
+		 */
 		buffer->bsize = new_bsize;
-		VIPS_FREEF( vips_tracked_free, buffer->buf );
-		if( !(buffer->buf = vips_tracked_malloc( buffer->bsize )) ) 
+		if( !(buffer->buf = buffer_arena_alloc( &buffer->bsize )) ) {
+			buffer->bsize = 0;
 			return( -1 );
+		}
 	}
 
 	return( 0 );
@@ -653,6 +941,37 @@ buffer_thread_destroy_notify( VipsBufferThread *buffer_thread )
 	buffer_thread_free( buffer_thread );
 }
 
+/* Drop this thread's buffer caches, but keep the arena. Workers call this 
+ * when they finish a pipeline, since they may be reused for another.
+ */
+void
+vips__buffer_flush( void )
+{
+	VipsBufferThread *buffer_thread;
+
+	if( (buffer_thread = g_private_get( buffer_thread_key )) ) {
+		g_hash_table_remove_all( buffer_thread->hash );
+
+		g_mutex_lock( buffer_arena_lock );
+		buffer_arena_sync( buffer_thread->arena );
+		g_mutex_unlock( buffer_arena_lock );
+	}
+}
+
+/* Free all of this thread's buffer state. This is called from 
+ * vips_thread_shutdown().
+ */
+void
+vips__buffer_shutdown( void )
+{
+	VipsBufferThread *buffer_thread;
+
+	if( (buffer_thread = g_private_get( buffer_thread_key )) ) {
+		buffer_thread_free( buffer_thread );
+		g_private_set( buffer_thread_key, NULL );
+	}
+}
+
 /* Init the buffer cache system. This is called during vips_init.
  */
 void
@@ -669,6 +988,9 @@ vips__buffer_init( void )
 			(GDestroyNotify) buffer_thread_destroy_notify );
 #endif
 
+	if( !buffer_arena_lock )
+		buffer_arena_lock = vips_g_mutex_new();
+
 	if( buffer_cache_max_reserve < 1 )
 		printf( "vips__buffer_init: buffer reserve disabled\n" );
 
@@ -4,6 +4,14 @@
  * 	- try to make it compile on centos5
  * 7/7/12
  * 	- add a lock so we can run operations from many threads
+ * 16/10/17
+ * 	- split the cache into shards, each with its own lock, and make LRU
+ * 	  approximate so lookups on different operations don't contend
+ * 	- record build time and memory use for each operation, add
+ * 	  experimental greedy-dual-size eviction, add vips_cache_get_stats()
+ * 	- greedy-dual-size counts compute time and output size
+ * 	- look in the disc cache before build, see cachedisc.c
+ * 	- free the shard tables on shutdown
  */
 
 /*
@@ -91,17 +99,62 @@ static int vips_cache_max_files = 100;
  */
 static size_t vips_cache_max_mem = 100 * 1024 * 1024;
 
-/* Hold a ref to all "recent" operations.
+/* How we pick operations to drop.
  */
-static GHashTable *vips_cache_table = NULL;
+static VipsCachePolicy vips_cache_policy = VIPS_CACHE_POLICY_GDS;
 
-/* A 'time' counter: increment on all cache ops. Use this to detect LRU.
+/* The cache is split into shards by operation hash. Each shard has its own 
+ * lock, so threads looking up different operations don't contend.
  */
-static int vips_cache_time = 0;
+#define VIPS_CACHE_N_SHARDS (16)
 
-/* Protect cache access with this.
+typedef struct _VipsCacheShard {
+	/* Protect this shard with this.
+	 */
+	GMutex *lock;
+
+	/* Hold a ref to all "recent" operations in this shard.
+	 */
+	GHashTable *table;
+
+	/* Lookups which found / did not find an operation.
+	 */
+	guint64 n_hit;
+	guint64 n_miss;
+} VipsCacheShard;
+
+static VipsCacheShard vips_cache_shard[VIPS_CACHE_N_SHARDS];
+
+/* A 'time' counter: increment on all cache ops. Use this to detect LRU. 
+ * This is updated atomically with no lock held, so entries can share a time 
+ * and LRU is only approximate.
+ */
+static volatile gint vips_cache_time = 0;
+
+/* Number of operations in cache, over all shards. 
+ */
+static volatile gint vips_cache_size = 0;
+
+/* Only one thread trims at once.
+ */
+static GMutex *vips_cache_trim_lock = NULL;
+
+/* The greedy-dual-size inflation value: the priority of the last operation
+ * we dropped. Entries which are not touched slowly sink below new ones. 
+ * Protected by vips_cache_inflation_lock, which is never held while taking
+ * another lock.
+ */
+static double vips_cache_inflation = 0.0;
+static GMutex *vips_cache_inflation_lock = NULL;
+
+/* Number of operations dropped by trim. Protected by the trim lock.
  */
-static GMutex *vips_cache_lock = NULL;
+static guint64 vips_cache_n_evict = 0;
+
+/* Charge every entry at least this many bytes, so tiny outputs don't get 
+ * enormous priorities.
+ */
+#define VIPS_CACHE_MIN_SIZE (1024)
 
 /* Old versions of glib are missing these. When we abandon centos 5, switch to
  * g_int64_hash() and g_double_hash().
@@ -127,6 +180,18 @@ typedef struct _VipsOperationCacheEntry {
 	 */
 	int time;
 
+	/* Seconds it took to build this operation, and the number of bytes 
+	 * of pixels in its outputs. The time spent computing the outputs is 
+	 * added to the cost when we touch the entry.
+	 */
+	double cost;
+	size_t size;
+
+	/* Greedy-dual-size priority: the inflation value when we last touched
+	 * this entry, plus cost / size. Smallest is dropped first.
+	 */
+	double priority;
+
 	/* We listen for "invalidate" from the operation. Track the id here so
 	 * we can disconnect when we drop an operation.
 	 */
@@ -448,11 +513,21 @@ vips_operation_equal( VipsOperation *a, VipsOperation *b )
 void *
 vips__cache_once_init( void )
 {
-	vips_cache_lock = vips_g_mutex_new();
+	int i;
 
-	vips_cache_table = g_hash_table_new( 
-		(GHashFunc) vips_operation_hash, 
-		(GEqualFunc) vips_operation_equal );
+	for( i = 0; i < VIPS_CACHE_N_SHARDS; i++ ) {
+		VipsCacheShard *shard = &vips_cache_shard[i];
+
+		shard->lock = vips_g_mutex_new();
+		shard->table = g_hash_table_new( 
+			(GHashFunc) vips_operation_hash, 
+			(GEqualFunc) vips_operation_equal );
+	}
+
+	vips_cache_trim_lock = vips_g_mutex_new();
+	vips_cache_inflation_lock = vips_g_mutex_new();
+
+	vips__cache_disc_init();
 
 	return( NULL ); 
 }
@@ -465,6 +540,23 @@ vips__cache_init( void )
 	g_once( &once, (GThreadFunc) vips__cache_once_init, NULL );
 }
 
+/* Pick the shard for an operation. The low bit of the hash is always set,
+ * and the low bits are mostly from the last arg, so mix a bit first.
+ *
+ * The hash is cached on the operation, so this is cheap after the first
+ * call and needs no lock. 
+ */
+static VipsCacheShard *
+vips_cache_get_shard( VipsOperation *operation )
+{
+	guint hash = vips_operation_hash( operation ) >> 1;
+
+	hash ^= hash >> 16;
+	hash ^= hash >> 8;
+
+	return( &vips_cache_shard[hash % VIPS_CACHE_N_SHARDS] );
+}
+
 static void *
 vips_cache_print_fn( void *value, void *a, void *b )
 {
@@ -488,15 +580,22 @@ vips_cache_print_fn( void *value, void *a, void *b )
 void
 vips_cache_print( void )
 {
-	g_mutex_lock( vips_cache_lock );
+	int i;
 
-	if( vips_cache_table ) {
-		printf( "Operation cache:\n" );
-		vips_hash_table_map( vips_cache_table, 
-			vips_cache_print_fn, NULL, NULL ); 
-	}
+	if( !vips_cache_trim_lock )
+		return;
+
+	printf( "Operation cache:\n" );
 
-	g_mutex_unlock( vips_cache_lock );
+	for( i = 0; i < VIPS_CACHE_N_SHARDS; i++ ) {
+		VipsCacheShard *shard = &vips_cache_shard[i];
+
+		g_mutex_lock( shard->lock );
+		if( shard->table )
+			vips_hash_table_map( shard->table, 
+				vips_cache_print_fn, NULL, NULL ); 
+		g_mutex_unlock( shard->lock );
+	}
 }
 
 static void *
@@ -535,13 +634,14 @@ vips_cache_unref( VipsOperation *operation )
 	g_object_unref( operation );
 }
 
-/* Remove an operation from the cache.
+/* Remove an operation from the cache. Call with the shard lock held.
  */
 static void
 vips_cache_remove( VipsOperation *operation )
 {
+	VipsCacheShard *shard = vips_cache_get_shard( operation );
 	VipsOperationCacheEntry *entry = (VipsOperationCacheEntry *)
-		g_hash_table_lookup( vips_cache_table, operation );
+		g_hash_table_lookup( shard->table, operation );
 
 #ifdef DEBUG
 	printf( "vips_cache_remove: trimming %p\n", operation );
@@ -554,12 +654,26 @@ vips_cache_remove( VipsOperation *operation )
 		entry->invalidate_id = 0;
 	}
 
-	g_hash_table_remove( vips_cache_table, operation );
+	g_hash_table_remove( shard->table, operation );
+	g_atomic_int_add( &vips_cache_size, -1 );
 	vips_cache_unref( operation );
 
 	g_free( entry );
 }
 
+/* The operation has signalled "invalidate" ... we must drop it. 
+ */
+static void
+vips_cache_invalidate_cb( VipsOperation *operation )
+{
+	VipsCacheShard *shard = vips_cache_get_shard( operation );
+
+	g_mutex_lock( shard->lock );
+	if( g_hash_table_lookup( shard->table, operation ) )
+		vips_cache_remove( operation );
+	g_mutex_unlock( shard->lock );
+}
+
 static void *
 vips_object_ref_arg( VipsObject *object,
 	GParamSpec *pspec,
@@ -582,18 +696,82 @@ vips_object_ref_arg( VipsObject *object,
 	return( NULL );
 }
 
+static void *
+vips_object_time_arg( VipsObject *object,
+	GParamSpec *pspec,
+	VipsArgumentClass *argument_class,
+	VipsArgumentInstance *argument_instance,
+	void *a, void *b )
+{
+	gint64 *time = (gint64 *) a;
+
+	if( (argument_class->flags & VIPS_ARGUMENT_CONSTRUCT) &&
+		(argument_class->flags & VIPS_ARGUMENT_OUTPUT) &&
+		argument_instance->assigned &&
+		G_IS_PARAM_SPEC_OBJECT( pspec ) &&
+		G_PARAM_SPEC_VALUE_TYPE( pspec ) == VIPS_TYPE_IMAGE ) {
+		VipsImage *image;
+		VipsImagePixels *pixels;
+
+		g_object_get( G_OBJECT( object ), 
+			g_param_spec_get_name( pspec ), &image, NULL );
+
+		g_mutex_lock( vips__global_lock );
+		if( (pixels = g_object_get_qdata( G_OBJECT( image ), 
+			vips__image_pixels_quark )) )
+			*time += pixels->total_time;
+		g_mutex_unlock( vips__global_lock );
+
+		g_object_unref( image );
+	}
+
+	return( NULL );
+}
+
+/* The time spent computing an operation's outputs so far, in seconds. This 
+ * is only counted with the greedy-dual-size policy, see 
+ * vips_region_generate().
+ */
+static double
+vips_operation_get_compute_time( VipsOperation *operation )
+{
+	gint64 time;
+
+	time = 0;
+	(void) vips_argument_map( VIPS_OBJECT( operation ),
+		vips_object_time_arg, &time, NULL );
+
+	return( time / (double) G_USEC_PER_SEC );
+}
+
 static void
 vips_operation_touch( VipsOperation *operation )
 {
+	VipsCacheShard *shard = vips_cache_get_shard( operation );
 	VipsOperationCacheEntry *entry = (VipsOperationCacheEntry *)
-		g_hash_table_lookup( vips_cache_table, operation );
+		g_hash_table_lookup( shard->table, operation );
+
+	double inflation;
+	double cost;
+
+	g_atomic_int_inc( &vips_cache_time );
+	entry->time = g_atomic_int_get( &vips_cache_time );
+
+	if( vips_cache_policy == VIPS_CACHE_POLICY_GDS ) {
+		cost = entry->cost + 
+			vips_operation_get_compute_time( operation );
 
-	vips_cache_time += 1;
-	entry->time = vips_cache_time;
+		g_mutex_lock( vips_cache_inflation_lock );
+		inflation = vips_cache_inflation;
+		g_mutex_unlock( vips_cache_inflation_lock );
+
+		entry->priority = inflation + 
+			cost / VIPS_MAX( VIPS_CACHE_MIN_SIZE, entry->size );
+	}
 }
 
 /* Ref an operation for the cache. The operation itself, plus all the output 
- * objects it makes. 
+ * objects it makes. Call with the shard lock held.
  */
 static void
 vips_cache_ref( VipsOperation *operation )
@@ -604,9 +782,97 @@ vips_cache_ref( VipsOperation *operation )
 	vips_operation_touch( operation );
 }
 
+static void *
+vips_object_size_arg( VipsObject *object,
+	GParamSpec *pspec,
+	VipsArgumentClass *argument_class,
+	VipsArgumentInstance *argument_instance,
+	void *a, void *b )
+{
+	size_t *size = (size_t *) a;
+
+	if( (argument_class->flags & VIPS_ARGUMENT_CONSTRUCT) &&
+		(argument_class->flags & VIPS_ARGUMENT_OUTPUT) &&
+		argument_instance->assigned &&
+		G_IS_PARAM_SPEC_OBJECT( pspec ) &&
+		G_PARAM_SPEC_VALUE_TYPE( pspec ) == VIPS_TYPE_IMAGE ) {
+		VipsImage *image;
+
+		g_object_get( G_OBJECT( object ), 
+			g_param_spec_get_name( pspec ), &image, NULL );
+
+		/* Partial images hold little themselves, but keeping them 
+		 * keeps the caches and buffers along their pipeline, which
+		 * grow with the image.
+		 */
+		*size += VIPS_IMAGE_SIZEOF_IMAGE( image );
+
+		g_object_unref( image );
+	}
+
+	return( NULL );
+}
+
+static void *
+vips_object_class_arg( VipsObject *object, GParamSpec *pspec,
+	VipsArgumentClass *argument_class,
+	VipsArgumentInstance *argument_instance,
+	void *a, void *b )
+{
+	if( (argument_class->flags & VIPS_ARGUMENT_CONSTRUCT) &&
+		(argument_class->flags & VIPS_ARGUMENT_OUTPUT) &&
+		argument_instance->assigned &&
+		G_IS_PARAM_SPEC_OBJECT( pspec ) &&
+		G_PARAM_SPEC_VALUE_TYPE( pspec ) == VIPS_TYPE_IMAGE ) {
+		VipsImage *image;
+
+		g_object_get( G_OBJECT( object ), 
+			g_param_spec_get_name( pspec ), &image, NULL );
+
+		/* Operations build their sub-operations first, so the
+		 * innermost operation to make an image wins.
+		 */
+		if( !g_object_get_qdata( G_OBJECT( image ), 
+			vips__image_class_quark ) )
+			g_object_set_qdata( G_OBJECT( image ), 
+				vips__image_class_quark, 
+				vips__stats_class_get( 
+				VIPS_OBJECT_GET_CLASS( object )->nickname ) );
+
+		g_object_unref( image );
+	}
+
+	return( NULL );
+}
+
+/* Tag output images with the counters for this class of operation. 
+ * vips_region_generate() uses this to count tiles and to name profile gates.
+ */
 static void
-vips_cache_insert( VipsOperation *operation )
+vips_operation_set_class( VipsOperation *operation )
 {
+	(void) vips_argument_map( VIPS_OBJECT( operation ),
+		vips_object_class_arg, NULL, NULL );
+}
+
+/* The size of an operation's outputs. 
+ */
+static size_t
+vips_operation_get_size( VipsOperation *operation )
+{
+	size_t size;
+
+	size = 0;
+	(void) vips_argument_map( VIPS_OBJECT( operation ),
+		vips_object_size_arg, &size, NULL );
+
+	return( size );
+}
+
+static void
+vips_cache_insert( VipsOperation *operation, double cost )
+{
+	VipsCacheShard *shard = vips_cache_get_shard( operation );
 	VipsOperationCacheEntry *entry = g_new( VipsOperationCacheEntry, 1 );
 
 #ifdef VIPS_DEBUG
@@ -615,15 +881,19 @@ vips_cache_insert( VipsOperation *operation )
 
 	entry->operation = operation;
 	entry->time = 0;
+	entry->cost = cost;
+	entry->size = vips_operation_get_size( operation );
+	entry->priority = 0.0;
 	entry->invalidate_id = 0;
 
-	g_hash_table_insert( vips_cache_table, operation, entry );
+	g_hash_table_insert( shard->table, operation, entry );
+	g_atomic_int_add( &vips_cache_size, 1 );
 	vips_cache_ref( operation );
 
 	/* If the operation signals "invalidate", we must drop it.
 	 */
 	entry->invalidate_id = g_signal_connect( operation, "invalidate", 
-		G_CALLBACK( vips_cache_remove ), NULL ); 
+		G_CALLBACK( vips_cache_invalidate_cb ), NULL ); 
 }
 
 static void *
@@ -632,16 +902,15 @@ vips_cache_get_first_fn( void *value, void *a, void *b )
 	return( value );
 }
 
-/* Return the first item.
+/* Return the first item in a shard.
  */
 static VipsOperation *
-vips_cache_get_first( void )
+vips_cache_get_first( VipsCacheShard *shard )
 {
 	VipsOperationCacheEntry *entry;
 
-	if( vips_cache_table &&
-		(entry = vips_hash_table_map( vips_cache_table, 
-			vips_cache_get_first_fn, NULL, NULL )) )
+	if( (entry = vips_hash_table_map( shard->table, 
+		vips_cache_get_first_fn, NULL, NULL )) )
 		return( VIPS_OPERATION( entry->operation ) );
 
 	return( NULL ); 
@@ -656,53 +925,139 @@ vips_cache_get_first( void )
 void
 vips_cache_drop_all( void )
 {
-	g_mutex_lock( vips_cache_lock );
+	int i;
+
+	if( !vips_cache_trim_lock )
+		return;
+
+	if( vips__cache_dump )
+		vips_cache_print();
+
+	g_mutex_lock( vips_cache_trim_lock );
+
+	for( i = 0; i < VIPS_CACHE_N_SHARDS; i++ ) {
+		VipsCacheShard *shard = &vips_cache_shard[i];
 
-	if( vips_cache_table ) {
 		VipsOperation *operation;
 
-		if( vips__cache_dump )
-			vips_cache_print();
+		g_mutex_lock( shard->lock );
 
 		/* We can't modify the hash in the callback from
 		 * g_hash_table_foreach() and friends. Repeatedly drop the
 		 * first item instead.
 		 */
-		while( (operation = vips_cache_get_first()) ) 
+		while( shard->table &&
+			(operation = vips_cache_get_first( shard )) ) 
 			vips_cache_remove( operation );
 
-		VIPS_FREEF( g_hash_table_unref, vips_cache_table );
+		g_mutex_unlock( shard->lock );
+	}
+
+	g_mutex_unlock( vips_cache_trim_lock );
+}
+
+/* Drop the cache and free the shard tables. Called from vips_shutdown(), 
+ * the cache can't be used after this.
+ */
+void
+vips__cache_shutdown( void )
+{
+	int i;
+
+	if( !vips_cache_trim_lock )
+		return;
+
+	vips_cache_drop_all();
+
+	g_mutex_lock( vips_cache_trim_lock );
+
+	for( i = 0; i < VIPS_CACHE_N_SHARDS; i++ ) {
+		VipsCacheShard *shard = &vips_cache_shard[i];
+
+		g_mutex_lock( shard->lock );
+		VIPS_FREEF( g_hash_table_unref, shard->table );
+		g_mutex_unlock( shard->lock );
 	}
 
-	g_mutex_unlock( vips_cache_lock );
+	g_mutex_unlock( vips_cache_trim_lock );
+}
+
+/* Is entry a a better candidate for dropping than entry b. 
+ */
+static gboolean
+vips_cache_drop_before( double a_priority, int a_time, 
+	double b_priority, int b_time )
+{
+	if( vips_cache_policy == VIPS_CACHE_POLICY_GDS &&
+		a_priority != b_priority )
+		return( a_priority < b_priority );
+
+	return( a_time < b_time );
 }
 
 static void
-vips_cache_get_lru_cb( VipsOperation *key, VipsOperationCacheEntry *value, 
+vips_cache_get_victim_cb( VipsOperation *key, VipsOperationCacheEntry *value, 
 	VipsOperationCacheEntry **best )
 {
 	if( !*best ||
-		(*best)->time > value->time )
+		vips_cache_drop_before( value->priority, value->time, 
+			(*best)->priority, (*best)->time ) )
 		*best = value;
 }
 
-/* Get the least-recently-used cache item. 
+/* Get the cache item to drop next: least-recently-used, or lowest priority
+ * for greedy-dual-size. Shards are locked one at a time, so this is only 
+ * approximate.
  *
- * TODO ... will this be too expensive? probably not
+ * The operation comes back with an extra ref, since it could be dropped 
+ * by another thread as soon as we release the shard lock.
  */
 static VipsOperation *
-vips_cache_get_lru( void )
+vips_cache_get_victim( double *priority )
 {
-	VipsOperationCacheEntry *entry;
+	VipsOperation *operation;
+	int time;
+	int i;
 
-	entry = NULL;
-	g_hash_table_foreach( vips_cache_table,
-		(GHFunc) vips_cache_get_lru_cb, &entry );
+	operation = NULL;
+	time = 0;
+	*priority = 0.0;
 
-	if( entry )
-		return( entry->operation );
+	for( i = 0; i < VIPS_CACHE_N_SHARDS; i++ ) {
+		VipsCacheShard *shard = &vips_cache_shard[i];
 
-	return( NULL ); 
+		VipsOperationCacheEntry *entry;
+
+		g_mutex_lock( shard->lock );
+
+		entry = NULL;
+		if( shard->table )
+			g_hash_table_foreach( shard->table,
+				(GHFunc) vips_cache_get_victim_cb, &entry );
+
+		if( entry &&
+			(!operation || 
+			 vips_cache_drop_before( entry->priority, entry->time,
+				*priority, time )) ) {
+			VIPS_UNREF( operation );
+			operation = entry->operation;
+			time = entry->time;
+			*priority = entry->priority;
+			g_object_ref( operation );
+		}
+
+		g_mutex_unlock( shard->lock );
+	}
+
+	return( operation ); 
+}
+
+static gboolean
+vips_cache_full( void )
+{
+	return( g_atomic_int_get( &vips_cache_size ) > vips_cache_max ||
+		vips_tracked_get_files() > vips_cache_max_files ||
+		vips_tracked_get_mem() > vips_cache_max_mem );
 }
 
 /* Is the cache full? Drop until it's not.
@@ -711,22 +1066,45 @@ static void
 vips_cache_trim( void )
 {
 	VipsOperation *operation;
+	double priority;
 
-	g_mutex_lock( vips_cache_lock );
+	if( !vips_cache_trim_lock )
+		return;
+
+	/* If another thread is already trimming, it'll do our work for us. 
+	 */
+	if( !g_mutex_trylock( vips_cache_trim_lock ) )
+		return;
+
+	while( vips_cache_full() &&
+		(operation = vips_cache_get_victim( &priority )) ) {
+		VipsCacheShard *shard = vips_cache_get_shard( operation );
 
-	while( vips_cache_table &&
-		(g_hash_table_size( vips_cache_table ) > vips_cache_max ||
-		vips_tracked_get_files() > vips_cache_max_files ||
-		vips_tracked_get_mem() > vips_cache_max_mem) &&
-		(operation = vips_cache_get_lru()) ) {
 #ifdef DEBUG
 		printf( "vips_cache_trim: trimming %p\n", operation );
 #endif /*DEBUG*/
 
-		vips_cache_remove( operation );
+		/* Someone else may have dropped it while we weren't 
+		 * looking.
+		 */
+		g_mutex_lock( shard->lock );
+		if( g_hash_table_lookup( shard->table, operation ) ) {
+			vips_cache_remove( operation );
+			vips_cache_n_evict += 1;
+
+			/* Everything left is now relatively more valuable.
+			 */
+			g_mutex_lock( vips_cache_inflation_lock );
+			vips_cache_inflation = 
+				VIPS_MAX( vips_cache_inflation, priority );
+			g_mutex_unlock( vips_cache_inflation_lock );
+		}
+		g_mutex_unlock( shard->lock );
+
+		g_object_unref( operation );
 	}
 
-	g_mutex_unlock( vips_cache_lock );
+	g_mutex_unlock( vips_cache_trim_lock );
 }
 
 /**
@@ -741,6 +1119,7 @@ vips_cache_trim( void )
 VipsOperation *
 vips_cache_operation_lookup( VipsOperation *operation )
 {
+	VipsCacheShard *shard;
 	VipsOperationCacheEntry *hit;
 	VipsOperation *result;
 
@@ -752,11 +1131,15 @@ vips_cache_operation_lookup( VipsOperation *operation )
 	vips_object_print_dump( VIPS_OBJECT( operation ) );
 #endif /*VIPS_DEBUG*/
 
-	g_mutex_lock( vips_cache_lock );
+	/* Hash outside the lock, it can be slow for large operations.
+	 */
+	shard = vips_cache_get_shard( operation );
+
+	g_mutex_lock( shard->lock );
 
 	result = NULL;
 
-	if( (hit = g_hash_table_lookup( vips_cache_table, operation )) ) {
+	if( (hit = g_hash_table_lookup( shard->table, operation )) ) {
 		if( vips__cache_trace ) {
 			printf( "vips cache*: " );
 			vips_object_print_summary( VIPS_OBJECT( operation ) );
@@ -764,9 +1147,12 @@ vips_cache_operation_lookup( VipsOperation *operation )
 
 		result = hit->operation;
 		vips_cache_ref( result );
+		shard->n_hit += 1;
 	}
+	else
+		shard->n_miss += 1;
 
-	g_mutex_unlock( vips_cache_lock );
+	g_mutex_unlock( shard->lock );
 
 #ifdef VIPS_DEBUG
 	printf( "vips_cache_operation_lookup: result = %p\n", result );
@@ -775,18 +1161,18 @@ vips_cache_operation_lookup( VipsOperation *operation )
 	return( result );
 }
 
-/**
- * vips_cache_operation_add:
- * @operation: (transfer none): pointer to operation to add
- *
- * Add a built operation to the cache. The cache will ref the operation. 
+/* Add, with the number of seconds @operation took to build. 
  */
-void
-vips_cache_operation_add( VipsOperation *operation )
+static void
+vips_cache_operation_add_cost( VipsOperation *operation, double cost )
 {
+	VipsCacheShard *shard;
+
 	g_assert( VIPS_OBJECT( operation )->constructed ); 
 
-	g_mutex_lock( vips_cache_lock );
+	shard = vips_cache_get_shard( operation );
+
+	g_mutex_lock( shard->lock );
 
 #ifdef VIPS_DEBUG
 	printf( "vips_cache_operation_add: adding " );
@@ -797,7 +1183,7 @@ vips_cache_operation_add( VipsOperation *operation )
 	 * we can get multiple adds. Let the first one win. See
 	 * https://github.com/jcupitt/libvips/pull/181
 	 */
-	if( !g_hash_table_lookup( vips_cache_table, operation ) ) {
+	if( !g_hash_table_lookup( shard->table, operation ) ) {
 		VipsOperationFlags flags = 
 			vips_operation_get_flags( operation );
 		gboolean nocache = flags & VIPS_OPERATION_NOCACHE;
@@ -813,14 +1199,29 @@ vips_cache_operation_add( VipsOperation *operation )
 		}
 
 		if( !nocache ) 
-			vips_cache_insert( operation );
+			vips_cache_insert( operation, cost );
 	}
 
-	g_mutex_unlock( vips_cache_lock );
+	g_mutex_unlock( shard->lock );
 
 	vips_cache_trim();
 }
 
+/**
+ * vips_cache_operation_add:
+ * @operation: (transfer none): pointer to operation to add
+ *
+ * Add a built operation to the cache. The cache will ref the operation. 
+ *
+ * We don't know how long @operation took to build, so it is treated as
+ * cheap to remake. Use vips_cache_operation_buildp() if you can.
+ */
+void
+vips_cache_operation_add( VipsOperation *operation )
+{
+	vips_cache_operation_add_cost( operation, 0.0 );
+}
+
 /**
  * vips_cache_operation_buildp: (skip)
  * @operation: pointer to operation to lookup
@@ -836,6 +1237,9 @@ int
 vips_cache_operation_buildp( VipsOperation **operation )
 {
 	VipsOperation *hit;
+	gint64 start;
+	double cost;
+	char *key;
 
 	g_assert( VIPS_IS_OPERATION( *operation ) );
 
@@ -857,10 +1261,24 @@ vips_cache_operation_buildp( VipsOperation **operation )
 		printf( "vips_cache_operation_buildp: cache miss, building\n" );
 #endif /*VIPS_DEBUG*/
 
-		if( vips_object_build( VIPS_OBJECT( *operation ) ) ) 
-			return( -1 );
+		/* On a disc cache hit, the operation is never built.
+		 */
+		if( vips__cache_disc_lookup( *operation, &key ) ) 
+			cost = 0.0;
+		else {
+			start = vips__get_time();
+			if( vips_object_build( VIPS_OBJECT( *operation ) ) ) {
+				g_free( key );
+				return( -1 );
+			}
+			cost = (vips__get_time() - start) / 
+				(double) G_USEC_PER_SEC;
+
+			vips__cache_disc_attach( *operation, key );
+		}
 
-		vips_cache_operation_add( *operation ); 
+		vips_operation_set_class( *operation );
+		vips_cache_operation_add_cost( *operation, cost ); 
 	}
 
 	return( 0 );
@@ -952,17 +1370,7 @@ vips_cache_get_max( void )
 int
 vips_cache_get_size( void )
 {
-	guint size;
-
-	g_mutex_lock( vips_cache_lock );
-
-	size = 0;
-	if( vips_cache_table )
-		size = g_hash_table_size( vips_cache_table );
-
-	g_mutex_unlock( vips_cache_lock );
-
-	return( size );
+	return( g_atomic_int_get( &vips_cache_size ) );
 }
 
 /**
@@ -1047,3 +1455,105 @@ vips_cache_set_trace( gboolean trace )
 {
 	vips__cache_trace = trace;
 }
+
+/**
+ * VipsCachePolicy:
+ * @VIPS_CACHE_POLICY_LRU: drop the least-recently-used operation
+ * @VIPS_CACHE_POLICY_GDS: greedy-dual-size: drop the operation with the 
+ * lowest build time per byte of memory, ageing entries as they go unused
+ *
+ * How the operation cache picks operations to drop when it is full.
+ *
+ * See also: vips_cache_set_policy().
+ */
+
+/**
+ * vips_cache_set_policy:
+ * @policy: how to pick operations to drop
+ *
+ * Set how the operation cache picks operations to drop when it is full. 
+ *
+ * #VIPS_CACHE_POLICY_LRU simply drops the least-recently-used operation. 
+ *
+ * #VIPS_CACHE_POLICY_GDS, the default, keeps operations which were 
+ * slow to make and which have small outputs, ageing entries as they go 
+ * unused. The cost of an operation is the time taken by 
+ * vips_object_build() plus the thread time spent computing its output 
+ * pixels so far, and its size is the number of bytes of pixels in its
+ * outputs. Turning it on times every tile computed, in the same way as 
+ * vips_accounting_set(). The cost is updated each time the operation is 
+ * found in the cache. 
+ *
+ * You can also set the policy with the environment variable 
+ * `VIPS_CACHE_POLICY` or the command-line flag `--vips-cache-policy`.
+ *
+ * See also: vips_cache_get_stats(). 
+ */
+void
+vips_cache_set_policy( VipsCachePolicy policy )
+{
+	g_assert( policy >= 0 &&
+		policy < VIPS_CACHE_POLICY_LAST );
+
+	vips_cache_policy = policy;
+}
+
+/**
+ * vips_cache_get_policy:
+ *
+ * Get how the operation cache picks operations to drop.
+ *
+ * Returns: the current cache policy
+ */
+VipsCachePolicy
+vips_cache_get_policy( void )
+{
+	return( vips_cache_policy );
+}
+
+/**
+ * vips_cache_get_stats:
+ * @n_hit: (out) (allow-none): return lookups which found an operation
+ * @n_miss: (out) (allow-none): return lookups which did not
+ * @n_evict: (out) (allow-none): return operations dropped to make space
+ *
+ * Get the operation cache counters since startup. Operations dropped by
+ * vips_cache_drop_all() or because an input was invalidated are not counted
+ * as evictions.
+ *
+ * See also: vips_cache_set_policy(). 
+ */
+void
+vips_cache_get_stats( guint64 *n_hit, guint64 *n_miss, guint64 *n_evict )
+{
+	guint64 hit;
+	guint64 miss;
+	guint64 evict;
+	int i;
+
+	hit = 0;
+	miss = 0;
+	evict = 0;
+
+	if( vips_cache_trim_lock ) {
+		for( i = 0; i < VIPS_CACHE_N_SHARDS; i++ ) {
+			VipsCacheShard *shard = &vips_cache_shard[i];
+
+			g_mutex_lock( shard->lock );
+			hit += shard->n_hit;
+			miss += shard->n_miss;
+			g_mutex_unlock( shard->lock );
+		}
+
+		g_mutex_lock( vips_cache_trim_lock );
+		evict = vips_cache_n_evict;
+		g_mutex_unlock( vips_cache_trim_lock );
+	}
+
+	if( n_hit )
+		*n_hit = hit;
+	if( n_miss )
+		*n_miss = miss;
+	if( n_evict )
+		*n_evict = evict;
+}
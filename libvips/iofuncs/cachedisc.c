@@ -0,0 +1,780 @@
+/* keep the results of vips operations on disc
+ *
+ * 16/10/17
+ * 	- from cache.c
+ * 	- look up before build, save only finished results
+ * 	- ignore optional outputs in keys, trace hits and saves
+ */
+
+/*
+
+    This file is part of VIPS.
+
+    VIPS is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301  USA
+
+ */
+
+/*
+
+    These files are distributed with VIPS - http://www.vips.ecs.soton.ac.uk
+
+ */
+
+/*
+
+   The disc cache sits behind the operation cache. Before an operation is
+   built, we make a key from its class and input arguments. Input images
+   must be keyed too: images from loaders are keyed by filename, file size
+   and modification time, and the output of a keyed operation is keyed by
+   that operation. If any input can't be keyed, we don't cache on disc.
+
+   If the cache directory has a file for the key, we don't build the
+   operation at all, we set its output to an image mapped from that file. 
+   If it doesn't, the operation is built as usual and its output is tagged 
+   with the key.
+
+   Pixels are computed lazily, so we don't save anything at build time. A
+   keyed image is saved when vips_image_write() computes it into a memory
+   image (the pixels are there already, so this is cheap), or when 
+   vips_cache_disc_save() is called on it. Intermediate images in a
+   pipeline are never computed just to be cached.
+
+   Only operations with a single image output, "out", are cached.
+
+ */
+
+/*
+#define DEBUG
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /*HAVE_CONFIG_H*/
+#include <vips/intl.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif /*HAVE_UNISTD_H*/
+
+#include <glib/gstdio.h>
+
+#include <vips/vips.h>
+#include <vips/internal.h>
+#include <vips/debug.h>
+
+/* The directory we keep results in, or NULL for no disc cache.
+ */
+static char *vips_cache_disc_dir = NULL;
+
+/* Drop least-recently-used results when the directory gets bigger than
+ * this ... default 1gb.
+ */
+static size_t vips_cache_max_disc = 1024 * 1024 * 1024;
+
+/* Protect the settings above, and serialise trims.
+ */
+static GMutex *vips_cache_disc_lock = NULL;
+
+/* The key we made for an image, attached as qdata.
+ */
+static GQuark vips__cache_disc_key_quark = 0;
+
+/* A file in the cache directory.
+ */
+typedef struct _VipsCacheDiscFile {
+	char *filename;
+	gint64 size;
+
+	/* We set mtime on each hit, so this is the last use.
+	 */
+	time_t time;
+} VipsCacheDiscFile;
+
+void
+vips__cache_disc_init( void )
+{
+	vips_cache_disc_lock = vips_g_mutex_new();
+	vips__cache_disc_key_quark =
+		g_quark_from_static_string( "vips-cache-disc-key" );
+}
+
+/* Get a copy of the directory, or NULL for no disc cache.
+ */
+static char *
+vips_cache_disc_get_dir( void )
+{
+	char *dir;
+
+	if( !vips_cache_disc_lock )
+		return( NULL );
+
+	g_mutex_lock( vips_cache_disc_lock );
+	dir = g_strdup( vips_cache_disc_dir );
+	g_mutex_unlock( vips_cache_disc_lock );
+
+	return( dir );
+}
+
+static gboolean
+vips_cache_disc_key_image( GString *key, VipsImage *image )
+{
+	const char *image_key;
+
+	if( !image ||
+		!(image_key = g_object_get_qdata( G_OBJECT( image ),
+			vips__cache_disc_key_quark )) )
+		return( FALSE );
+
+	g_string_append_printf( key, "{%s}", image_key );
+
+	return( TRUE );
+}
+
+/* A file is identified by its name, size and modification time.
+ */
+static gboolean
+vips_cache_disc_key_file( GString *key, const char *name )
+{
+	char filename[VIPS_PATH_MAX];
+	char option_string[VIPS_PATH_MAX];
+	struct stat st;
+
+	vips__filename_split8( name, filename, option_string );
+	if( g_stat( filename, &st ) )
+		return( FALSE );
+
+	g_string_append_printf( key, ":%" G_GINT64_FORMAT ":%" G_GINT64_FORMAT,
+		(gint64) st.st_size, (gint64) st.st_mtime );
+
+	return( TRUE );
+}
+
+static gboolean
+vips_cache_disc_key_value( GString *key, const char *name, GValue *value )
+{
+	GType type = G_VALUE_TYPE( value );
+	GType fundamental = G_TYPE_FUNDAMENTAL( type );
+
+	int i;
+
+	if( type == G_TYPE_DOUBLE ) {
+		char buf[G_ASCII_DTOSTR_BUF_SIZE];
+
+		g_string_append( key, g_ascii_dtostr( buf,
+			G_ASCII_DTOSTR_BUF_SIZE, g_value_get_double( value ) ) );
+	}
+	else if( type == G_TYPE_STRING ) {
+		const char *str = g_value_get_string( value );
+
+		if( !str )
+			g_string_append( key, "(null)" );
+		else {
+			/* Length first, so strings with spaces can't make
+			 * two keys look the same.
+			 */
+			g_string_append_printf( key, "%d:%s", 
+				(int) strlen( str ), str );
+
+			if( strcmp( name, "filename" ) == 0 &&
+				!vips_cache_disc_key_file( key, str ) )
+				return( FALSE );
+		}
+	}
+	else if( fundamental == G_TYPE_BOOLEAN ||
+		fundamental == G_TYPE_CHAR ||
+		fundamental == G_TYPE_UCHAR ||
+		fundamental == G_TYPE_INT ||
+		fundamental == G_TYPE_UINT ||
+		fundamental == G_TYPE_LONG ||
+		fundamental == G_TYPE_ULONG ||
+		fundamental == G_TYPE_INT64 ||
+		fundamental == G_TYPE_UINT64 ||
+		fundamental == G_TYPE_ENUM ||
+		fundamental == G_TYPE_FLAGS ) {
+		char *str = g_strdup_value_contents( value );
+
+		g_string_append( key, str );
+		g_free( str );
+	}
+	else if( g_type_is_a( type, VIPS_TYPE_IMAGE ) )
+		return( vips_cache_disc_key_image( key,
+			g_value_get_object( value ) ) );
+	else if( type == VIPS_TYPE_ARRAY_IMAGE ) {
+		VipsImage **images;
+		int n;
+
+		images = vips_value_get_array_image( value, &n );
+		for( i = 0; i < n; i++ )
+			if( !vips_cache_disc_key_image( key, images[i] ) )
+				return( FALSE );
+	}
+	else if( type == VIPS_TYPE_ARRAY_DOUBLE ) {
+		double *array;
+		int n;
+
+		array = vips_value_get_array_double( value, &n );
+		for( i = 0; i < n; i++ ) {
+			char buf[G_ASCII_DTOSTR_BUF_SIZE];
+
+			g_string_append_printf( key, "%s,", g_ascii_dtostr( buf,
+				G_ASCII_DTOSTR_BUF_SIZE, array[i] ) );
+		}
+	}
+	else if( type == VIPS_TYPE_ARRAY_INT ) {
+		int *array;
+		int n;
+
+		array = vips_value_get_array_int( value, &n );
+		for( i = 0; i < n; i++ )
+			g_string_append_printf( key, "%d,", array[i] );
+	}
+	else if( type == VIPS_TYPE_BLOB ) {
+		void *data;
+		size_t length;
+		char *checksum;
+
+		if( !(data = vips_value_get_blob( value, &length )) )
+			return( FALSE );
+		checksum = g_compute_checksum_for_data( G_CHECKSUM_SHA1,
+			data, length );
+		g_string_append( key, checksum );
+		g_free( checksum );
+	}
+	else if( g_type_is_a( type, VIPS_TYPE_INTERPOLATE ) ) {
+		VipsObject *interpolate = g_value_get_object( value );
+
+		/* Interpolators have no parameters, the nickname is
+		 * enough.
+		 */
+		if( !interpolate )
+			g_string_append( key, "(null)" );
+		else
+			g_string_append( key,
+				VIPS_OBJECT_GET_CLASS( interpolate )->nickname );
+	}
+	else
+		/* Something we can't key, eg. a VipsObject with
+		 * properties.
+		 */
+		return( FALSE );
+
+	return( TRUE );
+}
+
+static void *
+vips_cache_disc_key_arg( VipsObject *object,
+	GParamSpec *pspec,
+	VipsArgumentClass *argument_class,
+	VipsArgumentInstance *argument_instance,
+	void *a, void *b )
+{
+	GString *key = (GString *) a;
+	const char *name = g_param_spec_get_name( pspec );
+	GType type = G_PARAM_SPEC_VALUE_TYPE( pspec );
+
+	GValue value = { 0, };
+	gboolean ok;
+
+	/* We can only swap a single image output. Stop (return non-NULL)
+	 * on any other required output. Optional outputs, like the "flags"
+	 * on every load, are left unset on a hit.
+	 */
+	if( argument_class->flags & VIPS_ARGUMENT_OUTPUT ) {
+		if( !(argument_class->flags & VIPS_ARGUMENT_REQUIRED) )
+			return( NULL );
+		if( strcmp( name, "out" ) != 0 ||
+			!g_type_is_a( type, VIPS_TYPE_IMAGE ) )
+			return( object );
+
+		return( NULL );
+	}
+
+	if( !(argument_class->flags & VIPS_ARGUMENT_CONSTRUCT) ||
+		!(argument_class->flags & VIPS_ARGUMENT_INPUT) ||
+		!argument_instance->assigned )
+		return( NULL );
+
+	g_string_append_printf( key, " %s=", name );
+
+	g_value_init( &value, type );
+	g_object_get_property( G_OBJECT( object ), name, &value );
+	ok = vips_cache_disc_key_value( key, name, &value );
+	g_value_unset( &value );
+
+	return( ok ? NULL : object );
+}
+
+/* Make a key for an operation, or NULL if it can't be cached on disc.
+ */
+static char *
+vips_cache_disc_key( VipsOperation *operation )
+{
+	GString *key;
+
+	key = g_string_new( VIPS_VERSION );
+	g_string_append_printf( key, " %s", G_OBJECT_TYPE_NAME( operation ) );
+
+	if( vips_argument_map( VIPS_OBJECT( operation ),
+		vips_cache_disc_key_arg, key, NULL ) ) {
+		g_string_free( key, TRUE );
+		return( NULL );
+	}
+
+	return( g_string_free( key, FALSE ) );
+}
+
+static gint
+vips_cache_disc_file_compare( VipsCacheDiscFile *a, VipsCacheDiscFile *b )
+{
+	if( a->time < b->time )
+		return( -1 );
+	if( a->time > b->time )
+		return( 1 );
+
+	return( 0 );
+}
+
+static void
+vips_cache_disc_file_free( VipsCacheDiscFile *file )
+{
+	g_free( file->filename );
+	g_free( file );
+}
+
+/* Drop least-recently-used files until we're within the size limit.
+ * Another process may be using the same directory, so we must rescan each
+ * time.
+ */
+static void
+vips_cache_disc_trim( const char *dir )
+{
+	GDir *gdir;
+	const char *name;
+	GSList *files;
+	GSList *p;
+	gint64 total;
+
+	g_mutex_lock( vips_cache_disc_lock );
+
+	files = NULL;
+	total = 0;
+	if( (gdir = g_dir_open( dir, 0, NULL )) ) {
+		while( (name = g_dir_read_name( gdir )) )
+			if( vips_ispostfix( name, ".v" ) ) {
+				VipsCacheDiscFile *file;
+				struct stat st;
+
+				file = g_new( VipsCacheDiscFile, 1 );
+				file->filename =
+					g_build_filename( dir, name, NULL );
+				if( g_stat( file->filename, &st ) ) {
+					vips_cache_disc_file_free( file );
+					continue;
+				}
+				file->size = st.st_size;
+				file->time = st.st_mtime;
+
+				files = g_slist_prepend( files, file );
+				total += file->size;
+			}
+
+		g_dir_close( gdir );
+	}
+
+	files = g_slist_sort( files,
+		(GCompareFunc) vips_cache_disc_file_compare );
+
+	for( p = files; p && total > vips_cache_max_disc; p = p->next ) {
+		VipsCacheDiscFile *file = (VipsCacheDiscFile *) p->data;
+
+#ifdef DEBUG
+		printf( "vips_cache_disc_trim: removing %s\n", file->filename );
+#endif /*DEBUG*/
+
+		/* This can fail on Windows if the file is mapped by
+		 * someone. Just skip it.
+		 */
+		if( !g_unlink( file->filename ) )
+			total -= file->size;
+	}
+
+	g_slist_foreach( files, (GFunc) vips_cache_disc_file_free, NULL );
+	g_slist_free( files );
+
+	g_mutex_unlock( vips_cache_disc_lock );
+}
+
+/* Open a cached result, or NULL for a miss.
+ */
+static VipsImage *
+vips_cache_disc_load( const char *filename )
+{
+	VipsImage *image;
+
+	if( !g_file_test( filename, G_FILE_TEST_IS_REGULAR ) )
+		return( NULL );
+
+	if( !(image = vips_image_new_mode( filename, "r" )) ) {
+		/* A damaged file, perhaps a crash during write. Remove it
+		 * and treat as a miss.
+		 */
+		(void) g_unlink( filename );
+		vips_error_clear();
+
+		return( NULL );
+	}
+
+	/* Mark as recently used.
+	 */
+	(void) g_utime( filename, NULL );
+
+	return( image );
+}
+
+/* Write an image to the cache directory. Write to a temp file first so
+ * other processes never see a partial result.
+ */
+static int
+vips_cache_disc_write( VipsImage *image,
+	const char *dir, const char *hash, const char *filename )
+{
+	char *basename;
+	char *tempname;
+	VipsImage *t;
+	int result;
+
+	basename = g_strdup_printf( "%s-%08x.v", hash, g_random_int() );
+	tempname = g_build_filename( dir, basename, NULL );
+	g_free( basename );
+
+	result = 0;
+	if( !(t = vips_image_new_mode( tempname, "w" )) )
+		result = -1;
+	else {
+		if( vips_image_write( image, t ) )
+			result = -1;
+		g_object_unref( t );
+	}
+
+	if( !result &&
+		g_rename( tempname, filename ) )
+		result = -1;
+
+	if( result )
+		(void) g_unlink( tempname );
+
+	g_free( tempname );
+
+	if( !result )
+		vips_cache_disc_trim( dir );
+
+	return( result );
+}
+
+/* The file we keep the result for @key in. Free with g_free().
+ */
+static char *
+vips_cache_disc_filename( const char *dir, const char *key, char **hash )
+{
+	char *basename;
+	char *filename;
+
+	*hash = g_compute_checksum_for_string( G_CHECKSUM_SHA1, key, -1 );
+	basename = g_strdup_printf( "%s.v", *hash );
+	filename = g_build_filename( dir, basename, NULL );
+	g_free( basename );
+
+	return( filename );
+}
+
+static void
+vips_cache_disc_set_key( VipsImage *image, const char *key )
+{
+	g_object_set_qdata_full( G_OBJECT( image ), vips__cache_disc_key_quark,
+		g_strdup( key ), (GDestroyNotify) g_free );
+}
+
+/* Save @image under the key of @keyed, if it's not there already.
+ */
+static int
+vips_cache_disc_save_as( VipsImage *keyed, VipsImage *image )
+{
+	const char *key;
+	char *dir;
+	char *hash;
+	char *filename;
+	int result;
+
+	if( !(key = g_object_get_qdata( G_OBJECT( keyed ),
+		vips__cache_disc_key_quark )) ||
+		!(dir = vips_cache_disc_get_dir()) )
+		return( 0 );
+
+	filename = vips_cache_disc_filename( dir, key, &hash );
+
+#ifdef DEBUG
+	printf( "vips_cache_disc_save_as: %s\n\t%s\n", key, filename );
+#endif /*DEBUG*/
+
+	/* Very large images would flush everything else, don't bother.
+	 */
+	result = 0;
+	if( !g_file_test( filename, G_FILE_TEST_IS_REGULAR ) &&
+		VIPS_IMAGE_SIZEOF_IMAGE( image ) < vips_cache_max_disc / 4 ) {
+		result = vips_cache_disc_write( image, dir, hash, filename );
+
+		if( !result &&
+			vips__cache_trace ) 
+			printf( "vips disc+: %s\n", key );
+	}
+
+	g_free( filename );
+	g_free( hash );
+	g_free( dir );
+
+	return( result );
+}
+
+/* Called by the operation cache before building @operation. On a hit, set
+ * the output from the disc cache, mark the operation as built and return
+ * TRUE.
+ *
+ * On a miss, return FALSE and set @key to the key for this operation, or
+ * NULL if it can't be cached on disc. Build the operation, then pass the
+ * key to vips__cache_disc_attach().
+ */
+gboolean
+vips__cache_disc_lookup( VipsOperation *operation, char **key )
+{
+	char *dir;
+	char *hash;
+	char *filename;
+	VipsImage *image;
+	VipsImage *x;
+
+	*key = NULL;
+
+	if( !(dir = vips_cache_disc_get_dir()) )
+		return( FALSE );
+	if( (vips_operation_get_flags( operation ) &
+		VIPS_OPERATION_NOCACHE) ||
+		!(*key = vips_cache_disc_key( operation )) ) {
+		g_free( dir );
+		return( FALSE );
+	}
+
+	filename = vips_cache_disc_filename( dir, *key, &hash );
+
+#ifdef DEBUG
+	printf( "vips__cache_disc_lookup: %s\n\t%s\n", *key, filename );
+#endif /*DEBUG*/
+
+	image = vips_cache_disc_load( filename );
+
+	g_free( filename );
+	g_free( hash );
+	g_free( dir );
+
+	if( !image )
+		return( FALSE );
+
+	if( vips__cache_trace ) {
+		printf( "vips disc*: " );
+		vips_object_print_summary( VIPS_OBJECT( operation ) );
+	}
+
+	/* Wrap the mapped file in a partial image, so things like
+	 * vips_image_inplace() make a copy rather than writing to the
+	 * cache file.
+	 */
+	x = vips_image_new();
+	if( vips_image_write( image, x ) ) {
+		g_object_unref( x );
+		g_object_unref( image );
+		vips_error_clear();
+
+		return( FALSE );
+	}
+	g_object_unref( image );
+
+	/* It's now a random-access image.
+	 */
+	(void) vips_image_remove( x, VIPS_META_SEQUENTIAL );
+	vips_cache_disc_set_key( x, *key );
+	VIPS_FREE( *key );
+
+	/* The operation takes over our ref to x. It now counts as built,
+	 * even if a postbuild handler fails, so we can't go back to a
+	 * normal build.
+	 */
+	g_object_set( operation, "out", x, NULL );
+	if( vips__object_set_built( VIPS_OBJECT( operation ) ) )
+		vips_error_clear();
+
+	return( TRUE );
+}
+
+/* Tag the output of a freshly built operation with its key, so operations
+ * made from it can be keyed and it can be saved later. We take ownership
+ * of @key.
+ */
+void
+vips__cache_disc_attach( VipsOperation *operation, char *key )
+{
+	VipsImage *out;
+
+	if( !key )
+		return;
+
+	g_object_get( operation, "out", &out, NULL );
+	g_object_set_qdata_full( G_OBJECT( out ), vips__cache_disc_key_quark,
+		key, (GDestroyNotify) g_free );
+	g_object_unref( out );
+}
+
+/* vips_image_write() has just computed @image into @out. If @image is
+ * keyed and @out is a memory image, we have the pixels already, so save
+ * them.
+ */
+void
+vips__cache_disc_written( VipsImage *image, VipsImage *out )
+{
+	gboolean enabled;
+
+	if( out->dtype != VIPS_IMAGE_SETBUF ||
+		!vips_cache_disc_lock )
+		return;
+
+	g_mutex_lock( vips_cache_disc_lock );
+	enabled = vips_cache_disc_dir != NULL;
+	g_mutex_unlock( vips_cache_disc_lock );
+	if( !enabled )
+		return;
+
+	if( vips_cache_disc_save_as( image, out ) )
+		vips_error_clear();
+}
+
+/**
+ * vips_cache_disc_save:
+ * @image: image to save
+ *
+ * If @image is the output of an operation that can be kept in the disc
+ * cache, compute it and save it there, unless it's there already. Do
+ * nothing if the disc cache is off or @image can't be kept.
+ *
+ * Results written to memory with vips_image_write() are saved
+ * automatically. Use this for the final image of a pipeline you are
+ * saving to a file, for example.
+ *
+ * See also: vips_cache_set_disc().
+ *
+ * Returns: 0 on success, -1 on error.
+ */
+int
+vips_cache_disc_save( VipsImage *image )
+{
+	return( vips_cache_disc_save_as( image, image ) );
+}
+
+/**
+ * vips_cache_set_disc:
+ * @dir: (allow-none): directory to keep results in
+ *
+ * Keep the results of operations in @dir, and reuse them, even from other
+ * processes. Pass %NULL to turn the disc cache off, the default.
+ *
+ * Only operations with a single image output, whose inputs are files or
+ * the results of other cached operations, are kept. A result is saved in 
+ * vips format when vips_image_write() computes it into a memory image, or
+ * when you call vips_cache_disc_save() on it. Later builds of the same 
+ * operation skip the build and map the saved result back in.
+ *
+ * You can also set the directory with the environment variable
+ * `VIPS_CACHE_DISC` or the command-line flag `--vips-cache-disc`.
+ *
+ * See also: vips_cache_set_max_disc().
+ *
+ * Returns: 0 on success, -1 on error.
+ */
+int
+vips_cache_set_disc( const char *dir )
+{
+	if( dir &&
+		g_mkdir_with_parents( dir, 0755 ) ) {
+		vips_error( "vips_cache_set_disc",
+			_( "unable to make directory \"%s\"" ), dir );
+		return( -1 );
+	}
+
+	vips__cache_init();
+
+	g_mutex_lock( vips_cache_disc_lock );
+	VIPS_FREE( vips_cache_disc_dir );
+	vips_cache_disc_dir = g_strdup( dir );
+	g_mutex_unlock( vips_cache_disc_lock );
+
+	return( 0 );
+}
+
+/**
+ * vips_cache_get_disc:
+ *
+ * Get the directory results are kept in, or %NULL if the disc cache is off.
+ *
+ * Returns: (transfer full): the cache directory, free with g_free().
+ */
+char *
+vips_cache_get_disc( void )
+{
+	return( vips_cache_disc_get_dir() );
+}
+
+/**
+ * vips_cache_set_max_disc:
+ * @max_disc: maximum size of the disc cache in bytes
+ *
+ * Set the maximum size of the disc cache. When a new result takes it over
+ * this limit, the least-recently-used results are removed.
+ *
+ * The default is 1gb. You can also set this with the environment variable
+ * `VIPS_CACHE_MAX_DISC` or the command-line flag `--vips-cache-max-disc`.
+ *
+ * See also: vips_cache_set_disc().
+ */
+void
+vips_cache_set_max_disc( size_t max_disc )
+{
+	vips_cache_max_disc = max_disc;
+}
+
+/**
+ * vips_cache_get_max_disc:
+ *
+ * Get the maximum size of the disc cache.
+ *
+ * Returns: the maximum size of the disc cache in bytes
+ */
+size_t
+vips_cache_get_max_disc( void )
+{
+	return( vips_cache_max_disc );
+}
@@ -826,6 +826,24 @@ vips_operation_flags_get_type( void )
 
 	return( etype );
 }
+GType
+vips_cache_policy_get_type( void )
+{
+	static GType etype = 0;
+
+	if( etype == 0 ) {
+		static const GEnumValue values[] = {
+			{VIPS_CACHE_POLICY_LRU, "VIPS_CACHE_POLICY_LRU", "lru"},
+			{VIPS_CACHE_POLICY_GDS, "VIPS_CACHE_POLICY_GDS", "gds"},
+			{VIPS_CACHE_POLICY_LAST, "VIPS_CACHE_POLICY_LAST", "last"},
+			{0, NULL, NULL}
+		};
+		
+		etype = g_enum_register_static( "VipsCachePolicy", values );
+	}
+
+	return( etype );
+}
 /* enumerations from "../../libvips/include/vips/convolution.h" */
 GType
 vips_combine_get_type( void )
@@ -1,6 +1,13 @@
 /* gate.c --- thread profiling
  *
  * Written on: 18 nov 13
+ *
+ * 16/10/17
+ * 	- add ring mode: a bounded buffer per thread which can be read at any
+ * 	  time and saved as a chrome trace
+ * 	- total time in "wait" gates, see vips_profile_get_wait(), summarised
+ * 	  on stderr at exit
+ * 	- share vips__get_time(), fix the non-monotonic fallback
  */
 
 /*
@@ -43,12 +50,29 @@
 #endif /*HAVE_CONFIG_H*/
 #include <vips/intl.h>
 
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
 #include <vips/vips.h>
 #include <vips/internal.h>
 #include <vips/debug.h>
 
 #define VIPS_GATE_SIZE (1000)
 
+/* Default and max number of events in a ring. 
+ */
+#define VIPS_GATE_RING_SIZE (16384)
+#define VIPS_GATE_RING_MAX (1 << 24)
+
+/* Track at most this many nested gates per thread.
+ */
+#define VIPS_GATE_DEPTH (64)
+
+/* Keep the rings of at most this many finished threads.
+ */
+#define VIPS_GATE_RETIRED (32)
+
 /* A set of timing records. i is the index of the next slot we fill. 
  */
 typedef struct _VipsThreadGateBlock {
@@ -66,6 +90,64 @@ typedef struct _VipsThreadGate {
 	VipsThreadGateBlock *stop;
 } VipsThreadGate; 
 
+/* In ring mode, one of these for each gate which has stopped, or for each
+ * change in memory use. 
+ */
+typedef struct _VipsThreadEvent {
+	const char *name;
+	gint64 time;
+
+	/* Duration for 'X' events, bytes allocated for 'C' events.
+	 */
+	gint64 value;
+
+	/* The chrome trace event phase. 
+	 */
+	char phase;
+} VipsThreadEvent;
+
+/* A gate which has started but not yet stopped.
+ */
+typedef struct _VipsThreadOpen {
+	const char *name;
+	gint64 time;
+} VipsThreadOpen;
+
+/* The ring for a thread. Only the owning thread writes to it, so we don't
+ * lock. Readers copy the events out and then discard any which the owner
+ * might have overwritten during the copy.
+ */
+typedef struct _VipsThreadRing {
+	const char *name;
+	int id;
+
+	/* Always a power of two.
+	 */
+	guint size;
+	VipsThreadEvent *events;
+
+	/* Number of events ever written, this wraps. Set full once we've been
+	 * round once.
+	 */
+	volatile gint n;
+	volatile gint full;
+
+	/* Gates which have started. Any over VIPS_GATE_DEPTH are counted in 
+	 * overflow and not recorded.
+	 */
+	VipsThreadOpen open[VIPS_GATE_DEPTH];
+	int depth;
+	int overflow;
+
+	/* The open list is only valid for this generation of the profiler.
+	 */
+	int generation;
+
+	/* Bytes allocated by this thread.
+	 */
+	gint64 memory;
+} VipsThreadRing;
+
 /* One of these in per-thread private storage. 
  */
 
@@ -76,27 +158,112 @@ typedef struct _VipsThreadProfile {
 	GThread *thread;
 	GHashTable *gates;
 	VipsThreadGate *memory;
+	VipsThreadRing *ring;
+
+	/* The wait gate we are in, if any, and when we went in. Wait gates
+	 * don't nest.
+	 */
+	const char *wait_name;
+	gint64 wait_start;
 } VipsThreadProfile; 
 
 gboolean vips__thread_profile = FALSE;
 
+/* The size of new rings. Zero means ring mode is off, and we record
+ * everything and save to vips-profile.txt on exit.
+ */
+int vips__thread_profile_ring = 0;
+
 static GPrivate *vips_thread_profile_key = NULL;
 
 static FILE *vips__thread_fp = NULL;;
 
+/* Bumped each time profiling is turned on or off, see 
+ * vips_thread_ring_get().
+ */
+static volatile gint vips_thread_profile_generation = 0;
+
+/* Rings for running threads, and a queue of rings from threads which have
+ * finished. Protected by vips_thread_ring_lock.
+ */
+static GMutex *vips_thread_ring_lock = NULL;
+static GSList *vips_thread_rings = NULL;
+static GQueue *vips_thread_rings_retired = NULL;
+static int vips_thread_ring_id = 0;
+
+/* Save a trace here on exit. 
+ */
+static char *vips_thread_profile_trace = NULL;
+
+/* Number of wait gates passed, and total time in them, in usec.
+ */
+static GMutex *vips_thread_wait_lock = NULL;
+static guint64 vips_thread_wait_n = 0;
+static gint64 vips_thread_wait_time = 0;
+
 /**
  * vips_profile_set:
  * @profile: %TRUE to enable profile recording
  *
  * If set, vips will record profiling information, and dump it on program
  * exit. These profiles can be analysed with the `vipsprofile` program. 
+ *
+ * If ring mode is on, see vips_profile_set_ring(), this turns recording into
+ * the rings on and off instead. 
  */
 void
 vips_profile_set( gboolean profile )
 {
+	g_atomic_int_inc( &vips_thread_profile_generation );
 	vips__thread_profile = profile;
 }
 
+/**
+ * vips_profile_set_ring:
+ * @n_events: number of events to keep per thread, or 0
+ *
+ * Record profiling information into a fixed-size ring of events for each
+ * thread, rather than keeping everything until exit. The oldest events are
+ * overwritten once a ring fills, so memory use is bounded however long the
+ * program runs.
+ *
+ * Recording starts right away and can be turned on and off at any time. Use
+ * vips_profile_get_trace() or vips_profile_save_trace() to fetch the current
+ * contents of all the rings without stopping the program. 
+ *
+ * Each ring is created with @n_events slots, rounded up to a power of two, 
+ * the first time its thread passes a gate. Rings which already exist 
+ * keep their size.
+ *
+ * Set 0 to turn ring mode and profiling off.
+ *
+ * See also: vips_profile_set(), vips_profile_set_trace().
+ */
+void
+vips_profile_set_ring( int n_events )
+{
+	vips__thread_profile_ring = 
+		VIPS_CLIP( 0, n_events, VIPS_GATE_RING_MAX );
+	vips_profile_set( vips__thread_profile_ring > 0 );
+}
+
+/**
+ * vips_profile_set_trace:
+ * @filename: save a trace here on exit
+ *
+ * Turn on ring mode, if it's not already on, and save a chrome trace to
+ * @filename when vips_shutdown() is called. 
+ *
+ * See also: vips_profile_set_ring(), vips_profile_save_trace().
+ */
+void
+vips_profile_set_trace( const char *filename )
+{
+	VIPS_SETSTR( vips_thread_profile_trace, filename );
+	if( !vips__thread_profile_ring )
+		vips_profile_set_ring( VIPS_GATE_RING_SIZE );
+}
+
 static void
 vips_thread_gate_block_save( VipsThreadGateBlock *block, FILE *fp )
 {
@@ -153,7 +320,9 @@ vips_thread_profile_save( VipsThreadProfile *profile )
 	fprintf( vips__thread_fp, "thread: %s (%p)\n", profile->name, profile );
 	g_hash_table_foreach( profile->gates, 
 		vips_thread_profile_save_cb, vips__thread_fp );
-	vips_thread_profile_save_gate( profile->memory, vips__thread_fp ); 
+	if( profile->memory )
+		vips_thread_profile_save_gate( profile->memory, 
+			vips__thread_fp ); 
 
 	g_mutex_unlock( vips__global_lock );
 }
@@ -173,6 +342,31 @@ vips_thread_gate_free( VipsThreadGate *gate )
 	VIPS_FREE( gate ); 
 }
 
+static void
+vips_thread_ring_free( VipsThreadRing *ring )
+{
+	VIPS_FREE( ring->events );
+	VIPS_FREE( ring );
+}
+
+/* The thread has finished: keep the ring for vips_profile_get_trace(), but
+ * only the most recent few.
+ */
+static void
+vips_thread_ring_retire( VipsThreadRing *ring )
+{
+	g_mutex_lock( vips_thread_ring_lock );
+
+	vips_thread_rings = g_slist_remove( vips_thread_rings, ring );
+	g_queue_push_tail( vips_thread_rings_retired, ring );
+	while( g_queue_get_length( vips_thread_rings_retired ) > 
+		VIPS_GATE_RETIRED )
+		vips_thread_ring_free( (VipsThreadRing *) 
+			g_queue_pop_head( vips_thread_rings_retired ) );
+
+	g_mutex_unlock( vips_thread_ring_lock );
+}
+
 static void
 vips_thread_profile_free( VipsThreadProfile *profile )
 {
@@ -180,14 +374,36 @@ vips_thread_profile_free( VipsThreadProfile *profile )
 
 	VIPS_FREEF( g_hash_table_destroy, profile->gates );
 	VIPS_FREEF( vips_thread_gate_free, profile->memory );
+	VIPS_FREEF( vips_thread_ring_retire, profile->ring );
 	VIPS_FREE( profile );
 }
 
 void
 vips__thread_profile_stop( void )
 {
+	guint64 n_wait;
+	double wait_time;
+
 	if( vips__thread_profile ) 
 		VIPS_FREEF( fclose, vips__thread_fp ); 
+
+	/* Only summarise waits if profiling was asked for, and never on 
+	 * stdout, since we might be writing an image there.
+	 */
+	vips_profile_get_wait( &n_wait, &wait_time );
+	if( (vips__thread_profile || 
+		vips_thread_profile_trace) &&
+		n_wait > 0 )
+		fprintf( stderr, "lock wait: %" G_GUINT64_FORMAT " waits, "
+			"%gs\n", n_wait, wait_time );
+
+	if( vips_thread_profile_trace ) {
+		if( vips_profile_save_trace( vips_thread_profile_trace ) ) {
+			g_warning( "%s", vips_error_buffer() );
+			vips_error_clear();
+		}
+		VIPS_FREE( vips_thread_profile_trace );
+	}
 }
 
 static void
@@ -202,7 +418,8 @@ vips__thread_profile_init_cb( VipsThreadProfile *profile )
 	 * probably haven't done that because vips_thread_shutdown() has not
 	 * been called. 
 	 */
-	if( vips__thread_profile ) 
+	if( vips__thread_profile &&
+		!vips__thread_profile_ring ) 
 		g_warning( "discarding unsaved state for thread %p --- "
 			"call vips_thread_shutdown() for this thread",
 			profile->thread ); 
@@ -223,6 +440,18 @@ vips__thread_profile_init( void )
 		vips_thread_profile_key = g_private_new( 
 			(GDestroyNotify) vips__thread_profile_init_cb );
 #endif
+
+	vips_thread_ring_lock = vips_g_mutex_new();
+	vips_thread_rings_retired = g_queue_new();
+	vips_thread_wait_lock = vips_g_mutex_new();
+}
+
+static void
+vips__thread_profile_init_once( void )
+{
+	static GOnce once = G_ONCE_INIT;
+
+	g_once( &once, (GThreadFunc) vips__thread_profile_init, NULL );
 }
 
 static VipsThreadGate *
@@ -241,11 +470,9 @@ vips_thread_gate_new( const char *gate_name )
 void
 vips__thread_profile_attach( const char *thread_name )
 {
-	static GOnce once = G_ONCE_INIT;
-
 	VipsThreadProfile *profile;
 
-	g_once( &once, (GThreadFunc) vips__thread_profile_init, NULL );
+	vips__thread_profile_init_once();
 
 	VIPS_DEBUG_MSG( "vips__thread_profile_attach: %s\n", thread_name ); 
 
@@ -256,7 +483,10 @@ vips__thread_profile_attach( const char *thread_name )
 	profile->gates = g_hash_table_new_full( 
 		g_direct_hash, g_str_equal, 
 		NULL, (GDestroyNotify) vips_thread_gate_free );
-	profile->memory = vips_thread_gate_new( "memory" ); 
+	profile->memory = NULL;
+	profile->ring = NULL;
+	profile->wait_name = NULL;
+	profile->wait_start = 0;
 	g_private_set( vips_thread_profile_key, profile );
 }
 
@@ -280,7 +510,8 @@ vips__thread_profile_detach( void )
 	VIPS_DEBUG_MSG( "vips__thread_profile_detach:\n" ); 
 
 	if( (profile = vips_thread_profile_get()) ) {
-		if( vips__thread_profile ) 
+		if( vips__thread_profile &&
+			!vips__thread_profile_ring ) 
 			vips_thread_profile_save( profile ); 
 
 		vips_thread_profile_free( profile );
@@ -298,8 +529,10 @@ vips_thread_gate_block_add( VipsThreadGateBlock **block )
 	*block = new_block;
 }
 
-static gint64
-vips_get_time( void )
+/* The time in microseconds. Monotonic, if glib supports it.
+ */
+gint64
+vips__get_time( void )
 {
 #ifdef HAVE_MONOTONIC_TIME
 	return( g_get_monotonic_time() );  
@@ -308,10 +541,159 @@ vips_get_time( void )
 
 	g_get_current_time( &time );
 
-	return( (gint64) time.tv_usec ); 
+	return( (gint64) time.tv_sec * G_USEC_PER_SEC + time.tv_usec ); 
 #endif
 }
 
+/* Gates named "something: wait" or "something: wait2" are times a thread
+ * spent blocked on a lock or condition.
+ */
+static gboolean
+vips_thread_gate_is_wait( const char *gate_name )
+{
+	const char *p;
+
+	return( (p = strrchr( gate_name, ':' )) &&
+		vips_isprefix( " wait", p + 1 ) );
+}
+
+static void
+vips_thread_wait_start( VipsThreadProfile *profile, 
+	const char *gate_name, gint64 time )
+{
+	if( vips_thread_gate_is_wait( gate_name ) ) {
+		profile->wait_name = gate_name;
+		profile->wait_start = time;
+	}
+}
+
+static void
+vips_thread_wait_stop( VipsThreadProfile *profile, 
+	const char *gate_name, gint64 time )
+{
+	/* We can see a stop with no start if profiling was turned on while
+	 * a thread was waiting.
+	 */
+	if( profile->wait_name &&
+		(profile->wait_name == gate_name ||
+		 strcmp( profile->wait_name, gate_name ) == 0) ) {
+		g_mutex_lock( vips_thread_wait_lock );
+		vips_thread_wait_n += 1;
+		vips_thread_wait_time += time - profile->wait_start;
+		g_mutex_unlock( vips_thread_wait_lock );
+
+		profile->wait_name = NULL;
+	}
+}
+
+static VipsThreadRing *
+vips_thread_ring_new( const char *name, int n_events )
+{
+	VipsThreadRing *ring;
+	guint size;
+
+	for( size = 16; size < (guint) n_events; size *= 2 )
+		;
+
+	ring = g_new0( VipsThreadRing, 1 );
+	ring->name = name;
+	ring->size = size;
+	ring->events = g_new( VipsThreadEvent, size );
+	ring->generation = g_atomic_int_get( &vips_thread_profile_generation );
+
+	g_mutex_lock( vips_thread_ring_lock );
+	ring->id = vips_thread_ring_id++;
+	vips_thread_rings = g_slist_prepend( vips_thread_rings, ring );
+	g_mutex_unlock( vips_thread_ring_lock );
+
+	return( ring );
+}
+
+static VipsThreadRing *
+vips_thread_ring_get( VipsThreadProfile *profile )
+{
+	VipsThreadRing *ring;
+	int generation;
+
+	if( !(ring = profile->ring) ) 
+		ring = profile->ring = vips_thread_ring_new( profile->name, 
+			vips__thread_profile_ring );
+
+	/* Profiling has been turned off and on again, so we may have missed 
+	 * some stops. Forget about any gates we saw start.
+	 */
+	generation = g_atomic_int_get( &vips_thread_profile_generation );
+	if( ring->generation != generation ) {
+		ring->generation = generation;
+		ring->depth = 0;
+		ring->overflow = 0;
+	}
+
+	return( ring );
+}
+
+static void
+vips_thread_ring_add( VipsThreadRing *ring, 
+	const char *name, gint64 time, gint64 value, char phase )
+{
+	guint n = (guint) ring->n;
+	VipsThreadEvent *event = &ring->events[n & (ring->size - 1)];
+
+	event->name = name;
+	event->time = time;
+	event->value = value;
+	event->phase = phase;
+
+	/* This is a barrier, so readers will never see n before the event.
+	 */
+	g_atomic_int_set( &ring->n, (gint) (n + 1) );
+	if( n + 1 == ring->size )
+		g_atomic_int_set( &ring->full, TRUE );
+}
+
+static void
+vips_thread_ring_start( VipsThreadProfile *profile, 
+	const char *gate_name, gint64 time )
+{
+	VipsThreadRing *ring = vips_thread_ring_get( profile );
+
+	if( ring->depth >= VIPS_GATE_DEPTH )
+		ring->overflow += 1;
+	else {
+		ring->open[ring->depth].name = gate_name;
+		ring->open[ring->depth].time = time;
+		ring->depth += 1;
+	}
+}
+
+static void
+vips_thread_ring_stop( VipsThreadProfile *profile, 
+	const char *gate_name, gint64 time )
+{
+	VipsThreadRing *ring = vips_thread_ring_get( profile );
+
+	int i;
+
+	if( ring->overflow > 0 ) {
+		ring->overflow -= 1;
+		return;
+	}
+
+	/* Usually the top gate, but if profiling was turned on while a gate
+	 * was open we can see stops with no start. 
+	 */
+	for( i = ring->depth - 1; i >= 0; i-- ) 
+		if( ring->open[i].name == gate_name ||
+			strcmp( ring->open[i].name, gate_name ) == 0 ) 
+			break;
+
+	if( i >= 0 ) {
+		vips_thread_ring_add( ring, gate_name, ring->open[i].time, 
+			time - ring->open[i].time, 'X' );
+		ring->depth = i;
+	}
+}
+
 void
 vips__thread_gate_start( const char *gate_name )
 {
@@ -320,10 +702,17 @@ vips__thread_gate_start( const char *gate_name )
 	VIPS_DEBUG_MSG_RED( "vips__thread_gate_start: %s\n", gate_name ); 
 
 	if( (profile = vips_thread_profile_get()) ) { 
-		gint64 time = vips_get_time(); 
+		gint64 time = vips__get_time(); 
 
 		VipsThreadGate *gate;
 
+		vips_thread_wait_start( profile, gate_name, time );
+
+		if( vips__thread_profile_ring ) {
+			vips_thread_ring_start( profile, gate_name, time );
+			return;
+		}
+
 		if( !(gate = 
 			g_hash_table_lookup( profile->gates, gate_name )) ) {
 			gate = vips_thread_gate_new( gate_name );
@@ -348,10 +737,17 @@ vips__thread_gate_stop( const char *gate_name )
 	VIPS_DEBUG_MSG_RED( "vips__thread_gate_stop: %s\n", gate_name ); 
 
 	if( (profile = vips_thread_profile_get()) ) { 
-		gint64 time = vips_get_time(); 
+		gint64 time = vips__get_time(); 
 
 		VipsThreadGate *gate;
 
+		vips_thread_wait_stop( profile, gate_name, time );
+
+		if( vips__thread_profile_ring ) {
+			vips_thread_ring_stop( profile, gate_name, time );
+			return;
+		}
+
 		if( !(gate = 
 			g_hash_table_lookup( profile->gates, gate_name )) ) {
 			gate = vips_thread_gate_new( gate_name );
@@ -383,8 +779,22 @@ vips__thread_malloc_free( gint64 size )
 #endif /*VIPS_DEBUG*/
 
 	if( (profile = vips_thread_profile_get()) ) { 
-		gint64 time = vips_get_time(); 
-		VipsThreadGate *gate = profile->memory;
+		gint64 time = vips__get_time(); 
+
+		VipsThreadGate *gate;
+
+		if( vips__thread_profile_ring ) {
+			VipsThreadRing *ring = vips_thread_ring_get( profile );
+
+			ring->memory += size;
+			vips_thread_ring_add( ring, 
+				"memory", time, ring->memory, 'C' );
+			return;
+		}
+
+		if( !profile->memory )
+			profile->memory = vips_thread_gate_new( "memory" ); 
+		gate = profile->memory;
 
 		if( gate->start->i >= VIPS_GATE_SIZE ) {
 			vips_thread_gate_block_add( &gate->start );
@@ -395,3 +805,182 @@ vips__thread_malloc_free( gint64 size )
 		gate->stop->time[gate->stop->i++] = size;
 	}
 }
+
+static void
+vips_profile_append_string( GString *str, const char *text )
+{
+	const char *p;
+
+	g_string_append_c( str, '"' );
+	for( p = text; *p; p++ )
+		if( *p == '"' ||
+			*p == '\\' ) {
+			g_string_append_c( str, '\\' );
+			g_string_append_c( str, *p );
+		}
+		else if( (unsigned char) *p < 32 )
+			g_string_append_printf( str, "\\u%04x", *p );
+		else
+			g_string_append_c( str, *p );
+	g_string_append_c( str, '"' );
+}
+
+static void
+vips_thread_ring_append( VipsThreadRing *ring, GString *str )
+{
+	guint mask = ring->size - 1;
+
+	VipsThreadEvent *events;
+	guint n, start, count, i;
+	gint64 lost;
+
+	g_string_append_printf( str, ",\n{\"name\":\"thread_name\","
+		"\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":",
+		ring->id );
+	vips_profile_append_string( str, ring->name );
+	g_string_append( str, "}}" );
+
+	/* Copy the events out, then find how many the owner might have 
+	 * overwritten while we copied. All this arithmetic is modulo 2^32, 
+	 * like n.
+	 */
+	n = (guint) g_atomic_int_get( &ring->n );
+	count = g_atomic_int_get( &ring->full ) ? ring->size : n;
+	start = n - count;
+	events = g_new( VipsThreadEvent, ring->size );
+	for( i = 0; i < count; i++ )
+		events[(start + i) & mask] = ring->events[(start + i) & mask];
+	lost = (gint64) ((guint) g_atomic_int_get( &ring->n ) - n) + 
+		1 + count - ring->size;
+	if( lost > 0 ) {
+		lost = VIPS_MIN( lost, count );
+		start += lost;
+		count -= lost;
+	}
+
+	for( i = 0; i < count; i++ ) {
+		VipsThreadEvent *event = &events[(start + i) & mask];
+
+		g_string_append( str, ",\n{\"name\":" );
+		vips_profile_append_string( str, event->name );
+
+		if( event->phase == 'X' ) 
+			g_string_append_printf( str, 
+				",\"cat\":\"vips\",\"ph\":\"X\","
+				"\"ts\":%" G_GINT64_FORMAT ","
+				"\"dur\":%" G_GINT64_FORMAT ","
+				"\"pid\":1,\"tid\":%d}",
+				event->time, event->value, ring->id );
+		else 
+			g_string_append_printf( str, 
+				",\"ph\":\"C\","
+				"\"ts\":%" G_GINT64_FORMAT ","
+				"\"pid\":1,\"tid\":%d,"
+				"\"args\":{\"%d\":%" G_GINT64_FORMAT "}}",
+				event->time, ring->id, 
+				ring->id, event->value );
+	}
+
+	g_free( events );
+}
+
+/**
+ * vips_profile_get_trace:
+ *
+ * Fetch the events in the profile rings of all threads, see 
+ * vips_profile_set_ring(), as a chrome trace. Load the trace into 
+ * chrome://tracing or any compatible viewer.
+ *
+ * Each finished gate is a complete event on its thread, gates with an
+ * operation nickname, like "add", are the time spent generating pixels for 
+ * that operation. Memory use is a counter for each thread.
+ *
+ * Threads carry on running and recording while the trace is made. Rings
+ * are kept for the most recent few threads to finish.
+ *
+ * See also: vips_profile_save_trace().
+ *
+ * Returns: (transfer full): the trace as a JSON string. Free with g_free().
+ */
+char *
+vips_profile_get_trace( void )
+{
+	GString *str;
+	GSList *p;
+	GList *q;
+
+	vips__thread_profile_init_once();
+
+	str = g_string_new( "{\"traceEvents\":[\n" );
+	g_string_append( str, "{\"name\":\"process_name\",\"ph\":\"M\","
+		"\"pid\":1,\"args\":{\"name\":\"vips\"}}" );
+
+	g_mutex_lock( vips_thread_ring_lock );
+	for( q = vips_thread_rings_retired->head; q; q = q->next )
+		vips_thread_ring_append( (VipsThreadRing *) q->data, str );
+	for( p = vips_thread_rings; p; p = p->next )
+		vips_thread_ring_append( (VipsThreadRing *) p->data, str );
+	g_mutex_unlock( vips_thread_ring_lock );
+
+	g_string_append( str, "\n],\"displayTimeUnit\":\"ms\"}\n" );
+
+	return( g_string_free( str, FALSE ) );
+}
+
+/**
+ * vips_profile_save_trace:
+ * @filename: write the trace here
+ *
+ * Save the current contents of the profile rings as a chrome trace, see
+ * vips_profile_get_trace().
+ *
+ * Returns: 0 on success, -1 on error.
+ */
+int
+vips_profile_save_trace( const char *filename )
+{
+	FILE *fp;
+	char *trace;
+	int result;
+
+	if( !(fp = vips__file_open_write( filename, TRUE )) )
+		return( -1 );
+
+	trace = vips_profile_get_trace();
+	result = 0;
+	if( fputs( trace, fp ) == EOF ) {
+		vips_error_system( errno, "vips_profile_save_trace", 
+			_( "unable to write to \"%s\"" ), filename );
+		result = -1;
+	}
+	g_free( trace );
+	fclose( fp );
+
+	return( result );
+}
+
+/**
+ * vips_profile_get_wait:
+ * @n_wait: (out) (allow-none): return number of waits here
+ * @wait_time: (out) (allow-none): return total seconds spent waiting here
+ *
+ * Fetch the number of times worker threads have blocked on a lock or 
+ * condition, and the total time they spent blocked, summed over all 
+ * threads. 
+ *
+ * Waits are only recorded while profiling is on, see vips_profile_set() and
+ * vips_profile_set_ring(). If profiling was turned on with vips_profile_set() 
+ * or vips_profile_set_trace(), a summary is printed to stderr on exit.
+ */
+void
+vips_profile_get_wait( guint64 *n_wait, double *wait_time )
+{
+	vips__thread_profile_init_once();
+
+	g_mutex_lock( vips_thread_wait_lock );
+	if( n_wait )
+		*n_wait = vips_thread_wait_n;
+	if( wait_time )
+		*wait_time = vips_thread_wait_time / 1000000.0;
+	g_mutex_unlock( vips_thread_wait_lock );
+}
@@ -14,6 +14,14 @@
  * 	- add vips_image_hasalpha()
  * 11/10/1
  * 	- more severing for vips_image_write()
+ * 16/10/17
+ * 	- vips_image_copy_memory() goes via disc if the copy would break the
+ * 	  pipeline's memory budget
+ * 	- large memory images ask for huge pages
+ * 	- unmap cached windows on dispose
+ * 	- vips_image_write_line() can write to compressed spill images
+ * 	- vips_image_write() to memory saves keyed results to the disc cache
+ * 	- keep the file access hint in qdata, see vips__image_set_access()
  */
 
 /*
@@ -507,6 +515,10 @@ vips_image_dispose( GObject *gobject )
 	 * read.
 	 */
 
+	/* Unmap any windows we were keeping in case they were needed again. 
+	 */
+	vips__window_flush( image );
+
 	/* Any file mapping?
 	 */
 	if( image->baseaddr ) {
@@ -938,14 +950,14 @@ vips_image_build( VipsObject *object )
 {
 		const char *file_op;
 
+		if( !(file_op = vips_foreign_find_save( filename )) )
+			return( -1 );
+
 		/* Make sure the vips saver is there ... strange things will
 		 * happen if this type is renamed or removed.
 		 */
 		g_assert( g_type_from_name( "VipsForeignSaveVips" ) );
 
-		if( !(file_op = vips_foreign_find_save( filename )) )
-			return( -1 );
-
 		/* If this is the vips saver, just save directly ourselves.
 		 * Otherwise save with VipsForeign when the image has been 
 		 * written to.
@@ -1578,6 +1590,9 @@ vips_image_eval( VipsImage *image, guint64 processed )
 void
 vips_image_posteval( VipsImage *image )
 {
+	if( vips__accounting )
+		vips__region_report( image );
+
 	if( image->progress_signal &&
 		image->progress_signal->time ) { 
 		VIPS_DEBUG_MSG( "vips_image_posteval: %p\n", image );
@@ -1722,6 +1737,34 @@ vips_image_new( void )
 	return( image ); 
 }
 
+/* Record how a file image will be read. This is a hint for the kernel, see
+ * vips__mmap_advise(), so it's kept in qdata rather than on the image. 
+ * Store access + 1, so NULL means no hint was given.
+ */
+void
+vips__image_set_access( VipsImage *image, VipsAccess access )
+{
+	g_object_set_qdata( G_OBJECT( image ), vips__image_access_quark, 
+		GINT_TO_POINTER( access + 1 ) );
+}
+
+/* Fetch the access hint, or FALSE if none was set and the kernel defaults 
+ * should be left alone.
+ */
+gboolean
+vips__image_get_access( VipsImage *image, VipsAccess *access )
+{
+	int value;
+
+	if( !(value = GPOINTER_TO_INT( g_object_get_qdata( G_OBJECT( image ), 
+		vips__image_access_quark ) )) )
+		return( FALSE );
+
+	*access = (VipsAccess) (value - 1);
+
+	return( TRUE );
+}
+
 VipsImage *
 vips_image_new_mode( const char *filename, const char *mode )
 {
@@ -1871,6 +1914,12 @@ vips_filename_get_options( const char *vips_filename )
  * "m" or "g" to indicate kilobytes, megabytes or gigabytes.
  * The default threshold is 100 MB.
  *
+ * Set the "--vips-spill-memory" command-line argument, or the
+ * `VIPS_SPILL_MEMORY` environment variable, to decompress large images to
+ * memory as compressed strips instead of to disc. This is handy when
+ * temporary storage is slow. It uses less memory than decompressing to a
+ * plain memory buffer, though how much less depends on the image.
+ *
  * For example:
  *
  * |[
@@ -2090,6 +2139,7 @@ vips_image_new_from_memory_copy( const void *data, size_t size,
 
 	if( !(data_copy = vips_tracked_malloc( size )) )
 		return( NULL );
+	vips__memory_advise_hugepage( data_copy, size );
 	memcpy( data_copy, data, size );
 	if( !(image = vips_image_new_from_memory( data_copy, size, 
 		width, height, bands, format )) ) {
@@ -2541,6 +2591,10 @@ vips_image_write( VipsImage *image, VipsImage *out )
 	else {
 		vips__reorder_clear( image );
 		vips__link_break_all( out );
+
+		/* We've computed @image, perhaps the disc cache wants it.
+		 */
+		vips__cache_disc_written( image, out );
 	}
 
 	return( 0 );
@@ -2915,10 +2969,13 @@ vips_image_write_prepare( VipsImage *image )
 		break;
 
 	case VIPS_IMAGE_SETBUF:
-		if( !image->data && 
-			!(image->data = vips_tracked_malloc( 
+		if( !image->data ) {
+			if( !(image->data = vips_tracked_malloc( 
 				VIPS_IMAGE_SIZEOF_IMAGE( image ))) ) 
-			return( -1 );
+				return( -1 );
+			vips__memory_advise_hugepage( image->data, 
+				VIPS_IMAGE_SIZEOF_IMAGE( image ) );
+		}
 
 		break;
 
@@ -2955,6 +3012,11 @@ vips_image_write_line( VipsImage *image, int ypos, VipsPel *linebuffer )
 {	
 	int linesize = VIPS_IMAGE_SIZEOF_LINE( image );
 
+	/* Spill images keep lines compressed in memory, see spill.c.
+	 */
+	if( vips__image_isspill( image ) )
+		return( vips__spill_write_line( image, ypos, linebuffer ) );
+
 	/* Is this the start of eval?
 	 */
 	if( ypos == 0 ) {
@@ -3086,7 +3148,11 @@ vips_image_rewind_output( VipsImage *image )
  * If you are sure that @image is not shared with another thread (perhaps you
  * have made it yourself), use vips_image_wio_input() instead.
  *
- * See also: vips_image_wio_input().
+ * If the copy would break the memory budget of @image's pipeline, or of 
+ * the pipeline we are working for, it is made in a temporary disc file and
+ * mapped in instead. 
+ *
+ * See also: vips_image_wio_input(), vips_image_set_memory_budget().
  *
  * Returns: (transfer full): the new #VipsImage, or %NULL on error.
  */
@@ -3094,6 +3160,8 @@ VipsImage *
 vips_image_copy_memory( VipsImage *image )
 {
 	VipsImage *new;
+	size_t budget;
+	guint64 size;
 
 	switch( image->dtype ) {
 	case VIPS_IMAGE_SETBUF:
@@ -3109,10 +3177,24 @@ vips_image_copy_memory( VipsImage *image )
 	case VIPS_IMAGE_OPENOUT:
 	case VIPS_IMAGE_OPENIN:
 	case VIPS_IMAGE_PARTIAL:
-		new = vips_image_new_memory();
-		if( vips_image_write( image, new ) ) {
-			g_object_unref( new );
-			return( NULL ); 
+		budget = vips__image_get_pipeline_budget( image );
+		size = VIPS_IMAGE_SIZEOF_IMAGE( image );
+		if( (budget && size > budget) ||
+			vips__budget_would_exceed( size ) ) {
+			if( !(new = vips_image_new_temp_file( "%s.v" )) )
+				return( NULL );
+			if( vips_image_write( image, new ) ||
+				vips_image_wio_input( new ) ) {
+				g_object_unref( new );
+				return( NULL ); 
+			}
+		}
+		else {
+			new = vips_image_new_memory();
+			if( vips_image_write( image, new ) ) {
+				g_object_unref( new );
+				return( NULL ); 
+			}
 		}
 		break;
 
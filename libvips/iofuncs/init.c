@@ -28,6 +28,8 @@
  * 	- call _setmaxstdio() on win32
  * 4/8/17
  * 	- hide warnings is VIPS_WARNING is set
+ * 16/10/17
+ * 	- register operation classes on first use
  */
 
 /*
@@ -106,11 +108,17 @@ static char *vips__argv0 = NULL;
  */
 int vips__leak = 0;
 
-#ifdef DEBUG_LEAK
 /* Count pixels processed per image here.
  */
 GQuark vips__image_pixels_quark = 0; 
-#endif /*DEBUG_LEAK*/
+
+/* The VipsClassStats for the operation which made an image.
+ */
+GQuark vips__image_class_quark = 0; 
+
+/* The VipsAccess a file image was opened with, if one was given.
+ */
+GQuark vips__image_access_quark = 0; 
 
 /**
  * vips_get_argv0:
@@ -246,6 +254,23 @@ vips_load_plugins( const char *fmt, ... )
 	return( result );
 }
 
+/* Set the cache policy from a nickname, eg. "lru".
+ */
+static void
+vips_cache_policy_set_nick( const char *nick )
+{
+	int policy;
+
+	if( (policy = vips_enum_from_nick( "vips", 
+		VIPS_TYPE_CACHE_POLICY, nick )) < 0 ) {
+		g_warning( "%s", vips_error_buffer() );
+		vips_error_clear();
+		return;
+	}
+
+	vips_cache_set_policy( policy );
+}
+
 /* Install this log handler to hide warning messages.
  */
 static void
@@ -323,6 +348,8 @@ vips_init( const char *argv0 )
 
 	vips__threadpool_init();
 	vips__buffer_init();
+	vips__stats_init();
+	vips__region_init();
 
 	/* This does an unsynchronised static hash table init on first call --
 	 * we have to make sure we do this single-threaded. See: 
@@ -371,11 +398,38 @@ vips_init( const char *argv0 )
 	 */
 	if( g_getenv( "VIPS_TRACE" ) )
 		vips_cache_set_trace( TRUE );
+	if( g_getenv( "VIPS_CACHE_POLICY" ) )
+		vips_cache_policy_set_nick( g_getenv( "VIPS_CACHE_POLICY" ) );
+	if( g_getenv( "VIPS_SINK_DISC_BUFFERS" ) )
+		vips_sink_disc_set_buffers( 
+			atoi( g_getenv( "VIPS_SINK_DISC_BUFFERS" ) ) );
+	if( g_getenv( "VIPS_CACHE_MAX_DISC" ) )
+		vips_cache_set_max_disc( 
+			vips__parse_size( g_getenv( "VIPS_CACHE_MAX_DISC" ) ) );
+	if( g_getenv( "VIPS_PROFILE_RING" ) )
+		vips_profile_set_ring( atoi( g_getenv( "VIPS_PROFILE_RING" ) ) );
+	if( g_getenv( "VIPS_PROFILE_TRACE" ) )
+		vips_profile_set_trace( g_getenv( "VIPS_PROFILE_TRACE" ) );
+	if( g_getenv( "VIPS_NOFUSE" ) )
+		vips__fuse_enabled = FALSE;
+	if( g_getenv( "VIPS_WINDOW_CACHE" ) )
+		vips__window_cache_max = 
+			vips__parse_size( g_getenv( "VIPS_WINDOW_CACHE" ) );
+	if( g_getenv( "VIPS_NOMADVISE" ) )
+		vips__mmap_advise_enabled = FALSE;
+	if( g_getenv( "VIPS_SPILL_MEMORY" ) )
+		vips__spill_memory = TRUE;
+	if( g_getenv( "VIPS_CACHE_DISC" ) &&
+		vips_cache_set_disc( g_getenv( "VIPS_CACHE_DISC" ) ) ) {
+		g_warning( "%s", vips_error_buffer() );
+		vips_error_clear();
+	}
 
 	/* Register base vips types.
 	 */
 	(void) vips_image_get_type();
 	(void) vips_region_get_type();
+	(void) vips_operation_get_type();
 	(void) write_thread_state_get_type();
 	(void) sink_memory_thread_state_get_type(); 
 	(void) render_thread_state_get_type(); 
@@ -391,21 +445,8 @@ vips_init( const char *argv0 )
 	 */
 	vips__reorder_init();
 
-	/* Start up packages.
+	/* Packages are started on first use, see vips__operations_init().
 	 */
-	(void) vips_system_get_type();
-	vips_arithmetic_operation_init();
-	vips_conversion_operation_init();
-	vips_create_operation_init();
-	vips_foreign_operation_init();
-	vips_resample_operation_init();
-	vips_colour_operation_init();
-	vips_histogram_operation_init();
-	vips_convolution_operation_init();
-	vips_freqfilt_operation_init();
-	vips_morphology_operation_init();
-	vips_draw_operation_init();
-	vips_mosaicing_operation_init();
 
 	/* Load any vips8 plugins from the vips libdir. Keep going, even if
 	 * some plugins fail to load. 
@@ -435,6 +476,10 @@ vips_init( const char *argv0 )
 	 */
 	vips_vector_init();
 
+	/* And pick native vector kernels for this CPU.
+	 */
+	vips__simd_init();
+
 #ifdef HAVE_GSF
 	/* Use this for structured file write.
 	 */
@@ -448,10 +493,12 @@ vips_init( const char *argv0 )
 	atexit( vips_shutdown );
 #endif /*HAVE_ATEXIT*/
 
-#ifdef DEBUG_LEAK
 	vips__image_pixels_quark = 
 		g_quark_from_static_string( "vips-image-pixels" ); 
-#endif /*DEBUG_LEAK*/
+	vips__image_class_quark = 
+		g_quark_from_static_string( "vips-image-class" ); 
+	vips__image_access_quark = 
+		g_quark_from_static_string( "vips-image-access" ); 
 
 	done = TRUE;
 
@@ -472,6 +519,42 @@ vips_init( const char *argv0 )
 	return( 0 );
 }
 
+static void *
+vips_operations_init_once( void *data )
+{
+	(void) vips_system_get_type();
+	vips_arithmetic_operation_init();
+	vips_conversion_operation_init();
+	vips_create_operation_init();
+	vips_foreign_operation_init();
+	vips_resample_operation_init();
+	vips_colour_operation_init();
+	vips_histogram_operation_init();
+	vips_convolution_operation_init();
+	vips_freqfilt_operation_init();
+	vips_morphology_operation_init();
+	vips_draw_operation_init();
+	vips_mosaicing_operation_init();
+
+	return( NULL );
+}
+
+/* Register all our operation classes. Registering and initialising a few
+ * hundred classes is a large part of startup time, so we put it off until
+ * something looks up or loops over classes by name, see vips_class_find()
+ * and friends. 
+ *
+ * Calling an operation's get_type() function directly still works, 
+ * of course.
+ */
+void
+vips__operations_init( void )
+{
+	static GOnce once = G_ONCE_INIT;
+
+	g_once( &once, (GThreadFunc) vips_operations_init_once, NULL );
+}
+
 /* Call this before vips stuff that uses stuff we need to have inited.
  */
 void
@@ -542,6 +625,8 @@ void
 vips_thread_shutdown( void )
 {
 	vips__thread_profile_detach();
+	vips__buffer_shutdown();
+	vips__region_account_flush();
 }
 
 /**
@@ -561,7 +646,7 @@ vips_shutdown( void )
 	printf( "vips_shutdown:\n" );
 #endif /*DEBUG*/
 
-	vips_cache_drop_all();
+	vips__cache_shutdown();
 
 	im_close_plugins();
 
@@ -577,8 +662,14 @@ vips_shutdown( void )
 
 	vips__render_shutdown();
 
+	vips__threadpool_shutdown();
+
 	vips_thread_shutdown();
 
+	/* All workers have gone, we can free any recycled pixel memory.
+	 */
+	vips__buffer_arena_drain();
+
 	vips__thread_profile_stop();
 
 #ifdef HAVE_GSF
@@ -671,6 +762,57 @@ vips_cache_max_memory_cb( const gchar *option_name, const gchar *value,
 	return( TRUE ); 
 }
 
+static gboolean
+vips_cache_policy_cb( const gchar *option_name, const gchar *value, 
+	gpointer data, GError **error )
+{
+	vips_cache_policy_set_nick( value );
+
+	return( TRUE ); 
+}
+
+static gboolean
+vips_profile_trace_cb( const gchar *option_name, const gchar *value, 
+	gpointer data, GError **error )
+{
+	vips_profile_set_trace( value );
+
+	return( TRUE ); 
+}
+
+static gboolean
+vips_cache_disc_cb( const gchar *option_name, const gchar *value, 
+	gpointer data, GError **error )
+{
+	if( vips_cache_set_disc( value ) ) {
+		g_set_error( error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+			"%s", vips_error_buffer() ); 
+		vips_error_clear();
+
+		return( FALSE ); 
+	}
+
+	return( TRUE ); 
+}
+
+static gboolean
+vips_cache_max_disc_cb( const gchar *option_name, const gchar *value, 
+	gpointer data, GError **error )
+{
+	vips_cache_set_max_disc( vips__parse_size( value ) );
+
+	return( TRUE ); 
+}
+
+static gboolean
+vips_window_cache_cb( const gchar *option_name, const gchar *value, 
+	gpointer data, GError **error )
+{
+	vips__window_cache_max = vips__parse_size( value );
+
+	return( TRUE ); 
+}
+
 static gboolean
 vips_cache_max_files_cb( const gchar *option_name, const gchar *value, 
 	gpointer data, GError **error )
@@ -690,6 +832,19 @@ static GOptionEntry option_entries[] = {
 	{ "vips-concurrency", 0, 0, 
 		G_OPTION_ARG_INT, &vips__concurrency, 
 		N_( "evaluate with N concurrent threads" ), "N" },
+	{ "vips-threadpool-max-idle", 0, 0, 
+		G_OPTION_ARG_INT, &vips__threadpool_max_idle, 
+		N_( "keep at most N idle worker threads" ), "N" },
+	{ "vips-threadpool-idle-timeout", 0, 0, 
+		G_OPTION_ARG_INT, &vips__threadpool_idle_timeout, 
+		N_( "idle worker threads exit after N seconds" ), "N" },
+	{ "vips-threadpool-max-active", 0, 0, 
+		G_OPTION_ARG_INT, &vips__threadpool_max_active, 
+		N_( "at most N workers compute at once over all pipelines" ), 
+		"N" },
+	{ "vips-sink-disc-buffers", 0, 0, 
+		G_OPTION_ARG_INT, &vips__sink_disc_buffers, 
+		N_( "write behind through N buffers" ), "N" },
 	{ "vips-tile-width", 0, G_OPTION_FLAG_HIDDEN, 
 		G_OPTION_ARG_INT, &vips__tile_width, 
 		N_( "set tile width to N (DEBUG)" ), "N" },
@@ -702,6 +857,9 @@ static GOptionEntry option_entries[] = {
 	{ "vips-fatstrip-height", 0, G_OPTION_FLAG_HIDDEN, 
 		G_OPTION_ARG_INT, &vips__fatstrip_height, 
 		N_( "set fatstrip height to N (DEBUG)" ), "N" },
+	{ "vips-adaptive-tiles", 0, 0, 
+		G_OPTION_ARG_NONE, &vips__tile_adaptive, 
+		N_( "size tiles to fit the L2 cache" ), NULL },
 	{ "vips-progress", 0, 0, 
 		G_OPTION_ARG_NONE, &vips__progress, 
 		N_( "show progress feedback" ), NULL },
@@ -711,9 +869,34 @@ static GOptionEntry option_entries[] = {
 	{ "vips-profile", 0, 0, 
 		G_OPTION_ARG_NONE, &vips__thread_profile, 
 		N_( "profile and dump timing on exit" ), NULL },
+	{ "vips-accounting", 0, 0, 
+		G_OPTION_ARG_NONE, &vips__accounting, 
+		N_( "report time and pixels for each operation after "
+			"each sink" ), NULL },
+	{ "vips-profile-trace", 0, 0, 
+		G_OPTION_ARG_CALLBACK, (gpointer) &vips_profile_trace_cb,
+		N_( "profile and save a chrome trace to FILE on exit" ), 
+		"FILE" },
 	{ "vips-disc-threshold", 0, 0, 
 		G_OPTION_ARG_STRING, &vips__disc_threshold, 
 		N_( "images larger than N are decompressed to disc" ), "N" },
+	{ "vips-spill-memory", 0, 0, 
+		G_OPTION_ARG_NONE, &vips__spill_memory, 
+		N_( "decompress large images to compressed memory, "
+			"not disc" ), NULL },
+	{ "vips-nofuse", 0, G_OPTION_FLAG_REVERSE, 
+		G_OPTION_ARG_NONE, &vips__fuse_enabled, 
+		N_( "don't fuse point operations" ), NULL },
+	{ "vips-window-cache", 0, 0, 
+		G_OPTION_ARG_CALLBACK, (gpointer) &vips_window_cache_cb,
+		N_( "keep up to N bytes of unused mmap windows per image" ), 
+		"N" },
+	{ "vips-nomadvise", 0, G_OPTION_FLAG_REVERSE, 
+		G_OPTION_ARG_NONE, &vips__mmap_advise_enabled, 
+		N_( "don't pass access hints to the kernel" ), NULL },
+	{ "vips-nosimd", 0, G_OPTION_FLAG_REVERSE, 
+		G_OPTION_ARG_NONE, &vips__simd_enabled, 
+		N_( "disable native vector kernels" ), NULL },
 	{ "vips-novector", 0, G_OPTION_FLAG_REVERSE, 
 		G_OPTION_ARG_NONE, &vips__vector_enabled, 
 		N_( "disable vectorised versions of operations" ), NULL },
@@ -726,6 +909,15 @@ static GOptionEntry option_entries[] = {
 	{ "vips-cache-max-files", 0, 0, 
 		G_OPTION_ARG_CALLBACK, (gpointer) &vips_cache_max_files_cb,
 		N_( "allow at most N open files" ), "N" },
+	{ "vips-cache-policy", 0, 0, 
+		G_OPTION_ARG_CALLBACK, (gpointer) &vips_cache_policy_cb,
+		N_( "drop cached operations by POLICY" ), "POLICY" },
+	{ "vips-cache-disc", 0, 0, 
+		G_OPTION_ARG_CALLBACK, (gpointer) &vips_cache_disc_cb,
+		N_( "keep operation results in DIR" ), "DIR" },
+	{ "vips-cache-max-disc", 0, 0, 
+		G_OPTION_ARG_CALLBACK, (gpointer) &vips_cache_max_disc_cb,
+		N_( "keep at most N bytes of results on disc" ), "N" },
 	{ "vips-cache-trace", 0, 0, 
 		G_OPTION_ARG_NONE, &vips__cache_trace, 
 		N_( "trace operation cache" ), NULL },
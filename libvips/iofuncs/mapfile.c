@@ -22,6 +22,8 @@
  * 	- set NOCACHE if we can ... helps OS X performance a lot
  * 25/3/11
  * 	- move to vips_ namespace
+ * 16/10/17
+ * 	- add vips__mmap_advise() and friends
  */
 
 /*
@@ -65,6 +67,7 @@
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
+#include <fcntl.h>
 
 #include <sys/types.h>
 #ifdef HAVE_SYS_MMAN_H
@@ -84,11 +87,21 @@
 #endif /*OS_WIN32*/
 
 #include <vips/vips.h>
+#include <vips/internal.h>
 
 #ifdef OS_WIN32
 #include <windows.h>
 #endif /*OS_WIN32*/
 
+/* Set this to stop us passing access hints to the kernel, see
+ * --vips-nomadvise.
+ */
+gboolean vips__mmap_advise_enabled = TRUE;
+
+/* Memory areas larger than this are backed by huge pages, if we can.
+ */
+#define VIPS_HUGEPAGE_SIZE (2 * 1024 * 1024)
+
 void *
 vips__mmap( int fd, int writeable, size_t length, gint64 offset )
 {
@@ -208,6 +221,93 @@ vips__munmap( const void *start, size_t length )
 	return( 0 );
 }
 
+/* Tell the kernel how we will read a mapped area of a file. Sequential
+ * windows get aggressive readahead. Random windows are read in one go and
+ * readahead beyond them is turned off, since the next window could be
+ * anywhere.
+ *
+ * These are only hints, so we ignore errors.
+ */
+void
+vips__mmap_advise( void *baseaddr, size_t length, VipsAccess access )
+{
+#ifdef HAVE_MADVISE
+	if( !vips__mmap_advise_enabled )
+		return;
+
+	switch( access ) {
+	case VIPS_ACCESS_SEQUENTIAL:
+	case VIPS_ACCESS_SEQUENTIAL_UNBUFFERED:
+		(void) madvise( baseaddr, length, MADV_SEQUENTIAL );
+		break;
+
+	case VIPS_ACCESS_RANDOM:
+		(void) madvise( baseaddr, length, MADV_RANDOM );
+		(void) madvise( baseaddr, length, MADV_WILLNEED );
+		break;
+
+	default:
+		break;
+	}
+#endif /*HAVE_MADVISE*/
+}
+
+/* We're about to unmap an area. If it was read sequentially we won't be 
+ * back, so let the kernel drop the pages now. Unbuffered reads drop the 
+ * file's pages from the cache too.
+ */
+void
+vips__mmap_release( int fd, void *baseaddr, size_t length, gint64 offset,
+	VipsAccess access )
+{
+	if( !vips__mmap_advise_enabled ||
+		access == VIPS_ACCESS_RANDOM )
+		return;
+
+#ifdef HAVE_MADVISE
+	(void) madvise( baseaddr, length, MADV_DONTNEED );
+#endif /*HAVE_MADVISE*/
+
+#ifdef HAVE_POSIX_FADVISE
+	if( access == VIPS_ACCESS_SEQUENTIAL_UNBUFFERED )
+		(void) posix_fadvise( fd, 
+			(off_t) offset, (off_t) length, POSIX_FADV_DONTNEED );
+#endif /*HAVE_POSIX_FADVISE*/
+}
+
+/* Start reading an area of a file into the page cache in the background, 
+ * ready for the next window. 
+ */
+void
+vips__file_prefetch( int fd, gint64 offset, gint64 length )
+{
+#ifdef HAVE_POSIX_FADVISE
+	if( vips__mmap_advise_enabled &&
+		length > 0 )
+		(void) posix_fadvise( fd, 
+			(off_t) offset, (off_t) length, POSIX_FADV_WILLNEED );
+#endif /*HAVE_POSIX_FADVISE*/
+}
+
+/* Large memory images get transparent huge pages, if the kernel has them. 
+ * This cuts TLB misses a lot when we walk a big image. The area must
+ * be page-aligned, so we only advise the aligned part in the middle.
+ */
+void
+vips__memory_advise_hugepage( void *data, size_t length )
+{
+#if defined(HAVE_MADVISE) && defined(MADV_HUGEPAGE)
+	size_t pagesize = (size_t) getpagesize();
+	guint64 start = ((guint64) data + pagesize - 1) & ~(pagesize - 1);
+	guint64 end = ((guint64) data + length) & ~(pagesize - 1);
+
+	if( vips__mmap_advise_enabled &&
+		length >= VIPS_HUGEPAGE_SIZE &&
+		end > start )
+		(void) madvise( (void *) start, end - start, MADV_HUGEPAGE );
+#endif /*HAVE_MADVISE && MADV_HUGEPAGE*/
+}
+
 int
 vips_mapfile( VipsImage *im )
 {
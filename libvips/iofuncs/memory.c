@@ -22,6 +22,12 @@
  * 21/9/11
  * 	- rename as vips_tracked_malloc() to emphasise difference from
  * 	  g_malloc()/g_free()
+ * 16/10/17
+ * 	- charge tracked memory to the memory budget of the pipeline being
+ * 	  computed, see vips_image_set_memory_budget()
+ * 	- add vips_tracked_reset_mem_highwater()
+ * 	- don't count buffers parked for reuse in vips_tracked_get_mem()
+ * 	- throttled workers wait on a budget GCond
  */
 
 /*
@@ -67,6 +73,7 @@
 
 #include <vips/vips.h>
 #include <vips/thread.h>
+#include <vips/internal.h>
 
 /**
  * SECTION: memory
@@ -104,6 +111,47 @@ static int vips_tracked_files = 0;
 static size_t vips_tracked_mem_highwater = 0;
 static GMutex *vips_tracked_mutex = NULL;
 
+/* A memory budget for a pipeline. Threads working on a pipeline set it as
+ * their current budget, and tracked memory they allocate is charged to it.
+ * Each charged block holds a ref, so the budget lives until the last block 
+ * is freed. 
+ */
+struct _VipsBudget {
+	volatile gint ref_count;
+
+	/* Limit and current charge, in kb, so we can update with
+	 * g_atomic_int_add().
+	 */
+	int limit;
+	volatile gint used;
+
+	/* Throttled workers wait on @cond for memory to be released. 
+	 * n_waiting lets uncharge skip the lock when no one is waiting.
+	 */
+	GMutex *lock;
+	GCond *cond;
+	volatile gint n_waiting;
+};
+
+/* The budget for the pipeline this thread is working on.
+ */
+static GPrivate *vips_budget_key = NULL;
+
+/* Attach memory budgets to images with this.
+ */
+static GQuark vips__image_budget_quark = 0;
+
+/* The size of a block, as charged to a budget.
+ */
+#define VIPS_BUDGET_KB( S ) ((int) (((S) + 1023) / 1024))
+
+/* The tracked header: the size of the block, then the budget it is charged
+ * to, if any. 
+ */
+#define VIPS_TRACKED_SIZE( B ) (*((size_t *) (B)))
+#define VIPS_TRACKED_BUDGET( B ) \
+	(*((VipsBudget **) ((char *) (B) + sizeof( size_t ))))
+
 /**
  * VIPS_NEW:
  * @OBJ: allocate memory local to @OBJ, or %NULL for no auto-free
@@ -243,7 +291,8 @@ vips_tracked_free( void *s )
 	 * alignment rules are kept.
 	 */
 	s = (void *) ((char*)s - 16);
-	size = *((size_t*)s);
+	size = VIPS_TRACKED_SIZE( s );
+	vips__budget_uncharge( VIPS_TRACKED_BUDGET( s ), size );
 
 	g_mutex_lock( vips_tracked_mutex );
 
@@ -265,6 +314,14 @@ vips_tracked_free( void *s )
 static void
 vips_tracked_init_mutex( void )
 {
+#ifdef HAVE_PRIVATE_INIT
+	static GPrivate private = G_PRIVATE_INIT( NULL );
+
+	vips_budget_key = &private;
+#else
+	vips_budget_key = g_private_new( NULL );
+#endif
+
 	vips_tracked_mutex = vips_g_mutex_new(); 
 }
 
@@ -320,9 +377,11 @@ vips_tracked_malloc( size_t size )
                 return( NULL );
 	}
 
+	VIPS_TRACKED_SIZE( buf ) = size;
+	VIPS_TRACKED_BUDGET( buf ) = vips__budget_charge( size );
+
 	g_mutex_lock( vips_tracked_mutex );
 
-	*((size_t *)buf) = size;
 	buf = (void *) ((char *)buf + 16);
 
 	vips_tracked_mem += size;
@@ -429,6 +488,9 @@ vips_tracked_close( int fd )
  * friends. vips uses this figure to decide when to start dropping cache, see
  * #VipsOperation.
  *
+ * Pixel buffers held for reuse are not included, see 
+ * vips_buffer_arena_stats().
+ *
  * Returns: the number of currently allocated bytes
  */
 size_t
@@ -472,6 +534,25 @@ vips_tracked_get_mem_highwater( void )
 	return( mx );
 }
 
+/**
+ * vips_tracked_reset_mem_highwater:
+ *
+ * Reset the high-water mark to the number of bytes currently allocated, so
+ * vips_tracked_get_mem_highwater() will give the peak for the next part of 
+ * a program.
+ */
+void
+vips_tracked_reset_mem_highwater( void )
+{
+	vips_tracked_init(); 
+
+	g_mutex_lock( vips_tracked_mutex );
+
+	vips_tracked_mem_highwater = vips_tracked_mem;
+
+	g_mutex_unlock( vips_tracked_mutex );
+}
+
 /**
  * vips_tracked_get_allocs:
  *
@@ -519,3 +600,302 @@ vips_tracked_get_files( void )
 	return( n );
 }
 
+
+/* Make a budget of @limit bytes. 
+ */
+VipsBudget *
+vips__budget_new( size_t limit )
+{
+	VipsBudget *budget;
+
+	budget = g_new( VipsBudget, 1 );
+	budget->ref_count = 1;
+	budget->limit = VIPS_MAX( 1, VIPS_BUDGET_KB( limit ) );
+	budget->used = 0;
+	budget->lock = vips_g_mutex_new();
+	budget->cond = vips_g_cond_new();
+	budget->n_waiting = 0;
+
+	return( budget );
+}
+
+VipsBudget *
+vips__budget_ref( VipsBudget *budget )
+{
+	g_atomic_int_inc( &budget->ref_count );
+
+	return( budget );
+}
+
+void
+vips__budget_unref( VipsBudget *budget )
+{
+	if( g_atomic_int_dec_and_test( &budget->ref_count ) ) {
+		VIPS_FREEF( vips_g_mutex_free, budget->lock );
+		VIPS_FREEF( vips_g_cond_free, budget->cond );
+		g_free( budget );
+	}
+}
+
+/* Set the budget for the pipeline this thread is working on, or NULL.
+ */
+void
+vips__budget_set_current( VipsBudget *budget )
+{
+	vips_tracked_init(); 
+
+	g_private_set( vips_budget_key, budget );
+}
+
+VipsBudget *
+vips__budget_get_current( void )
+{
+	vips_tracked_init(); 
+
+	return( (VipsBudget *) g_private_get( vips_budget_key ) );
+}
+
+/* Charge @size bytes to this thread's current budget. Return the budget we
+ * charged, with a ref, or NULL if there's no current budget.
+ */
+VipsBudget *
+vips__budget_charge( size_t size )
+{
+	VipsBudget *budget;
+
+	if( !vips_budget_key ||
+		!(budget = g_private_get( vips_budget_key )) )
+		return( NULL );
+
+	g_atomic_int_add( &budget->used, VIPS_BUDGET_KB( size ) );
+
+	return( vips__budget_ref( budget ) );
+}
+
+/* Give back a charge made by vips__budget_charge(). @budget can be NULL.
+ */
+void
+vips__budget_uncharge( VipsBudget *budget, size_t size )
+{
+	if( budget ) {
+		g_atomic_int_add( &budget->used, -VIPS_BUDGET_KB( size ) );
+
+		/* A waiter bumps n_waiting before it tests the budget, so
+		 * either it sees the memory we just gave back, or we see it.
+		 */
+		if( g_atomic_int_get( &budget->n_waiting ) > 0 ) 
+			vips__budget_wake( budget );
+
+		vips__budget_unref( budget );
+	}
+}
+
+/* TRUE if @budget has been spent.
+ */
+gboolean
+vips__budget_over( VipsBudget *budget )
+{
+	return( g_atomic_int_get( &budget->used ) > budget->limit );
+}
+
+/* Block until @budget has some room, or until @done returns TRUE. @done is
+ * tested with the budget lock held, so anything that might change its 
+ * result must call vips__budget_wake() afterwards.
+ */
+void
+vips__budget_wait( VipsBudget *budget, VipsBudgetDoneFn done, void *a )
+{
+	g_mutex_lock( budget->lock );
+	g_atomic_int_inc( &budget->n_waiting );
+
+	while( vips__budget_over( budget ) &&
+		!done( a ) )
+		g_cond_wait( budget->cond, budget->lock );
+
+	g_atomic_int_add( &budget->n_waiting, -1 );
+	g_mutex_unlock( budget->lock );
+}
+
+/* Wake everyone waiting in vips__budget_wait() so they test again.
+ */
+void
+vips__budget_wake( VipsBudget *budget )
+{
+	g_mutex_lock( budget->lock );
+	g_cond_broadcast( budget->cond );
+	g_mutex_unlock( budget->lock );
+}
+
+/* TRUE if allocating @size more bytes would break this thread's current 
+ * budget. 
+ */
+gboolean
+vips__budget_would_exceed( size_t size )
+{
+	VipsBudget *budget;
+
+	if( !(budget = vips__budget_get_current()) )
+		return( FALSE );
+
+	return( g_atomic_int_get( &budget->used ) + 
+		(gint64) VIPS_BUDGET_KB( size ) > budget->limit );
+}
+
+/* Pixel buffers are recycled between pipelines. The buffer system parks 
+ * blocks it is keeping for reuse: they are no longer charged to a budget
+ * or counted by vips_tracked_get_mem(), so the operation cache doesn't
+ * see them as live memory. Unparking charges the block to the current 
+ * pipeline and counts it again. 
+ *
+ * A parked block must be unparked before vips_tracked_free().
+ */
+void
+vips__tracked_park( void *s )
+{
+	size_t size;
+
+	s = (void *) ((char *) s - 16);
+	size = VIPS_TRACKED_SIZE( s );
+
+	vips__budget_uncharge( VIPS_TRACKED_BUDGET( s ), size );
+	VIPS_TRACKED_BUDGET( s ) = NULL;
+
+	g_mutex_lock( vips_tracked_mutex );
+	vips_tracked_mem -= size;
+	vips_tracked_allocs -= 1;
+	g_mutex_unlock( vips_tracked_mutex );
+}
+
+void
+vips__tracked_unpark( void *s )
+{
+	size_t size;
+
+	s = (void *) ((char *) s - 16);
+	size = VIPS_TRACKED_SIZE( s );
+
+	VIPS_TRACKED_BUDGET( s ) = vips__budget_charge( size );
+
+	g_mutex_lock( vips_tracked_mutex );
+	vips_tracked_mem += size;
+	if( vips_tracked_mem > vips_tracked_mem_highwater ) 
+		vips_tracked_mem_highwater = vips_tracked_mem;
+	vips_tracked_allocs += 1;
+	g_mutex_unlock( vips_tracked_mutex );
+}
+
+static void
+vips_image_budget_free( size_t *budget )
+{
+	g_free( budget );
+}
+
+/**
+ * vips_image_set_memory_budget: (method)
+ * @image: image to set the budget on
+ * @budget: the budget in bytes, or 0 for no budget
+ *
+ * Set a memory budget for pipelines which compute @image. This can be 
+ * useful on servers, where a single large request could otherwise use all
+ * available memory.
+ *
+ * Pixel buffers and other tracked memory allocated by the threads
+ * computing the pipeline are charged to the budget. Once it is spent, 
+ * worker threads stop taking new work until memory is released, though at 
+ * least one thread always keeps going. Images which would need to be 
+ * decompressed to memory, or copied to memory by vips_image_copy_memory(), 
+ * go to a temporary disc file instead if they would break the budget. 
+ *
+ * If several images in a pipeline have budgets, the smallest is used.
+ *
+ * See also: vips_image_get_memory_budget(), vips_tracked_get_mem().
+ */
+void
+vips_image_set_memory_budget( VipsImage *image, size_t budget )
+{
+	size_t *value;
+
+	if( !vips__image_budget_quark )
+		vips__image_budget_quark = 
+			g_quark_from_static_string( "vips-memory-budget" );
+
+	value = NULL;
+	if( budget > 0 ) {
+		value = g_new( size_t, 1 );
+		*value = budget;
+	}
+
+	g_object_set_qdata_full( G_OBJECT( image ), vips__image_budget_quark,
+		value, (GDestroyNotify) vips_image_budget_free );
+}
+
+/**
+ * vips_image_get_memory_budget: (method)
+ * @image: image to get the budget from
+ *
+ * Get the memory budget set on @image with vips_image_set_memory_budget().
+ *
+ * Returns: the budget in bytes, or 0 for no budget.
+ */
+size_t
+vips_image_get_memory_budget( VipsImage *image )
+{
+	size_t *value;
+
+	if( !vips__image_budget_quark ||
+		!(value = g_object_get_qdata( G_OBJECT( image ), 
+			vips__image_budget_quark )) )
+		return( 0 );
+
+	return( *value );
+}
+
+static void *
+vips_image_budget_min( VipsImage *image, size_t *budget, void *b )
+{
+	size_t image_budget;
+
+	if( (image_budget = vips_image_get_memory_budget( image )) )
+		*budget = *budget ? 
+			VIPS_MIN( *budget, image_budget ) : image_budget;
+
+	return( NULL );
+}
+
+/* The budget of a pipeline is the smallest budget set on any image in it, 
+ * or 0 for no budget.
+ */
+size_t
+vips__image_get_pipeline_budget( VipsImage *image )
+{
+	size_t budget;
+
+	budget = 0;
+	if( vips__image_budget_quark )
+		(void) vips__link_map( image, TRUE, 
+			(VipsSListMap2Fn) vips_image_budget_min, &budget, NULL );
+
+	return( budget );
+}
+
+/* TRUE if allocating @size more bytes for @image would break the current 
+ * budget, or the budget of any pipeline @image feeds. Images are often
+ * made (and loaded) before any worker has a current budget, so we must 
+ * look at the pipeline as well.
+ */
+gboolean
+vips__budget_would_exceed_image( VipsImage *image, size_t size )
+{
+	size_t budget;
+
+	if( vips__budget_would_exceed( size ) )
+		return( TRUE );
+
+	budget = 0;
+	if( vips__image_budget_quark )
+		(void) vips__link_map( image, FALSE, 
+			(VipsSListMap2Fn) vips_image_budget_min, &budget, NULL );
+
+	return( budget && 
+		size > budget );
+}
@@ -211,9 +211,12 @@ static guint vips_object_signals[SIG_LAST] = { 0 };
 
 int _vips__argument_id = 1;
 
-/* Keep a cache of nickname -> GType lookups.
+/* Keep a cache of basename -> nickname -> GType lookups. We fill this as
+ * we search, since building it in one go would mean initialising every
+ * class.
  */
 static GHashTable *vips__object_nickname_table = NULL;
+static GMutex *vips__object_nickname_lock = NULL;
 
 G_DEFINE_ABSTRACT_TYPE( VipsObject, vips_object, G_TYPE_OBJECT );
 
@@ -361,6 +364,17 @@ vips_object_build( VipsObject *object )
 	return( result );
 }
 
+/* Mark an object as built without running its build method. The disc cache
+ * uses this after setting the outputs of an operation from a saved result.
+ */
+int
+vips__object_set_built( VipsObject *object )
+{
+	object->constructed = TRUE;
+
+	return( vips_object_postbuild( object ) );
+}
+
 /**
  * vips_object_summary_class: (skip)
  * @klass: class to summarise
@@ -2638,6 +2652,8 @@ vips_type_map_all( GType base, VipsTypeMapFn fn, void *a )
 {
 	void *result;
 
+	vips__operations_init();
+
 	if( !(result = fn( base, a )) )
 		result = vips_type_map( base, 
 			(VipsTypeMap2Fn) vips_type_map_all, fn, a );
@@ -2663,6 +2679,8 @@ vips_class_map_all( GType type, VipsClassMapFn fn, void *a )
 {
 	void *result;
 
+	vips__operations_init();
+
 	/* Avoid abstract classes. Use type_map_all for them.
 	 */
 	if( !G_TYPE_IS_ABSTRACT( type ) ) {
@@ -2730,6 +2748,8 @@ vips_class_find( const char *basename, const char *nickname )
 	VipsObjectClass *class;
 	GType base;
 
+	vips__operations_init();
+
 	if( !(base = g_type_from_name( classname )) )
 		return( NULL );
 	class = vips_class_map_all( base, 
@@ -2742,50 +2762,26 @@ vips_class_find( const char *basename, const char *nickname )
  * GINT_TO_POINTER() since GType is 64 bits on some platforms.
  */
 typedef struct _NicknameGType {
-	const char *nickname;
+	char *nickname;
 	GType type;
-	gboolean duplicate;
 } NicknameGType;
 
-static void *
-vips_class_add_hash( VipsObjectClass *class, GHashTable *table )
+static void
+vips_nickname_gtype_free( NicknameGType *hit )
 {
-	GType type = G_OBJECT_CLASS_TYPE( class );
-	NicknameGType *hit;
-
-	hit = (NicknameGType *) 
-		g_hash_table_lookup( table, (void *) class->nickname );
-
-	/* If this is not a unique name, mark as a duplicate. In this case
-	 * we'll need to fall back to a search.
-	 */
-	if( hit ) 
-		hit->duplicate = TRUE;
-	else {
-		hit = g_new( NicknameGType, 1 );
-		hit->nickname = class->nickname;
-		hit->type = type;
-		hit->duplicate = FALSE;
-		g_hash_table_insert( table, (void *) hit->nickname, hit );
-	}
-
-	return( NULL ); 
+	VIPS_FREE( hit->nickname );
+	VIPS_FREE( hit );
 }
 
-static void 
-vips_class_build_hash( void )
+static void *
+vips_class_init_hash( void *data )
 {
-	GType base;
-
-	vips__object_nickname_table = 
-		g_hash_table_new( g_str_hash, g_str_equal );
+	vips__object_nickname_lock = vips_g_mutex_new();
+	vips__object_nickname_table = g_hash_table_new_full( 
+		g_str_hash, g_str_equal, 
+		g_free, (GDestroyNotify) g_hash_table_destroy );
 
-	base = g_type_from_name( "VipsObject" );
-	g_assert( base ); 
-
-	vips_class_map_all( base, 
-		(VipsClassMapFn) vips_class_add_hash, 
-		(void *) vips__object_nickname_table );
+	return( NULL );
 }
 
 /**
@@ -2797,7 +2793,9 @@ vips_class_build_hash( void )
  * @nickname matches, or 0 for not found. 
  * If @basename is NULL, the whole of #VipsObject is searched.
  *
- * This function uses a cache, so it should be quick. 
+ * This function uses a cache, so it should be quick. Operation classes are
+ * registered on the first search, and each class is only initialised when a
+ * search first reaches it.
  *
  * See also: vips_class_find()
  *
@@ -2810,32 +2808,44 @@ vips_type_find( const char *basename, const char *nickname )
 
 	const char *classname = basename ? basename : "VipsObject";
 
+	GHashTable *table;
 	NicknameGType *hit;
-	GType base;
 	GType type;
 
-	g_once( &once, (GThreadFunc) vips_class_build_hash, NULL ); 
+	g_once( &once, (GThreadFunc) vips_class_init_hash, NULL ); 
 
-	hit = (NicknameGType *) 
-		g_hash_table_lookup( vips__object_nickname_table, 
-			(void *) nickname );
-
-	/* We must only search below basename ... check that the cache hit is
-	 * in the right part of the tree.
-	 */
-	if( !(base = g_type_from_name( classname )) )
-		return( 0 );
-	if( hit &&
-		!hit->duplicate &&
-		g_type_is_a( hit->type, base ) ) 
+	g_mutex_lock( vips__object_nickname_lock );
+	type = 0;
+	if( (table = g_hash_table_lookup( vips__object_nickname_table, 
+		classname )) &&
+		(hit = g_hash_table_lookup( table, nickname )) )
 		type = hit->type;
-	else {
+	g_mutex_unlock( vips__object_nickname_lock );
+
+	if( !type ) {
 		const VipsObjectClass *class;
 
+		/* Search outside the lock, we may need to init some classes.
+		 */
 		if( !(class = vips_class_find( basename, nickname )) )
 			return( 0 );
-
 		type = G_OBJECT_CLASS_TYPE( class );
+
+		g_mutex_lock( vips__object_nickname_lock );
+		if( !(table = g_hash_table_lookup( 
+			vips__object_nickname_table, classname )) ) {
+			table = g_hash_table_new_full( g_str_hash, g_str_equal,
+				NULL, (GDestroyNotify) vips_nickname_gtype_free );
+			g_hash_table_insert( vips__object_nickname_table, 
+				g_strdup( classname ), table );
+		}
+		if( !g_hash_table_lookup( table, nickname ) ) {
+			hit = g_new( NicknameGType, 1 );
+			hit->nickname = g_strdup( nickname );
+			hit->type = type;
+			g_hash_table_insert( table, hit->nickname, hit );
+		}
+		g_mutex_unlock( vips__object_nickname_lock );
 	}
 
 	return( type );
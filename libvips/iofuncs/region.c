@@ -43,6 +43,14 @@
  * 	- move on top of VipsObject, rename as VipsRegion
  * 23/2/17
  * 	- multiply transparent images through alpha in vips_region_shrink()
+ * 16/10/17
+ * 	- time generate in a profile gate named after the operation
+ * 	- count tiles for each class of operation
+ * 	- add vips_accounting_set(): time and pixels for each image
+ * 	- sum accounting per thread, merge when workers finish
+ * 	- time generates for the greedy-dual-size cache too
+ * 	- flush per-thread accounting on thread exit, and after each 
+ * 	  top-level generate outside the worker threads
  */
 
 /*
@@ -1373,6 +1381,190 @@ vips_region_shrink( VipsRegion *from, VipsRegion *to, const VipsRect *target )
 	return( 0 );
 }
 
+/* Set by vips_accounting_set(), --vips-accounting and VIPS_ACCOUNTING.
+ */
+gboolean vips__accounting = FALSE;
+
+/* With accounting on, each vips_region_generate() on a thread's stack has 
+ * one of these, so we can take the time spent in generates for input images
+ * away from the time for this image.
+ */
+typedef struct _VipsRegionFrame {
+	struct _VipsRegionFrame *parent;
+	gint64 child_time;
+} VipsRegionFrame;
+
+static GPrivate *vips_region_frame_key = NULL;
+
+/* Costs are summed per thread, so workers don't contend for a lock on every 
+ * generate. Each thread has a table of these indexed by image, merged into
+ * the VipsImagePixels on each image by vips__region_account_flush(). 
+ *
+ * The table holds a ref to each image, so it must not outlive the work: 
+ * workers flush as they leave a pipeline, other threads flush at the end of 
+ * each top-level generate, and the table is flushed on thread exit too.
+ */
+typedef struct _VipsRegionAccount {
+	const char *nickname;
+	gint64 npels;
+	gint64 time;
+} VipsRegionAccount;
+
+static GPrivate *vips_region_account_key = NULL;
+
+static void vips_region_account_free( GHashTable *table );
+
+/* Called from vips_init().
+ */
+void
+vips__region_init( void )
+{
+	/* We need to work with the pre-2.32 threading API.
+	 */
+#ifdef HAVE_PRIVATE_INIT
+	static GPrivate private = { 0 }; 
+	static GPrivate account_private = 
+		G_PRIVATE_INIT( (GDestroyNotify) vips_region_account_free );
+
+	vips_region_frame_key = &private;
+	vips_region_account_key = &account_private;
+#else
+	if( !vips_region_frame_key ) 
+		vips_region_frame_key = g_private_new( NULL ); 
+	if( !vips_region_account_key ) 
+		vips_region_account_key = g_private_new( 
+			(GDestroyNotify) vips_region_account_free ); 
+#endif
+
+	if( g_getenv( "VIPS_ACCOUNTING" ) )
+		vips_accounting_set( TRUE );
+}
+
+/**
+ * vips_accounting_set:
+ * @accounting: %TRUE to turn on accounting
+ *
+ * With accounting on, libvips records the time spent computing each image 
+ * in a pipeline, not counting time spent computing its inputs, and the 
+ * number of pixels computed. After each sink completes, for example 
+ * vips_image_write_to_file(), it prints a report to stderr listing the
+ * operations in the pipeline, most costly first.
+ *
+ * Times are summed over all threads. The counts are reset after each 
+ * report.
+ *
+ * This can be turned on and off at any time. You can also set it with 
+ * `--vips-accounting` and `VIPS_ACCOUNTING`.
+ */
+void
+vips_accounting_set( gboolean accounting )
+{
+	vips__accounting = accounting;
+}
+
+static gint64
+vips_region_get_time( void )
+{
+#ifdef HAVE_MONOTONIC_TIME
+	return( g_get_monotonic_time() );  
+#else
+	GTimeVal time;
+
+	g_get_current_time( &time );
+
+	return( (gint64) time.tv_sec * G_USEC_PER_SEC + time.tv_usec ); 
+#endif
+}
+
+/* Add to this thread's counts for the image a region is on. We hold a ref 
+ * to the image until the counts are merged.
+ */
+static void
+vips_region_account( VipsRegion *region, const char *nickname, 
+	gint64 npels, gint64 time )
+{
+	VipsImage *image = region->im;
+
+	GHashTable *table;
+	VipsRegionAccount *account;
+
+	if( !(table = g_private_get( vips_region_account_key )) ) {
+		table = g_hash_table_new_full( g_direct_hash, g_direct_equal,
+			(GDestroyNotify) g_object_unref, 
+			(GDestroyNotify) g_free );
+		g_private_set( vips_region_account_key, table );
+	}
+
+	if( !(account = g_hash_table_lookup( table, image )) ) {
+		account = g_new0( VipsRegionAccount, 1 );
+		g_object_ref( image );
+		g_hash_table_insert( table, image, account );
+	}
+
+	if( !account->nickname )
+		account->nickname = nickname; 
+	account->npels += npels;
+	account->time += time;
+}
+
+static void
+vips_region_account_merge( VipsImage *image, VipsRegionAccount *account, 
+	void *b )
+{
+	VipsImagePixels *pixels;
+
+	if( !(pixels = g_object_get_qdata( G_OBJECT( image ), 
+		vips__image_pixels_quark )) ) {
+		pixels = g_new0( VipsImagePixels, 1 );
+		g_object_set_qdata_full( G_OBJECT( image ), 
+			vips__image_pixels_quark, 
+			pixels, (GDestroyNotify) g_free ); 
+	}
+
+	if( !pixels->tpels )
+		pixels->tpels = VIPS_IMAGE_N_PELS( image ); 
+	if( !pixels->nickname )
+		pixels->nickname = account->nickname; 
+	pixels->npels += account->npels;
+	pixels->time += account->time;
+	pixels->total_time += account->time;
+}
+
+/* Merge a table of costs into the totals on each image, then drop it and 
+ * the refs it holds. This is also the destroy notify for the table, so 
+ * threads which exit without flushing don't pin their images.
+ */
+static void
+vips_region_account_free( GHashTable *table )
+{
+	g_mutex_lock( vips__global_lock );
+	g_hash_table_foreach( table, 
+		(GHFunc) vips_region_account_merge, NULL );
+	g_mutex_unlock( vips__global_lock );
+
+	/* Drop our refs outside the lock, since image dispose can take it.
+	 */
+	g_hash_table_destroy( table );
+}
+
+/* Merge this thread's costs into the totals on each image. Workers call this
+ * as they finish a pipeline, and the report calls it for the main thread.
+ */
+void
+vips__region_account_flush( void )
+{
+	GHashTable *table;
+
+	if( !vips_region_account_key ||
+		!(table = g_private_get( vips_region_account_key )) )
+		return;
+
+	/* Plain set, so the destroy notify doesn't run as well.
+	 */
+	g_private_set( vips_region_account_key, NULL );
+	vips_region_account_free( table );
+}
+
 /* Generate into a region. 
  */
 static int
@@ -1381,16 +1573,86 @@ vips_region_generate( VipsRegion *reg )
 	VipsImage *im = reg->im;
 
 	gboolean stop;
+	VipsClassStats *class_stats;
+	const char *nickname;
+	gboolean accounting;
+	VipsRegionFrame frame;
+	gint64 start;
+	int result;
 
         /* Start new sequence, if necessary.
          */
         if( vips__region_start( reg ) )
 		return( -1 );
 
+	/* If we know the operation which made this image, count the tile 
+	 * and time the generate in a gate named after it.
+	 */
+	nickname = NULL;
+	if( (class_stats = g_object_get_qdata( G_OBJECT( im ), 
+		vips__image_class_quark )) ) {
+		vips__stats_class_tile( class_stats );
+
+		if( vips__thread_profile ) {
+			nickname = class_stats->nickname;
+			vips__thread_gate_start( nickname );
+		}
+	}
+
+	/* Accounting can be switched on and off at any moment, so take a
+	 * copy. The greedy-dual-size cache needs compute times too.
+	 */
+	accounting = vips__accounting || 
+		vips_cache_get_policy() == VIPS_CACHE_POLICY_GDS;
+	start = 0;
+	if( accounting ) {
+		frame.parent = g_private_get( vips_region_frame_key );
+		frame.child_time = 0;
+		g_private_set( vips_region_frame_key, &frame );
+		start = vips_region_get_time();
+	}
+
 	/* Ask for evaluation.
 	 */
 	stop = FALSE;
-	if( im->generate_fn( reg, reg->seq, im->client1, im->client2, &stop ) )
+	result = im->generate_fn( reg, reg->seq, 
+		im->client1, im->client2, &stop );
+
+	if( accounting ) {
+		gint64 elapsed = vips_region_get_time() - start;
+		gint64 npels;
+
+		g_private_set( vips_region_frame_key, frame.parent );
+		if( frame.parent )
+			frame.parent->child_time += elapsed;
+
+#ifdef DEBUG_LEAK
+		/* Operations count their own pixels with 
+		 * VIPS_COUNT_PIXELS().
+		 */
+		npels = 0;
+#else /*!DEBUG_LEAK*/
+		npels = result ? 
+			0 : (gint64) reg->valid.width * reg->valid.height;
+#endif /*DEBUG_LEAK*/
+
+		vips_region_account( reg, 
+			class_stats ? class_stats->nickname : NULL, 
+			npels, elapsed - frame.child_time );
+
+		/* Workers flush when they leave the pipeline. Other 
+		 * threads might never sink, so they flush as each 
+		 * top-level generate finishes.
+		 */
+		if( !frame.parent &&
+			!vips_thread_isworker() )
+			vips__region_account_flush();
+	}
+
+	if( nickname )
+		vips__thread_gate_stop( nickname );
+
+	if( result )
 		return( -1 );
 	if( stop ) {
 		vips_error( "vips_region_generate", 
@@ -1749,20 +2011,103 @@ vips_region_dump_all( void )
 }
 #endif /*VIPS_DEBUG*/
 
-#ifdef DEBUG_LEAK
 void
 vips__region_count_pixels( VipsRegion *region, const char *nickname )
 {
-	VipsImage *image = region->im;
-	VipsImagePixels *pixels = g_object_get_qdata( G_OBJECT( image ), 
-		vips__image_pixels_quark ); 
+	vips_region_account( region, nickname, 
+		(gint64) region->valid.width * region->valid.height, 0 );
+}
 
-	g_mutex_lock( vips__global_lock );
-	if( !pixels->tpels )
-		pixels->tpels = VIPS_IMAGE_N_PELS( image ); 
-	if( !pixels->nickname )
-		pixels->nickname = nickname; 
-	pixels->npels += region->valid.width * region->valid.height;
-	g_mutex_unlock( vips__global_lock );
+/* One line in the accounting report.
+ */
+typedef struct _VipsRegionCost {
+	const char *nickname;
+	char *filename;
+	gint64 npels;
+	gint64 time;
+} VipsRegionCost;
+
+static void *
+vips_region_report_cb( VipsImage *image, GArray *costs, void *b )
+{
+	VipsImagePixels *pixels;
+
+	if( (pixels = g_object_get_qdata( G_OBJECT( image ), 
+		vips__image_pixels_quark )) ) {
+		VipsRegionCost cost;
+
+		g_mutex_lock( vips__global_lock );
+		cost.nickname = pixels->nickname;
+		cost.npels = pixels->npels;
+		cost.time = pixels->time;
+		pixels->npels = 0;
+		pixels->time = 0;
+		g_mutex_unlock( vips__global_lock );
+
+		if( cost.npels > 0 ||
+			cost.time > 0 ) {
+			cost.filename = g_strdup( image->filename );
+			g_array_append_val( costs, cost );
+		}
+	}
+
+	return( NULL );
+}
+
+static int
+vips_region_report_compare( const void *a, const void *b )
+{
+	const VipsRegionCost *x = (const VipsRegionCost *) a;
+	const VipsRegionCost *y = (const VipsRegionCost *) b;
+
+	return( x->time < y->time ? 1 : x->time > y->time ? -1 : 0 );
+}
+
+/* A sink on @image has finished: print the costs for the images in the
+ * pipeline and reset them. See vips_accounting_set().
+ */
+void
+vips__region_report( VipsImage *image )
+{
+	GArray *costs;
+	gint64 total;
+	guint i;
+
+	/* The workers have all flushed by now, add anything the calling 
+	 * thread computed.
+	 */
+	vips__region_account_flush();
+
+	costs = g_array_new( FALSE, FALSE, sizeof( VipsRegionCost ) );
+	vips__link_map( image, TRUE, 
+		(VipsSListMap2Fn) vips_region_report_cb, costs, NULL );
+	g_array_sort( costs, vips_region_report_compare );
+
+	total = 0;
+	for( i = 0; i < costs->len; i++ ) 
+		total += g_array_index( costs, VipsRegionCost, i ).time;
+
+	if( costs->len > 0 ) {
+		fprintf( stderr, "vips: costs for %s, %.3fs thread time\n", 
+			image->filename, (double) total / G_USEC_PER_SEC );
+		fprintf( stderr, "  %6s %9s %12s  %s\n", 
+			"self", "time", "pixels", "operation" );
+	}
+
+	for( i = 0; i < costs->len; i++ ) {
+		VipsRegionCost *cost = &g_array_index( costs, 
+			VipsRegionCost, i );
+
+		fprintf( stderr, "  %5.1f%% %8.3fs %12" G_GINT64_FORMAT 
+			"  %s (%s)\n",
+			total > 0 ? 100.0 * cost->time / total : 0.0, 
+			(double) cost->time / G_USEC_PER_SEC, 
+			cost->npels, 
+			cost->nickname ? cost->nickname : "unknown",
+			cost->filename ? cost->filename : "" );
+
+		g_free( cost->filename );
+	}
+
+	g_array_free( costs, TRUE );
 }
-#endif /*DEBUG_LEAK*/
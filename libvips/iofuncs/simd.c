@@ -0,0 +1,404 @@
+/* native vector kernels, picked at runtime for the host CPU
+ *
+ * 16/10/17
+ * 	- first version
+ * 	- convf kernels sum in double, like the C path
+ */
+
+/*
+
+    This file is part of VIPS.
+
+    VIPS is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301  USA
+
+ */
+
+/*
+
+    These files are distributed with VIPS - http://www.vips.ecs.soton.ac.uk
+
+ */
+
+/*
+#define DEBUG
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /*HAVE_CONFIG_H*/
+#include <vips/intl.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <vips/vips.h>
+#include <vips/vector.h>
+#include <vips/internal.h>
+#include <vips/thread.h>
+
+/* We need per-function target attributes to build AVX kernels without
+ * compiling the whole library for AVX. gcc 5 is the first to know about
+ * AVX-512 in __builtin_cpu_supports().
+ */
+#if (defined(__x86_64__) || defined(__i386__)) && \
+	(defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5))
+#define HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+/* Always there on aarch64. 32-bit ARM NEON has no float divide, so we skip
+ * it.
+ */
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#define HAVE_NEON_SIMD
+#include <arm_neon.h>
+#endif
+
+/* Cleared by the command-line --vips-nosimd switch and the VIPS_NOSIMD env
+ * var.
+ */
+gboolean vips__simd_enabled = TRUE;
+
+/* The features the host CPU has.
+ */
+static VipsSimdFeature vips_simd_features = 0;
+
+/* Kernel name -> the best VipsSimdKernel registered so far.
+ */
+static GHashTable *vips_simd_kernels = NULL;
+
+typedef struct _VipsSimdKernel {
+	const char *name;
+	VipsSimdFeature feature;
+	void *fn;
+} VipsSimdKernel;
+
+/* Kernels share a scalar tail. This must match CONV_FLOAT in convf.c
+ * exactly: sum in double, then scale and offset in double. The vector 
+ * versions widen each float to double and do the same operations in the 
+ * same order, so all paths give the same result.
+ */
+static void
+vips_simd_convf_c( float *out, const float *in, const int *offsets,
+	const double *coeff, int nnz, int n, double scale, double offset )
+{
+	int x, i;
+
+	for( x = 0; x < n; x++ ) {
+		double sum;
+
+		sum = 0;
+		for( i = 0; i < nnz; i++ )
+			sum += coeff[i] * in[offsets[i] + x];
+
+		out[x] = (sum / scale) + offset;
+	}
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse4.1")))
+static void
+vips_simd_convf_sse41( float *out, const float *in, const int *offsets,
+	const double *coeff, int nnz, int n, double scale, double offset )
+{
+	const __m128d vscale = _mm_set1_pd( scale );
+	const __m128d voffset = _mm_set1_pd( offset );
+
+	int x, i;
+
+	for( x = 0; x + 4 <= n; x += 4 ) {
+		__m128d lo, hi;
+
+		lo = _mm_setzero_pd();
+		hi = _mm_setzero_pd();
+		for( i = 0; i < nnz; i++ ) {
+			__m128d c = _mm_set1_pd( coeff[i] );
+			__m128 v = _mm_loadu_ps( in + offsets[i] + x );
+
+			lo = _mm_add_pd( lo, 
+				_mm_mul_pd( c, _mm_cvtps_pd( v ) ) );
+			hi = _mm_add_pd( hi, 
+				_mm_mul_pd( c, _mm_cvtps_pd( 
+					_mm_movehl_ps( v, v ) ) ) );
+		}
+
+		lo = _mm_add_pd( _mm_div_pd( lo, vscale ), voffset );
+		hi = _mm_add_pd( _mm_div_pd( hi, vscale ), voffset );
+		_mm_storeu_ps( out + x, 
+			_mm_movelh_ps( _mm_cvtpd_ps( lo ), _mm_cvtpd_ps( hi ) ) );
+	}
+
+	vips_simd_convf_c( out + x, in + x, offsets,
+		coeff, nnz, n - x, scale, offset );
+}
+
+__attribute__((target("avx2")))
+static void
+vips_simd_convf_avx2( float *out, const float *in, const int *offsets,
+	const double *coeff, int nnz, int n, double scale, double offset )
+{
+	const __m256d vscale = _mm256_set1_pd( scale );
+	const __m256d voffset = _mm256_set1_pd( offset );
+
+	int x, i;
+
+	for( x = 0; x + 8 <= n; x += 8 ) {
+		__m256d lo, hi;
+
+		lo = _mm256_setzero_pd();
+		hi = _mm256_setzero_pd();
+		for( i = 0; i < nnz; i++ ) {
+			__m256d c = _mm256_set1_pd( coeff[i] );
+			const float *p = in + offsets[i] + x;
+
+			lo = _mm256_add_pd( lo, _mm256_mul_pd( c, 
+				_mm256_cvtps_pd( _mm_loadu_ps( p ) ) ) );
+			hi = _mm256_add_pd( hi, _mm256_mul_pd( c, 
+				_mm256_cvtps_pd( _mm_loadu_ps( p + 4 ) ) ) );
+		}
+
+		lo = _mm256_add_pd( _mm256_div_pd( lo, vscale ), voffset );
+		hi = _mm256_add_pd( _mm256_div_pd( hi, vscale ), voffset );
+		_mm_storeu_ps( out + x, _mm256_cvtpd_ps( lo ) );
+		_mm_storeu_ps( out + x + 4, _mm256_cvtpd_ps( hi ) );
+	}
+
+	vips_simd_convf_c( out + x, in + x, offsets,
+		coeff, nnz, n - x, scale, offset );
+}
+
+__attribute__((target("avx512f")))
+static void
+vips_simd_convf_avx512( float *out, const float *in, const int *offsets,
+	const double *coeff, int nnz, int n, double scale, double offset )
+{
+	const __m512d vscale = _mm512_set1_pd( scale );
+	const __m512d voffset = _mm512_set1_pd( offset );
+
+	int x, i;
+
+	for( x = 0; x + 16 <= n; x += 16 ) {
+		__m512d lo, hi;
+
+		lo = _mm512_setzero_pd();
+		hi = _mm512_setzero_pd();
+		for( i = 0; i < nnz; i++ ) {
+			__m512d c = _mm512_set1_pd( coeff[i] );
+			const float *p = in + offsets[i] + x;
+
+			lo = _mm512_add_pd( lo, _mm512_mul_pd( c, 
+				_mm512_cvtps_pd( _mm256_loadu_ps( p ) ) ) );
+			hi = _mm512_add_pd( hi, _mm512_mul_pd( c, 
+				_mm512_cvtps_pd( _mm256_loadu_ps( p + 8 ) ) ) );
+		}
+
+		lo = _mm512_add_pd( _mm512_div_pd( lo, vscale ), voffset );
+		hi = _mm512_add_pd( _mm512_div_pd( hi, vscale ), voffset );
+		_mm256_storeu_ps( out + x, _mm512_cvtpd_ps( lo ) );
+		_mm256_storeu_ps( out + x + 8, _mm512_cvtpd_ps( hi ) );
+	}
+
+	vips_simd_convf_c( out + x, in + x, offsets,
+		coeff, nnz, n - x, scale, offset );
+}
+#endif /*HAVE_X86_SIMD*/
+
+#ifdef HAVE_NEON_SIMD
+static void
+vips_simd_convf_neon( float *out, const float *in, const int *offsets,
+	const double *coeff, int nnz, int n, double scale, double offset )
+{
+	const float64x2_t vscale = vdupq_n_f64( scale );
+	const float64x2_t voffset = vdupq_n_f64( offset );
+
+	int x, i;
+
+	for( x = 0; x + 4 <= n; x += 4 ) {
+		float64x2_t lo, hi;
+
+		lo = vdupq_n_f64( 0 );
+		hi = vdupq_n_f64( 0 );
+		for( i = 0; i < nnz; i++ ) {
+			float32x4_t v = vld1q_f32( in + offsets[i] + x );
+
+			lo = vaddq_f64( lo, vmulq_n_f64( 
+				vcvt_f64_f32( vget_low_f32( v ) ), coeff[i] ) );
+			hi = vaddq_f64( hi, vmulq_n_f64( 
+				vcvt_high_f64_f32( v ), coeff[i] ) );
+		}
+
+		lo = vaddq_f64( vdivq_f64( lo, vscale ), voffset );
+		hi = vaddq_f64( vdivq_f64( hi, vscale ), voffset );
+		vst1q_f32( out + x, 
+			vcvt_high_f32_f64( vcvt_f32_f64( lo ), hi ) );
+	}
+
+	vips_simd_convf_c( out + x, in + x, offsets,
+		coeff, nnz, n - x, scale, offset );
+}
+#endif /*HAVE_NEON_SIMD*/
+
+static VipsSimdFeature
+vips_simd_detect( void )
+{
+	VipsSimdFeature features;
+
+	features = 0;
+
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if( __builtin_cpu_supports( "sse4.1" ) )
+		features |= VIPS_SIMD_SSE41;
+	if( __builtin_cpu_supports( "avx2" ) )
+		features |= VIPS_SIMD_AVX2;
+	if( __builtin_cpu_supports( "avx512f" ) )
+		features |= VIPS_SIMD_AVX512;
+#endif /*HAVE_X86_SIMD*/
+
+#ifdef HAVE_NEON_SIMD
+	features |= VIPS_SIMD_NEON;
+#endif /*HAVE_NEON_SIMD*/
+
+	return( features );
+}
+
+/* Called from vips_init(): find what the CPU can do and pick the best
+ * version of each of our kernels.
+ */
+void
+vips__simd_init( void )
+{
+	if( vips_simd_kernels )
+		return;
+
+	vips_simd_kernels = g_hash_table_new_full( g_str_hash, g_str_equal,
+		NULL, (GDestroyNotify) vips_free );
+	vips_simd_features = vips_simd_detect();
+
+	if( g_getenv( "VIPS_NOSIMD" ) )
+		vips__simd_enabled = FALSE;
+
+#ifdef HAVE_X86_SIMD
+	vips_simd_register( "convf_f32", VIPS_SIMD_SSE41,
+		(void *) vips_simd_convf_sse41 );
+	vips_simd_register( "convf_f32", VIPS_SIMD_AVX2,
+		(void *) vips_simd_convf_avx2 );
+	vips_simd_register( "convf_f32", VIPS_SIMD_AVX512,
+		(void *) vips_simd_convf_avx512 );
+#endif /*HAVE_X86_SIMD*/
+
+#ifdef HAVE_NEON_SIMD
+	vips_simd_register( "convf_f32", VIPS_SIMD_NEON,
+		(void *) vips_simd_convf_neon );
+#endif /*HAVE_NEON_SIMD*/
+}
+
+/**
+ * vips_simd_get_features:
+ *
+ * Find the vector features the host CPU supports.
+ *
+ * Returns: the set of #VipsSimdFeature the host supports.
+ */
+VipsSimdFeature
+vips_simd_get_features( void )
+{
+	return( vips_simd_features );
+}
+
+/**
+ * vips_simd_register:
+ * @name: kernel name
+ * @feature: the #VipsSimdFeature this version needs
+ * @fn: the kernel
+ *
+ * Register a version of a kernel. If the host supports @feature, and no
+ * version needing a better feature has been registered, vips_simd_get()
+ * will return @fn for @name from now on.
+ *
+ * Features are ranked by their value, so #VIPS_SIMD_AVX512 is preferred to
+ * #VIPS_SIMD_AVX2, for example.
+ *
+ * Kernels are usually registered by vips_init() and looked up by operations
+ * when they build.
+ *
+ * See also: vips_simd_get().
+ */
+void
+vips_simd_register( const char *name, VipsSimdFeature feature, void *fn )
+{
+	VipsSimdKernel *kernel;
+
+	g_assert( vips_simd_kernels );
+
+	if( (feature & vips_simd_features) != feature )
+		return;
+
+	g_mutex_lock( vips__global_lock );
+
+	if( !(kernel = g_hash_table_lookup( vips_simd_kernels, name )) ) {
+		kernel = VIPS_NEW( NULL, VipsSimdKernel );
+		kernel->name = name;
+		kernel->feature = 0;
+		kernel->fn = NULL;
+		g_hash_table_insert( vips_simd_kernels, (char *) name, kernel );
+	}
+
+	if( !kernel->fn ||
+		feature >= kernel->feature ) {
+		kernel->feature = feature;
+		kernel->fn = fn;
+
+#ifdef DEBUG
+		printf( "vips_simd_register: %s uses feature %d\n",
+			name, feature );
+#endif /*DEBUG*/
+	}
+
+	g_mutex_unlock( vips__global_lock );
+}
+
+/**
+ * vips_simd_get:
+ * @name: kernel name
+ *
+ * Find the best version of a kernel for the host CPU, see
+ * vips_simd_register().
+ *
+ * Kernels are not used if they are disabled with `--vips-nosimd` or
+ * `VIPS_NOSIMD`, or if there is no version for this host. Callers must
+ * have a plain C path for this case.
+ *
+ * Returns: the kernel, or %NULL.
+ */
+void *
+vips_simd_get( const char *name )
+{
+	VipsSimdKernel *kernel;
+	void *fn;
+
+	if( !vips__simd_enabled ||
+		!vips_simd_kernels )
+		return( NULL );
+
+	g_mutex_lock( vips__global_lock );
+	fn = NULL;
+	if( (kernel = g_hash_table_lookup( vips_simd_kernels, name )) )
+		fn = kernel->fn;
+	g_mutex_unlock( vips__global_lock );
+
+	return( fn );
+}
@@ -2,6 +2,10 @@
  * 
  * 28/3/10
  * 	- from im_iterate(), reworked for threadpool
+ * 16/10/17
+ * 	- allocate tiles with an atomic counter, see 
+ * 	  vips_threadpool_run_concurrent()
+ * 	- vips_sink_tile() keeps tiles in order for sequential sources
  */
 
 /*
@@ -214,6 +218,7 @@ vips_sink_base_init( SinkBase *sink_base, VipsImage *image )
 		&sink_base->n_lines );
 
 	sink_base->processed = 0;
+	sink_base->n_allocated = 0;
 }
 
 static int
@@ -293,6 +298,96 @@ vips_sink_base_allocate( VipsThreadState *state, void *a, gboolean *stop )
 	return( 0 );
 }
 
+/* The number of tiles across and down the image.
+ */
+static void
+vips_sink_base_grid( SinkBase *sink_base, int *across, int *down )
+{
+	*across = VIPS_ROUND_UP( sink_base->im->Xsize, sink_base->tile_width ) / 
+		sink_base->tile_width;
+	*down = VIPS_ROUND_UP( sink_base->im->Ysize, sink_base->tile_height ) / 
+		sink_base->tile_height;
+}
+
+/* As vips_sink_base_allocate(), but for sinks which don't need to keep tiles 
+ * in order. Tiles are numbered left-to-right, top-to-bottom and handed out 
+ * with an atomic counter, so this can run on many threads at once. Use with
+ * vips_threadpool_run_concurrent().
+ */
+int 
+vips_sink_base_allocate_concurrent( VipsThreadState *state, 
+	void *a, gboolean *stop )
+{
+	SinkBase *sink_base = (SinkBase *) a;
+
+	int across;
+	int down;
+	int n;
+	VipsRect image, tile;
+
+	/* Has work requested early termination?
+	 */
+	if( state->stop ) {
+		*stop = TRUE;
+
+		return( 0 );
+	}
+
+	/* The threadpool only runs us concurrently if g_atomic_int_add() 
+	 * returns the old value.
+	 */
+#ifdef HAVE_ATOMIC_INT_ADD
+	n = g_atomic_int_add( &sink_base->n_allocated, 1 );
+#else
+	n = sink_base->n_allocated++;
+#endif /*HAVE_ATOMIC_INT_ADD*/
+
+	vips_sink_base_grid( sink_base, &across, &down );
+	if( n >= across * down ) {
+		*stop = TRUE;
+
+		return( 0 );
+	}
+
+	image.left = 0;
+	image.top = 0;
+	image.width = sink_base->im->Xsize;
+	image.height = sink_base->im->Ysize;
+	tile.left = (n % across) * sink_base->tile_width;
+	tile.top = (n / across) * sink_base->tile_height;
+	tile.width = sink_base->tile_width;
+	tile.height = sink_base->tile_height;
+	vips_rect_intersectrect( &image, &tile, &state->pos );
+
+	return( 0 );
+}
+
+/* Number of pixels covered by the first n tiles 
+ * vips_sink_base_allocate_concurrent() hands out.
+ */
+static guint64
+vips_sink_base_allocated_pixels( SinkBase *sink_base, int n )
+{
+	int across;
+	int down;
+	int top;
+	guint64 pixels;
+
+	vips_sink_base_grid( sink_base, &across, &down );
+	n = VIPS_MIN( n, across * down );
+
+	top = (n / across) * sink_base->tile_height;
+	pixels = (guint64) sink_base->im->Xsize * top;
+	if( top < sink_base->im->Ysize ) 
+		pixels += (guint64) 
+			VIPS_MIN( (n % across) * sink_base->tile_width, 
+				sink_base->im->Xsize ) * 
+			VIPS_MIN( sink_base->tile_height, 
+				sink_base->im->Ysize - top );
+
+	return( pixels );
+}
+
 static int 
 sink_work( VipsThreadState *state, void *a )
 {
@@ -314,6 +409,13 @@ vips_sink_base_progress( void *a )
 
 	VIPS_DEBUG_MSG( "vips_sink_base_progress:\n" ); 
 
+	/* The concurrent allocator doesn't count pixels as it goes, work it
+	 * out from the number of tiles.
+	 */
+	if( sink_base->n_allocated > 0 )
+		sink_base->processed = vips_sink_base_allocated_pixels( 
+			sink_base, g_atomic_int_get( &sink_base->n_allocated ) );
+
 	/* Trigger any eval callbacks on our source image and
 	 * check for errors.
 	 */
@@ -376,12 +478,24 @@ vips_sink_tile( VipsImage *im,
 	 */
 	vips_image_preeval( im );
 
-	result = vips_threadpool_run( im, 
-		vips_sink_thread_state_new,
-		vips_sink_base_allocate, 
-		sink_work, 
-		vips_sink_base_progress, 
-		&sink );
+	/* Sequential sources need requests to stay roughly in order, so
+	 * allocate single-threaded. Otherwise we don't need tiles in any 
+	 * particular order and workers can allocate without locking.
+	 */
+	if( vips_image_get_typeof( im, VIPS_META_SEQUENTIAL ) ) 
+		result = vips_threadpool_run( im, 
+			vips_sink_thread_state_new,
+			vips_sink_base_allocate, 
+			sink_work, 
+			vips_sink_base_progress, 
+			&sink );
+	else
+		result = vips_threadpool_run_concurrent( im, 
+			vips_sink_thread_state_new,
+			vips_sink_base_allocate_concurrent, 
+			sink_work, 
+			vips_sink_base_progress, 
+			&sink );
 
 	vips_image_posteval( im );
 
@@ -61,6 +61,11 @@ typedef struct _SinkBase {
 	 * feedback.
 	 */
 	guint64 processed;
+
+	/* The number of tiles vips_sink_base_allocate_concurrent() has
+	 * handed out. Updated atomically.
+	 */
+	volatile gint n_allocated;
 } SinkBase;
 
 /* Some function we can share.
@@ -68,6 +73,8 @@ typedef struct _SinkBase {
 void vips_sink_base_init( SinkBase *sink_base, VipsImage *image );
 VipsThreadState *vips_sink_thread_state_new( VipsImage *im, void *a );
 int vips_sink_base_allocate( VipsThreadState *state, void *a, gboolean *stop );
+int vips_sink_base_allocate_concurrent( VipsThreadState *state, 
+	void *a, gboolean *stop );
 int vips_sink_base_progress( void *a );
 
 #ifdef __cplusplus
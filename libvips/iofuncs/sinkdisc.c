@@ -9,6 +9,11 @@
  * 	- we could get stuck if allocate failed (thanks Tim)
  * 23/2/12
  * 	- we could deadlock if generate failed
+ * 16/10/17
+ * 	- write behind through a ring of buffers with a single writer thread,
+ * 	  see vips_sink_disc_set_buffers()
+ * 	- count time spent waiting for the writer, see vips_sink_disc_stats()
+ * 	- check the final write for errors
  */
 
 /*
@@ -65,6 +70,17 @@
 
 #include "sink.h"
 
+/* The default number of buffers we write behind through. 
+ */
+int vips__sink_disc_buffers = 4;
+
+/* Totals over all calls, for vips_sink_disc_stats(). Protected by
+ * vips__global_lock.
+ */
+static guint64 vips_sink_disc_n_wait = 0;
+static double vips_sink_disc_wait_time = 0.0;
+static guint64 vips_sink_disc_bytes = 0;
+
 /* A buffer we are going to write to disc in a background thread.
  */
 typedef struct _WriteBuffer {
@@ -72,12 +88,10 @@ typedef struct _WriteBuffer {
 
 	VipsRegion *region;	/* Pixels */
 	VipsRect area;		/* Part of image this region covers */
-        VipsSemaphore go; 	/* Start bg thread loop */
         VipsSemaphore nwrite; 	/* Number of threads writing to region */
         VipsSemaphore done; 	/* Bg thread has done write */
         int write_errno;	/* Save write errors here */
-	GThread *thread;	/* BG writer thread */
-	gboolean kill;		/* Set to ask thread to exit */
+	gboolean queued;	/* Has been handed to the writer */
 } WriteBuffer;
 
 /* Per-call state.
@@ -85,11 +99,27 @@ typedef struct _WriteBuffer {
 typedef struct _Write {
 	SinkBase sink_base;
 
-	/* We are current writing tiles to buf, buf_back is in the hands of
-	 * the bg write thread.
+	/* A ring of buffers. Workers fill ring[current], the writer thread
+	 * works through the buffers after it in order. 
 	 */
+	int n_buffers;
+	WriteBuffer **ring;
+	int current;
 	WriteBuffer *buf;
-	WriteBuffer *buf_back;
+
+	/* The writer thread waits here for buffers to write. It writes 
+	 * ring[next] next.
+	 */
+	GThread *thread;
+	VipsSemaphore queued;
+	int next;
+	gboolean kill;
+
+	/* Time workers spent waiting for the writer to free a buffer.
+	 */
+	GTimer *timer;
+	int n_wait;
+	double wait_time;
 
 	/* The file format write operation.
 	 */
@@ -139,22 +169,7 @@ write_thread_state_new( VipsImage *im, void *a )
 static void
 wbuffer_free( WriteBuffer *wbuffer )
 {
-        /* Is there a thread running this region? Kill it!
-         */
-        if( wbuffer->thread ) {
-                wbuffer->kill = TRUE;
-		vips_semaphore_up( &wbuffer->go );
-
-		/* Return value is always NULL (see wbuffer_write_thread).
-		 */
-		(void) vips_g_thread_join( wbuffer->thread );
-		VIPS_DEBUG_MSG( "wbuffer_free: vips_g_thread_join()\n" );
-
-		wbuffer->thread = NULL;
-        }
-
 	VIPS_UNREF( wbuffer->region );
-	vips_semaphore_destroy( &wbuffer->go );
 	vips_semaphore_destroy( &wbuffer->nwrite );
 	vips_semaphore_destroy( &wbuffer->done );
 	vips_free( wbuffer );
@@ -176,21 +191,27 @@ wbuffer_write( WriteBuffer *wbuffer )
 	VIPS_GATE_STOP( "wbuffer_write: work" ); 
 }
 
-/* Run this as a thread to do a BG write.
+/* Run this as a thread to do BG writes. Buffers are queued in order, so we
+ * just work around the ring.
  */
 static void *
 wbuffer_write_thread( void *data )
 {
-	WriteBuffer *wbuffer = (WriteBuffer *) data;
+	Write *write = (Write *) data;
 
 	for(;;) {
+		WriteBuffer *wbuffer;
+
 		/* Wait to be told to write.
 		 */
-		vips_semaphore_down( &wbuffer->go );
+		vips_semaphore_down( &write->queued );
 
-		if( wbuffer->kill )
+		if( write->kill )
 			break;
 
+		wbuffer = write->ring[write->next];
+		write->next = (write->next + 1) % write->n_buffers;
+
 		/* Now block until the last worker finishes on this buffer.
 		 */
 		vips_semaphore_downn( &wbuffer->nwrite, 0 );
@@ -214,12 +235,10 @@ wbuffer_new( Write *write )
 		return( NULL );
 	wbuffer->write = write;
 	wbuffer->region = NULL;
-	vips_semaphore_init( &wbuffer->go, 0, "go" );
 	vips_semaphore_init( &wbuffer->nwrite, 0, "nwrite" );
 	vips_semaphore_init( &wbuffer->done, 0, "done" );
 	wbuffer->write_errno = 0;
-	wbuffer->thread = NULL;
-	wbuffer->kill = FALSE;
+	wbuffer->queued = FALSE;
 
 	if( !(wbuffer->region = vips_region_new( write->sink_base.im )) ) {
 		wbuffer_free( wbuffer );
@@ -230,46 +249,70 @@ wbuffer_new( Write *write )
 	 */
 	vips__region_no_ownership( wbuffer->region );
 
-	/* Make this last (picks up parts of wbuffer on startup).
-	 */
-	if( !(wbuffer->thread = vips_g_thread_new( "wbuffer", 
-		wbuffer_write_thread, wbuffer )) ) {  
-		wbuffer_free( wbuffer );
-		return( NULL );
-	}
-
 	return( wbuffer );
 }
 
-/* Block until the previous write completes, then write the front buffer.
+/* Wait for the writer to finish with a buffer, if it has one.
  */
 static int
-wbuffer_flush( Write *write )
+wbuffer_wait( WriteBuffer *wbuffer )
 {
-	VIPS_DEBUG_MSG( "wbuffer_flush:\n" );
+	Write *write = wbuffer->write;
 
-	/* Block until the other buffer has been written. We have to do this 
-	 * before we can set this buffer writing or we'll lose output ordering.
+	gboolean blocked;
+
+	if( !wbuffer->queued )
+		return( 0 );
+
+	/* Only count the times we will actually block.
 	 */
-	if( write->buf->area.top > 0 ) {
-		vips_semaphore_down( &write->buf_back->done );
+	g_mutex_lock( wbuffer->done.mutex );
+	blocked = wbuffer->done.v <= 0;
+	g_mutex_unlock( wbuffer->done.mutex );
 
-		/* Previous write suceeded?
-		 */
-		if( write->buf_back->write_errno ) {
-			vips_error_system( write->buf_back->write_errno,
-				"wbuffer_write", "%s", _( "write failed" ) );
-			return( -1 ); 
-		}
+	VIPS_GATE_START( "wbuffer_wait: wait" ); 
+
+	g_timer_start( write->timer );
+	vips_semaphore_down( &wbuffer->done );
+	if( blocked ) {
+		write->wait_time += g_timer_elapsed( write->timer, NULL );
+		write->n_wait += 1;
 	}
 
-	/* Set the background writer going for this buffer.
+	VIPS_GATE_STOP( "wbuffer_wait: wait" ); 
+
+	wbuffer->queued = FALSE;
+
+	/* Write suceeded?
 	 */
-	vips_semaphore_up( &write->buf->go );
+	if( wbuffer->write_errno ) {
+		vips_error_system( wbuffer->write_errno,
+			"wbuffer_write", "%s", _( "write failed" ) );
+		return( -1 ); 
+	}
 
 	return( 0 );
 }
 
+/* Hand the front buffer to the writer, and move on to the next buffer in the
+ * ring, waiting for the writer to finish with it if necessary.
+ */
+static int
+wbuffer_flush( Write *write )
+{
+	VIPS_DEBUG_MSG( "wbuffer_flush:\n" );
+
+	/* The writer takes buffers in ring order, so output order is kept.
+	 */
+	write->buf->queued = TRUE;
+	vips_semaphore_up( &write->queued );
+
+	write->current = (write->current + 1) % write->n_buffers;
+	write->buf = write->ring[write->current];
+
+	return( wbuffer_wait( write->buf ) );
+}
+
 /* Move a wbuffer to a position.
  */
 static int 
@@ -335,8 +378,9 @@ wbuffer_allocate_fn( VipsThreadState *state, void *a, gboolean *stop )
 				"finished top = %d, height = %d\n",
 				write->buf->area.top, write->buf->area.height );
 
-			/* Block until the write of the previous buffer 
-			 * is done, then set write of this buffer going.
+			/* Set write of this buffer going, then move on to
+			 * the next buffer in the ring, blocking until 
+			 * any previous write from that is done.
 			 */
 			if( wbuffer_flush( write ) ) {
 				*stop = TRUE;
@@ -354,10 +398,6 @@ wbuffer_allocate_fn( VipsThreadState *state, void *a, gboolean *stop )
 				"starting top = %d, height = %d\n",
 				sink_base->y, sink_base->n_lines );
 
-			/* Swap buffers.
-			 */
-			VIPS_SWAP( WriteBuffer *, write->buf, write->buf_back );
-
 			/* Position buf at the new y.
 			 */
 			if( wbuffer_position( write->buf, 
@@ -435,23 +475,74 @@ wbuffer_work_fn( VipsThreadState *state, void *a )
 	return( result );
 }
 
-static void
+static int
 write_init( Write *write, 
 	VipsImage *image, VipsRegionWrite write_fn, void *a )
 {
+	int i;
+
 	vips_sink_base_init( &write->sink_base, image );
 
-	write->buf = wbuffer_new( write );
-	write->buf_back = wbuffer_new( write );
+	/* We need at least two buffers, or compute and write can't overlap.
+	 */
+	write->n_buffers = VIPS_MAX( 2, vips__sink_disc_buffers );
+	write->ring = VIPS_ARRAY( NULL, write->n_buffers, WriteBuffer * );
+	write->current = 0;
+	write->buf = NULL;
+	write->thread = NULL;
+	vips_semaphore_init( &write->queued, 0, "queued" );
+	write->next = 0;
+	write->kill = FALSE;
+	write->timer = g_timer_new();
+	write->n_wait = 0;
+	write->wait_time = 0.0;
 	write->write_fn = write_fn;
 	write->a = a;
+
+	if( !write->ring )
+		return( -1 );
+	for( i = 0; i < write->n_buffers; i++ )
+		write->ring[i] = NULL;
+	for( i = 0; i < write->n_buffers; i++ )
+		if( !(write->ring[i] = wbuffer_new( write )) )
+			return( -1 );
+	write->buf = write->ring[0];
+
+	/* Make this last (picks up parts of write on startup).
+	 */
+	if( !(write->thread = vips_g_thread_new( "wbuffer", 
+		wbuffer_write_thread, write )) )
+		return( -1 );
+
+	return( 0 );
 }
 
 static void
 write_free( Write *write )
 {
-	VIPS_FREEF( wbuffer_free, write->buf );
-	VIPS_FREEF( wbuffer_free, write->buf_back );
+	int i;
+
+        /* Is there a thread running? Kill it!
+         */
+        if( write->thread ) {
+                write->kill = TRUE;
+		vips_semaphore_up( &write->queued );
+
+		/* Return value is always NULL (see wbuffer_write_thread).
+		 */
+		(void) vips_g_thread_join( write->thread );
+		VIPS_DEBUG_MSG( "write_free: vips_g_thread_join()\n" );
+
+		write->thread = NULL;
+        }
+
+	if( write->ring ) {
+		for( i = 0; i < write->n_buffers; i++ )
+			VIPS_FREEF( wbuffer_free, write->ring[i] );
+		VIPS_FREE( write->ring );
+	}
+	vips_semaphore_destroy( &write->queued );
+	VIPS_FREEF( g_timer_destroy, write->timer );
 }
 
 /**
@@ -485,7 +576,11 @@ write_free( Write *write )
  * disc files. Things like vips_jpegsave(), for example, use this to write
  * images to files in JPEG format. 
  *
- * See also: vips_concurrency_set().
+ * @write_fn runs in a background thread while the workers go on to compute 
+ * later sections. Use vips_sink_disc_set_buffers() to set how far ahead 
+ * they can get. 
+ *
+ * See also: vips_concurrency_set(), vips_sink_disc_stats().
  *
  * Returns: 0 on success, -1 on error.
  */
@@ -494,14 +589,12 @@ vips_sink_disc( VipsImage *im, VipsRegionWrite write_fn, void *a )
 {
 	Write write;
 	int result;
+	int i;
 
 	vips_image_preeval( im );
 
-	write_init( &write, im, write_fn, a );
-
 	result = 0;
-	if( !write.buf || 
-		!write.buf_back || 
+	if( write_init( &write, im, write_fn, a ) ||
 		wbuffer_position( write.buf, 0, write.sink_base.n_lines ) ||
 		vips_threadpool_run( im, 
 			write_thread_state_new, 
@@ -511,23 +604,85 @@ vips_sink_disc( VipsImage *im, VipsRegionWrite write_fn, void *a )
 			&write ) )  
 		result = -1;
 
-	/* Just before allocate signalled stop, it set write.buf writing. We
-	 * need to wait for this write to finish. 
+	/* Just before allocate signalled stop, it queued the final buffer. 
+	 * We need to wait for all queued writes to finish. 
 	 *
-	 * We can't just free the buffers (which will wait for the bg threads 
+	 * We can't just free the buffers (which will wait for the bg thread 
 	 * to finish), since the bg thread might see the kill before it gets a 
 	 * chance to write.
 	 *
-	 * If the pool exited with an error, write.buf might not have been
-	 * started (if the allocate failed), and in any case, we don't care if
-	 * the final write went through or not.
+	 * If the pool exited with an error, the writer might still be waiting 
+	 * for buffers that will never be queued, and in any case, we don't 
+	 * care if the final writes went through or not.
 	 */
 	if( !result ) 
-		vips_semaphore_down( &write.buf->done );
+		for( i = 1; i <= write.n_buffers; i++ ) 
+			if( wbuffer_wait( write.ring[(write.current + i) % 
+				write.n_buffers] ) )
+				result = -1;
 
 	vips_image_posteval( im );
 
+	g_mutex_lock( vips__global_lock );
+	vips_sink_disc_n_wait += write.n_wait;
+	vips_sink_disc_wait_time += write.wait_time;
+	if( !result )
+		vips_sink_disc_bytes += VIPS_IMAGE_SIZEOF_IMAGE( im );
+	g_mutex_unlock( vips__global_lock );
+
 	write_free( &write );
 
 	return( result );
 }
+
+/**
+ * vips_sink_disc_set_buffers:
+ * @n: number of buffers
+ *
+ * vips_sink_disc() writes behind through a ring of @n buffers, each a few 
+ * tiles high and the width of the image. While one buffer is being written, 
+ * workers can compute the others, so more buffers let the workers keep 
+ * going when the saver is slow, for example during PNG compression. 
+ *
+ * The minimum, and the old behaviour, is 2. The default is 4.
+ *
+ * You can also set this with the environment variable 
+ * `VIPS_SINK_DISC_BUFFERS` or the command-line flag 
+ * `--vips-sink-disc-buffers`.
+ *
+ * See also: vips_sink_disc_stats().
+ */
+void
+vips_sink_disc_set_buffers( int n )
+{
+	vips__sink_disc_buffers = VIPS_MAX( 2, n );
+}
+
+/**
+ * vips_sink_disc_stats:
+ * @n_wait: (out) (allow-none): return the number of times workers waited
+ * @wait_time: (out) (allow-none): return the total seconds they waited
+ * @bytes_written: (out) (allow-none): return the number of bytes written
+ *
+ * Get totals over all vips_sink_disc() calls since startup. @n_wait and 
+ * @wait_time are the number of times the workers had to wait for the 
+ * writer to free a buffer, and how long they waited for. If this is high, 
+ * try more buffers with vips_sink_disc_set_buffers().
+ *
+ * @bytes_written counts uncompressed pixel bytes from successful calls.
+ */
+void
+vips_sink_disc_stats( guint64 *n_wait, double *wait_time, 
+	guint64 *bytes_written )
+{
+	g_mutex_lock( vips__global_lock );
+
+	if( n_wait )
+		*n_wait = vips_sink_disc_n_wait;
+	if( wait_time )
+		*wait_time = vips_sink_disc_wait_time;
+	if( bytes_written )
+		*bytes_written = vips_sink_disc_bytes;
+
+	g_mutex_unlock( vips__global_lock );
+}
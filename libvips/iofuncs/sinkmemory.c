@@ -8,6 +8,8 @@
  * 	- from sinkdisc.c
  * 23/2/12
  * 	- we could deadlock if generate failed
+ * 16/10/17
+ * 	- images with no sequential source use the concurrent allocator
  */
 
 /*
@@ -249,6 +251,20 @@ sink_memory_area_allocate_fn( VipsThreadState *state, void *a, gboolean *stop )
 	return( 0 );
 }
 
+/* Images with no sequential source don't need areas, we can hand out tiles 
+ * in any order.
+ */
+static int
+sink_memory_allocate_concurrent_fn( VipsThreadState *state, 
+	void *a, gboolean *stop )
+{
+	SinkMemoryThreadState *wstate = (SinkMemoryThreadState *) state;
+
+	wstate->area = NULL;
+
+	return( vips_sink_base_allocate_concurrent( state, a, stop ) );
+}
+
 /* Our VipsThreadpoolWork function ... generate a tile!
  */
 static int
@@ -271,7 +287,8 @@ sink_memory_area_work_fn( VipsThreadState *state, void *a )
 
 	/* Tell the allocator we're done.
 	 */
-	vips_semaphore_upn( &area->nwrite, 1 );
+	if( area )
+		vips_semaphore_upn( &area->nwrite, 1 );
 
 	return( result );
 }
@@ -332,14 +349,29 @@ vips_sink_memory( VipsImage *image )
 	vips_image_preeval( image );
 
 	result = 0;
-	sink_memory_area_position( memory.area, 0, memory.sink_base.n_lines );
-	if( vips_threadpool_run( image, 
-		sink_memory_thread_state_new, 
-		sink_memory_area_allocate_fn, 
-		sink_memory_area_work_fn, 
-		vips_sink_base_progress, 
-		&memory ) )  
-		result = -1;
+	if( vips_image_get_typeof( image, VIPS_META_SEQUENTIAL ) ) {
+		/* Sequential sources need requests to stay roughly in 
+		 * order, so allocate single-threaded with areas. 
+		 */
+		sink_memory_area_position( memory.area, 
+			0, memory.sink_base.n_lines );
+		if( vips_threadpool_run( image, 
+			sink_memory_thread_state_new, 
+			sink_memory_area_allocate_fn, 
+			sink_memory_area_work_fn, 
+			vips_sink_base_progress, 
+			&memory ) )  
+			result = -1;
+	}
+	else {
+		if( vips_threadpool_run_concurrent( image, 
+			sink_memory_thread_state_new, 
+			sink_memory_allocate_concurrent_fn, 
+			sink_memory_area_work_fn, 
+			vips_sink_base_progress, 
+			&memory ) )  
+			result = -1;
+	}
 
 	vips_image_posteval( image );
 
@@ -0,0 +1,435 @@
+/* keep large loads as compressed strips in memory
+ *
+ * 16/10/17
+ * 	- first version
+ * 	- size the decoded strip cache in bytes
+ */
+
+/*
+
+    This file is part of VIPS.
+
+    VIPS is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301  USA
+
+ */
+
+/*
+
+    These files are distributed with VIPS - http://www.vips.ecs.soton.ac.uk
+
+ */
+
+/* When a random-access load is bigger than vips_get_disc_threshold(),
+ * vips_foreign_load() normally decompresses to a temporary vips file. With
+ * --vips-spill-memory or VIPS_SPILL_MEMORY, it decompresses to one of these
+ * instead.
+ *
+ * A spill image starts as a partial image with a store attached. The loader
+ * either attaches a pipeline with vips_image_generate(), which we run into
+ * the store with vips_sink_disc(), or writes lines with
+ * vips_image_write_line(), which image.c passes to us.
+ *
+ * Lines are coded with vips__rle_encode() in independent strips of
+ * VIPS_SPILL_STRIP_HEIGHT lines. vips__spill_build() then makes a partial
+ * image that decodes strips on demand behind a threaded tile cache.
+ */
+
+/*
+#define DEBUG
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /*HAVE_CONFIG_H*/
+#include <vips/intl.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vips/vips.h>
+#include <vips/internal.h>
+
+/* Lines per coded strip.
+ */
+#define VIPS_SPILL_STRIP_HEIGHT (16)
+
+/* Keep at most this many bytes of decoded strips.
+ */
+#define VIPS_SPILL_CACHE_MAX (64 * 1024 * 1024)
+
+/* Set by --vips-spill-memory and VIPS_SPILL_MEMORY.
+ */
+gboolean vips__spill_memory = FALSE;
+
+typedef struct _VipsSpill {
+	/* Geometry, set when the first pixels arrive.
+	 */
+	int width;
+	int height;
+	size_t sizeof_pel;
+	size_t sizeof_line;
+	int n_strips;
+
+	/* The coded strips, and the length of each one.
+	 */
+	VipsPel **strips;
+	size_t *lengths;
+
+	/* Lines waiting to be coded, and the next line we expect.
+	 */
+	VipsPel *buffer;
+	int y;
+
+	/* Scratch space for the coder.
+	 */
+	VipsPel *line;
+	VipsPel *coded;
+
+	/* Total bytes of coded pixels.
+	 */
+	size_t length;
+} VipsSpill;
+
+static GQuark
+vips_spill_quark( void )
+{
+	return( g_quark_from_static_string( "vips-spill" ) );
+}
+
+static void
+vips_spill_free( VipsSpill *spill )
+{
+	int i;
+
+	if( spill->strips ) {
+		for( i = 0; i < spill->n_strips; i++ )
+			VIPS_FREEF( vips_tracked_free, spill->strips[i] );
+		VIPS_FREE( spill->strips );
+	}
+	VIPS_FREE( spill->lengths );
+	VIPS_FREE( spill->buffer );
+	VIPS_FREE( spill->line );
+	VIPS_FREE( spill->coded );
+
+	g_free( spill );
+}
+
+static void
+vips_spill_close_cb( VipsImage *image, VipsSpill *spill )
+{
+	vips_spill_free( spill );
+}
+
+/* Size the store from the image we are filling.
+ */
+static int
+vips_spill_alloc( VipsSpill *spill, VipsImage *image )
+{
+	if( spill->strips )
+		return( 0 );
+
+	spill->width = image->Xsize;
+	spill->height = image->Ysize;
+	spill->sizeof_pel = VIPS_IMAGE_SIZEOF_PEL( image );
+	spill->sizeof_line = VIPS_IMAGE_SIZEOF_LINE( image );
+	spill->n_strips = VIPS_ROUND_UP( image->Ysize,
+		VIPS_SPILL_STRIP_HEIGHT ) / VIPS_SPILL_STRIP_HEIGHT;
+
+	if( !(spill->strips = VIPS_ARRAY( NULL, spill->n_strips, VipsPel * )) )
+		return( -1 );
+	memset( spill->strips, 0, spill->n_strips * sizeof( VipsPel * ) );
+	if( !(spill->lengths = VIPS_ARRAY( NULL, spill->n_strips, size_t )) ||
+		!(spill->buffer = VIPS_ARRAY( NULL,
+			VIPS_SPILL_STRIP_HEIGHT * spill->sizeof_line,
+			VipsPel )) ||
+		!(spill->line = VIPS_ARRAY( NULL,
+			spill->sizeof_line, VipsPel )) ||
+		!(spill->coded = VIPS_ARRAY( NULL,
+			VIPS_SPILL_STRIP_HEIGHT *
+				VIPS__RLE_BOUND( spill->sizeof_line ),
+			VipsPel )) )
+		return( -1 );
+
+	return( 0 );
+}
+
+/* Code the lines in the buffer.
+ */
+static int
+vips_spill_code( VipsSpill *spill, int height )
+{
+	int strip = (spill->y - 1) / VIPS_SPILL_STRIP_HEIGHT;
+
+	size_t length;
+
+	length = vips__rle_encode( spill->coded, spill->buffer,
+		spill->sizeof_line, spill->width, height, spill->sizeof_pel,
+		spill->line );
+	if( !(spill->strips[strip] = vips_tracked_malloc( length )) )
+		return( -1 );
+	memcpy( spill->strips[strip], spill->coded, length );
+	spill->lengths[strip] = length;
+	spill->length += length;
+
+	return( 0 );
+}
+
+static int
+vips_spill_add_line( VipsSpill *spill, VipsPel *p )
+{
+	int line = spill->y % VIPS_SPILL_STRIP_HEIGHT;
+
+	memcpy( spill->buffer + line * spill->sizeof_line,
+		p, spill->sizeof_line );
+	spill->y += 1;
+
+	if( line == VIPS_SPILL_STRIP_HEIGHT - 1 ||
+		spill->y == spill->height )
+		return( vips_spill_code( spill, line + 1 ) );
+
+	return( 0 );
+}
+
+/* vips_sink_disc() gives us complete lines, top to bottom.
+ */
+static int
+vips_spill_write( VipsRegion *region, VipsRect *area, void *a )
+{
+	VipsSpill *spill = (VipsSpill *) a;
+
+	int y;
+
+	for( y = 0; y < area->height; y++ )
+		if( vips_spill_add_line( spill,
+			VIPS_REGION_ADDR( region, 0, area->top + y ) ) )
+			return( -1 );
+
+	return( 0 );
+}
+
+/* Make a partial image that a loader can write to with vips_image_generate(),
+ * vips_image_write() or vips_image_write_line(). Once the loader is done,
+ * call vips__spill_build() to get an image you can read from.
+ */
+VipsImage *
+vips__spill_new( void )
+{
+	VipsImage *image;
+	VipsSpill *spill;
+
+	image = vips_image_new();
+	spill = g_new0( VipsSpill, 1 );
+	g_object_set_qdata_full( G_OBJECT( image ), vips_spill_quark(),
+		spill, (GDestroyNotify) vips_spill_free );
+
+	return( image );
+}
+
+gboolean
+vips__image_isspill( VipsImage *image )
+{
+	return( g_object_get_qdata( G_OBJECT( image ),
+		vips_spill_quark() ) != NULL );
+}
+
+/* Called from vips_image_write_line() for spill images.
+ */
+int
+vips__spill_write_line( VipsImage *image, int ypos, VipsPel *linebuffer )
+{
+	VipsSpill *spill = (VipsSpill *)
+		g_object_get_qdata( G_OBJECT( image ), vips_spill_quark() );
+
+	g_assert( spill );
+
+	if( ypos == 0 ) {
+		if( image->generate_fn ) {
+			vips_error( "VipsImage",
+				"%s", _( "image already written" ) );
+			return( -1 );
+		}
+		if( vips_spill_alloc( spill, image ) )
+			return( -1 );
+
+		vips_image_set_kill( image, FALSE );
+		vips_image_preeval( image );
+	}
+
+	if( ypos != spill->y ) {
+		vips_error( "VipsImage", "%s", _( "lines out of order" ) );
+		return( -1 );
+	}
+	if( vips_spill_add_line( spill, linebuffer ) )
+		return( -1 );
+
+	vips_image_eval( image, ypos * image->Xsize );
+	if( vips_image_iskilled( image ) )
+		return( -1 );
+
+	if( ypos == image->Ysize - 1 ) {
+		vips_image_posteval( image );
+		if( vips_image_written( image ) )
+			return( -1 );
+	}
+
+	return( 0 );
+}
+
+/* Each sequence decodes a strip at a time.
+ */
+static void *
+vips_spill_start( VipsImage *out, void *a, void *b )
+{
+	VipsSpill *spill = (VipsSpill *) a;
+
+	return( vips_malloc( NULL,
+		VIPS_SPILL_STRIP_HEIGHT * spill->sizeof_line ) );
+}
+
+static int
+vips_spill_generate( VipsRegion *or,
+	void *seq, void *a, void *b, gboolean *stop )
+{
+	VipsSpill *spill = (VipsSpill *) a;
+	VipsRect *r = &or->valid;
+	VipsPel *pixels = (VipsPel *) seq;
+	size_t ps = spill->sizeof_pel;
+
+	int strip;
+
+	/* Strips are never changed after vips__spill_build(), so we can read
+	 * them without a lock.
+	 */
+	for( strip = r->top / VIPS_SPILL_STRIP_HEIGHT;
+		strip * VIPS_SPILL_STRIP_HEIGHT < VIPS_RECT_BOTTOM( r );
+		strip++ ) {
+		int top = strip * VIPS_SPILL_STRIP_HEIGHT;
+		int height = VIPS_MIN( VIPS_SPILL_STRIP_HEIGHT,
+			spill->height - top );
+		int bottom = VIPS_MIN( top + height, VIPS_RECT_BOTTOM( r ) );
+
+		int y;
+
+		if( vips__rle_decode( pixels, spill->width, height, ps,
+			spill->strips[strip], spill->lengths[strip] ) ) {
+			vips_error( "VipsImage", "%s", _( "corrupt strip" ) );
+			return( -1 );
+		}
+
+		for( y = VIPS_MAX( top, r->top ); y < bottom; y++ )
+			memcpy( VIPS_REGION_ADDR( or, r->left, y ),
+				pixels + (y - top) * spill->sizeof_line +
+					r->left * ps,
+				r->width * ps );
+	}
+
+	return( 0 );
+}
+
+static int
+vips_spill_stop( void *seq, void *a, void *b )
+{
+	vips_free( seq );
+
+	return( 0 );
+}
+
+/* Finish loading into @image and make @out, a partial image that reads
+ * from the compressed store. @out does not reference @image, so the loader
+ * can be freed.
+ */
+int
+vips__spill_build( VipsImage *image, VipsImage **out )
+{
+	VipsSpill *spill = (VipsSpill *)
+		g_object_get_qdata( G_OBJECT( image ), vips_spill_quark() );
+
+	VipsImage *raw;
+	size_t strip_bytes;
+	size_t cache_bytes;
+	int max_tiles;
+
+	g_assert( spill );
+
+	/* The loader attached a pipeline: run it into the store. Loaders
+	 * which use vips_image_write_line() will have filled it already.
+	 */
+	if( image->generate_fn &&
+		(vips_spill_alloc( spill, image ) ||
+		 vips_sink_disc( image, vips_spill_write, spill )) )
+		return( -1 );
+
+	if( !spill->strips ||
+		spill->y != spill->height ) {
+		vips_error( "VipsImage", "%s", _( "image not written" ) );
+		return( -1 );
+	}
+
+#ifdef DEBUG
+	printf( "vips__spill_build: %zd bytes of pixels in %zd bytes\n",
+		(size_t) VIPS_IMAGE_SIZEOF_IMAGE( image ), spill->length );
+#endif /*DEBUG*/
+
+	/* The store now belongs to raw.
+	 */
+	g_object_steal_qdata( G_OBJECT( image ), vips_spill_quark() );
+	raw = vips_image_new();
+	g_signal_connect( raw, "close",
+		G_CALLBACK( vips_spill_close_cb ), spill );
+
+	/* Don't make raw depend on image, we want image and the loader
+	 * behind it to be freed. The loader sets the metadata on the final
+	 * output image, so we only need the geometry.
+	 */
+	vips_image_init_fields( raw,
+		image->Xsize, image->Ysize, image->Bands, image->BandFmt,
+		image->Coding, image->Type, image->Xres, image->Yres );
+	raw->Xoffset = image->Xoffset;
+	raw->Yoffset = image->Yoffset;
+
+	if( vips_image_pipelinev( raw, VIPS_DEMAND_STYLE_FATSTRIP, NULL ) ||
+		vips_image_generate( raw,
+		vips_spill_start, vips_spill_generate, vips_spill_stop,
+		spill, NULL ) ) {
+		g_object_unref( raw );
+		return( -1 );
+	}
+
+	/* Cache a few decoded strips per thread, so area operations don't
+	 * decode each strip many times. Strips are the full width of the 
+	 * image, so limit the cache in bytes too. The cache will go over
+	 * this for a moment if every strip is in use.
+	 */
+	strip_bytes = (size_t) VIPS_SPILL_STRIP_HEIGHT * 
+		VIPS_IMAGE_SIZEOF_LINE( raw );
+	cache_bytes = VIPS_MIN( (size_t) 4 * vips_concurrency_get() * 
+		strip_bytes, VIPS_SPILL_CACHE_MAX );
+	max_tiles = VIPS_MAX( 2, cache_bytes / strip_bytes );
+
+	if( vips_tilecache( raw, out,
+		"tile_width", raw->Xsize,
+		"tile_height", VIPS_SPILL_STRIP_HEIGHT,
+		"max_tiles", max_tiles,
+		"threaded", TRUE,
+		NULL ) ) {
+		g_object_unref( raw );
+		return( -1 );
+	}
+	g_object_unref( raw );
+
+	return( 0 );
+}
@@ -0,0 +1,201 @@
+/* a snapshot of the libvips counters
+ *
+ * 16/10/17
+ * 	- first version
+ */
+
+/*
+
+    This file is part of VIPS.
+
+    VIPS is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301  USA
+
+ */
+
+/*
+
+    These files are distributed with VIPS - http://www.vips.ecs.soton.ac.uk
+
+ */
+
+/*
+#define DEBUG
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /*HAVE_CONFIG_H*/
+#include <vips/intl.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vips/vips.h>
+#include <vips/vector.h>
+#include <vips/internal.h>
+
+/**
+ * SECTION: stats
+ * @short_description: a snapshot of the libvips counters
+ * @stability: Stable
+ * @include: vips/vips.h
+ *
+ * libvips keeps a set of counters as it runs: operation cache hits and
+ * misses, pixel buffer reuse, mmap windows, time threads spend blocked,
+ * bytes written by vips_sink_disc(), and the number of tiles each class of
+ * operation has computed.
+ *
+ * vips_stats_snapshot() fetches them all at once. It's cheap, so a server
+ * could call it every second and report the changes.
+ */
+
+/* Protects the class table.
+ */
+static GMutex *vips_stats_lock = NULL;
+
+/* Nickname -> VipsClassStats. Entries are never removed, so output images
+ * can hold pointers to them.
+ */
+static GHashTable *vips_stats_classes = NULL;
+
+void
+vips__stats_init( void )
+{
+	if( !vips_stats_lock ) {
+		vips_stats_lock = vips_g_mutex_new();
+		vips_stats_classes = g_hash_table_new( g_str_hash, g_str_equal );
+	}
+}
+
+/* Get the counters for a class of operation.
+ */
+VipsClassStats *
+vips__stats_class_get( const char *nickname )
+{
+	VipsClassStats *class_stats;
+
+	g_mutex_lock( vips_stats_lock );
+
+	if( !(class_stats =
+		g_hash_table_lookup( vips_stats_classes, nickname )) ) {
+		class_stats = g_new0( VipsClassStats, 1 );
+		class_stats->nickname = nickname;
+		class_stats->lock = vips_g_mutex_new();
+		g_hash_table_insert( vips_stats_classes,
+			(char *) nickname, class_stats );
+	}
+
+	g_mutex_unlock( vips_stats_lock );
+
+	return( class_stats );
+}
+
+/* Count a tile computed by this class of operation.
+ */
+void
+vips__stats_class_tile( VipsClassStats *class_stats )
+{
+	g_mutex_lock( class_stats->lock );
+	class_stats->n_tiles += 1;
+	g_mutex_unlock( class_stats->lock );
+}
+
+static void
+vips_stats_class_add( const char *nickname,
+	VipsClassStats *class_stats, VipsStats *stats )
+{
+	VipsStatsOperation *operation =
+		&stats->operations[stats->n_operations++];
+
+	operation->nickname = class_stats->nickname;
+	g_mutex_lock( class_stats->lock );
+	operation->n_tiles = class_stats->n_tiles;
+	g_mutex_unlock( class_stats->lock );
+}
+
+/**
+ * vips_stats_snapshot:
+ * @stats: (out): fill this with the current counters
+ *
+ * Fetch the current value of all the libvips counters, see #VipsStats.
+ * Counters only go up, apart from the sizes, so callers can subtract
+ * successive snapshots to get rates.
+ *
+ * @stats->operations is an array of the number of tiles computed so far by
+ * each class of operation, in no particular order. Tiles are only counted
+ * for operations built via vips_cache_operation_buildp(), which includes
+ * all the usual C API.
+ *
+ * Free the array with vips_stats_clear().
+ *
+ * See also: vips_cache_get_stats(), vips_sink_disc_stats(),
+ * vips_vector_cache_get_stats(), vips_tracked_get_mem().
+ */
+void
+vips_stats_snapshot( VipsStats *stats )
+{
+	memset( stats, 0, sizeof( VipsStats ) );
+
+	stats->cache_size = vips_cache_get_size();
+	vips_cache_get_stats( &stats->cache_hit,
+		&stats->cache_miss, &stats->cache_evict );
+
+	stats->mem = vips_tracked_get_mem();
+	stats->mem_highwater = vips_tracked_get_mem_highwater();
+	stats->allocs = vips_tracked_get_allocs();
+	stats->files = vips_tracked_get_files();
+
+	vips_buffer_arena_stats( &stats->buffer_hit,
+		&stats->buffer_miss, &stats->buffer_cached );
+
+	vips__window_stats( &stats->windows, &stats->window_bytes,
+		&stats->window_maps, &stats->window_unmaps );
+
+	vips__threadpool_wait_stats( &stats->threadpool_n_wait,
+		&stats->threadpool_wait_time );
+
+	vips_sink_disc_stats( &stats->sink_n_wait,
+		&stats->sink_wait_time, &stats->sink_bytes_written );
+
+	vips_vector_cache_get_stats( &stats->vector_hit,
+		&stats->vector_miss, &stats->vector_programs );
+
+	g_mutex_lock( vips_stats_lock );
+	stats->operations = g_new( VipsStatsOperation,
+		g_hash_table_size( vips_stats_classes ) );
+	g_hash_table_foreach( vips_stats_classes,
+		(GHFunc) vips_stats_class_add, stats );
+	g_mutex_unlock( vips_stats_lock );
+
+#ifdef DEBUG
+	printf( "vips_stats_snapshot: %d operation classes\n",
+		stats->n_operations );
+#endif /*DEBUG*/
+}
+
+/**
+ * vips_stats_clear:
+ * @stats: free the contents of this
+ *
+ * Free any memory vips_stats_snapshot() attached to @stats.
+ */
+void
+vips_stats_clear( VipsStats *stats )
+{
+	VIPS_FREE( stats->operations );
+	stats->n_operations = 0;
+}
@@ -21,6 +21,20 @@
  * 23/4/17
  * 	- add ->stall
  * 	- don't depend on image width when setting n_lines
+ * 16/10/17
+ * 	- borrow threads from a process-wide pool of workers rather than
+ * 	  creating and joining a set of threads for every pipeline
+ * 	- add vips_threadpool_run_concurrent() 
+ * 	- workers share a limited number of slots fairly between pipelines, 
+ * 	  see vips_image_set_priority()
+ * 	- workers pause when the pipeline's memory budget is spent, see
+ * 	  vips_image_set_memory_budget()
+ * 	- paused workers wait on the budget, rather than polling
+ * 	- vips_get_tile_size() can size tiles from the pixel size, the
+ * 	  pipeline length and the L2 cache, see vips_tile_size_set_adaptive()
+ * 	- count the time workers spend blocked, see vips_stats_snapshot()
+ * 	- keep the wait counters in 64 bits
+ * 	- reset the worker pool in the child after fork()
  */
 
 /*
@@ -67,6 +81,9 @@
 #include <unistd.h>
 #endif /*HAVE_UNISTD_H*/
 #include <errno.h>
+#ifdef HAVE_PTHREAD_ATFORK
+#include <pthread.h>
+#endif /*HAVE_PTHREAD_ATFORK*/
 
 #include <vips/vips.h>
 #include <vips/internal.h>
@@ -88,6 +105,16 @@
  * in turns to allocate units of work (a unit might be a tile in an image),
  * then run in parallel to process those units. An optional progress function
  * can be used to give feedback.
+ *
+ * Threads are borrowed from a process-wide pool of workers. The pool grows
+ * on demand, and idle workers exit after a timeout. See
+ * vips_threadpool_set_max_idle() and vips_threadpool_set_idle_timeout().
+ * After fork(), the child starts with an empty pool.
+ *
+ * When several pipelines run at once, the number of workers processing work 
+ * units is limited (see vips_threadpool_set_max_active()) and the available
+ * slots are shared between pipelines according to their priority (see
+ * vips_image_set_priority()).
  */
 
 /* Maximum number of concurrent threads we allow. No reason for the limit,
@@ -102,6 +129,12 @@ int vips__tile_height = VIPS__TILE_HEIGHT;
 int vips__fatstrip_height = VIPS__FATSTRIP_HEIGHT;
 int vips__thinstrip_height = VIPS__THINSTRIP_HEIGHT;
 
+/* Set to size tiles to fit the L2 cache rather than use the fixed geometry
+ * above, and the L2 size we aim for. The size is found on startup.
+ */
+gboolean vips__tile_adaptive = FALSE;
+size_t vips__l2_size = VIPS__L2_SIZE;
+
 /* Default n threads ... 0 means get from environment.
  */
 int vips__concurrency = 0;
@@ -110,10 +143,31 @@ int vips__concurrency = 0;
  */
 int vips__n_active_threads = 0; 
 
+/* The max number of idle workers we keep in the pool, and how long (in 
+ * seconds) an idle worker waits for a job before exiting. -1 for max_idle 
+ * means "use vips_concurrency_get()". 
+ */
+int vips__threadpool_max_idle = -1;
+int vips__threadpool_idle_timeout = 10;
+
+/* The max number of workers which can be processing work units at once, 
+ * over all pipelines. -1 means "use vips_concurrency_get()", 0 means no 
+ * limit.
+ */
+int vips__threadpool_max_active = -1;
+
 /* Set this GPrivate to indicate that this is a vips worker.
  */
 static GPrivate *is_worker_key = NULL;
 
+/* Workers set this to the VipsThread they are running.
+ */
+static GPrivate *current_thread_key = NULL;
+
+/* Attach pipeline priorities to images with this.
+ */
+static GQuark vips__image_priority_quark = 0;
+
 /* Set to stall threads for debugging.
  */
 static gboolean vips__stall = FALSE;
@@ -201,8 +255,9 @@ vips_thread_run( gpointer data )
 	 */
 	g_private_set( is_worker_key, data );
 
-	if( vips__thread_profile ) 
-		vips__thread_profile_attach( info->domain );
+	/* Always attach, profiling can be turned on at any time.
+	 */
+	vips__thread_profile_attach( info->domain );
 
 	result = info->func( info->data );
 
@@ -372,6 +427,50 @@ get_num_processors( void )
 	return( nproc );
 }
 
+/* Size of the L2 cache in bytes, or a guess.
+ */
+static size_t
+get_l2_size( void )
+{
+	size_t size;
+
+	size = VIPS__L2_SIZE;
+
+#if defined(HAVE_UNISTD_H) && defined(_SC_LEVEL2_CACHE_SIZE)
+{
+	/* glibc has this.
+	 */
+	long x;
+
+	x = sysconf( _SC_LEVEL2_CACHE_SIZE );
+	if( x > 0 )
+		return( x );
+}
+#endif
+
+#ifdef G_OS_UNIX
+{
+	/* Linux sysfs has "256K" or similar here. index2 is usually the
+	 * unified L2.
+	 */
+	char *contents;
+
+	if( g_file_get_contents( 
+		"/sys/devices/system/cpu/cpu0/cache/index2/size", 
+		&contents, NULL, NULL ) ) {
+		guint64 x;
+
+		x = vips__parse_size( contents );
+		g_free( contents );
+		if( x > 0 )
+			size = x;
+	}
+}
+#endif /*G_OS_UNIX*/
+
+	return( size );
+}
+
 /**
  * vips_concurrency_get:
  *
@@ -509,18 +608,15 @@ typedef struct {
 
 	VipsThreadState *state;
 
-	/* Thread we are running.
-	 */
-        GThread *thread;  	
-
-	/* Set this to ask the thread to exit.
-	 */
-	gboolean exit;	
-
 	/* Set by the thread if work or allocate return an error.
 	 */
 	gboolean error;	
 
+	/* Set while we hold a slot from the scheduler, ie. while we are
+	 * processing a work unit.
+	 */
+	gboolean has_slot;
+
 } VipsThread;
 
 /* What we track for a group of threads working together.
@@ -541,6 +637,10 @@ typedef struct _VipsThreadpool {
 	GMutex *allocate_lock;
         void *a; 		/* User argument to start / allocate / etc. */
 
+	/* Set if allocate is threadsafe and can run without allocate_lock.
+	 */
+	gboolean concurrent;
+
 	int nthr;		/* Number of threads in pool */
 	VipsThread **thr;	/* Threads */
 
@@ -559,24 +659,232 @@ typedef struct _VipsThreadpool {
 	/* Set by Allocate (via an arg) to indicate normal end of computation.
 	 */
 	gboolean stop;
+
+	/* This pipeline's weight when sharing worker slots, the number of 
+	 * our workers holding a slot (updated atomically), and the number 
+	 * queueing for one (protected by the sched lock).
+	 */
+	double weight;
+	volatile gint n_active;
+	int n_waiting;
+
+	/* Memory allocated by our workers is charged to this, if set. 
+	 * Workers pause when it's spent, and we count the number paused.
+	 */
+	VipsBudget *budget;
+	volatile gint n_throttled;
 } VipsThreadpool;
 
-/* Junk a thread.
+/* A thread in the process-wide set of workers. vips_threadpool_run() 
+ * borrows workers from here rather than starting a fresh set of threads 
+ * for every pipeline.
+ */
+typedef struct _VipsWorker {
+	GThread *thread;
+
+	/* The job we have been given, or NULL for an idle worker.
+	 */
+	VipsThread *thr;
+
+	/* Idle workers wait on this for a job.
+	 */
+	GCond *cond;
+
+	/* Set to ask an idle worker to exit.
+	 */
+	gboolean exit;
+} VipsWorker;
+
+/* Protects the worker lists.
+ */
+static GMutex *vips__worker_lock = NULL;
+
+/* Workers waiting for a job.
+ */
+static GSList *vips__worker_idle = NULL;
+static int vips__worker_n_idle = 0;
+
+/* Workers which have timed out and exited, but have not been joined yet.
+ */
+static GSList *vips__worker_zombie = NULL;
+
+/* Protects the scheduler's list of pipelines. Workers wait on the cond for 
+ * a slot.
+ */
+static GMutex *vips__sched_lock = NULL;
+static GCond *vips__sched_cond = NULL;
+
+/* Pipelines which are currently running.
+ */
+static GSList *vips__sched_pools = NULL;
+
+/* Number of workers holding a slot, and number queueing for one. Updated 
+ * atomically, so workers can take and return slots without the lock while 
+ * no one is queueing.
+ */
+static volatile gint vips__sched_active = 0;
+static volatile gint vips__sched_waiting = 0;
+
+/* Number of times workers have blocked, and the total time they spent 
+ * blocked, in microseconds. There are no portable 64-bit atomics, and a 
+ * 32-bit total would wrap after about 70 minutes, so these have a lock.
+ * Workers have just been blocked anyway, so it costs little.
+ */
+static GMutex *vips__threadpool_wait_lock = NULL;
+static guint64 vips__threadpool_n_wait = 0;
+static gint64 vips__threadpool_wait_time = 0;
+
+/* A worker has blocked since @start.
  */
 static void
-vips_thread_free( VipsThread *thr )
+vips_threadpool_add_wait( gint64 start )
+{
+	gint64 elapsed = vips__get_time() - start;
+
+	g_mutex_lock( vips__threadpool_wait_lock );
+	vips__threadpool_n_wait += 1;
+	vips__threadpool_wait_time += elapsed;
+	g_mutex_unlock( vips__threadpool_wait_lock );
+}
+
+/* The number of times workers have blocked on the allocate lock, for a 
+ * slot, or on a memory budget, and the total time in seconds they spent 
+ * waiting.
+ */
+void
+vips__threadpool_wait_stats( guint64 *n_wait, double *wait_time )
+{
+	g_mutex_lock( vips__threadpool_wait_lock );
+	*n_wait = vips__threadpool_n_wait;
+	*wait_time = (double) vips__threadpool_wait_time / G_USEC_PER_SEC;
+	g_mutex_unlock( vips__threadpool_wait_lock );
+}
+
+static int
+vips_sched_max_active( void )
+{
+	if( vips__threadpool_max_active < 0 )
+		return( vips_concurrency_get() );
+	else
+		return( vips__threadpool_max_active );
+}
+
+/* TRUE if no other queueing pipeline has a smaller share of active workers, 
+ * relative to its weight, than this one. The sched lock must be held.
+ */
+static gboolean
+vips_sched_is_fair( VipsThreadpool *pool )
+{
+	int n_active = g_atomic_int_get( &pool->n_active );
+
+	GSList *p;
+
+	for( p = vips__sched_pools; p; p = p->next ) {
+		VipsThreadpool *other = (VipsThreadpool *) p->data;
+
+		if( other != pool &&
+			other->n_waiting > 0 &&
+			g_atomic_int_get( &other->n_active ) * pool->weight < 
+				n_active * other->weight )
+			return( FALSE );
+	}
+
+	return( TRUE );
+}
+
+/* Try to take a slot, return TRUE for success. 
+ */
+static gboolean
+vips_sched_take( VipsThreadpool *pool, int max_active )
 {
-        /* Is there a thread running this region? Kill it!
-         */
-        if( thr->thread ) {
-                thr->exit = 1;
+	int active;
+
+	while( (active = g_atomic_int_get( &vips__sched_active )) < 
+		max_active ) 
+		if( g_atomic_int_compare_and_exchange( &vips__sched_active, 
+			active, active + 1 ) ) {
+			g_atomic_int_inc( &pool->n_active );
+			return( TRUE );
+		}
+
+	return( FALSE );
+}
+
+/* Block until the scheduler gives this thread a slot. 
+ */
+static void
+vips_sched_acquire( VipsThread *thr )
+{
+	VipsThreadpool *pool = thr->pool;
+	int max_active = vips_sched_max_active();
+
+	gint64 start;
+
+	g_assert( !thr->has_slot );
+
+	if( max_active <= 0 )
+		return;
+
+	/* Fast path: if no one is queueing, grab a free slot. 
+	 */
+	if( !g_atomic_int_get( &vips__sched_waiting ) &&
+		vips_sched_take( pool, max_active ) ) {
+		thr->has_slot = TRUE;
+		return;
+	}
 
-		/* Return value is always NULL (see thread_main_loop).
+	VIPS_GATE_START( "vips_sched_acquire: wait" ); 
+	start = vips__get_time();
+
+	g_mutex_lock( vips__sched_lock );
+
+	pool->n_waiting += 1;
+	g_atomic_int_inc( &vips__sched_waiting );
+	while( !vips_sched_is_fair( pool ) ||
+		!vips_sched_take( pool, max_active ) )
+		g_cond_wait( vips__sched_cond, vips__sched_lock );
+	pool->n_waiting -= 1;
+	(void) g_atomic_int_dec_and_test( &vips__sched_waiting );
+
+	/* Others may now be able to run.
+	 */
+	g_cond_broadcast( vips__sched_cond );
+
+	g_mutex_unlock( vips__sched_lock );
+
+	vips_threadpool_add_wait( start );
+	VIPS_GATE_STOP( "vips_sched_acquire: wait" ); 
+
+	thr->has_slot = TRUE;
+}
+
+static void
+vips_sched_release( VipsThread *thr )
+{
+	VipsThreadpool *pool = thr->pool;
+
+	if( thr->has_slot ) {
+		(void) g_atomic_int_dec_and_test( &pool->n_active );
+		(void) g_atomic_int_dec_and_test( &vips__sched_active );
+		thr->has_slot = FALSE;
+
+		/* If anyone is queueing, we must wake them. They hold the 
+		 * lock between counting themselves in and waiting, so we 
+		 * can't miss them.
 		 */
-		(void) vips_g_thread_join( thr->thread );
-		thr->thread = NULL;
-        }
+		if( g_atomic_int_get( &vips__sched_waiting ) ) {
+			g_mutex_lock( vips__sched_lock );
+			g_cond_broadcast( vips__sched_cond );
+			g_mutex_unlock( vips__sched_lock );
+		}
+	}
+}
 
+/* Junk a thread. The worker running it has already gone back to the pool.
+ */
+static void
+vips_thread_free( VipsThread *thr )
+{
 	VIPS_FREEF( g_object_unref, thr->state );
 	thr->pool = NULL;
 }
@@ -599,23 +907,24 @@ vips_thread_allocate( VipsThread *thr )
 	return( 0 );
 }
 
-/* Run this once per main loop. Get some work (single-threaded), then do it
- * (many-threaded).
- *
- * The very first workunit is also executed single-threaded. This gives
- * loaders a change to seek to the correct spot, see vips_sequential().
+/* Get a work unit with the allocate lock held. Return FALSE if there's no
+ * work for us.
  */
-static void
-vips_thread_work_unit( VipsThread *thr )
+static gboolean
+vips_thread_allocate_serial( VipsThread *thr )
 {
 	VipsThreadpool *pool = thr->pool;
 
-	if( thr->error )
-		return;
-
 	VIPS_GATE_START( "vips_thread_work_unit: wait" ); 
 
-	g_mutex_lock( pool->allocate_lock );
+	/* Only time the lock if we have to wait for it.
+	 */
+	if( !g_mutex_trylock( pool->allocate_lock ) ) {
+		gint64 start = vips__get_time();
+
+		g_mutex_lock( pool->allocate_lock );
+		vips_threadpool_add_wait( start );
+	}
 
 	VIPS_GATE_STOP( "vips_thread_work_unit: wait" ); 
 
@@ -623,25 +932,133 @@ vips_thread_work_unit( VipsThread *thr )
 	 */
 	if( pool->stop ) {
 		g_mutex_unlock( pool->allocate_lock );
-		return;
+		return( FALSE );
 	}
 
 	if( vips_thread_allocate( thr ) ) {
 		thr->error = TRUE;
 		pool->error = TRUE;
 		g_mutex_unlock( pool->allocate_lock );
-		return;
+		return( FALSE );
 	}
 
 	/* Have we just signalled stop?
 	 */
 	if( pool->stop ) {
 		g_mutex_unlock( pool->allocate_lock );
-		return;
+		return( FALSE );
 	}
 
 	g_mutex_unlock( pool->allocate_lock );
 
+	return( TRUE );
+}
+
+/* Get a work unit from a threadsafe allocate. Many workers can be in here at 
+ * once, so we can only set pool->stop, never clear it.
+ */
+static gboolean
+vips_thread_allocate_concurrent( VipsThread *thr )
+{
+	VipsThreadpool *pool = thr->pool;
+
+	gboolean stop;
+
+	if( pool->stop ) 
+		return( FALSE );
+
+	stop = FALSE;
+	if( pool->allocate( thr->state, pool->a, &stop ) ) {
+		thr->error = TRUE;
+		pool->error = TRUE;
+		return( FALSE );
+	}
+
+	/* Another worker might set pool->stop while we are allocating, but 
+	 * if we've got a work unit we must still process it.
+	 */
+	if( stop ) {
+		pool->stop = TRUE;
+		return( FALSE );
+	}
+
+	return( TRUE );
+}
+
+/* Stop waiting for the budget if the pool is shutting down, or if every 
+ * worker is waiting.
+ */
+static gboolean
+vips_thread_throttle_done( VipsThreadpool *pool )
+{
+	return( pool->stop ||
+		pool->error ||
+		g_atomic_int_get( &pool->n_throttled ) >= pool->nthr );
+}
+
+/* If the pipeline's memory budget is spent, wait for some memory to be 
+ * released before taking more work. One worker always keeps going, so we
+ * can't stall.
+ *
+ * Uncharging the budget wakes us, as does the last worker to throttle and
+ * any worker leaving the pool.
+ */
+static void
+vips_thread_throttle( VipsThread *thr )
+{
+	VipsThreadpool *pool = thr->pool;
+
+	gint64 start;
+
+	if( !pool->budget ||
+		!vips__budget_over( pool->budget ) )
+		return;
+
+	VIPS_GATE_START( "vips_thread_throttle: wait" ); 
+	start = vips__get_time();
+
+	g_atomic_int_inc( &pool->n_throttled );
+	if( g_atomic_int_get( &pool->n_throttled ) >= pool->nthr )
+		vips__budget_wake( pool->budget );
+	vips__budget_wait( pool->budget, 
+		(VipsBudgetDoneFn) vips_thread_throttle_done, pool );
+	g_atomic_int_add( &pool->n_throttled, -1 );
+
+	vips_threadpool_add_wait( start );
+	VIPS_GATE_STOP( "vips_thread_throttle: wait" ); 
+}
+
+/* Run this once per main loop. Get some work (single-threaded, unless the
+ * pool has a concurrent allocator), then do it (many-threaded).
+ *
+ * The very first workunit is also executed single-threaded. This gives
+ * loaders a change to seek to the correct spot, see vips_sequential().
+ */
+static void
+vips_thread_work_unit( VipsThread *thr )
+{
+	VipsThreadpool *pool = thr->pool;
+
+	gboolean allocated;
+
+	if( thr->error )
+		return;
+
+	vips_thread_throttle( thr );
+
+	/* The start function must always run single-threaded, so the first 
+	 * allocate for each thread always takes the lock. 
+	 */
+#ifdef HAVE_ATOMIC_INT_ADD
+	if( pool->concurrent &&
+		thr->state ) 
+		allocated = vips_thread_allocate_concurrent( thr );
+	else
+#endif /*HAVE_ATOMIC_INT_ADD*/
+		allocated = vips_thread_allocate_serial( thr );
+	if( !allocated )
+		return;
+
 	if( thr->state->stall &&
 		vips__stall ) { 
 		/* Sleep for 0.5s. Handy for stressing the seq system. Stall
@@ -653,26 +1070,30 @@ vips_thread_work_unit( VipsThread *thr )
 			"stall done, releasing y = %d ...\n", thr->state->y ); 
 	}
 
-	/* Process a work unit.
+	/* Process a work unit. We only hold a slot while we work, since
+	 * allocate can block waiting for other workers.
 	 */
+	vips_sched_acquire( thr );
 	if( pool->work( thr->state, pool->a ) ) { 
 		thr->error = TRUE;
 		pool->error = TRUE;
 	}
+	vips_sched_release( thr );
 }
 
-/* What runs as a thread ... loop, waiting to be told to do stuff.
+/* Run a thread's share of a pipeline ... loop, allocating and processing
+ * work units until the pool stops.
  */
-static void *
-vips_thread_main_loop( void *a )
+static void
+vips_thread_main_loop( VipsThread *thr )
 {
-        VipsThread *thr = (VipsThread *) a;
 	VipsThreadpool *pool = thr->pool;
 
-	g_assert( pool == thr->pool );
-
 	VIPS_GATE_START( "vips_thread_main_loop: thread" ); 
 
+	g_private_set( current_thread_key, thr );
+	vips__budget_set_current( pool->budget );
+
 	/* Process work units! Always tick, even if we are stopping, so the
 	 * main thread will wake up for exit. 
 	 */
@@ -687,70 +1108,285 @@ vips_thread_main_loop( void *a )
 			break;
 	} 
 
-	/* We are exiting: tell the main thread. 
+	g_private_set( current_thread_key, NULL );
+
+	/* This worker will go on to run other pipelines, so we must drop any 
+	 * buffers we have cached for this one. 
 	 */
-	vips_semaphore_up( &pool->finish );
+	vips__buffer_flush();
+	vips__budget_set_current( NULL );
+	vips__region_account_flush();
+
+	/* Workers throttled on the budget must see that we've stopped.
+	 */
+	if( pool->budget )
+		vips__budget_wake( pool->budget );
 
 	VIPS_GATE_STOP( "vips_thread_main_loop: thread" ); 
 
-        return( NULL );
+	/* We are done: tell the main thread. The pool can be freed as soon 
+	 * as this happens, so we must not touch it again.
+	 */
+	vips_semaphore_up( &pool->finish );
 }
 
-/* Attach another thread to a threadpool.
+/* Wait for a job, or for the idle timeout to expire. The worker lock must be
+ * held. Return FALSE on timeout.
  */
-static VipsThread *
-vips_thread_new( VipsThreadpool *pool )
+static gboolean
+vips_worker_wait( VipsWorker *worker )
 {
-	VipsThread *thr;
+	int timeout = VIPS_MAX( 0, vips__threadpool_idle_timeout );
 
-	if( !(thr = VIPS_NEW( pool->im, VipsThread )) )
-		return( NULL );
-	thr->pool = pool;
-	thr->state = NULL;
-	thr->thread = NULL;
-	thr->exit = 0;
-	thr->error = 0;
+#ifdef HAVE_COND_INIT
+	gint64 end_time;
 
-	/* We can't build the state here, it has to be done by the worker
-	 * itself the first time that allocate runs so that any regions are 
-	 * owned by the correct thread.
-	 */
+	end_time = g_get_monotonic_time() + timeout * G_TIME_SPAN_SECOND;
+	while( !worker->thr &&
+		!worker->exit ) 
+		if( !g_cond_wait_until( worker->cond, 
+			vips__worker_lock, end_time ) ) 
+			break;
+#else
+	GTimeVal end_time;
+
+	g_get_current_time( &end_time );
+	g_time_val_add( &end_time, timeout * G_USEC_PER_SEC );
+	while( !worker->thr &&
+		!worker->exit ) 
+		if( !g_cond_timed_wait( worker->cond, 
+			vips__worker_lock, &end_time ) ) 
+			break;
+#endif
 
-	if( !(thr->thread = vips_g_thread_new( "worker", 
-		vips_thread_main_loop, thr )) ) {  
-		vips_thread_free( thr );
-		return( NULL );
-	}
+	return( worker->thr != NULL );
+}
 
-	return( thr );
+static int
+vips_worker_max_idle( void )
+{
+	if( vips__threadpool_max_idle < 0 )
+		return( vips_concurrency_get() );
+	else
+		return( vips__threadpool_max_idle );
 }
 
-/* Kill all threads in a threadpool, if there are any.
+/* What runs as a thread ... loop, waiting to be handed jobs.
  */
-static void
-vips_threadpool_kill_threads( VipsThreadpool *pool )
+static void *
+vips_worker_main( void *a )
 {
-	if( pool->thr ) {
-		int i;
+	VipsWorker *worker = (VipsWorker *) a;
 
-		for( i = 0; i < pool->nthr; i++ ) 
-			if( pool->thr[i] ) {
-				vips_thread_free( pool->thr[i] );
-				pool->thr[i] = NULL;
-			}
+	g_mutex_lock( vips__worker_lock );
 
-		pool->thr = NULL;
+	for(;;) {
+		VipsThread *thr;
 
-		VIPS_DEBUG_MSG( "vips_threadpool_kill_threads: "
-			"killed %d threads\n", pool->nthr );
-	}
-}
+		if( !vips_worker_wait( worker ) ) 
+			break;
 
-/* This can be called multiple times, careful.
- */
-static int
-vips_threadpool_free( VipsThreadpool *pool )
-{
+		thr = worker->thr;
+
+		g_mutex_unlock( vips__worker_lock );
+
+		vips_thread_main_loop( thr ); 
+
+		g_mutex_lock( vips__worker_lock );
+
+		worker->thr = NULL;
+
+		if( worker->exit ||
+			vips__worker_n_idle >= vips_worker_max_idle() )
+			break;
+
+		vips__worker_idle = g_slist_prepend( vips__worker_idle, worker );
+		vips__worker_n_idle += 1;
+	} 
+
+	/* If we were asked to exit, the thread asking will join us. Otherwise
+	 * we've timed out or the pool is full: take ourselves off the idle
+	 * list and wait to be joined by the next user of the pool.
+	 */
+	if( !worker->exit ) {
+		if( g_slist_find( vips__worker_idle, worker ) ) {
+			vips__worker_idle = 
+				g_slist_remove( vips__worker_idle, worker );
+			vips__worker_n_idle -= 1;
+		}
+
+		vips__worker_zombie = 
+			g_slist_prepend( vips__worker_zombie, worker );
+	}
+
+	g_mutex_unlock( vips__worker_lock );
+
+        return( NULL );
+}
+
+static void
+vips_worker_free( VipsWorker *worker )
+{
+	if( worker->thread ) {
+		(void) vips_g_thread_join( worker->thread );
+		worker->thread = NULL;
+	}
+
+	VIPS_FREEF( vips_g_cond_free, worker->cond );
+	g_free( worker );
+}
+
+/* Join any workers which have exited.
+ */
+static void
+vips_worker_reap( void )
+{
+	GSList *zombie;
+
+	g_mutex_lock( vips__worker_lock );
+	zombie = vips__worker_zombie;
+	vips__worker_zombie = NULL;
+	g_mutex_unlock( vips__worker_lock );
+
+	g_slist_free_full( zombie, (GDestroyNotify) vips_worker_free );
+}
+
+/* Hand a thread to a worker, starting a new worker if none are idle.
+ */
+static int
+vips_worker_assign( VipsThread *thr )
+{
+	VipsWorker *worker;
+
+	vips_worker_reap();
+
+	g_mutex_lock( vips__worker_lock );
+
+	if( vips__worker_idle ) {
+		worker = (VipsWorker *) vips__worker_idle->data;
+		vips__worker_idle = g_slist_remove( vips__worker_idle, worker );
+		vips__worker_n_idle -= 1;
+
+		worker->thr = thr;
+		g_cond_signal( worker->cond );
+	}
+	else {
+		worker = g_new( VipsWorker, 1 );
+		worker->thread = NULL;
+		worker->thr = thr;
+		worker->cond = vips_g_cond_new();
+		worker->exit = FALSE;
+
+		/* We hold the lock during create, so the worker can't exit 
+		 * before we set ->thread.
+		 */
+		if( !(worker->thread = vips_g_thread_new( "worker", 
+			vips_worker_main, worker )) ) {
+			g_mutex_unlock( vips__worker_lock );
+			vips_worker_free( worker );
+			return( -1 );
+		}
+	}
+
+	g_mutex_unlock( vips__worker_lock );
+
+	return( 0 );
+}
+
+#ifdef HAVE_PTHREAD_ATFORK
+/* Hold the pool locks over fork(), so the child sees consistent lists.
+ */
+static void
+vips_worker_atfork_prepare( void )
+{
+	g_mutex_lock( vips__worker_lock );
+	g_mutex_lock( vips__sched_lock );
+}
+
+static void
+vips_worker_atfork_parent( void )
+{
+	g_mutex_unlock( vips__sched_lock );
+	g_mutex_unlock( vips__worker_lock );
+}
+
+/* Only the thread which called fork() exists in the child, so the pool's
+ * workers are gone. Forget them and start again with an empty pool. 
+ *
+ * We can't free the old workers or locks: their conds may have waiters 
+ * which no longer exist. Leak them instead.
+ */
+static void
+vips_worker_atfork_child( void )
+{
+	vips__worker_idle = NULL;
+	vips__worker_n_idle = 0;
+	vips__worker_zombie = NULL;
+	vips__sched_pools = NULL;
+	vips__sched_active = 0;
+	vips__sched_waiting = 0;
+
+	vips__worker_lock = vips_g_mutex_new();
+	vips__sched_lock = vips_g_mutex_new();
+	vips__sched_cond = vips_g_cond_new();
+	vips__threadpool_wait_lock = vips_g_mutex_new();
+}
+#endif /*HAVE_PTHREAD_ATFORK*/
+
+/* Attach another thread to a threadpool and hand it to a worker.
+ */
+static VipsThread *
+vips_thread_new( VipsThreadpool *pool )
+{
+	VipsThread *thr;
+
+	if( !(thr = VIPS_NEW( pool->im, VipsThread )) )
+		return( NULL );
+	thr->pool = pool;
+	thr->state = NULL;
+	thr->error = 0;
+	thr->has_slot = FALSE;
+
+	/* We can't build the state here, it has to be done by the worker
+	 * itself the first time that allocate runs so that any regions are 
+	 * owned by the correct thread.
+	 */
+
+	if( vips_worker_assign( thr ) ) {
+		vips_thread_free( thr );
+		return( NULL );
+	}
+
+	return( thr );
+}
+
+/* Free all threads in a threadpool, if there are any. Workers must have
+ * finished with them.
+ */
+static void
+vips_threadpool_kill_threads( VipsThreadpool *pool )
+{
+	if( pool->thr ) {
+		int i;
+
+		for( i = 0; i < pool->nthr; i++ ) 
+			if( pool->thr[i] ) {
+				vips_thread_free( pool->thr[i] );
+				pool->thr[i] = NULL;
+			}
+
+		pool->thr = NULL;
+
+		VIPS_DEBUG_MSG( "vips_threadpool_kill_threads: "
+			"killed %d threads\n", pool->nthr );
+	}
+}
+
+/* This can be called multiple times, careful.
+ */
+static int
+vips_threadpool_free( VipsThreadpool *pool )
+{
 	VIPS_DEBUG_MSG( "vips_threadpool_free: \"%s\" (%p)\n", 
 		pool->im->filename, pool );
 
@@ -758,6 +1394,7 @@ vips_threadpool_free( VipsThreadpool *pool )
 	VIPS_FREEF( vips_g_mutex_free, pool->allocate_lock );
 	vips_semaphore_destroy( &pool->finish );
 	vips_semaphore_destroy( &pool->tick );
+	VIPS_FREEF( vips__budget_unref, pool->budget );
 
 	return( 0 );
 }
@@ -768,6 +1405,44 @@ vips_threadpool_new_cb( VipsImage *im, VipsThreadpool *pool )
 	vips_threadpool_free( pool );
 }
 
+static void *
+vips_image_priority_max( VipsImage *image, int *priority, void *b )
+{
+	int image_priority;
+
+	if( (image_priority = vips_image_get_priority( image )) ) 
+		*priority = *priority ? 
+			VIPS_MAX( *priority, image_priority ) : image_priority;
+
+	return( NULL );
+}
+
+/* The priority of a pipeline is the highest priority set on any image in it.
+ */
+static int
+vips_image_get_pipeline_priority( VipsImage *image )
+{
+	int priority;
+
+	priority = 0;
+	(void) vips__link_map( image, TRUE, 
+		(VipsSListMap2Fn) vips_image_priority_max, &priority, NULL );
+
+	return( priority );
+}
+
+/* Priority 0 is weight 1, each step up adds another 1, each step down 
+ * divides.
+ */
+static double
+vips_threadpool_priority_weight( int priority )
+{
+	if( priority >= 0 )
+		return( 1.0 + priority );
+	else
+		return( 1.0 / (1 - priority) );
+}
+
 static VipsThreadpool *
 vips_threadpool_new( VipsImage *im )
 {
@@ -776,6 +1451,7 @@ vips_threadpool_new( VipsImage *im )
 	int tile_height;
 	gint64 n_tiles;
 	int n_lines;
+	size_t budget;
 
 	/* Allocate and init new thread block.
 	 */
@@ -785,12 +1461,27 @@ vips_threadpool_new( VipsImage *im )
 	pool->allocate = NULL;
 	pool->work = NULL;
 	pool->allocate_lock = vips_g_mutex_new();
+	pool->concurrent = FALSE;
 	pool->nthr = vips_concurrency_get();
 	pool->thr = NULL;
 	vips_semaphore_init( &pool->finish, 0, "finish" );
 	vips_semaphore_init( &pool->tick, 0, "tick" );
 	pool->error = FALSE;
 	pool->stop = FALSE;
+	pool->weight = vips_threadpool_priority_weight( 
+		vips_image_get_pipeline_priority( im ) );
+	pool->n_active = 0;
+	pool->n_waiting = 0;
+	pool->n_throttled = 0;
+
+	/* Use the pipeline's budget, or share the budget of the pipeline 
+	 * that's running us, if any.
+	 */
+	pool->budget = NULL;
+	if( (budget = vips__image_get_pipeline_budget( im )) )
+		pool->budget = vips__budget_new( budget );
+	else if( vips__budget_get_current() )
+		pool->budget = vips__budget_ref( vips__budget_get_current() );
 
 	/* If this is a tiny image, we won't need all nthr threads. Guess how
 	 * many tiles we might need to cover the image and use that to limit
@@ -833,7 +1524,13 @@ vips_threadpool_create_threads( VipsThreadpool *pool )
 	 */
 	for( i = 0; i < pool->nthr; i++ )
 		if( !(pool->thr[i] = vips_thread_new( pool )) ) {
+			/* Stop the threads we've started and wait for them
+			 * to return to the pool.
+			 */
+			pool->error = TRUE;
+			vips_semaphore_downn( &pool->finish, i );
 			vips_threadpool_kill_threads( pool );
+
 			return( -1 );
 		}
 
@@ -914,43 +1611,29 @@ vips_threadpool_create_threads( VipsThreadpool *pool )
  * Returns: 0 on success, or -1 on error
  */
 
-/**
- * vips_threadpool_run:
- * @im: image to loop over
- * @start: allocate per-thread state
- * @allocate: allocate a work unit
- * @work: process a work unit
- * @progress: give progress feedback about a work unit, or %NULL
- * @a: client data
- *
- * This function runs a set of threads over an image. Each thread first calls
- * @start to create new per-thread state, then runs
- * @allocate to set up a new work unit (perhaps the next tile in an image, for
- * example), then @work to process that work unit. After each unit is
- * processed, @progress is called, so that the operation can give
- * progress feedback. @progress may be %NULL.
- *
- * The object returned by @start must be an instance of a subclass of
- * #VipsThreadState. Use this to communicate between @allocate and @work. 
- *
- * @allocate and @start are always single-threaded (so they can write to the 
- * per-pool state), whereas @work can be executed concurrently. @progress is 
- * always called by 
- * the main thread (ie. the thread which called vips_threadpool_run()).
- *
- * See also: vips_concurrency_set().
- *
- * Returns: 0 on success, or -1 on error.
+/* Remove a pool from the scheduler. All workers must have finished.
  */
-int
-vips_threadpool_run( VipsImage *im, 
+static void
+vips_threadpool_unschedule( VipsThreadpool *pool )
+{
+	g_mutex_lock( vips__sched_lock );
+	g_assert( pool->n_active == 0 );
+	vips__sched_pools = g_slist_remove( vips__sched_pools, pool );
+	g_cond_broadcast( vips__sched_cond );
+	g_mutex_unlock( vips__sched_lock );
+}
+
+static int
+vips_threadpool_run_pool( VipsImage *im, 
 	VipsThreadStartFn start, 
 	VipsThreadpoolAllocateFn allocate, 
 	VipsThreadpoolWorkFn work,
 	VipsThreadpoolProgressFn progress, 
-	void *a )
+	void *a,
+	gboolean concurrent )
 {
 	VipsThreadpool *pool; 
+	VipsThread *caller;
 	int result;
 
 	if( !(pool = vips_threadpool_new( im )) )
@@ -960,10 +1643,23 @@ vips_threadpool_run( VipsImage *im,
 	pool->allocate = allocate;
 	pool->work = work;
 	pool->a = a;
+	pool->concurrent = concurrent;
+
+	/* If we're being run from inside a work unit, give up the caller's
+	 * slot while we wait, or nested pipelines could deadlock. The caller
+	 * will queue for a slot again on its next work unit. 
+	 */
+	if( (caller = g_private_get( current_thread_key )) )
+		vips_sched_release( caller );
+
+	g_mutex_lock( vips__sched_lock );
+	vips__sched_pools = g_slist_prepend( vips__sched_pools, pool );
+	g_mutex_unlock( vips__sched_lock );
 
 	/* Attach workers and set them going.
 	 */
 	if( vips_threadpool_create_threads( pool ) ) {
+		vips_threadpool_unschedule( pool );
 		vips_threadpool_free( pool );
 		return( -1 );
 	}
@@ -988,6 +1684,11 @@ vips_threadpool_run( VipsImage *im,
 			break;
 	}
 
+	/* Wake any workers throttled on the budget, so they see the error.
+	 */
+	if( pool->budget )
+		vips__budget_wake( pool->budget );
+
 	/* Wait for them all to hit finish.
 	 */
 	vips_semaphore_downn( &pool->finish, pool->nthr );
@@ -996,6 +1697,7 @@ vips_threadpool_run( VipsImage *im,
 	 */
 	result = pool->error ? -1 : 0;
 
+	vips_threadpool_unschedule( pool );
 	vips_threadpool_free( pool );
 
 	vips_image_minimise_all( im );
@@ -1003,24 +1705,339 @@ vips_threadpool_run( VipsImage *im,
 	return( result );
 }
 
+/**
+ * vips_threadpool_run:
+ * @im: image to loop over
+ * @start: allocate per-thread state
+ * @allocate: allocate a work unit
+ * @work: process a work unit
+ * @progress: give progress feedback about a work unit, or %NULL
+ * @a: client data
+ *
+ * This function runs a set of threads over an image. Each thread first calls
+ * @start to create new per-thread state, then runs
+ * @allocate to set up a new work unit (perhaps the next tile in an image, for
+ * example), then @work to process that work unit. After each unit is
+ * processed, @progress is called, so that the operation can give
+ * progress feedback. @progress may be %NULL.
+ *
+ * The object returned by @start must be an instance of a subclass of
+ * #VipsThreadState. Use this to communicate between @allocate and @work. 
+ *
+ * @allocate and @start are always single-threaded (so they can write to the 
+ * per-pool state), whereas @work can be executed concurrently. @progress is 
+ * always called by 
+ * the main thread (ie. the thread which called vips_threadpool_run()).
+ *
+ * See also: vips_concurrency_set().
+ *
+ * Returns: 0 on success, or -1 on error.
+ */
+int
+vips_threadpool_run( VipsImage *im, 
+	VipsThreadStartFn start, 
+	VipsThreadpoolAllocateFn allocate, 
+	VipsThreadpoolWorkFn work,
+	VipsThreadpoolProgressFn progress, 
+	void *a )
+{
+	return( vips_threadpool_run_pool( im, 
+		start, allocate, work, progress, a, FALSE ) );
+}
+
+/**
+ * vips_threadpool_run_concurrent:
+ * @im: image to loop over
+ * @start: allocate per-thread state
+ * @allocate: allocate a work unit
+ * @work: process a work unit
+ * @progress: give progress feedback about a work unit, or %NULL
+ * @a: client data
+ *
+ * As vips_threadpool_run(), but @allocate is threadsafe and may be run by 
+ * many workers at once. Workers will not wait on a pool-wide lock to 
+ * get their next work unit. 
+ *
+ * Use this for sinks which can number their work units in advance and hand 
+ * them out with an atomic counter. Sinks which must keep work in order 
+ * should use vips_threadpool_run(). 
+ *
+ * @start is still single-threaded, and the first @allocate for each thread 
+ * is made with @start. On platforms without atomic operations this is the
+ * same as vips_threadpool_run().
+ *
+ * See also: vips_threadpool_run().
+ *
+ * Returns: 0 on success, or -1 on error.
+ */
+int
+vips_threadpool_run_concurrent( VipsImage *im, 
+	VipsThreadStartFn start, 
+	VipsThreadpoolAllocateFn allocate, 
+	VipsThreadpoolWorkFn work,
+	VipsThreadpoolProgressFn progress, 
+	void *a )
+{
+	return( vips_threadpool_run_pool( im, 
+		start, allocate, work, progress, a, TRUE ) );
+}
+
 /* Start up threadpools. This is called during vips_init.
  */
 void
 vips__threadpool_init( void )
 {
+	const char *str;
+
 	/* We need to work with the pre-2.32 threading API.
 	 */
 #ifdef HAVE_PRIVATE_INIT
 	static GPrivate private = { 0 }; 
+	static GPrivate current = { 0 }; 
 
 	is_worker_key = &private;
+	current_thread_key = &current;
 #else
 	if( !is_worker_key ) 
 		is_worker_key = g_private_new( NULL ); 
+	if( !current_thread_key ) 
+		current_thread_key = g_private_new( NULL ); 
 #endif
 
 	if( g_getenv( "VIPS_STALL" ) )
 		vips__stall = TRUE;
+
+	if( !vips__worker_lock ) {
+		vips__worker_lock = vips_g_mutex_new();
+		vips__sched_lock = vips_g_mutex_new();
+		vips__sched_cond = vips_g_cond_new();
+		vips__threadpool_wait_lock = vips_g_mutex_new();
+
+#ifdef HAVE_PTHREAD_ATFORK
+		(void) pthread_atfork( vips_worker_atfork_prepare,
+			vips_worker_atfork_parent, 
+			vips_worker_atfork_child );
+#endif /*HAVE_PTHREAD_ATFORK*/
+	}
+	if( !vips__image_priority_quark )
+		vips__image_priority_quark = 
+			g_quark_from_static_string( "vips-image-priority" ); 
+
+	if( (str = g_getenv( "VIPS_THREADPOOL_MAX_IDLE" )) )
+		vips_threadpool_set_max_idle( atoi( str ) );
+	if( (str = g_getenv( "VIPS_THREADPOOL_IDLE_TIMEOUT" )) )
+		vips_threadpool_set_idle_timeout( atoi( str ) );
+	if( (str = g_getenv( "VIPS_THREADPOOL_MAX_ACTIVE" )) )
+		vips_threadpool_set_max_active( atoi( str ) );
+
+	vips__l2_size = get_l2_size();
+	if( (str = g_getenv( "VIPS_L2_SIZE" )) &&
+		vips__parse_size( str ) > 0 )
+		vips__l2_size = vips__parse_size( str );
+	if( g_getenv( "VIPS_ADAPTIVE_TILES" ) )
+		vips_tile_size_set_adaptive( TRUE );
+}
+
+/* Stop and join all idle workers. This is called during vips_shutdown.
+ */
+void
+vips__threadpool_shutdown( void )
+{
+	GSList *idle;
+	GSList *p;
+
+	if( !vips__worker_lock )
+		return;
+
+	g_mutex_lock( vips__worker_lock );
+	idle = vips__worker_idle;
+	vips__worker_idle = NULL;
+	vips__worker_n_idle = 0;
+	for( p = idle; p; p = p->next ) {
+		VipsWorker *worker = (VipsWorker *) p->data;
+
+		worker->exit = TRUE;
+		g_cond_signal( worker->cond );
+	}
+	g_mutex_unlock( vips__worker_lock );
+
+	g_slist_free_full( idle, (GDestroyNotify) vips_worker_free );
+
+	vips_worker_reap();
+}
+
+/**
+ * vips_threadpool_set_max_idle:
+ * @max_idle: max number of idle workers to keep
+ *
+ * vips_threadpool_run() borrows threads from a process-wide pool of 
+ * workers. When a pipeline finishes, its workers wait in the pool for more
+ * work. This sets the maximum number of idle workers that are kept. Workers 
+ * over this limit exit as soon as their pipeline finishes. 
+ *
+ * Set 0 to never keep idle workers. The special value -1 means "default", 
+ * and uses the value of vips_concurrency_get(). You can also set this with 
+ * the environment variable VIPS_THREADPOOL_MAX_IDLE.
+ *
+ * See also: vips_threadpool_set_idle_timeout().
+ */
+void
+vips_threadpool_set_max_idle( int max_idle )
+{
+	vips__threadpool_max_idle = VIPS_CLIP( -1, max_idle, MAX_THREADS );
+}
+
+/**
+ * vips_threadpool_set_idle_timeout:
+ * @timeout: seconds an idle worker waits for a new pipeline
+ *
+ * Idle workers in the pool exit if they are not given another pipeline to 
+ * work on within @timeout seconds. The default is 10 seconds. You can also 
+ * set this with the environment variable VIPS_THREADPOOL_IDLE_TIMEOUT.
+ *
+ * See also: vips_threadpool_set_max_idle().
+ */
+void
+vips_threadpool_set_idle_timeout( int timeout )
+{
+	vips__threadpool_idle_timeout = VIPS_MAX( 0, timeout );
+}
+
+/**
+ * vips_threadpool_set_max_active:
+ * @max_active: max number of workers processing work units at once
+ *
+ * Sets the maximum number of workers which can be processing work units at 
+ * the same time, over all pipelines in this process. If several pipelines 
+ * run at once, workers queue for a slot, and slots are shared fairly 
+ * between pipelines according to their priority. 
+ *
+ * The special value -1 means "default", and uses the value of 
+ * vips_concurrency_get(). Set 0 for no limit. You can also set this with 
+ * the environment variable VIPS_THREADPOOL_MAX_ACTIVE.
+ *
+ * See also: vips_image_set_priority(), vips_concurrency_set().
+ */
+void
+vips_threadpool_set_max_active( int max_active )
+{
+	vips__threadpool_max_active = VIPS_CLIP( -1, max_active, MAX_THREADS );
+}
+
+/**
+ * vips_image_set_priority: (method)
+ * @image: image to set
+ * @priority: scheduling priority
+ *
+ * Set the scheduling priority of pipelines which use @image. When several
+ * pipelines compete for worker slots, each pipeline gets a share in 
+ * proportion to its weight. Priority 0 (the default) has weight 1, each step
+ * above 0 adds 1 to the weight, and each step below 0 divides the weight, 
+ * so a priority 2 pipeline gets three times as many workers as a priority 
+ * 0 pipeline, and a priority -1 pipeline half as many. 
+ *
+ * A pipeline takes the highest priority set on any of its images, so you 
+ * can set this on the image you load or the image you save. 
+ *
+ * See also: vips_threadpool_set_max_active().
+ */
+void
+vips_image_set_priority( VipsImage *image, int priority )
+{
+	g_object_set_qdata( G_OBJECT( image ), 
+		vips__image_priority_quark, GINT_TO_POINTER( priority ) );
+}
+
+/**
+ * vips_image_get_priority: (method)
+ * @image: image to get from
+ *
+ * See also: vips_image_set_priority().
+ *
+ * Returns: the scheduling priority set on @image, or 0.
+ */
+int
+vips_image_get_priority( VipsImage *image )
+{
+	return( GPOINTER_TO_INT( g_object_get_qdata( G_OBJECT( image ), 
+		vips__image_priority_quark ) ) );
+}
+
+static void *
+vips_get_tile_size_count( VipsImage *image, void *a, void *b )
+{
+	int *depth = (int *) a;
+
+	*depth += 1;
+
+	return( NULL );
+}
+
+/* Size tiles so that the working set of a thread fits in half the L2 cache,
+ * leaving the rest for the operations' own tables and stack. Each image in
+ * the pipeline holds a region about the size of the tile, so the working 
+ * set is roughly tile pixels * pel size * pipeline depth. 
+ *
+ * This uses the pel size of the output as a guess for all the images 
+ * upstream.
+ */
+static void
+vips_get_tile_size_adaptive( VipsImage *im, int *tile_width, int *tile_height )
+{
+	int depth;
+	size_t budget;
+	size_t pel;
+	int side;
+
+	/* Count this image and everything upstream, but don't let very long
+	 * pipelines shrink tiles to nothing.
+	 */
+	depth = 0;
+	(void) vips__link_map( im, TRUE, 
+		(VipsSListMap2Fn) vips_get_tile_size_count, &depth, NULL );
+	depth = VIPS_CLIP( 1, depth, 16 );
+
+	pel = VIPS_MAX( 1, VIPS_IMAGE_SIZEOF_PEL( im ) );
+	budget = vips__l2_size / 2 / depth;
+
+	switch( im->dhint ) {
+	case VIPS_DEMAND_STYLE_SMALLTILE:
+		/* The largest power of two square that fits, from 16 to 512. 
+		 */
+		for( side = 512; side > 16; side /= 2 )
+			if( (size_t) side * side * pel <= budget ) 
+				break;
+		*tile_width = side;
+		*tile_height = side;
+		break;
+
+	case VIPS_DEMAND_STYLE_ANY:
+	case VIPS_DEMAND_STYLE_FATSTRIP:
+		/* As many full-width lines as fit, but stay within 4x the 
+		 * fixed strip height either way.
+		 */
+		*tile_width = im->Xsize;
+		*tile_height = budget / ((size_t) im->Xsize * pel);
+		*tile_height = VIPS_CLIP( 
+			VIPS_MAX( 1, vips__fatstrip_height / 4 ), 
+			*tile_height,
+			vips__fatstrip_height * 4 ); 
+		break;
+
+	case VIPS_DEMAND_STYLE_THINSTRIP:
+		/* Thinstrip is usually asked for by operations which must 
+		 * see single scanlines, leave it alone.
+		 */
+		*tile_width = im->Xsize;
+		*tile_height = vips__thinstrip_height;
+		break;
+
+	default:
+		g_assert_not_reached();
+	}
+
+	VIPS_DEBUG_MSG( "vips_get_tile_size_adaptive: depth = %d, "
+		"pel = %d, L2 = %d\n", depth, (int) pel, (int) vips__l2_size );
 }
 
 /**
@@ -1035,8 +2052,13 @@ vips__threadpool_init( void )
  * will always be a multiple of tile_height.
  *
  * The buffer height is the height of each buffer we fill in sink disc. Since
- * we have two buffers, the largest range of input locality is twice the output
- * buffer size, plus whatever margin we add for things like convolution. 
+ * we write behind through a ring of buffers, the largest range of input 
+ * locality is the output buffer size times the number of buffers, plus 
+ * whatever margin we add for things like convolution. 
+ *
+ * If adaptive tiling is on, see vips_tile_size_set_adaptive(), small tiles
+ * and fat strips are sized so that a tile of @im, and the matching area 
+ * of every image upstream of it, fit in the L2 cache. 
  */
 void
 vips_get_tile_size( VipsImage *im, 
@@ -1050,6 +2072,11 @@ vips_get_tile_size( VipsImage *im,
 	*tile_width = 1;
 	*tile_height = 1;
 
+	if( vips__tile_adaptive ) {
+		vips_get_tile_size_adaptive( im, tile_width, tile_height );
+		goto have_size;
+	}
+
 	/* Pick a render geometry.
 	 */
 	switch( im->dhint ) {
@@ -1073,6 +2100,7 @@ vips_get_tile_size( VipsImage *im,
 		g_assert_not_reached();
 	}
 
+have_size:
 	/* We can't set n_lines for the current demand style: a later bit of
 	 * the pipeline might see a different hint and we need to synchronise
 	 * buffer sizes everywhere.
@@ -1099,3 +2127,29 @@ vips_get_tile_size( VipsImage *im,
 		*tile_width, *tile_height, *n_lines );
 }
 
+
+/**
+ * vips_tile_size_set_adaptive:
+ * @adaptive: %TRUE to size tiles from the image and the host
+ *
+ * By default, vips_get_tile_size() uses a fixed tile geometry. With adaptive
+ * tiling on, small tiles and fat strips are sized from the size of each 
+ * pixel, the number of images in the pipeline and the size of the L2 
+ * cache, which is found on startup. 
+ *
+ * Small pixels through short pipelines get larger tiles, so there are 
+ * fewer calls to each operation. Large pixels through long pipelines get 
+ * smaller tiles, so the working set of each thread stays in cache.
+ *
+ * You can also turn this on with the environment variable 
+ * `VIPS_ADAPTIVE_TILES` or the command-line flag `--vips-adaptive-tiles`.
+ * Set `VIPS_L2_SIZE` to override the detected cache size, for example 
+ * "512k".
+ *
+ * See also: vips_get_tile_size().
+ */
+void
+vips_tile_size_set_adaptive( gboolean adaptive )
+{
+	vips__tile_adaptive = adaptive;
+}
@@ -2,6 +2,9 @@
  *
  * 29/10/10
  * 	- from morph hacking
+ * 16/10/17
+ * 	- share compiled programs between identical vectors, see 
+ * 	  vips_vector_cache_set_max()
  */
 
 /*
@@ -68,6 +71,32 @@
  */
 gboolean vips__vector_enabled = TRUE;
 
+/* A compiled program shared between identical vectors.
+ */
+typedef struct _VipsVectorCacheEntry {
+	/* The signature of the vectors this program was made from.
+	 */
+	char *signature;
+
+#ifdef HAVE_ORC
+	OrcProgram *program;
+#endif /*HAVE_ORC*/
+
+	/* Number of vectors using this program, and when it was last used.
+	 */
+	int ref_count;
+	int time;
+} VipsVectorCacheEntry;
+
+/* Signature -> VipsVectorCacheEntry. Protected by vips__global_lock, which
+ * we hold anyway for compiles.
+ */
+static GHashTable *vips_vector_cache = NULL;
+static int vips_vector_cache_max = 100;
+static int vips_vector_cache_time = 0;
+static guint64 vips_vector_cache_n_hit = 0;
+static guint64 vips_vector_cache_n_miss = 0;
+
 void
 vips_vector_error( VipsVector *vector )
 {
@@ -103,6 +132,75 @@ vips_vector_init( void )
 		g_getenv( "IM_NOVECTOR" ) ) 
 		vips__vector_enabled = FALSE;
 #endif /*HAVE_ORC*/
+
+	if( g_getenv( "VIPS_VECTOR_CACHE_MAX" ) )
+		vips_vector_cache_set_max( 
+			atoi( g_getenv( "VIPS_VECTOR_CACHE_MAX" ) ) );
+}
+
+static void
+vips_vector_cache_entry_free( VipsVectorCacheEntry *entry )
+{
+	g_assert( entry->ref_count == 0 );
+
+#ifdef HAVE_ORC
+	VIPS_FREEF( orc_program_free, entry->program );
+#endif /*HAVE_ORC*/
+	VIPS_FREE( entry->signature );
+	VIPS_FREE( entry );
+}
+
+static void
+vips_vector_cache_oldest_cb( const char *signature, 
+	VipsVectorCacheEntry *entry, VipsVectorCacheEntry **oldest )
+{
+	if( entry->ref_count == 0 &&
+		(!*oldest || 
+		 entry->time < (*oldest)->time) )
+		*oldest = entry;
+}
+
+/* Drop unused programs, oldest first, until we are under the limit. Call
+ * with vips__global_lock held.
+ */
+static void
+vips_vector_cache_trim( void )
+{
+	while( vips_vector_cache &&
+		g_hash_table_size( vips_vector_cache ) > 
+			vips_vector_cache_max ) {
+		VipsVectorCacheEntry *oldest;
+
+		oldest = NULL;
+		g_hash_table_foreach( vips_vector_cache, 
+			(GHFunc) vips_vector_cache_oldest_cb, &oldest );
+
+		/* Everything is in use.
+		 */
+		if( !oldest )
+			break;
+
+		g_hash_table_remove( vips_vector_cache, oldest->signature );
+		vips_vector_cache_entry_free( oldest );
+	}
+}
+
+/* Note part of the definition of a vector. Vectors with the same signature
+ * make identical programs with identical var numbers, so they can share
+ * the compiled program.
+ */
+static void
+vips_vector_sign( VipsVector *vector, const char *fmt, ... )
+{
+	va_list ap;
+	char *str;
+
+	va_start( ap, fmt );
+	str = g_strdup_vprintf( fmt, ap );
+	va_end( ap );
+	g_string_append( vector->signature, str );
+	g_string_append_c( vector->signature, ';' );
+	g_free( str );
 }
 
 gboolean 
@@ -137,8 +235,25 @@ vips_vector_free( VipsVector *vector )
 	printf( "orc_program_free( %s );\n", vector->unique_name ); 
 	printf( "%s = NULL;\n", vector->unique_name ); 
 #endif /*DEBUG_TRACE*/
+	if( vector->entry ) {
+		/* We share the program, drop our ref. It stays in the cache 
+		 * for the next vector like us.
+		 */
+		g_mutex_lock( vips__global_lock );
+		g_assert( vector->entry->ref_count > 0 );
+		vector->entry->ref_count -= 1;
+		vips_vector_cache_trim();
+		g_mutex_unlock( vips__global_lock );
+
+		vector->program = NULL;
+		vector->entry = NULL;
+	}
 	VIPS_FREEF( orc_program_free, vector->program );
 #endif /*HAVE_ORC*/
+	if( vector->signature ) {
+		g_string_free( vector->signature, TRUE );
+		vector->signature = NULL;
+	}
 	VIPS_FREE( vector->unique_name );
 	VIPS_FREE( vector );
 }
@@ -171,6 +286,8 @@ vips_vector_new( const char *name, int dsize )
 	vector->d1 = -1;
 
 	vector->compiled = FALSE;
+	vector->signature = g_string_new( NULL );
+	vector->entry = NULL;
 
 #ifdef HAVE_ORC
 	vector->program = orc_program_new();
@@ -196,6 +313,7 @@ vips_vector_asm2( VipsVector *vector,
 	const char *op, const char *a, const char *b )
 {
 	vector->n_instruction += 1;
+	vips_vector_sign( vector, "%s %s %s", op, a, b );
 
 #ifdef DEBUG
 	 printf( "  %s %s %s\n", op, a, b );
@@ -215,6 +333,7 @@ vips_vector_asm3( VipsVector *vector,
 	const char *op, const char *a, const char *b, const char *c )
 {
 	vector->n_instruction += 1;
+	vips_vector_sign( vector, "%s %s %s %s", op, a, b, c );
 
 #ifdef DEBUG
 	 printf( "  %s %s %s %s\n", op, a, b, c );
@@ -263,6 +382,8 @@ vips_vector_constant( VipsVector *vector, char *name, int value, int size )
 		if( !orc_program_add_constant( vector->program, 
 			size, value, name ) )
 			vips_vector_error( vector );
+		vips_vector_sign( vector, "constant %s %d %d", 
+			name, size, value );
 		vector->n_constant += 1;
 	}
 #endif /*HAVE_ORC*/
@@ -285,6 +406,7 @@ vips_vector_source_scanline( VipsVector *vector,
 		printf( "orc_program_add_source( %s, %d, \"%s\" );\n",
 			vector->unique_name, size, name );
 #endif /*DEBUG_TRACE*/
+		vips_vector_sign( vector, "scanline %s %d", name, size );
 		vector->sl[vector->n_scanline] = var;
 		vector->line[vector->n_scanline] = line;
 		vector->n_scanline += 1;
@@ -302,6 +424,7 @@ vips_vector_source_name( VipsVector *vector, const char *name, int size )
 
 	if( !(var = orc_program_add_source( vector->program, size, name )) )
 		vips_vector_error( vector ); 
+	vips_vector_sign( vector, "source %s %d", name, size );
 	vector->s[vector->n_source] = var;
 #ifdef DEBUG_TRACE
 	printf( "orc_program_add_source( %s, %d, \"%s\" );\n", 
@@ -323,6 +446,7 @@ vips_vector_temporary( VipsVector *vector, const char *name, int size )
 
 	if( !orc_program_add_temporary( vector->program, size, name ) )
 		vips_vector_error( vector ); 
+	vips_vector_sign( vector, "temporary %s %d", name, size );
 
 #ifdef DEBUG_TRACE
 	printf( "orc_program_add_temporary( %s, %d, \"%s\" );\n",
@@ -343,6 +467,7 @@ vips_vector_parameter( VipsVector *vector, const char *name, int size )
 	var = orc_program_add_parameter( vector->program, size, name );
 	if( !var )
 		vips_vector_error( vector ); 
+	vips_vector_sign( vector, "parameter %s %d", name, size );
 
 #ifdef DEBUG_TRACE
 	printf( "orc_program_add_parameter( %s, %d, \"%s\" );\n",
@@ -365,6 +490,7 @@ vips_vector_destination( VipsVector *vector, const char *name, int size )
 	g_assert( orc_program_find_var_by_name( vector->program, name ) == -1 );
 
 	var = orc_program_add_destination( vector->program, size, name );
+	vips_vector_sign( vector, "destination %s %d", name, size );
 #ifdef DEBUG_TRACE
 	printf( "orc_program_add_destination( %d, \"%s\" );\n",
 		size, name );
@@ -415,11 +541,52 @@ vips_vector_compile( VipsVector *vector )
 {
 #ifdef HAVE_ORC
 	OrcCompileResult result;
+	VipsVectorCacheEntry *entry;
+
+	g_assert( !vector->entry );
 
 	/* Some orcs seem to be unstable with many compilers active at once.
 	 */
 	g_mutex_lock( vips__global_lock );
+
+	if( !vips_vector_cache )
+		vips_vector_cache = g_hash_table_new( g_str_hash, g_str_equal );
+
+	/* Has an identical vector been compiled already? Use that program 
+	 * instead.
+	 */
+	if( (entry = g_hash_table_lookup( vips_vector_cache, 
+		vector->signature->str )) ) {
+		entry->ref_count += 1;
+		entry->time = vips_vector_cache_time++;
+		vips_vector_cache_n_hit += 1;
+		g_mutex_unlock( vips__global_lock );
+
+		VIPS_FREEF( orc_program_free, vector->program );
+		vector->program = entry->program;
+		vector->entry = entry;
+		vector->compiled = TRUE;
+
+		return( TRUE );
+	}
+
+	vips_vector_cache_n_miss += 1;
 	result = orc_program_compile( vector->program );
+
+	if( ORC_COMPILE_RESULT_IS_SUCCESSFUL( result ) &&
+		vips_vector_cache_max > 0 ) {
+		entry = VIPS_NEW( NULL, VipsVectorCacheEntry );
+		entry->signature = g_strdup( vector->signature->str );
+		entry->program = vector->program;
+		entry->ref_count = 1;
+		entry->time = vips_vector_cache_time++;
+		g_hash_table_insert( vips_vector_cache, 
+			entry->signature, entry );
+		vector->entry = entry;
+
+		vips_vector_cache_trim();
+	}
+
 	g_mutex_unlock( vips__global_lock );
 
 #ifdef DEBUG_TRACE
@@ -603,3 +770,52 @@ vips_vector_to_fixed_point( double *in, int *out, int n, int scale )
 			out[i] += direction;
 	}
 }
+
+/**
+ * vips_vector_cache_set_max:
+ * @max: maximum number of programs to keep
+ *
+ * Vectors which are built in the same way share a single compiled program. 
+ * For example, two vips_conv() calls with the same mask will compile only
+ * once. Programs are kept after the last vector using them is freed, up to
+ * @max programs. 
+ *
+ * Set @max to 0 to disable sharing. The default is 100. You can also set 
+ * this with the environment variable `VIPS_VECTOR_CACHE_MAX`.
+ *
+ * See also: vips_vector_cache_get_stats().
+ */
+void
+vips_vector_cache_set_max( int max )
+{
+	g_mutex_lock( vips__global_lock );
+	vips_vector_cache_max = VIPS_MAX( 0, max );
+	vips_vector_cache_trim();
+	g_mutex_unlock( vips__global_lock );
+}
+
+/**
+ * vips_vector_cache_get_stats:
+ * @n_hit: (out) (allow-none): return the number of compiles we skipped
+ * @n_miss: (out) (allow-none): return the number of programs compiled
+ * @n_program: (out) (allow-none): return the number of programs held
+ *
+ * Get counts for the compiled program cache. 
+ *
+ * See also: vips_vector_cache_set_max().
+ */
+void
+vips_vector_cache_get_stats( guint64 *n_hit, guint64 *n_miss, int *n_program )
+{
+	g_mutex_lock( vips__global_lock );
+
+	if( n_hit )
+		*n_hit = vips_vector_cache_n_hit;
+	if( n_miss )
+		*n_miss = vips_vector_cache_n_miss;
+	if( n_program )
+		*n_program = vips_vector_cache ? 
+			g_hash_table_size( vips_vector_cache ) : 0;
+
+	g_mutex_unlock( vips__global_lock );
+}
@@ -21,6 +21,8 @@
  * 	- use expat for xml read, printf for xml write
  * 16/8/17
  * 	- validate strs as being utf-8 before we write
+ * 16/10/17
+ * 	- add an optional tiled layout, see vips__tiled_write()
  */
 
 /*
@@ -145,6 +147,17 @@
  */
 #define NAMESPACE_URI "http://www.vips.ecs.soton.ac.uk/" 
 
+/* Tiled vips files have Compression set to VIPS__COMPRESSION_TILED and Level
+ * set to the tile size. Tiles are stored a line at a time with a byte 
+ * difference predictor and PackBits run-length coding, in any order. 
+ *
+ * After the tiles comes the index: a guint64 offset and length for each tile,
+ * in the file's byte order, tiles numbered across then down. The offset of 
+ * the index goes in the spare header bytes at VIPS_TILED_OFFSET. The 
+ * extension block follows the index.
+ */
+#define VIPS_TILED_OFFSET (56)
+
 /* Open for read for image files. 
  */
 int
@@ -200,15 +213,76 @@ vips__open_image_write( const char *filename, gboolean temp )
 	return( fd );
 }
 
+/* The number of guint64 in the index of a tiled image, or 0 for a bad tile
+ * size, or an index too large to hold in memory.
+ */
+static size_t
+image_tiled_n_index( VipsImage *image )
+{
+	int ts = image->Level;
+
+	guint64 across;
+	guint64 down;
+
+	if( ts < VIPS__TILED_MIN ||
+		ts > VIPS__TILED_MAX )
+		return( 0 );
+
+	across = VIPS_ROUND_UP( (guint64) image->Xsize, ts ) / ts;
+	down = VIPS_ROUND_UP( (guint64) image->Ysize, ts ) / ts;
+	if( across * down > G_MAXSIZE / (2 * sizeof( guint64 )) )
+		return( 0 );
+
+	return( across * down * 2 );
+}
+
+/* The offset of the tile index, from the spare header bytes. 
+ */
+static int
+image_tiled_index_offset( VipsImage *image, guint64 *offset )
+{
+	if( image->fd == -1 ||
+		vips__seek( image->fd, VIPS_TILED_OFFSET ) ||
+		read( image->fd, offset, 8 ) != 8 )
+		return( -1 );
+	if( vips_amiMSBfirst() != (image->magic == VIPS_MAGIC_SPARC) )
+		*offset = GUINT64_SWAP_LE_BE( *offset );
+
+	return( 0 );
+}
+
 /* Predict the size of the header plus pixel data. Don't use off_t,
  * it's sometimes only 32 bits (eg. on many windows build environments) and we
  * want to always be 64 bit.
+ *
+ * For tiled images, this is the end of the tile index.
  */
+static gint64
+image_tiled_length( VipsImage *image )
+{
+	guint64 offset;
+	size_t n_index;
+
+	if( image_tiled_index_offset( image, &offset ) ||
+		offset < (guint64) image->sizeof_header ||
+		offset > G_MAXINT64 / 2 ||
+		!(n_index = image_tiled_n_index( image )) ||
+		n_index > G_MAXINT64 / 2 / sizeof( guint64 ) )
+		return( image->sizeof_header );
+
+	return( offset + n_index * sizeof( guint64 ) );
+}
+
 static gint64
 image_pixel_length( VipsImage *image )
 {
 	gint64 psize;
 
+	/* Tiled images record where the tiles end.
+	 */
+	if( image->Compression == VIPS__COMPRESSION_TILED )
+		return( image_tiled_length( image ) );
+
 	switch( image->Coding ) {
 	case VIPS_CODING_LABQ:
 	case VIPS_CODING_RAD:
@@ -380,9 +454,12 @@ vips__write_header_bytes( VipsImage *im, unsigned char *to )
 		q += fields[i].size;
 	}
 
-	/* Pad spares with zeros.
+	/* Pad spares with zeros. Tiled images keep the end of the pixels in 
+	 * the spare bytes, leave that alone, see vips__tiled_write().
 	 */
-	while( q - to < im->sizeof_header )
+	while( q - to < im->sizeof_header &&
+		(im->Compression != VIPS__COMPRESSION_TILED ||
+		 q - to < VIPS_TILED_OFFSET) )
 		*q++ = 0;
 
 #ifdef SHOW_HEADER
@@ -959,6 +1036,406 @@ vips__writehist( VipsImage *image )
 	return( 0 );
 }
 
+/* PackBits-code n bytes from p to q, return the number of bytes we wrote.
+ */
+static size_t
+vips_tiled_pack( VipsPel *q, VipsPel *p, size_t n )
+{
+	VipsPel *q0 = q;
+
+	size_t i;
+
+	i = 0;
+	while( i < n ) {
+		size_t run;
+
+		for( run = 1; i + run < n && 
+			run < 128 && 
+			p[i + run] == p[i]; run++ )
+			;
+
+		if( run >= 3 ) {
+			*q++ = (VipsPel) (257 - run);
+			*q++ = p[i];
+			i += run;
+		}
+		else {
+			size_t start = i;
+
+			/* Literals up to the next run of 3 or more.
+			 */
+			do 
+				i += 1;
+			while( i < n && 
+				i - start < 128 &&
+				!(i + 2 < n && 
+				  p[i] == p[i + 1] && 
+				  p[i] == p[i + 2]) );
+
+			*q++ = (VipsPel) (i - start - 1);
+			memcpy( q, p + start, i - start );
+			q += i - start;
+		}
+	}
+
+	return( q - q0 );
+}
+
+/* Undo vips_tiled_pack() for n bytes. Return the number of bytes we used 
+ * from p, or -1 if we run off the end.
+ */
+static gint64
+vips_tiled_unpack( VipsPel *q, size_t n, VipsPel *p, size_t length )
+{
+	size_t i;
+	size_t j;
+
+	i = 0;
+	j = 0;
+	while( i < n ) {
+		int code;
+		size_t run;
+
+		if( j >= length )
+			return( -1 );
+		code = p[j++];
+
+		if( code < 128 ) {
+			run = code + 1;
+			if( i + run > n ||
+				j + run > length )
+				return( -1 );
+			memcpy( q + i, p + j, run );
+			j += run;
+		}
+		else if( code > 128 ) {
+			run = 257 - code;
+			if( i + run > n ||
+				j >= length )
+				return( -1 );
+			memset( q + i, p[j], run );
+			j += 1;
+		}
+		else
+			run = 0;
+
+		i += run;
+	}
+
+	return( j );
+}
+
+/* Code width * height pixels of ps bytes from p, lskip bytes between lines, 
+ * to q. Return the number of bytes we wrote. line is scratch space for one 
+ * line. q must have room for height * VIPS__RLE_BOUND( width * ps ) bytes.
+ *
+ * Also used by the compressed spill store, see spill.c.
+ */
+size_t
+vips__rle_encode( VipsPel *q, VipsPel *p, size_t lskip, 
+	int width, int height, size_t ps, VipsPel *line )
+{
+	size_t n = width * ps;
+
+	size_t length;
+	size_t i;
+	int y;
+
+	length = 0;
+	for( y = 0; y < height; y++, p += lskip ) {
+		/* Difference each byte against the same byte in the pixel to
+		 * the left.
+		 */
+		for( i = 0; i < ps; i++ )
+			line[i] = p[i];
+		for( i = ps; i < n; i++ )
+			line[i] = p[i] - p[i - ps];
+
+		length += vips_tiled_pack( q + length, line, n );
+	}
+
+	return( length );
+}
+
+/* Undo vips__rle_encode() to a packed width * height array of pixels.
+ */
+int
+vips__rle_decode( VipsPel *q, int width, int height, size_t ps, 
+	VipsPel *p, size_t length )
+{
+	size_t n = width * ps;
+
+	size_t i;
+	int y;
+
+	for( y = 0; y < height; y++ ) {
+		gint64 used;
+
+		if( (used = vips_tiled_unpack( q, n, p, length )) < 0 ) 
+			return( -1 );
+		p += used;
+		length -= used;
+
+		for( i = ps; i < n; i++ )
+			q[i] += q[i - ps];
+
+		q += n;
+	}
+
+	return( 0 );
+}
+
+/* State for reading a tiled vips file.
+ */
+typedef struct _VipsTiled {
+	char *filename;
+	int fd;
+
+	int tile_size;
+	int across;
+	int down;
+	size_t sizeof_pel;
+
+	/* Offset and length of each tile, in our byte order.
+	 */
+	guint64 *index;
+
+	/* Serialise seek/read on fd. Tiles are decoded outside the lock.
+	 */
+	GMutex *lock;
+} VipsTiled;
+
+static void
+vips_tiled_close_cb( VipsImage *image, VipsTiled *tiled )
+{
+	if( tiled->fd != -1 ) {
+		vips_tracked_close( tiled->fd );
+		tiled->fd = -1;
+	}
+	VIPS_FREE( tiled->index );
+	VIPS_FREEF( vips_g_mutex_free, tiled->lock );
+}
+
+/* Each sequence has a buffer for a decoded tile, followed by a buffer for a 
+ * coded tile.
+ */
+static void *
+vips_tiled_start( VipsImage *out, void *a, void *b )
+{
+	VipsTiled *tiled = (VipsTiled *) a;
+	size_t n = tiled->tile_size * tiled->sizeof_pel;
+
+	return( vips_malloc( NULL, 
+		tiled->tile_size * (n + VIPS__RLE_BOUND( n )) ) );
+}
+
+static int
+vips_tiled_generate( VipsRegion *or, 
+	void *seq, void *a, void *b, gboolean *stop )
+{
+	VipsTiled *tiled = (VipsTiled *) a;
+	VipsRect *r = &or->valid;
+	int ts = tiled->tile_size;
+	size_t ps = tiled->sizeof_pel;
+	VipsPel *pixels = (VipsPel *) seq;
+	VipsPel *buf = pixels + ts * ts * ps;
+
+	int x, y, z;
+
+	for( y = r->top / ts; y * ts < VIPS_RECT_BOTTOM( r ); y++ ) 
+		for( x = r->left / ts; x * ts < VIPS_RECT_RIGHT( r ); x++ ) {
+			int tile = y * tiled->across + x;
+			gint64 offset = tiled->index[tile * 2];
+			size_t length = tiled->index[tile * 2 + 1];
+
+			VipsRect area;
+			VipsRect hit;
+
+			area.left = x * ts;
+			area.top = y * ts;
+			area.width = VIPS_MIN( ts, or->im->Xsize - area.left );
+			area.height = VIPS_MIN( ts, or->im->Ysize - area.top );
+
+			g_mutex_lock( tiled->lock );
+			if( vips__seek( tiled->fd, offset ) ||
+				read( tiled->fd, buf, length ) != 
+					(ssize_t) length ) {
+				g_mutex_unlock( tiled->lock );
+				vips_error( "VipsImage", 
+					_( "unable to read tile from \"%s\"" ),
+					tiled->filename );
+				return( -1 );
+			}
+			g_mutex_unlock( tiled->lock );
+
+			if( vips__rle_decode( pixels, 
+				area.width, area.height, ps, buf, length ) ) {
+				vips_error( "VipsImage", 
+					_( "corrupt tile in \"%s\"" ), 
+					tiled->filename );
+				return( -1 );
+			}
+
+			vips_rect_intersectrect( r, &area, &hit );
+			for( z = 0; z < hit.height; z++ ) {
+				VipsPel *p = pixels + ps * 
+					((hit.top - area.top + z) * area.width + 
+					 hit.left - area.left);
+				VipsPel *q = VIPS_REGION_ADDR( or, 
+					hit.left, hit.top + z );
+
+				memcpy( q, p, hit.width * ps );
+			}
+		}
+
+	return( 0 );
+}
+
+static int
+vips_tiled_stop( void *seq, void *a, void *b )
+{
+	vips_free( seq );
+
+	return( 0 );
+}
+
+/* image has had the header and the extension block read. Replace the pixels 
+ * with a partial image that decodes tiles on demand. 
+ */
+static int
+vips_image_open_tiled( VipsImage *image )
+{
+	int ts = image->Level;
+
+	VipsImage *raw;
+	VipsImage *t;
+	VipsTiled *tiled;
+	size_t n_index;
+	guint64 index_offset;
+	guint64 tile_bytes;
+	guint64 max_length;
+	gboolean swap;
+	size_t i;
+
+	if( !(n_index = image_tiled_n_index( image )) ) {
+		vips_error( "VipsImage", _( "bad tile size in \"%s\"" ), 
+			image->filename );
+		return( -1 );
+	}
+
+	/* The largest coded tile we can accept. Each sequence holds a 
+	 * decoded and a coded tile, so check the pair fits in a size_t.
+	 */
+	tile_bytes = (guint64) ts * ts * VIPS_IMAGE_SIZEOF_PEL( image );
+	max_length = (guint64) ts * 
+		VIPS__RLE_BOUND( (guint64) ts * VIPS_IMAGE_SIZEOF_PEL( image ) );
+	if( tile_bytes + max_length > G_MAXSIZE / 2 ) {
+		vips_error( "VipsImage", _( "tiles too large in \"%s\"" ), 
+			image->filename );
+		return( -1 );
+	}
+
+	if( image_tiled_index_offset( image, &index_offset ) ||
+		index_offset < (guint64) image->sizeof_header ||
+		index_offset > (guint64) image->file_length ||
+		(guint64) image->file_length - index_offset < 
+			n_index * sizeof( guint64 ) ) {
+		vips_error( "VipsImage", _( "no tile index in \"%s\"" ), 
+			image->filename );
+		return( -1 );
+	}
+
+	raw = vips_image_new();
+	vips_object_local( image, raw );
+
+	if( !(tiled = VIPS_NEW( raw, VipsTiled )) )
+		return( -1 );
+	tiled->filename = vips_strdup( VIPS_OBJECT( raw ), image->filename );
+	tiled->fd = -1;
+	tiled->tile_size = ts;
+	tiled->across = VIPS_ROUND_UP( image->Xsize, ts ) / ts;
+	tiled->down = VIPS_ROUND_UP( image->Ysize, ts ) / ts;
+	tiled->sizeof_pel = VIPS_IMAGE_SIZEOF_PEL( image );
+	tiled->index = NULL;
+	tiled->lock = vips_g_mutex_new();
+	g_signal_connect( raw, "close", 
+		G_CALLBACK( vips_tiled_close_cb ), tiled );
+
+	if( !(tiled->index = VIPS_ARRAY( NULL, n_index, guint64 )) )
+		return( -1 );
+	if( vips__seek( image->fd, index_offset ) ||
+		read( image->fd, tiled->index, n_index * sizeof( guint64 ) ) !=
+			(ssize_t) (n_index * sizeof( guint64 )) ) {
+		vips_error( "VipsImage", 
+			_( "unable to read tile index from \"%s\"" ), 
+			image->filename );
+		return( -1 );
+	}
+
+	/* Check every tile is inside the tile area and is no bigger than the 
+	 * worst case, so we can't overflow the sequence buffers.
+	 */
+	swap = vips_amiMSBfirst() != (image->magic == VIPS_MAGIC_SPARC);
+	for( i = 0; i < n_index; i += 2 ) {
+		guint64 *entry = tiled->index + i;
+
+		if( swap ) {
+			entry[0] = GUINT64_SWAP_LE_BE( entry[0] );
+			entry[1] = GUINT64_SWAP_LE_BE( entry[1] );
+		}
+
+		if( entry[0] < (guint64) image->sizeof_header ||
+			entry[0] > index_offset ||
+			entry[1] == 0 ||
+			entry[1] > max_length ||
+			entry[1] > index_offset - entry[0] ) {
+			vips_error( "VipsImage", _( "bad tile index in \"%s\"" ),
+				image->filename );
+			return( -1 );
+		}
+	}
+
+	/* The tile reader owns the fd now.
+	 */
+	tiled->fd = image->fd;
+	image->fd = -1;
+
+	vips_image_init_fields( raw, 
+		image->Xsize, image->Ysize, image->Bands, image->BandFmt,
+		image->Coding, image->Type, image->Xres, image->Yres );
+	raw->Xoffset = image->Xoffset;
+	raw->Yoffset = image->Yoffset;
+	raw->magic = image->magic;
+
+	if( vips_image_pipelinev( raw, VIPS_DEMAND_STYLE_SMALLTILE, NULL ) ||
+		vips_image_generate( raw, 
+			vips_tiled_start, vips_tiled_generate, vips_tiled_stop, 
+			tiled, NULL ) )
+		return( -1 );
+
+	/* Keep enough decoded tiles for a couple of rows, so strip-wise 
+	 * readers don't decode each tile many times. 
+	 */
+	if( vips_tilecache( raw, &t, 
+		"tile_width", ts, 
+		"tile_height", ts,
+		"max_tiles", 2 * tiled->across + 2,
+		"threaded", TRUE,
+		NULL ) ) 
+		return( -1 );
+
+	image->dtype = VIPS_IMAGE_PARTIAL;
+	image->Compression = 0;
+	image->Level = 0;
+	if( vips_image_write( t, image ) ) {
+		g_object_unref( t );
+		return( -1 );
+	}
+	g_object_unref( t );
+
+	return( 0 );
+}
+
 /* Open the filename, read the header, some sanity checking.
  */
 int
@@ -1018,6 +1495,22 @@ vips_image_open_input( VipsImage *image )
 		vips_error_clear();
 	}
 
+	switch( image->Compression ) {
+	case 0:
+		break;
+
+	case VIPS__COMPRESSION_TILED:
+		if( vips_image_open_tiled( image ) )
+			return( -1 );
+		break;
+
+	default:
+		vips_error( "VipsImage", 
+			_( "unsupported compression in \"%s\"" ), 
+			image->filename );
+		return( -1 );
+	}
+
 	return( 0 );
 }
 
@@ -1034,6 +1527,8 @@ vips_image_open_output( VipsImage *image )
 			image->delete_on_close )) < 0 )
 			return( -1 );
 
+		memset( header, 0, VIPS_SIZEOF_HEADER );
+
 		/* We always write in native mode, so we must overwrite the
 		 * magic we read from the file originally.
 		 */
@@ -1047,3 +1542,153 @@ vips_image_open_output( VipsImage *image )
 
 	return( 0 );
 }
+
+/* State for writing a tiled vips file.
+ */
+typedef struct _VipsTiledWrite {
+	VipsImage *in;
+	VipsImage *image;
+	int tile_size;
+	int across;
+
+	/* Offset and length of each tile.
+	 */
+	guint64 *index;
+
+	/* Serialise appends to the file. Tiles are coded outside the lock.
+	 */
+	GMutex *lock;
+	gint64 offset;
+} VipsTiledWrite;
+
+/* Each worker has a line buffer, then space for a coded tile.
+ */
+static void *
+vips_tiled_write_start( VipsImage *out, void *a, void *b )
+{
+	VipsTiledWrite *write = (VipsTiledWrite *) a;
+	size_t n = write->tile_size * VIPS_IMAGE_SIZEOF_PEL( write->in );
+
+	return( vips_malloc( NULL, 
+		n + write->tile_size * VIPS__RLE_BOUND( n ) ) );
+}
+
+static int
+vips_tiled_write_tile( VipsRegion *region, 
+	void *seq, void *a, void *b, gboolean *stop )
+{
+	VipsTiledWrite *write = (VipsTiledWrite *) a;
+	VipsRect *r = &region->valid;
+	int ts = write->tile_size;
+	int tile = (r->top / ts) * write->across + r->left / ts;
+	VipsPel *line = (VipsPel *) seq;
+	VipsPel *buf = line + ts * VIPS_IMAGE_SIZEOF_PEL( write->in );
+
+	size_t length;
+	gint64 offset;
+
+	length = vips__rle_encode( buf, 
+		VIPS_REGION_ADDR( region, r->left, r->top ), 
+		VIPS_REGION_LSKIP( region ), r->width, r->height, 
+		VIPS_IMAGE_SIZEOF_PEL( region->im ), line );
+
+	g_mutex_lock( write->lock );
+	offset = write->offset;
+	if( vips__seek( write->image->fd, offset ) ||
+		vips__write( write->image->fd, buf, length ) ) {
+		g_mutex_unlock( write->lock );
+		return( -1 );
+	}
+	write->offset += length;
+	g_mutex_unlock( write->lock );
+
+	write->index[tile * 2] = offset;
+	write->index[tile * 2 + 1] = length;
+
+	return( 0 );
+}
+
+static int
+vips_tiled_write_stop( void *seq, void *a, void *b )
+{
+	vips_free( seq );
+
+	return( 0 );
+}
+
+/* Write @in to @filename as a tiled vips file. Tiles are computed and coded 
+ * in parallel and appended to the file as they complete.
+ */
+int
+vips__tiled_write( VipsImage *in, const char *filename, int tile_size )
+{
+	VipsTiledWrite write;
+	size_t n_index;
+	guint64 end;
+	int result;
+
+	if( tile_size < VIPS__TILED_MIN ||
+		tile_size > VIPS__TILED_MAX ) {
+		vips_error( "VipsImage", "%s", _( "bad tile size" ) );
+		return( -1 );
+	}
+
+	if( !(write.image = vips_image_new_mode( filename, "w" )) )
+		return( -1 );
+	if( write.image->dtype != VIPS_IMAGE_OPENOUT ) {
+		vips_error( "VipsImage", 
+			_( "\"%s\" is not a vips filename" ), filename );
+		g_object_unref( write.image );
+		return( -1 );
+	}
+	if( vips_image_pipelinev( write.image, 
+		VIPS_DEMAND_STYLE_THINSTRIP, in, NULL ) ) {
+		g_object_unref( write.image );
+		return( -1 );
+	}
+	vips__link_break_all( write.image );
+
+	write.image->Compression = VIPS__COMPRESSION_TILED;
+	write.image->Level = tile_size;
+	if( !(n_index = image_tiled_n_index( write.image )) ) {
+		vips_error( "VipsImage", "%s", _( "tile index too large" ) );
+		g_object_unref( write.image );
+		return( -1 );
+	}
+
+	write.in = in;
+	write.tile_size = tile_size;
+	write.across = VIPS_ROUND_UP( in->Xsize, tile_size ) / tile_size;
+	write.index = VIPS_ARRAY( NULL, n_index, guint64 );
+	write.lock = vips_g_mutex_new();
+	write.offset = write.image->sizeof_header;
+
+	result = 0;
+	if( !write.index ||
+		vips_image_open_output( write.image ) ||
+		vips_sink_tile( in, tile_size, tile_size, 
+			vips_tiled_write_start, 
+			vips_tiled_write_tile, 
+			vips_tiled_write_stop, 
+			&write, NULL ) )
+		result = -1;
+
+	/* Append the index, record where it starts, then write the rest of
+	 * the metadata after it. We always write in native byte order.
+	 */
+	end = write.offset;
+	if( !result &&
+		(vips__seek( write.image->fd, end ) ||
+		 vips__write( write.image->fd, 
+			write.index, n_index * sizeof( guint64 ) ) ||
+		 vips__seek( write.image->fd, VIPS_TILED_OFFSET ) ||
+		 vips__write( write.image->fd, &end, 8 ) ||
+		 vips__writehist( write.image )) )
+		result = -1;
+
+	VIPS_FREE( write.index );
+	VIPS_FREEF( vips_g_mutex_free, write.lock );
+	g_object_unref( write.image );
+
+	return( result );
+}
@@ -4,6 +4,14 @@
  *	- from region.c
  * 19/3/09
  *	- block mmaps of nodata images
+ * 16/10/17
+ * 	- always count windows, see vips_stats_snapshot()
+ * 	- pass the image access pattern to the kernel, if one was set, and
+ * 	  prefetch the next window for sequential images
+ * 	- keep unused windows mapped, up to vips__window_cache_max bytes per
+ * 	  image, and count map and unmap calls
+ * 	- sequential images unmap unused windows at once
+ * 	- read the access hint from qdata, not the image struct
  */
 
 /*
@@ -77,11 +85,20 @@ int vips__window_margin_pixels = VIPS__WINDOW_MARGIN_PIXELS;
  */
 int vips__window_margin_bytes = VIPS__WINDOW_MARGIN_BYTES;
 
-/* Track global mmap usage.
+/* Keep at most this many bytes of unused windows mapped on each image. 
+ * Random access to large files would otherwise map and unmap on almost 
+ * every tile.
  */
+size_t vips__window_cache_max = 256 * 1024 * 1024;
+
+/* Track global mmap usage. Protected by vips__global_lock.
+ */
+static int total_mmap_windows = 0;
+static size_t total_mmap_usage = 0;
+static guint64 total_mmap_maps = 0;
+static guint64 total_mmap_unmaps = 0;
 #ifdef DEBUG_TOTAL
-static int total_mmap_usage = 0;
-static int max_mmap_usage = 0;
+static size_t max_mmap_usage = 0;
 #endif /*DEBUG_TOTAL*/
 
 static int
@@ -90,19 +107,28 @@ vips_window_unmap( VipsWindow *window )
 	/* unmap the old window
 	 */
 	if( window->baseaddr ) {
+		VipsAccess access;
+
+		if( vips__image_get_access( window->im, &access ) )
+			vips__mmap_release( window->im->fd, 
+				window->baseaddr, window->length, 
+				window->offset, access );
+
 		if( vips__munmap( window->baseaddr, window->length ) )
 			return( -1 );
 
-#ifdef DEBUG_TOTAL
 		g_mutex_lock( vips__global_lock );
+		g_assert( total_mmap_windows > 0 );
+		g_assert( total_mmap_usage >= window->length );
+		total_mmap_windows -= 1;
 		total_mmap_usage -= window->length;
-		assert( total_mmap_usage >= 0 );
+		total_mmap_unmaps += 1;
 		g_mutex_unlock( vips__global_lock );
-#endif /*DEBUG_TOTAL*/
 
 		window->data = NULL;
 		window->baseaddr = NULL;
 		window->length = 0;
+		window->offset = 0;
 	}
 
 	return( 0 );
@@ -128,11 +154,59 @@ vips_window_free( VipsWindow *window )
 	return( 0 );
 }
 
+/* Unmap unused windows, oldest first, until at most max bytes of unused 
+ * windows are left on the image. Call with sslock held.
+ *
+ * im->windows is kept in most-recently-used order, so we walk from the end.
+ */
+static int
+vips_window_trim( VipsImage *im, size_t max )
+{
+	GSList *idle;
+	GSList *p;
+	size_t idle_bytes;
+	int result;
+
+	idle = NULL;
+	idle_bytes = 0;
+	for( p = im->windows; p; p = p->next ) {
+		VipsWindow *window = (VipsWindow *) p->data;
+
+		if( window->ref_count == 0 ) {
+			idle = g_slist_prepend( idle, window );
+			idle_bytes += window->length;
+		}
+	}
+
+	/* idle is now oldest first.
+	 */
+	result = 0;
+	for( p = idle; p && idle_bytes > max; p = p->next ) {
+		VipsWindow *window = (VipsWindow *) p->data;
+
+		idle_bytes -= window->length;
+		im->windows = g_slist_remove( im->windows, window );
+
+#ifdef DEBUG
+		printf( "vips_window_trim: dropping window top = %d, "
+			"height = %d\n", window->top, window->height );
+#endif /*DEBUG*/
+
+		if( vips_window_free( window ) ) 
+			result = -1;
+	}
+	g_slist_free( idle );
+
+	return( result );
+}
+
 int
 vips_window_unref( VipsWindow *window )
 {
 	VipsImage *im = window->im;
 
+	VipsAccess access;
+
 	g_mutex_lock( im->sslock );
 
 #ifdef DEBUG
@@ -148,12 +222,33 @@ vips_window_unref( VipsWindow *window )
 		assert( g_slist_find( im->windows, window ) );
 		im->windows = g_slist_remove( im->windows, window );
 
+		/* Sequential images never come back to a window, so unmap 
+		 * it now.
+		 */
+		if( vips__image_get_access( im, &access ) &&
+			(access == VIPS_ACCESS_SEQUENTIAL ||
+			 access == VIPS_ACCESS_SEQUENTIAL_UNBUFFERED) ) {
+			if( vips_window_free( window ) ) {
+				g_mutex_unlock( im->sslock );
+				return( -1 );
+			}
+
+			g_mutex_unlock( im->sslock );
+
+			return( 0 );
+		}
+
+		/* Keep it mapped in case we need this part of the file 
+		 * again. Move to the front, so the list stays in LRU order.
+		 */
+		im->windows = g_slist_prepend( im->windows, window );
+
 #ifdef DEBUG
 		printf( "vips_window_unref: %d windows left\n",
 			g_slist_length( im->windows ) );
 #endif /*DEBUG*/
 
-		if( vips_window_free( window ) ) {
+		if( vips_window_trim( im, vips__window_cache_max ) ) {
 			g_mutex_unlock( im->sslock );
 			return( -1 );
 		}
@@ -164,6 +259,18 @@ vips_window_unref( VipsWindow *window )
 	return( 0 );
 }
 
+/* Unmap all the unused windows on an image, for example before we close
+ * the file.
+ */
+void
+vips__window_flush( VipsImage *im )
+{
+	g_mutex_lock( im->sslock );
+	if( vips_window_trim( im, 0 ) )
+		vips_error_clear();
+	g_mutex_unlock( im->sslock );
+}
+
 #ifdef DEBUG_TOTAL
 static void
 trace_mmap_usage( void )
@@ -219,6 +326,7 @@ vips_window_set( VipsWindow *window, int top, int height )
 	void *baseaddr;
 	gint64 start, end, pagestart;
 	size_t length, pagelength;
+	VipsAccess access;
 
 	/* Calculate start and length for our window. 
 	 */
@@ -243,8 +351,24 @@ vips_window_set( VipsWindow *window, int top, int height )
 		0, pagelength, pagestart )) )
 		return( -1 ); 
 
+	/* Images which didn't ask for an access pattern get the kernel's 
+	 * usual readahead.
+	 */
+	if( vips__image_get_access( window->im, &access ) ) {
+		vips__mmap_advise( baseaddr, pagelength, access );
+
+		/* Sequential images will want the next window soon. Get the 
+		 * kernel reading it in the background.
+		 */
+		if( access != VIPS_ACCESS_RANDOM ) 
+			vips__file_prefetch( window->im->fd, end, 
+				VIPS_MIN( (gint64) length, 
+					window->im->file_length - end ) );
+	}
+
 	window->baseaddr = baseaddr;
 	window->length = pagelength;
+	window->offset = pagestart;
 
 	window->data = (VipsPel *) baseaddr + (start - pagestart);
 	window->top = top;
@@ -254,12 +378,17 @@ vips_window_set( VipsWindow *window, int top, int height )
 	 */
 	vips__read_test &= window->data[0];
 
-#ifdef DEBUG_TOTAL
 	g_mutex_lock( vips__global_lock );
+	total_mmap_windows += 1;
 	total_mmap_usage += window->length;
+	total_mmap_maps += 1;
+#ifdef DEBUG_TOTAL
 	if( total_mmap_usage > max_mmap_usage )
 		max_mmap_usage = total_mmap_usage;
+#endif /*DEBUG_TOTAL*/
 	g_mutex_unlock( vips__global_lock );
+
+#ifdef DEBUG_TOTAL
 	trace_mmap_usage();
 #endif /*DEBUG_TOTAL*/
 
@@ -283,6 +412,7 @@ vips_window_new( VipsImage *im, int top, int height )
 	window->data = NULL;
 	window->baseaddr = NULL;
 	window->length = 0;
+	window->offset = 0;
 
 	if( vips_window_set( window, top, height ) ) {
 		vips_window_free( window );
@@ -389,3 +519,18 @@ vips_window_print( VipsWindow *window )
 	printf( "baseaddr = %p, ", window->baseaddr );
 	printf( "length = %zd\n", window->length );
 }
+
+/* Number of mapped windows, the bytes they cover, and the number of 
+ * mmap() and munmap() calls so far.
+ */
+void
+vips__window_stats( int *n_windows, size_t *bytes, 
+	guint64 *n_map, guint64 *n_unmap )
+{
+	g_mutex_lock( vips__global_lock );
+	*n_windows = total_mmap_windows;
+	*bytes = total_mmap_usage;
+	*n_map = total_mmap_maps;
+	*n_unmap = total_mmap_unmaps;
+	g_mutex_unlock( vips__global_lock );
+}
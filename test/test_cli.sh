@@ -87,3 +87,125 @@ test_thumbnail "100x100<" 1024 768
 test_thumbnail "2000<" 2000 1500
 test_thumbnail "100x100>" 100 75
 test_thumbnail "2000>" 1024 768
+
+# chains of arithmetic operations inside one operation are fused, check we 
+# get exactly the same result without fusion
+test_fuse() {
+	op=$1
+	im=$2
+	shift 2
+
+	printf "testing fuse $op $* ... "
+	$vips $op $im $tmp/t1.v "$@"
+	VIPS_NOFUSE=1 $vips $op $im $tmp/t2.v "$@"
+	test_difference $tmp/t1.v $tmp/t2.v 0
+
+	echo "ok"
+}
+
+$vips cast $image $tmp/float.v float
+test_fuse scale $image --log
+test_fuse scale $tmp/float.v --log --exp 0.5
+test_fuse gamma $tmp/float.v
+
+# float convolution has native vector kernels, they must match the C path
+# exactly
+printf "testing conv with and without simd ... "
+$vips gaussmat $tmp/mask.v 2 0.1
+$vips conv $tmp/float.v $tmp/t1.v $tmp/mask.v --precision float
+VIPS_NOSIMD=1 $vips conv $tmp/float.v $tmp/t2.v $tmp/mask.v --precision float
+test_difference $tmp/t1.v $tmp/t2.v 0
+echo "ok"
+
+test_expr() {
+	expr=$1
+	a=$2
+	b=$3
+
+	printf "testing expr \"$expr\" ... "
+	$vips linear $image $tmp/t1.v $a $b
+	$vips expr $image $tmp/t2.v "$expr" 
+	test_difference $tmp/t1.v $tmp/t2.v 0.001
+	VIPS_NOVECTOR=1 $vips expr $image $tmp/t2.v "$expr" 
+	test_difference $tmp/t1.v $tmp/t2.v 0.001
+
+	echo "ok"
+}
+
+test_expr '$0 * 2 + 1' 2 1
+test_expr '($0 + 10) / 4' 0.25 2.5
+test_expr '0 - -$0 * 2 + 1' 2 1
+
+# compare an expression against the same thing made with other operations
+test_expr_ref() {
+	expr=$1
+	in=$2
+	ref=$3
+
+	printf "testing expr \"$expr\" ... "
+	$vips expr "$in" $tmp/t2.v "$expr" 
+	test_difference $ref $tmp/t2.v 0.001
+	VIPS_NOVECTOR=1 $vips expr "$in" $tmp/t2.v "$expr" 
+	test_difference $ref $tmp/t2.v 0.001
+
+	echo "ok"
+}
+
+$vips extract_band $image $tmp/band1.v 1
+$vips cast $image $tmp/short.v short
+$vips extract_band $tmp/short.v $tmp/band2.v 2
+
+# relational
+$vips relational_const $image $tmp/ref.v more 128
+test_expr_ref '$0 > 128' $image $tmp/ref.v
+$vips relational $image $tmp/band1.v $tmp/ref.v noteq
+test_expr_ref '$0 != $0[1]' $image $tmp/ref.v
+
+# band references
+$vips linear $tmp/band1.v $tmp/ref.v 2 0
+test_expr_ref '$0[1] * 2' $image $tmp/ref.v
+
+# uchar, short and float inputs together
+$vips multiply $image $tmp/band2.v $tmp/t1.v
+$vips subtract $tmp/t1.v $tmp/float.v $tmp/ref.v
+test_expr_ref '$0 * $1[2] - $2' "$image $tmp/short.v $tmp/float.v" $tmp/ref.v
+
+# very deep nesting must fail with an error, not blow the stack
+test_expr_nesting() {
+	expr=$1
+
+	if $vips expr $image $tmp/t2.v "$expr" 2> $tmp/err; then
+		echo "deeply nested expression was not refused"
+		exit 1
+	fi
+	if ! grep -q "nested too deeply" $tmp/err; then
+		echo "deeply nested expression did not fail cleanly"
+		exit 1
+	fi
+}
+
+printf "testing expr nesting is limited ... "
+test_expr_nesting "$(printf '%0.s(' $(seq 10000))\$0$(printf '%0.s)' $(seq 10000))"
+test_expr_nesting "$(printf '%0.s-' $(seq 10000))\$0"
+echo "ok"
+
+# the disc cache should keep the loaded image the first time, then hit the
+# second time ... rot45 copies its input to memory, which saves it
+printf "testing disc cache ... "
+rm -rf $tmp/cache
+mkdir $tmp/cache
+$vips crop $image $tmp/square.png 0 0 101 101
+VIPS_CACHE_DISC=$tmp/cache \
+	$vips rot45 $tmp/square.png $tmp/t1.v --vips-cache-trace > $tmp/trace1
+if ! grep -q "^vips disc+" $tmp/trace1; then
+	echo "disc cache did not save"
+	exit 1
+fi
+VIPS_CACHE_DISC=$tmp/cache \
+	$vips rot45 $tmp/square.png $tmp/t2.v --vips-cache-trace > $tmp/trace2
+if ! grep -q "^vips disc\*" $tmp/trace2; then
+	echo "disc cache did not hit"
+	exit 1
+fi
+test_difference $tmp/t1.v $tmp/t2.v 0
+echo "ok"
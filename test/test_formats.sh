@@ -95,6 +95,41 @@ test_format() {
 	echo "ok"
 }
 
+# as above, but load with a tiny disc threshold and the compressed memory
+# spill store
+test_spill() {
+	in=$1
+	format=$2
+
+	printf "testing $(basename $in) $format via compressed spill ... "
+
+	$vips copy $in $tmp/t1.$format
+	VIPS_DISC_THRESHOLD=1 VIPS_SPILL_MEMORY=1 \
+		$vips copy $tmp/t1.$format $tmp/back.v
+	test_difference $in $tmp/back.v 0
+
+	echo "ok"
+}
+
+# run an area operation on a spilled image, it must match the result from an
+# ordinary load ... force random access, since only random loads spill
+test_spill_op() {
+	in=$1
+	format=$2
+	op=$3
+	shift 3
+
+	printf "testing $op on $(basename $in) $format via compressed spill ... "
+
+	$vips copy $in $tmp/t1.$format
+	$vips $op $tmp/t1.$format[access=random] $tmp/before.v "$@"
+	VIPS_DISC_THRESHOLD=1 VIPS_SPILL_MEMORY=1 \
+		$vips $op $tmp/t1.$format[access=random] $tmp/after.v "$@"
+	test_difference $tmp/before.v $tmp/after.v 0
+
+	echo "ok"
+}
+
 # as above, but hdr format
 # this is a coded format, so we need to rad2float before we can test for
 # differences
@@ -186,6 +221,17 @@ test_supported() {
 }
 
 test_format $image v 0
+test_format $image v 0 [tile]
+test_format $image v 0 [tile,tile_size=100]
+test_format $mono v 0 [tile]
+
+# tiny tiles would make a huge index, they must be refused
+printf "testing v [tile,tile_size=8] is refused ... "
+if $vips copy $image $tmp/test.v[tile,tile_size=8] > /dev/null 2>&1; then
+	echo "tile_size=8 was not refused"
+	exit 1
+fi
+echo "ok"
 if test_supported tiffload; then
 	test_format $image tif 0
 	test_format $image tif 90 [compression=jpeg]
@@ -196,6 +242,9 @@ if test_supported tiffload; then
 fi
 if test_supported pngload; then
 	test_format $image png 0
+	test_spill $image png
+	test_spill_op $image png sharpen
+	test_spill_op $image png rot d90
 # sadly broken in libpng 1.6.28 and 29
 #	test_format $image png 0 [compression=9,interlace=1]
 fi
@@ -213,6 +262,7 @@ fi
 
 # csv can only do mono
 test_format $mono csv 0
+test_spill $mono csv
 
 # cmyk jpg is a special path
 if test_supported jpegload; then
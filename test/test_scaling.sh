@@ -0,0 +1,101 @@
+#!/bin/sh
+
+# time some typical pipelines with one thread and with many, and fail if they
+# don't speed up enough ... this is not run by "make check", since timings
+# are unreliable on a busy machine, run it by hand
+
+# set -x
+set -e
+
+. ./variables.sh
+
+# fail if speedup / threads drops below this
+threshold=${VIPS_SCALING_THRESHOLD:-0.25}
+
+# number of threads to compare against a single thread
+threads=${VIPS_SCALING_THREADS:-$(getconf _NPROCESSORS_ONLN 2>/dev/null || echo 1)}
+if [ $threads -gt 4 ]; then
+	threads=4
+fi
+
+if [ $threads -lt 2 ]; then
+	echo "only one CPU, skipping test"
+	exit 0
+fi
+
+# we need a fractional-second clock
+case $(date +%N) in
+*N*|"")
+	echo "no nanosecond date, skipping test"
+	exit 0
+	;;
+esac
+
+now() {
+	date +%s.%N
+}
+
+# build some large test images
+printf "building test images ... "
+$vips replicate $image $tmp/big.v 5 5
+$vips copy $tmp/big.v $tmp/big.jpg
+$vips copy $tmp/big.v "$tmp/big.tif[tile]"
+$vips sharpen $tmp/big.v $tmp/sharp.v
+echo "ok"
+
+failed=0
+
+# time a command with 1 and with $threads threads, report efficiency and
+# lock wait
+scaling() {
+	name=$1
+	shift
+
+	start=$(now)
+	$vips --vips-concurrency=1 "$@" > /dev/null
+	t1=$(echo "$(now) - $start" | bc)
+
+	start=$(now)
+	$vips --vips-concurrency=$threads "$@" > /dev/null
+	tn=$(echo "$(now) - $start" | bc)
+
+	# a separate run for lock wait, profiling changes the timing ... the
+	# totals from vips_profile_get_wait() are summarised on stderr
+	wait=$($vips --vips-concurrency=$threads \
+		--vips-profile-trace=$tmp/trace.json "$@" 2>&1 > /dev/null |
+		grep "lock wait" || echo "lock wait: none")
+
+	speedup=$(echo "scale=3; $t1 / $tn" | bc)
+	efficiency=$(echo "scale=3; $speedup / $threads" | bc)
+
+	echo "$name: 1 thread ${t1}s, $threads threads ${tn}s," \
+		"speedup $speedup, efficiency $efficiency, $wait"
+
+	if [ $(echo "$efficiency < $threshold" | bc) -eq 1 ]; then
+		echo "*** $name: efficiency below $threshold"
+		failed=1
+	fi
+}
+
+# sequential loader, sink_disc to a vips file
+scaling "seq load" \
+	sharpen "$tmp/big.jpg[access=sequential]" $tmp/x.v
+
+# tiled tiff load goes through a tilecache
+scaling "tilecache" \
+	sharpen $tmp/big.tif $tmp/x.v
+
+# sink_disc saver
+scaling "sink_disc save" \
+	sharpen $tmp/big.v $tmp/x.tif
+
+# im_cache is a sink_screen
+scaling "sink_screen" \
+	im_cache $tmp/sharp.v $tmp/x.v 128 128 1000
+
+if [ $failed -eq 1 ]; then
+	echo "thread scaling tests failed"
+	exit 1
+else
+	echo "all thread scaling tests passed"
+fi
@@ -20,6 +20,34 @@ if ! $vipsheader $tmp/x.png > /dev/null 2>&1 ; then
 fi
 echo "ok"
 
+# many workers read behind the one reading from a sequential loader, check 
+# they see the same pixels as a random-access load
+test_seq_threads() {
+	in=$1
+	op=$2
+	shift 2
+
+	printf "testing $op on $(basename $in) with many threads ... "
+	VIPS_CONCURRENCY=16 \
+		$vips $op $in[access=sequential] $tmp/seq.v "$@"
+	$vips $op $in[access=random] $tmp/random.v "$@"
+	$vips subtract $tmp/seq.v $tmp/random.v $tmp/difference.v
+	$vips abs $tmp/difference.v $tmp/abs.v 
+	dif=$($vips max $tmp/abs.v)
+	if [ $(echo "$dif > 0" | bc -l) -eq 1 ]; then
+		echo "difference is $dif"
+		exit 1
+	fi
+	echo "ok"
+}
+
+$vips replicate $image $tmp/medium.png 4 4
+$vips copy $tmp/medium.png $tmp/medium.jpg
+for file in $tmp/medium.png $tmp/medium.jpg; do
+	test_seq_threads $file sharpen
+	test_seq_threads $file shrink 2 2
+done
+
 if [ ! -d $tmp/readonly ] ; then
 	mkdir $tmp/readonly
 	chmod ugo-wx $tmp/readonly
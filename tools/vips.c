@@ -242,6 +242,10 @@ list_function( im_function *func )
 static int
 print_list( int argc, char **argv )
 {
+	/* We look up class names directly, so we need them all registered.
+	 */
+	vips__operations_init();
+
 	if( !argv[0] || strcmp( argv[0], "packages" ) == 0 ) 
 		im_map_packages( (VSListMap2Fn) list_package, NULL );
 	else if( strcmp( argv[0], "classes" ) == 0 ) 